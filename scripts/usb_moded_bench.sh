@@ -0,0 +1,354 @@
+#!/bin/sh
+
+# Measure usb-moded mode switch latency without a device
+#
+# Runs usb_moded built with --enable-simulated-backend against a
+# private D-Bus system bus and a throwaway root prefix, drives
+# set_mode cycles through com.meego.usb_moded and reports per mode
+# latency percentiles and D-Bus traffic per switch. If strace is
+# available, also syscalls and forks per switch are reported.
+
+PROGNAME="$(basename $0)"
+
+# ============================================================================
+# ENV
+# ============================================================================
+
+USB_MODED="${USB_MODED:-./usb_moded}"
+CYCLES="${CYCLES:-1000}"
+MODES="${MODES:-bench_a bench_b bench_c}"
+TIMEOUT_MS="${TIMEOUT_MS:-5000}"
+USE_STRACE="${USE_STRACE:-auto}"
+
+WORK_DIR=""
+ROOT_DIR=""
+BUS_PID=""
+MONITOR_PID=""
+DAEMON_PID=""
+
+MODED_SERVICE="com.meego.usb_moded"
+MODED_OBJECT="/com/meego/usb_moded"
+MODED_INTERFACE="com.meego.usb_moded"
+
+# ============================================================================
+# LOG
+# ============================================================================
+
+LOG_LEVEL=5
+
+log_critical() { test $LOG_LEVEL -ge 2 && echo >&2 "$PROGNAME: C: $*" ; }
+log_error()    { test $LOG_LEVEL -ge 3 && echo >&2 "$PROGNAME: E: $*" ; }
+log_warning()  { test $LOG_LEVEL -ge 4 && echo >&2 "$PROGNAME: W: $*" ; }
+log_notice()   { test $LOG_LEVEL -ge 5 && echo >&2 "$PROGNAME: N: $*" ; }
+log_info()     { test $LOG_LEVEL -ge 6 && echo >&2 "$PROGNAME: I: $*" ; }
+log_debug()    { test $LOG_LEVEL -ge 7 && echo >&2 "$PROGNAME: D: $*" ; }
+
+# ============================================================================
+# ROOT
+# ============================================================================
+
+root_populate() {
+  log_debug "Populate root prefix: $ROOT_DIR"
+
+  mkdir -p "$ROOT_DIR/etc/usb-moded/dyn-modes" \
+           "$ROOT_DIR/etc/modprobe.d" \
+           "$ROOT_DIR/run/usb-moded" \
+           "$ROOT_DIR/var/lib/usb-moded" \
+           "$ROOT_DIR/proc" || return 1
+  : > "$ROOT_DIR/proc/cmdline"
+
+  # Modes that only reconfigure the gadget, i.e. do not need
+  # mounts, network setup or services that are not available
+  local functions="mass_storage rndis ffs"
+  for mode in $MODES; do
+    set -- $functions
+    functions="$2 $3 $1"
+    cat > "$ROOT_DIR/etc/usb-moded/dyn-modes/$mode.ini" <<-EOF
+	[mode]
+	name = $mode
+	module = none
+
+	[options]
+	sysfs_value = $1
+	EOF
+  done
+}
+
+# ============================================================================
+# BUS
+# ============================================================================
+
+bus_start() {
+  log_debug "Start private system bus"
+
+  cat > "$WORK_DIR/bus.conf" <<-EOF
+	<!DOCTYPE busconfig PUBLIC
+	 "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+	 "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+	<busconfig>
+	  <type>system</type>
+	  <listen>unix:path=$WORK_DIR/bus</listen>
+	  <auth>EXTERNAL</auth>
+	  <policy context="default">
+	    <allow user="*"/>
+	    <allow own="*"/>
+	    <allow send_destination="*" eavesdrop="true"/>
+	    <allow eavesdrop="true"/>
+	  </policy>
+	</busconfig>
+	EOF
+
+  dbus-daemon --config-file="$WORK_DIR/bus.conf" --nofork --nopidfile \
+    2> "$WORK_DIR/bus.log" &
+  BUS_PID=$!
+
+  export DBUS_SYSTEM_BUS_ADDRESS="unix:path=$WORK_DIR/bus"
+  wait_until "bus" test -S "$WORK_DIR/bus"
+}
+
+bus_monitor_start() {
+  log_debug "Start bus monitor"
+  dbus-monitor --system > "$WORK_DIR/monitor.log" 2>&1 &
+  MONITOR_PID=$!
+  sleep 0.2
+}
+
+bus_call() {
+  local method="$1"
+  shift
+  dbus-send --system --print-reply --reply-timeout=$TIMEOUT_MS \
+    --dest=$MODED_SERVICE $MODED_OBJECT $MODED_INTERFACE.$method "$@"
+}
+
+bus_has_owner() {
+  dbus-send --system --print-reply --dest=org.freedesktop.DBus \
+    /org/freedesktop/DBus org.freedesktop.DBus.NameHasOwner \
+    string:$1 2> /dev/null | grep -q "boolean true"
+}
+
+# ============================================================================
+# DAEMON
+# ============================================================================
+
+daemon_start() {
+  log_debug "Start usb-moded"
+
+  local wrap=""
+  case "$USE_STRACE" in
+  auto)
+    command -v strace > /dev/null && wrap="strace -f -c -o $WORK_DIR/strace.txt"
+    ;;
+  yes)
+    wrap="strace -f -c -o $WORK_DIR/strace.txt"
+    ;;
+  esac
+
+  # --fallback: assume pc connection as udev is not simulated
+  # --rescue:   allow modes without DSME and device lock services
+  $wrap "$USB_MODED" --force-stderr --fallback --rescue \
+    --root-prefix="$ROOT_DIR" 2> "$WORK_DIR/usb_moded.log" &
+  DAEMON_PID=$!
+
+  wait_until "usb-moded" bus_has_owner $MODED_SERVICE
+}
+
+daemon_stop() {
+  if [ -n "$DAEMON_PID" ]; then
+    log_debug "Stop usb-moded"
+    kill -TERM $DAEMON_PID 2> /dev/null
+    wait $DAEMON_PID 2> /dev/null
+    DAEMON_PID=""
+  fi
+}
+
+# ============================================================================
+# UTIL
+# ============================================================================
+
+wait_until() {
+  local what="$1"
+  shift
+  for i in $(seq 100); do
+    "$@" && return 0
+    sleep 0.05
+  done
+  log_error "Timeout while waiting for $what"
+  return 1
+}
+
+# Check whether the latest current state signal reports given mode
+current_mode_is() {
+  tail -n 200 "$WORK_DIR/monitor.log" \
+    | grep -A1 "member=sig_usb_current_state_ind" \
+    | tail -n 1 | grep -q "string \"$1\""
+}
+
+cleanup() {
+  daemon_stop
+  test -n "$MONITOR_PID" && kill $MONITOR_PID 2> /dev/null
+  test -n "$BUS_PID" && kill $BUS_PID 2> /dev/null
+  wait 2> /dev/null
+  test -n "$WORK_DIR" && rm -rf "$WORK_DIR"
+}
+
+# ============================================================================
+# BENCH
+# ============================================================================
+
+bench_run() {
+  local switches=0
+  local failures=0
+
+  log_notice "Running $CYCLES cycles over modes: $MODES"
+
+  for cycle in $(seq $CYCLES); do
+    for mode in $MODES; do
+      if ! bus_call set_mode string:$mode > /dev/null 2>&1; then
+        log_warning "set_mode $mode: rejected"
+        failures=$((failures+1))
+        continue
+      fi
+      if ! wait_until "$mode" current_mode_is $mode; then
+        failures=$((failures+1))
+        continue
+      fi
+      switches=$((switches+1))
+    done
+  done
+
+  echo $switches > "$WORK_DIR/switches"
+  log_notice "Completed $switches switches, $failures failures"
+}
+
+# ============================================================================
+# REPORT
+# ============================================================================
+
+# Latency is measured from set_mode method call to the current state
+# signal reporting the requested mode, using bus monitor timestamps.
+# D-Bus traffic counts messages sent by usb-moded in the same window.
+report_latency() {
+  awk -v service=$MODED_SERVICE '
+    function ts(line) {
+      if( match(line, /time=[0-9.]+/) )
+        return substr(line, RSTART + 5, RLENGTH - 5)
+      return 0
+    }
+    function field(line, key,   re) {
+      re = key "=[^ ;]+"
+      if( match(line, re) )
+        return substr(line, RSTART + length(key) + 1, RLENGTH - length(key) - 1)
+      return ""
+    }
+    /^(method call|method return|error|signal) / {
+      hdr = $0
+      member = field(hdr, "member")
+      sender = field(hdr, "sender")
+      if( member == "sig_usb_current_state_ind" )
+        daemon = sender
+      if( pending != "" && sender == daemon ) {
+        if( hdr ~ /^method call/ ) calls++
+        if( hdr ~ /^signal/ )      signals++
+      }
+      next
+    }
+    /^ +string "/ {
+      if( member == "" )
+        next
+      arg = $2
+      gsub(/"/, "", arg)
+      if( member == "set_mode" && field(hdr, "destination") == service ) {
+        pending = arg
+        start = ts(hdr)
+        calls = signals = 0
+      }
+      else if( member == "sig_usb_current_state_ind" && arg == pending ) {
+        printf "%s %.3f %d %d\n", pending, (ts(hdr) - start) * 1000, calls, signals
+        pending = ""
+      }
+      member = ""
+    }
+  ' "$WORK_DIR/monitor.log" | sort -k1,1 -k2,2n > "$WORK_DIR/latency.txt"
+
+  printf "%-20s %8s %10s %10s %10s %10s\n" \
+    "mode" "count" "p50_ms" "p99_ms" "calls/sw" "signals/sw"
+  awk '
+    function report() {
+      if( n == 0 ) return
+      p50 = v[int((n - 1) * 0.50) + 1]
+      p99 = v[int((n - 1) * 0.99) + 1]
+      printf "%-20s %8d %10.3f %10.3f %10.2f %10.2f\n",
+             mode, n, p50, p99, c / n, s / n
+    }
+    $1 != mode { report(); mode = $1; n = c = s = 0 }
+    { v[++n] = $2; c += $3; s += $4 }
+    END { report() }
+  ' "$WORK_DIR/latency.txt"
+}
+
+# Syscall counts cover the whole daemon lifetime, including startup
+report_syscalls() {
+  test -s "$WORK_DIR/strace.txt" || return 0
+  awk -v switches=$(cat "$WORK_DIR/switches") '
+    $1 ~ /^[0-9.]+$/ && $NF != "total" { total += $4 }
+    $NF ~ /^(clone|clone3|fork|vfork)$/ { forks += $4 }
+    END {
+      if( switches > 0 )
+        printf "syscalls/switch: %.1f  forks/switch: %.2f\n",
+               total / switches, forks / switches
+    }
+  ' "$WORK_DIR/strace.txt"
+}
+
+# ============================================================================
+# MAIN
+# ============================================================================
+
+for arg in "$@"; do
+  case "$arg" in
+  -v|--verbose)
+    LOG_LEVEL=$((LOG_LEVEL+1))
+    ;;
+  -q|--quiet)
+    LOG_LEVEL=$((LOG_LEVEL-1))
+    ;;
+  -h|--help|--usage)
+    cat <<-EOF
+	Usage:
+	  $PROGNAME [-v|-q]
+
+	Environment:
+	  USB_MODED=<path>     usb_moded binary built with simulated backend
+	  CYCLES=<count>       number of cycles over all modes ($CYCLES)
+	  MODES="<m1> <m2>..." generated benchmark modes ($MODES)
+	  USE_STRACE=auto|yes|no
+	EOF
+    exit 0
+    ;;
+  *)
+    log_error "unknown option: $arg"
+    exit 1
+    ;;
+  esac
+done
+
+for tool in dbus-daemon dbus-send dbus-monitor; do
+  command -v $tool > /dev/null || { log_critical "$tool not found"; exit 1; }
+done
+test -x "$USB_MODED" || { log_critical "$USB_MODED: not executable"; exit 1; }
+
+WORK_DIR="$(mktemp -d /tmp/usb-moded-bench.XXXXXX)" || exit 1
+ROOT_DIR="$WORK_DIR/root"
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+root_populate     || exit 1
+bus_start         || exit 1
+bus_monitor_start
+daemon_start      || { cat >&2 "$WORK_DIR/usb_moded.log"; exit 1; }
+bench_run
+daemon_stop
+sleep 0.2
+
+report_latency
+report_syscalls
@@ -24,7 +24,9 @@
 
 #include "usb_moded-android.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
+#include "usb_moded-gadget.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
 #include "usb_moded-modesetting.h"
@@ -45,7 +47,6 @@
 static bool  android_write_file       (const char *path, const char *text);
 bool         android_in_use           (void);
 static bool  android_probe            (void);
-gchar       *android_get_serial       (void);
 bool         android_init             (void);
 void         android_quit             (void);
 bool         android_set_enabled      (bool enable);
@@ -55,6 +56,15 @@ bool         android_set_productid    (const char *id);
 bool         android_set_vendorid     (const char *id);
 bool         android_set_attr         (const char *function, const char *attr, const char *value);
 
+/* ------------------------------------------------------------------------- *
+ * ANDROID_BACKEND
+ * ------------------------------------------------------------------------- */
+
+static bool  android_backend_set_functions(const char *functions);
+static bool  android_backend_set_ids      (const char *product_id, const char *vendor_id);
+static bool  android_backend_add_lun      (int lun);
+static bool  android_backend_set_lun_attr (int lun, const char *attr, const char *value);
+
 /* ========================================================================= *
  * Data
  * ========================================================================= */
@@ -75,6 +85,8 @@ android_write_file(const char *path, const char *text)
     if( !path || !text )
         goto EXIT;
 
+    path = common_root_path(path);
+
     log_debug("WRITE %s '%s'", path, text);
 
     char buff[64];
@@ -107,64 +119,13 @@ android_probe(void)
     LOG_REGISTER_CONTEXT;
 
     if( android_probed <= 0 ) {
-        android_probed = access(ANDROID0_ENABLE, F_OK) == 0;
+        android_probed = access(common_root_path(ANDROID0_ENABLE), F_OK) == 0;
         log_warning("ANDROID0 %sdetected", android_probed ? "" : "not ");
     }
 
     return android_in_use();
 }
 
-/** Read android serial number from kernel command line
- */
-gchar *
-android_get_serial(void)
-{
-    LOG_REGISTER_CONTEXT;
-
-    static const char path[] = "/proc/cmdline";
-    static const char find[] = "androidboot.serialno=";
-    static const char pbrk[] = " \t\r\n,";
-
-    char   *res  = 0;
-    FILE   *file = 0;
-    size_t  size = 0;
-    char   *data = 0;
-
-    if( !(file = fopen(path, "r")) ) {
-        log_warning("%s: %s: %m", path, "can't open");
-        goto EXIT;
-    }
-
-    if( getline(&data, &size, file) < 0 ) {
-        log_warning("%s: %s: %m", path, "can't read");
-        goto EXIT;
-    }
-
-    char *beg = strstr(data, find);
-    if( !beg ) {
-        log_warning("%s: no serial found", path);
-        goto EXIT;
-    }
-
-    beg += sizeof find - 1;
-    size_t len = strcspn(beg, pbrk);
-    if( len < 1 ) {
-        log_warning("%s: empty serial found", path);
-        goto EXIT;
-    }
-
-    res = g_strndup(beg, len);
-
-EXIT:
-
-    free(data);
-
-    if( file )
-        fclose(file);
-
-    return res;
-}
-
 /** initialize the basic android values
  *
  * @return true if android usb backend is ready for use, false otherwise
@@ -183,7 +144,7 @@ android_init(void)
     android_set_enabled(false);
 
     /* Configure */
-    if( (text = android_get_serial()) )
+    if( (text = common_get_android_serial()) )
     {
         android_write_file(ANDROID0_SERIAL, text);
         g_free(text);
@@ -387,3 +348,89 @@ android_set_attr(const char *function, const char *attr, const char *value)
               function, attr, value, ack);
     return ack;
 }
+
+/* ========================================================================= *
+ * ANDROID_BACKEND
+ * ========================================================================= */
+
+static bool
+android_backend_set_functions(const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Android usb always has some function selected, so clearing
+     * is a no-op. Functions get replaced when new ones are set. */
+    if( !functions )
+        return true;
+
+    return android_set_function(functions);
+}
+
+static bool
+android_backend_set_ids(const char *product_id, const char *vendor_id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+
+    if( product_id && !android_set_productid(product_id) )
+        ack = false;
+
+    if( vendor_id && !android_set_vendorid(vendor_id) )
+        ack = false;
+
+    return ack;
+}
+
+static bool
+android_backend_add_lun(int lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Android usb mass-storage supports only one lun */
+    return lun == 0;
+}
+
+static bool
+android_backend_set_lun_attr(int lun, const char *attr, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( lun != 0 )
+        goto EXIT;
+
+    /* Other attributes are not exposed by android usb */
+    if( strcmp(attr, "file") && strcmp(attr, "nofua") ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    char path[64];
+    snprintf(path, sizeof path, "lun/%s", attr);
+    ack = android_set_attr("f_mass_storage", path, value);
+
+EXIT:
+    return ack;
+}
+
+/** Gadget configuration via android usb */
+const gadget_backend_t android_backend =
+{
+    .gb_name            = "android",
+    .gb_last_resort     = false,
+    .gb_max_luns        = 1,
+    .gb_mtpd_before_udc = false,
+    .gb_extra_sysfs     = true,
+    .gb_charging_module = 0,
+    .gb_init            = android_init,
+    .gb_quit            = android_quit,
+    .gb_set_functions   = android_backend_set_functions,
+    .gb_set_ids         = android_backend_set_ids,
+    .gb_set_udc         = android_set_enabled,
+    .gb_add_lun         = android_backend_add_lun,
+    .gb_remove_lun      = 0,
+    .gb_set_lun_attr    = android_backend_set_lun_attr,
+    .gb_set_charging    = android_set_charging_mode,
+};
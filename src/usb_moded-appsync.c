@@ -29,28 +29,109 @@
 
 #include "usb_moded-appsync.h"
 
+#include "usb_moded-common.h"
+#include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-systemd.h"
+#include "usb_moded-taskgraph.h"
+#include "usb_moded-worker.h"
 
 #include <sys/time.h>
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Launch bookkeeping for one app within a batch
+ */
+typedef struct appsync_job_t
+{
+    /** App to launch */
+    list_elem_t *elem;
+
+    /** Set when launch succeeded and app should be marked active */
+    bool         started;
+} appsync_job_t;
+
+/** Start statistics for one systemd unit
+ */
+typedef struct appsync_stats_t
+{
+    /** Number of start attempts */
+    unsigned  starts;
+
+    /** Number of failed start attempts */
+    unsigned  failures;
+
+    /** Duration of the latest start [ms] */
+    int64_t   last_ms;
+
+    /** Longest start [ms] */
+    int64_t   max_ms;
+
+    /** Sum of all start durations [ms] */
+    int64_t   total_ms;
+
+    /** Result of the latest start job, interned string */
+    const char *result;
+} appsync_stats_t;
 
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
 /* ------------------------------------------------------------------------- *
- * APPSYNC
+ * APPSYNC_ELEM
  * ------------------------------------------------------------------------- */
 
 static void         appsync_free_elem                 (list_elem_t *elem);
-static void         appsync_free_elem_cb              (gpointer elem, gpointer user_data);
-void                appsync_free_appsync_list         (void);
+static void         appsync_free_elem_cb              (gpointer elem);
+static void         appsync_elem_set_state            (list_elem_t *elem, app_state_t state);
+static gchar      **appsync_read_names                (GKeyFile *settingsfile, const char *key);
+static list_elem_t *appsync_read_file                 (const gchar *filename, int diag);
+
+/* ------------------------------------------------------------------------- *
+ * APPSYNC_REGISTRY
+ * ------------------------------------------------------------------------- */
+
 static gint         appsync_list_sort_func            (gconstpointer a, gconstpointer b);
+static void         appsync_registry_index            (GHashTable *lut, const char *key, list_elem_t *elem);
+static void         appsync_registry_build            (void);
+static GPtrArray   *appsync_registry_lookup_mode      (const char *mode);
+static GPtrArray   *appsync_registry_lookup_name      (const char *name);
+static bool         appsync_registry_is_active        (const char *name);
+
+/* ------------------------------------------------------------------------- *
+ * APPSYNC_STATS
+ * ------------------------------------------------------------------------- */
+
+static void         appsync_stats_record              (const char *name, bool success, int64_t duration, const char *result);
+gchar              *appsync_get_stats                 (void);
+void                appsync_reset_stats               (void);
+
+/* ------------------------------------------------------------------------- *
+ * APPSYNC_BATCH
+ * ------------------------------------------------------------------------- */
+
+static bool         appsync_batch_launch_cb           (void *aptr);
+static GHashTable  *appsync_batch_index               (const appsync_job_t *jobs, size_t count);
+static bool         appsync_batch_is_ready            (const appsync_job_t *jobs, GHashTable *index, const bool *placed, size_t i);
+static void         appsync_batch_order               (appsync_job_t *jobs, size_t count);
+static bool         appsync_batch_deps                (const appsync_job_t *jobs, GHashTable *index, size_t base, size_t i, uint32_t *after);
+static bool         appsync_batch_run                 (GPtrArray *apps, int post);
+
+/* ------------------------------------------------------------------------- *
+ * APPSYNC
+ * ------------------------------------------------------------------------- */
+
+void                appsync_free_appsync_list         (void);
 void                appsync_read_list                 (int diag);
-static list_elem_t *appsync_read_file                 (const gchar *filename, int diag);
 int                 appsync_activate_sync             (const char *mode);
 int                 appsync_activate_sync_post        (const char *mode);
 int                 appsync_mark_active               (const gchar *name, int post);
@@ -67,7 +148,26 @@ int                 appsync_stop                      (gboolean force);
  * Data
  * ========================================================================= */
 
-static GList *appsync_sync_list = NULL;
+/** All apps, sorted by config file name; owns the elements */
+static GPtrArray *appsync_sync_list = NULL;
+
+/** Apps by mode name: mode -> GPtrArray of list_elem_t */
+static GHashTable *appsync_mode_lut = NULL;
+
+/** Apps by app name: name -> GPtrArray of list_elem_t */
+static GHashTable *appsync_name_lut = NULL;
+
+/** Active apps in launch order, so that they can be stopped in reverse */
+static GPtrArray *appsync_active_list = NULL;
+
+/** Number of apps in APP_STATE_INACTIVE state: [0]=pre, [1]=post */
+static unsigned appsync_inactive_count[2] = { 0, 0 };
+
+/** Lock for appsync_stats_lut, units are started from helper threads */
+static pthread_mutex_t appsync_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Unit name -> appsync_stats_t lookup table */
+static GHashTable *appsync_stats_lut = NULL;
 
 #ifdef APP_SYNC_DBUS
 static guint appsync_enumerate_usb_id = 0;
@@ -78,7 +178,7 @@ static int appsync_no_dbus = 1; // always disabled
 #endif /* APP_SYNC_DBUS */
 
 /* ========================================================================= *
- * Functions
+ * APPSYNC_ELEM
  * ========================================================================= */
 
 static void appsync_free_elem(list_elem_t *elem)
@@ -88,85 +188,84 @@ static void appsync_free_elem(list_elem_t *elem)
     g_free(elem->name);
     g_free(elem->launch);
     g_free(elem->mode);
+    g_free(elem->file);
+    g_strfreev(elem->after);
+    g_strfreev(elem->requires);
     free(elem);
 }
 
-static void appsync_free_elem_cb(gpointer elem, gpointer user_data)
+static void appsync_free_elem_cb(gpointer elem)
 {
     LOG_REGISTER_CONTEXT;
 
-    (void)user_data;
     appsync_free_elem(elem);
 }
 
-void appsync_free_appsync_list(void)
+/** Change app state, keeping active list and inactive counts in sync
+ *
+ * @param elem   App
+ * @param state  New state
+ */
+static void appsync_elem_set_state(list_elem_t *elem, app_state_t state)
 {
     LOG_REGISTER_CONTEXT;
 
-    if( appsync_sync_list != 0 )
-    {
-        /*g_list_free_full(appsync_sync_list, appsync_free_elem); */
-        g_list_foreach (appsync_sync_list, appsync_free_elem_cb, NULL);
-        g_list_free (appsync_sync_list);
-        appsync_sync_list = 0;
-        log_debug("Appsync list freed\n");
-    }
-}
+    if( elem->state == state )
+        goto EXIT;
 
-static gint appsync_list_sort_func(gconstpointer a, gconstpointer b)
-{
-    LOG_REGISTER_CONTEXT;
+    if( elem->state == APP_STATE_INACTIVE )
+        appsync_inactive_count[!!elem->post] -= 1;
+    else if( elem->state == APP_STATE_ACTIVE )
+        g_ptr_array_remove(appsync_active_list, elem);
+
+    elem->state = state;
+
+    if( elem->state == APP_STATE_INACTIVE )
+        appsync_inactive_count[!!elem->post] += 1;
+    else if( elem->state == APP_STATE_ACTIVE )
+        g_ptr_array_add(appsync_active_list, elem);
 
-    return strcasecmp( (char*)a, (char*)b );
+EXIT:
+    return;
 }
 
-void appsync_read_list(int diag)
+/** Read list of app names from appsync config file
+ *
+ * Names can be separated with white space, commas or semicolons.
+ *
+ * @param settingsfile  Parsed config file
+ * @param key           Key in APP_INFO_ENTRY group
+ *
+ * @return NULL terminated array of names, or NULL if not defined
+ */
+static gchar **appsync_read_names(GKeyFile *settingsfile, const char *key)
 {
     LOG_REGISTER_CONTEXT;
 
-    GDir *confdir = 0;
-
-    const gchar *dirname;
-    list_elem_t *list_item;
+    gchar  *value = g_key_file_get_string(settingsfile, APP_INFO_ENTRY, key, NULL);
+    gchar **names = 0;
 
-    appsync_free_appsync_list();
+    if( !value )
+        goto EXIT;
 
-    if(diag)
-    {
-        if( !(confdir = g_dir_open(CONF_DIR_DIAG_PATH, 0, NULL)) )
-            goto cleanup;
-    }
-    else
-    {
-        if( !(confdir = g_dir_open(CONF_DIR_PATH, 0, NULL)) )
-            goto cleanup;
-    }
+    names = g_strsplit_set(value, " \t,;", 0);
 
-    while( (dirname = g_dir_read_name(confdir)) )
-    {
-        log_debug("Read file %s\n", dirname);
-        if( (list_item = appsync_read_file(dirname, diag)) )
-            appsync_sync_list = g_list_append(appsync_sync_list, list_item);
+    /* Drop empty items resulting from consecutive separators */
+    size_t dst = 0;
+    for( size_t src = 0; names[src]; ++src ) {
+        if( *names[src] )
+            names[dst++] = names[src];
+        else
+            g_free(names[src]);
     }
+    names[dst] = 0;
 
-cleanup:
-    if( confdir ) g_dir_close(confdir);
-
-    /* sort list alphabetically so services for a mode
-     * can be run in a certain order */
-    appsync_sync_list=g_list_sort(appsync_sync_list, appsync_list_sort_func);
-
-    /* set up session bus connection if app sync in use
-     * so we do not need to make the time consuming connect
-     * operation at enumeration time ... */
+    if( dst == 0 )
+        g_strfreev(names), names = 0;
 
-    if( appsync_sync_list )
-    {
-        log_debug("Sync list valid\n");
-#ifdef APP_SYNC_DBUS
-        dbusappsync_init_connection();
-#endif
-    }
+EXIT:
+    g_free(value);
+    return names;
 }
 
 static list_elem_t *appsync_read_file(const gchar *filename, int diag)
@@ -179,12 +278,12 @@ static list_elem_t *appsync_read_file(const gchar *filename, int diag)
 
     if(diag)
     {
-        if( !(full_filename = g_strconcat(CONF_DIR_DIAG_PATH, "/", filename, NULL)) )
+        if( !(full_filename = g_strconcat(common_root_path(CONF_DIR_DIAG_PATH), "/", filename, NULL)) )
             goto cleanup;
     }
     else
     {
-        if( !(full_filename = g_strconcat(CONF_DIR_PATH, "/", filename, NULL)) )
+        if( !(full_filename = g_strconcat(common_root_path(CONF_DIR_PATH), "/", filename, NULL)) )
             goto cleanup;
     }
 
@@ -197,6 +296,7 @@ static list_elem_t *appsync_read_file(const gchar *filename, int diag)
     if( !(list_item = calloc(1, sizeof *list_item)) )
         goto cleanup;
 
+    list_item->file = g_strdup(filename);
     list_item->name = g_key_file_get_string(settingsfile, APP_INFO_ENTRY, APP_INFO_NAME_KEY, NULL);
     log_debug("Appname = %s\n", list_item->name);
     list_item->launch = g_key_file_get_string(settingsfile, APP_INFO_ENTRY, APP_INFO_LAUNCH_KEY, NULL);
@@ -206,6 +306,8 @@ static list_elem_t *appsync_read_file(const gchar *filename, int diag)
     list_item->systemd = g_key_file_get_integer(settingsfile, APP_INFO_ENTRY, APP_INFO_SYSTEMD_KEY, NULL);
     log_debug("Systemd control = %d\n", list_item->systemd);
     list_item->post = g_key_file_get_integer(settingsfile, APP_INFO_ENTRY, APP_INFO_POST, NULL);
+    list_item->after = appsync_read_names(settingsfile, APP_INFO_AFTER_KEY);
+    list_item->requires = appsync_read_names(settingsfile, APP_INFO_REQUIRES_KEY);
     list_item->state = APP_STATE_DONTCARE;
 
 cleanup:
@@ -225,13 +327,567 @@ cleanup:
     return list_item;
 }
 
+/* ========================================================================= *
+ * APPSYNC_REGISTRY
+ * ========================================================================= */
+
+static gint appsync_list_sort_func(gconstpointer a, gconstpointer b)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const list_elem_t *elem_a = *(const list_elem_t * const *)a;
+    const list_elem_t *elem_b = *(const list_elem_t * const *)b;
+
+    return strcasecmp(elem_a->file, elem_b->file);
+}
+
+/** Add app to lookup table
+ *
+ * @param lut   Lookup table
+ * @param key   Lookup key, must stay valid while lut exists
+ * @param elem  App
+ */
+static void appsync_registry_index(GHashTable *lut, const char *key, list_elem_t *elem)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray *apps = g_hash_table_lookup(lut, key);
+    if( !apps ) {
+        apps = g_ptr_array_new();
+        g_hash_table_insert(lut, (gpointer)key, apps);
+    }
+    g_ptr_array_add(apps, elem);
+}
+
+/** Index apps by mode and by name
+ *
+ * Within each index, apps retain the config file name order.
+ */
+static void appsync_registry_build(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* sort list alphabetically so services for a mode
+     * can be run in a certain order */
+    g_ptr_array_sort(appsync_sync_list, appsync_list_sort_func);
+
+    appsync_mode_lut = g_hash_table_new_full(g_str_hash, g_str_equal, 0,
+                                             (GDestroyNotify)g_ptr_array_unref);
+    appsync_name_lut = g_hash_table_new_full(g_str_hash, g_str_equal, 0,
+                                             (GDestroyNotify)g_ptr_array_unref);
+    appsync_active_list = g_ptr_array_new();
+
+    for( guint i = 0; i < appsync_sync_list->len; ++i ) {
+        list_elem_t *elem = appsync_sync_list->pdata[i];
+        appsync_registry_index(appsync_mode_lut, elem->mode, elem);
+        appsync_registry_index(appsync_name_lut, elem->name, elem);
+    }
+}
+
+/** Get apps to launch in a mode
+ *
+ * @param mode  Mode name
+ *
+ * @return array of apps, or NULL if there are none
+ */
+static GPtrArray *appsync_registry_lookup_mode(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return appsync_mode_lut ? g_hash_table_lookup(appsync_mode_lut, mode) : 0;
+}
+
+/** Get apps by name
+ *
+ * The same app can be listed for several modes.
+ *
+ * @param name  App name
+ *
+ * @return array of apps, or NULL if there are none
+ */
+static GPtrArray *appsync_registry_lookup_name(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return appsync_name_lut ? g_hash_table_lookup(appsync_name_lut, name) : 0;
+}
+
+/** Check if an app with given name is active
+ *
+ * @param name  App name
+ *
+ * @return true if app is active, false otherwise
+ */
+static bool appsync_registry_is_active(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray *apps = appsync_registry_lookup_name(name);
+    for( guint i = 0; apps && i < apps->len; ++i ) {
+        const list_elem_t *elem = apps->pdata[i];
+        if( elem->state == APP_STATE_ACTIVE )
+            return true;
+    }
+    return false;
+}
+
+/* ========================================================================= *
+ * APPSYNC_STATS
+ * ========================================================================= */
+
+/** Account systemd unit start attempt
+ *
+ * @param name      Unit name
+ * @param success   Whether the unit was started
+ * @param duration  Time from start request to job completion [ms]
+ * @param result    Job result reported by systemd
+ */
+static void appsync_stats_record(const char *name, bool success, int64_t duration, const char *result)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pthread_mutex_lock(&appsync_stats_mutex);
+
+    if( !appsync_stats_lut )
+        appsync_stats_lut = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+
+    appsync_stats_t *stats = g_hash_table_lookup(appsync_stats_lut, name);
+    if( !stats ) {
+        stats = g_new0(appsync_stats_t, 1);
+        g_hash_table_insert(appsync_stats_lut, g_strdup(name), stats);
+    }
+
+    stats->starts   += 1;
+    stats->failures += !success;
+    stats->last_ms   = duration;
+    stats->total_ms += duration;
+    if( stats->max_ms < duration )
+        stats->max_ms = duration;
+    stats->result    = g_intern_string(result ?: "unknown");
+
+    pthread_mutex_unlock(&appsync_stats_mutex);
+}
+
+/** Get appsync unit start statistics
+ *
+ * @return "unit: key=value ..., ..." string; caller must release
+ */
+gchar *appsync_get_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *buff = g_string_new(0);
+
+    pthread_mutex_lock(&appsync_stats_mutex);
+
+    if( appsync_stats_lut ) {
+        GList *keys = g_hash_table_get_keys(appsync_stats_lut);
+        keys = g_list_sort(keys, (GCompareFunc)strcmp);
+        for( GList *iter = keys; iter; iter = iter->next ) {
+            const char            *name  = iter->data;
+            const appsync_stats_t *stats = g_hash_table_lookup(appsync_stats_lut, name);
+
+            if( buff->len )
+                g_string_append(buff, ", ");
+            g_string_append_printf(buff, "%s: starts=%u failures=%u "
+                                   "last=%lld longest=%lld average=%lld "
+                                   "result=%s",
+                                   name, stats->starts, stats->failures,
+                                   (long long)stats->last_ms,
+                                   (long long)stats->max_ms,
+                                   (long long)(stats->total_ms / stats->starts),
+                                   stats->result);
+        }
+        g_list_free(keys);
+    }
+
+    pthread_mutex_unlock(&appsync_stats_mutex);
+
+    return g_string_free(buff, FALSE);
+}
+
+/** Reset appsync unit start statistics
+ */
+void appsync_reset_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pthread_mutex_lock(&appsync_stats_mutex);
+    if( appsync_stats_lut )
+        g_hash_table_unref(appsync_stats_lut), appsync_stats_lut = 0;
+    pthread_mutex_unlock(&appsync_stats_mutex);
+}
+
+/* ========================================================================= *
+ * APPSYNC_BATCH
+ * ========================================================================= */
+
+/** Task graph callback for launching one app
+ *
+ * Systemd units are started from helper threads, so this must not
+ * touch appsync state other than the job it was given. Helper threads
+ * make their StartUnit calls over private D-Bus connections, so that
+ * blocking calls do not hold up the mainloop connection.
+ *
+ * Returns only after systemd units have finished starting up, so
+ * that apps are marked active when they really are active and
+ * dependent apps are not launched before their prerequisites.
+ *
+ * @param aptr  Launch job
+ *
+ * @return true on success, false on failure
+ */
+static bool appsync_batch_launch_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    appsync_job_t *job      = aptr;
+    list_elem_t   *data     = job->elem;
+    bool           ack      = false;
+    bool           attached = false;
+
+    log_debug("launching %s-enum-app %s\n", data->post ? "post" : "pre", data->name);
+
+    if(data->systemd)
+    {
+        /* Worker thread has a private connection of its own */
+        if( !worker_thread_p() && !(attached = umdbus_attach_thread_connection()) ) {
+            log_err("%s-enum-app %s: no private D-Bus connection",
+                    data->post ? "post" : "pre", data->name);
+            goto EXIT;
+        }
+
+        gchar   *result  = 0;
+        int64_t  started = common_get_monotonic_ms();
+        bool     success = systemd_control_wait(data->name, SYSTEMD_START, &result,
+                                                    worker_bailing_out);
+        int64_t  elapsed = common_get_monotonic_ms() - started;
+
+        appsync_stats_record(data->name, success, elapsed, result);
+        log_debug("%s-enum-app %s: %s in %lld ms", data->post ? "post" : "pre",
+                  data->name, result, (long long)elapsed);
+        g_free(result);
+
+        if( !success )
+            goto EXIT;
+        job->started = true;
+    }
+    else if(data->launch)
+    {
+        /* skipping if dbus session bus is not available,
+         * or not compiled in */
+        if(appsync_no_dbus)
+            job->started = !data->post;
+#ifdef APP_SYNC_DBUS
+        else if(dbusappsync_launch_app(data->launch) != 0)
+            goto EXIT;
+        else
+            /* post-enum-apps report readiness via session bus */
+            job->started = !data->post;
+#endif /* APP_SYNC_DBUS */
+    }
+
+    ack = true;
+
+EXIT:
+    if( attached )
+        umdbus_detach_thread_connection();
+
+    return ack;
+}
+
+/** Build name to batch position lookup table
+ *
+ * @param jobs   Launch jobs
+ * @param count  Number of launch jobs
+ *
+ * @return lookup table from app name to position + 1
+ */
+static GHashTable *appsync_batch_index(const appsync_job_t *jobs, size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable *index = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for( size_t i = count; i-- > 0; )
+        g_hash_table_insert(index, jobs[i].elem->name, GSIZE_TO_POINTER(i + 1));
+
+    return index;
+}
+
+/** Check if all batch local prerequisites of an app have been placed
+ *
+ * @param jobs    Launch jobs
+ * @param index   Lookup table from appsync_batch_index()
+ * @param placed  Flags for already placed jobs
+ * @param i       Job to check
+ *
+ * @return true if the job can be placed next, false otherwise
+ */
+static bool appsync_batch_is_ready(const appsync_job_t *jobs, GHashTable *index, const bool *placed, size_t i)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char **lists[] = { jobs[i].elem->after, jobs[i].elem->requires };
+
+    for( size_t l = 0; l < G_N_ELEMENTS(lists); ++l ) {
+        for( size_t k = 0; lists[l] && lists[l][k]; ++k ) {
+            gsize pos = GPOINTER_TO_SIZE(g_hash_table_lookup(index, lists[l][k]));
+            if( pos && pos - 1 != i && !placed[pos - 1] )
+                return false;
+        }
+    }
+    return true;
+}
+
+/** Sort launch jobs so that prerequisites come first
+ *
+ * Apps without ordering constraints retain config file name order.
+ * Dependency cycles are broken in config file name order.
+ *
+ * @param jobs   Launch jobs
+ * @param count  Number of launch jobs
+ */
+static void appsync_batch_order(appsync_job_t *jobs, size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable    *index  = appsync_batch_index(jobs, count);
+    bool          *placed = g_new0(bool, count);
+    appsync_job_t *sorted = g_new0(appsync_job_t, count);
+
+    for( size_t pos = 0; pos < count; ++pos ) {
+        size_t pick = count;
+
+        for( size_t i = 0; i < count; ++i ) {
+            if( !placed[i] && appsync_batch_is_ready(jobs, index, placed, i) ) {
+                pick = i;
+                break;
+            }
+        }
+
+        if( pick == count ) {
+            for( pick = 0; placed[pick]; ++pick )
+                ;
+            log_warning("dependency cycle at %s; ordering ignored",
+                        jobs[pick].elem->name);
+        }
+
+        placed[pick] = true;
+        sorted[pos]  = jobs[pick];
+    }
+
+    memcpy(jobs, sorted, count * sizeof *jobs);
+
+    g_free(sorted);
+    g_free(placed);
+    g_hash_table_unref(index);
+}
+
+/** Evaluate task graph dependencies for a launch job
+ *
+ * @param jobs   Launch jobs, in launch order
+ * @param index  Lookup table from appsync_batch_index()
+ * @param base   Position of the first job in the current task graph
+ * @param i      Position of the job to evaluate
+ * @param after  Where to store TASKGRAPH_DEP() mask
+ *
+ * @return true if the job can be launched, or false if
+ *         a required app is not going to be active
+ */
+static bool appsync_batch_deps(const appsync_job_t *jobs, GHashTable *index, size_t base, size_t i, uint32_t *after)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const list_elem_t *elem = jobs[i].elem;
+
+    *after = 0;
+
+    for( size_t k = 0; elem->after && elem->after[k]; ++k ) {
+        gsize pos = GPOINTER_TO_SIZE(g_hash_table_lookup(index, elem->after[k]));
+        /* Apps in earlier task graphs have already been launched, and
+         * ordering against apps outside the batch is not needed */
+        if( pos && pos - 1 >= base && pos - 1 < i )
+            *after |= TASKGRAPH_DEP(pos - 1 - base);
+    }
+
+    for( size_t k = 0; elem->requires && elem->requires[k]; ++k ) {
+        gsize pos = GPOINTER_TO_SIZE(g_hash_table_lookup(index, elem->requires[k]));
+        if( pos && pos - 1 < i ) {
+            if( pos - 1 >= base )
+                *after |= TASKGRAPH_DEP(pos - 1 - base);
+        }
+        else if( !appsync_registry_is_active(elem->requires[k]) ) {
+            log_warning("%s requires %s, which is not launched",
+                        elem->name, elem->requires[k]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/** Launch pre or post enumeration apps for a mode
+ *
+ * Apps are launched in dependency order. Systemd units that do not
+ * depend on each other are started concurrently. Launching stops at
+ * the first failure, but apps launched up to that point are still
+ * marked active so that they get stopped on mode exit.
+ *
+ * @param apps  Apps associated with the mode
+ * @param post  0 to launch pre-enum-apps, 1 to launch post-enum-apps
+ *
+ * @return true if all apps were launched, false otherwise
+ */
+static bool appsync_batch_run(GPtrArray *apps, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool              ack   = false;
+    size_t            count = 0;
+    appsync_job_t    *jobs  = g_new0(appsync_job_t, apps->len);
+    taskgraph_task_t *tasks = g_new0(taskgraph_task_t, TASKGRAPH_MAX_TASKS);
+    GHashTable       *index = 0;
+
+    for( guint i = 0; i < apps->len; ++i ) {
+        list_elem_t *elem = apps->pdata[i];
+        /* do not launch post items before usb is up, and vice versa */
+        if( !elem->post != !post )
+            continue;
+        if( !elem->systemd && !elem->launch )
+            continue;
+        jobs[count++].elem = elem;
+    }
+
+    appsync_batch_order(jobs, count);
+    index = appsync_batch_index(jobs, count);
+
+    /* Oversized batches are executed in chunks; ordering guarantees
+     * that prerequisites are never in a later chunk */
+    for( size_t base = 0; base < count; base += TASKGRAPH_MAX_TASKS ) {
+        size_t n  = MIN(count - base, TASKGRAPH_MAX_TASKS);
+        bool   ok = true;
+
+        for( size_t i = 0; ok && i < n; ++i ) {
+            appsync_job_t *job = &jobs[base + i];
+            tasks[i].name    = job->elem->name;
+            tasks[i].fn      = appsync_batch_launch_cb;
+            tasks[i].run_on  = (job->elem->systemd ?
+                                TASKGRAPH_RUN_ON_HELPER :
+                                TASKGRAPH_RUN_ON_CALLER);
+            tasks[i].aptr    = job;
+            tasks[i].enabled = true;
+            ok = appsync_batch_deps(jobs, index, base, base + i, &tasks[i].after);
+        }
+
+        if( ok )
+            ok = taskgraph_run(tasks, n, 0, worker_bailing_out);
+
+        for( size_t i = 0; i < n; ++i ) {
+            if( jobs[base + i].started )
+                appsync_mark_active(jobs[base + i].elem->name, post);
+        }
+
+        if( !ok )
+            goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    if( index )
+        g_hash_table_unref(index);
+    g_free(tasks);
+    g_free(jobs);
+
+    return ack;
+}
+
+/* ========================================================================= *
+ * APPSYNC
+ * ========================================================================= */
+
+void appsync_free_appsync_list(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( appsync_mode_lut )
+        g_hash_table_unref(appsync_mode_lut), appsync_mode_lut = 0;
+
+    if( appsync_name_lut )
+        g_hash_table_unref(appsync_name_lut), appsync_name_lut = 0;
+
+    if( appsync_active_list )
+        g_ptr_array_unref(appsync_active_list), appsync_active_list = 0;
+
+    appsync_inactive_count[0] = appsync_inactive_count[1] = 0;
+
+    appsync_reset_stats();
+
+    if( appsync_sync_list != 0 )
+    {
+        g_ptr_array_unref(appsync_sync_list);
+        appsync_sync_list = 0;
+        log_debug("Appsync list freed\n");
+    }
+}
+
+void appsync_read_list(int diag)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GDir *confdir = 0;
+
+    const gchar *dirname;
+    list_elem_t *list_item;
+
+    appsync_free_appsync_list();
+
+    appsync_sync_list = g_ptr_array_new_with_free_func(appsync_free_elem_cb);
+
+    if(diag)
+    {
+        if( !(confdir = g_dir_open(common_root_path(CONF_DIR_DIAG_PATH), 0, NULL)) )
+            goto cleanup;
+    }
+    else
+    {
+        if( !(confdir = g_dir_open(common_root_path(CONF_DIR_PATH), 0, NULL)) )
+            goto cleanup;
+    }
+
+    while( (dirname = g_dir_read_name(confdir)) )
+    {
+        log_debug("Read file %s\n", dirname);
+        if( (list_item = appsync_read_file(dirname, diag)) )
+            g_ptr_array_add(appsync_sync_list, list_item);
+    }
+
+cleanup:
+    if( confdir ) g_dir_close(confdir);
+
+    appsync_registry_build();
+
+    /* set up session bus connection if app sync in use
+     * so we do not need to make the time consuming connect
+     * operation at enumeration time ... */
+
+    if( appsync_sync_list->len )
+    {
+        log_debug("Sync list valid\n");
+#ifdef APP_SYNC_DBUS
+        dbusappsync_init_connection();
+#endif
+    }
+}
+
 /* @return 0 on succes, 1 if there is a failure */
 int appsync_activate_sync(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList *iter;
-    int count = 0;
+    GPtrArray *apps = 0;
 
     log_debug("activate sync");
 
@@ -240,7 +896,7 @@ int appsync_activate_sync(const char *mode)
     gettimeofday(&appsync_sync_tv, 0);
 #endif
 
-    if( appsync_sync_list == 0 )
+    if( !appsync_sync_list || !appsync_sync_list->len )
     {
         log_debug("No sync list!");
 #ifdef APP_SYNC_DBUS
@@ -249,25 +905,15 @@ int appsync_activate_sync(const char *mode)
         return 0;
     }
 
-    /* Count apps that need to be activated for this mode and
-     * mark them as currently inactive */
-    for( iter = appsync_sync_list; iter; iter = g_list_next(iter) )
-    {
-        list_elem_t *data = iter->data;
+    /* Mark apps that need to be activated for this mode as
+     * currently inactive, and forget about everything else */
+    for( guint i = 0; i < appsync_sync_list->len; ++i )
+        appsync_elem_set_state(appsync_sync_list->pdata[i], APP_STATE_DONTCARE);
 
-        if(!strcmp(data->mode, mode))
-        {
-            ++count;
-            data->state = APP_STATE_INACTIVE;
-        }
-        else
-        {
-            data->state = APP_STATE_DONTCARE;
-        }
-    }
+    apps = appsync_registry_lookup_mode(mode);
 
     /* If there is nothing to activate, enumerate immediately */
-    if(count <= 0)
+    if( !apps )
     {
         log_debug("Nothing to launch\n");
 #ifdef APP_SYNC_DBUS
@@ -276,6 +922,9 @@ int appsync_activate_sync(const char *mode)
         return 0;
     }
 
+    for( guint i = 0; i < apps->len; ++i )
+        appsync_elem_set_state(apps->pdata[i], APP_STATE_INACTIVE);
+
 #ifdef APP_SYNC_DBUS
     /* check dbus initialisation, skip dbus activated services if this fails */
     if(!dbusappsync_init())
@@ -288,39 +937,9 @@ int appsync_activate_sync(const char *mode)
     appsync_start_enumerate_usb_timer();
 #endif
 
-    /* go through list and launch apps */
-    for( iter = appsync_sync_list; iter; iter = g_list_next(iter) )
-    {
-        list_elem_t *data = iter->data;
-        if(!strcmp(mode, data->mode))
-        {
-            /* do not launch items marked as post, will be launched after usb is up */
-            if(data->post)
-            {
-                continue;
-            }
-            log_debug("launching pre-enum-app %s\n", data->name);
-            if(data->systemd)
-            {
-                if(!systemd_control_service(data->name, SYSTEMD_START))
-                    goto error;
-                appsync_mark_active(data->name, 0);
-            }
-            else if(data->launch)
-            {
-                /* skipping if dbus session bus is not available,
-                 * or not compiled in */
-                if(appsync_no_dbus)
-                    appsync_mark_active(data->name, 0);
-#ifdef APP_SYNC_DBUS
-                else if(!dbusappsync_launch_app(data->launch))
-                    appsync_mark_active(data->name, 0);
-                else
-                    goto error;
-#endif /* APP_SYNC_DBUS */
-            }
-        }
-    }
+    /* launch pre-enum-apps, post items will be launched after usb is up */
+    if( !appsync_batch_run(apps, 0) )
+        goto error;
 
     return 0;
 
@@ -333,16 +952,19 @@ int appsync_activate_sync_post(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList *iter;
+    GPtrArray *apps = 0;
 
     log_debug("activate post sync");
 
-    if( appsync_sync_list == 0 )
+    if( !appsync_sync_list || !appsync_sync_list->len )
     {
         log_debug("No sync list! skipping post sync\n");
         return 0;
     }
 
+    if( !(apps = appsync_registry_lookup_mode(mode)) )
+        return 0;
+
 #ifdef APP_SYNC_DBUS
     /* check dbus initialisation, skip dbus activated services if this fails */
     if(!dbusappsync_init())
@@ -352,35 +974,9 @@ int appsync_activate_sync_post(const char *mode)
     }
 #endif /* APP_SYNC_DBUS */
 
-    /* go through list and launch apps */
-    for( iter = appsync_sync_list; iter; iter = g_list_next(iter) )
-    {
-        list_elem_t *data = iter->data;
-        if(!strcmp(mode, data->mode))
-        {
-            /* launch only items marked as post, others are already running */
-            if(!data->post)
-                continue;
-            log_debug("launching post-enum-app %s\n", data->name);
-            if(data->systemd)
-            {
-                if(!systemd_control_service(data->name, SYSTEMD_START))
-                    goto error;
-                appsync_mark_active(data->name, 1);
-            }
-            else if(data->launch)
-            {
-                /* skipping if dbus session bus is not available,
-                 * or not compiled in */
-                if(appsync_no_dbus)
-                    continue;
-#ifdef APP_SYNC_DBUS
-                else if(dbusappsync_launch_app(data->launch) != 0)
-                    goto error;
-#endif /* APP_SYNC_DBUS */
-            }
-        }
-    }
+    /* launch only items marked as post, others are already running */
+    if( !appsync_batch_run(apps, 1) )
+        goto error;
 
     return 0;
 
@@ -394,34 +990,18 @@ int appsync_mark_active(const gchar *name, int post)
     LOG_REGISTER_CONTEXT;
 
     int ret = -1; // assume name not found
-    int missing = 0;
-
-    GList *iter;
 
     log_debug("%s-enum-app %s is started\n", post ? "post" : "pre", name);
 
-    for( iter = appsync_sync_list; iter; iter = g_list_next(iter) )
+    GPtrArray *apps = appsync_registry_lookup_name(name);
+    for( guint i = 0; apps && i < apps->len; ++i )
     {
-        list_elem_t *data = iter->data;
-
-        if(!strcmp(data->name, name))
-        {
-            /* TODO: do we need to worry about duplicate names in the list? */
-            ret = (data->state != APP_STATE_ACTIVE);
-            data->state = APP_STATE_ACTIVE;
-
-            /* updated + missing -> not going to enumerate */
-            if( missing ) break;
-        }
-        else if( data->state == APP_STATE_INACTIVE && data->post == post )
-        {
-            missing = 1;
-
-            /* updated + missing -> not going to enumerate */
-            if( ret != -1 ) break;
-        }
+        list_elem_t *data = apps->pdata[i];
+        ret = (data->state != APP_STATE_ACTIVE);
+        appsync_elem_set_state(data, APP_STATE_ACTIVE);
     }
-    if( !post && !missing )
+
+    if( !post && appsync_inactive_count[0] == 0 )
     {
         log_debug("All pre-enum-apps active");
 #ifdef APP_SYNC_DBUS
@@ -498,18 +1078,21 @@ void appsync_stop_apps(int post)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList *iter = 0;
+    if( !appsync_active_list )
+        return;
 
-    for( iter = appsync_sync_list; iter; iter = g_list_next(iter) )
+    /* Stop in reverse launch order, so that dependent apps
+     * are stopped before their prerequisites */
+    for( guint i = appsync_active_list->len; i-- > 0; )
     {
-        list_elem_t *data = iter->data;
+        list_elem_t *data = appsync_active_list->pdata[i];
 
-        if(data->systemd && data->state == APP_STATE_ACTIVE && data->post == post)
+        if(data->systemd && !data->post == !post)
         {
             log_debug("stopping %s-enum-app %s", post ? "post" : "pre", data->name);
             if(!systemd_control_service(data->name, SYSTEMD_STOP))
                 log_debug("Failed to stop %s\n", data->name);
-            data->state = APP_STATE_DONTCARE;
+            appsync_elem_set_state(data, APP_STATE_DONTCARE);
         }
     }
 }
@@ -520,16 +1103,12 @@ int appsync_stop(gboolean force)
 
     /* If force arg is used, stop all applications that
      * could have been started by usb-moded */
-    if(force)
+    if(force && appsync_sync_list)
     {
-        GList *iter;
         log_debug("assuming all applications are active");
 
-        for( iter = appsync_sync_list; iter; iter = g_list_next(iter) )
-        {
-            list_elem_t *data = iter->data;
-            data->state = APP_STATE_ACTIVE;
-        }
+        for( guint i = 0; i < appsync_sync_list->len; ++i )
+            appsync_elem_set_state(appsync_sync_list->pdata[i], APP_STATE_ACTIVE);
     }
 
     /* Stop post-apps 1st */
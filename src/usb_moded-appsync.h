@@ -44,6 +44,8 @@
 # define APP_INFO_LAUNCH_KEY    "launch"
 # define APP_INFO_SYSTEMD_KEY   "systemd"  // integer
 # define APP_INFO_POST          "post"     // integer
+# define APP_INFO_AFTER_KEY     "after"    // list of app names
+# define APP_INFO_REQUIRES_KEY  "requires" // list of app names
 
 /* ========================================================================= *
  * Types
@@ -71,6 +73,9 @@ typedef struct list_elem_t
     app_state_t state;    /**< marker to check if the app has started sucessfully */
     int systemd;          /**< marker to know if we start it with systemd or not */
     int post;             /**< marker to indicate when to start the app */
+    char *file;           /**< config file name, defines default launch order */
+    char **after;         /**< apps that must be launched before this one */
+    char **requires;      /**< apps that must be launched successfully before this one */
 } list_elem_t;
 
 /* ========================================================================= *
@@ -81,12 +86,19 @@ typedef struct list_elem_t
  * APPSYNC
  * ------------------------------------------------------------------------- */
 
-void appsync_free_appsync_list (void);
-void appsync_read_list         (int diag);
-int  appsync_activate_sync     (const char *mode);
-int  appsync_activate_sync_post(const char *mode);
-int  appsync_mark_active       (const gchar *name, int post);
-void appsync_stop_apps         (int post);
-int  appsync_stop              (gboolean force);
+void   appsync_free_appsync_list (void);
+void   appsync_read_list         (int diag);
+int    appsync_activate_sync     (const char *mode);
+int    appsync_activate_sync_post(const char *mode);
+int    appsync_mark_active       (const gchar *name, int post);
+void   appsync_stop_apps         (int post);
+int    appsync_stop              (gboolean force);
+
+/* ------------------------------------------------------------------------- *
+ * APPSYNC_STATS
+ * ------------------------------------------------------------------------- */
+
+gchar *appsync_get_stats         (void);
+void   appsync_reset_stats       (void);
 
 #endif /* USB_MODED_APPSYNC_H_ */
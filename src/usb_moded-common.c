@@ -32,15 +32,31 @@
 #include "usb_moded-dyn-config.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-recorder.h"
 #include "usb_moded-worker.h"
 
 #include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include <spawn.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** How long to wait for canceled child to exit before SIGKILL [ms] */
+#define COMMON_CHILD_TERM_TIMEOUT_MS 2000
 
 /* ========================================================================= *
  * Types
@@ -69,6 +85,12 @@ typedef struct modemapping_t
 
 const char *cable_state_repr(cable_state_t state);
 
+/* ------------------------------------------------------------------------- *
+ * MODE_REASON
+ * ------------------------------------------------------------------------- */
+
+const char *mode_reason_repr(mode_reason_t reason);
+
 /* ------------------------------------------------------------------------- *
  * COMMON
  * ------------------------------------------------------------------------- */
@@ -79,17 +101,42 @@ void         common_send_supported_modes_signal  (void);
 void         common_send_available_modes_signal  (void);
 void         common_send_hidden_modes_signal     (void);
 void         common_send_whitelisted_modes_signal(void);
-static void  common_write_to_sysfs_file          (const char *path, const char *text);
-void         common_acquire_wakelock             (const char *wakelock_name);
-void         common_release_wakelock             (const char *wakelock_name);
+static bool  common_wait_child_timed             (pid_t pid, int pid_fd, int timeout_ms, int *status);
+static int   common_wait_child                   (pid_t pid);
+static pid_t common_spawn_child                  (const char *command, int redirect_fd, int target_fd);
+static int   common_spawn_shell                  (const char *command);
 int          common_system_                      (const char *file, int line, const char *func, const char *command);
 FILE        *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
+int          common_pclose                       (FILE *stream);
+int64_t      common_get_monotonic_ms             (void);
 waitres_t    common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
 bool         common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
 static bool  common_mode_in_list                 (const char *mode, char *const *modes);
 bool         common_modename_is_internal         (const char *modename);
 int          common_valid_mode                   (const char *mode);
 gchar       *common_get_mode_list                (mode_list_type_t type, uid_t uid);
+gchar       *common_get_android_serial           (void);
+
+/* ------------------------------------------------------------------------- *
+ * ROOT_PREFIX
+ * ------------------------------------------------------------------------- */
+
+void         common_set_root_prefix              (const char *prefix);
+const char  *common_get_root_prefix              (void);
+const char  *common_root_path                    (const char *path);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Directory under which all filesystem paths are looked up, or NULL */
+static gchar *common_root_prefix = 0;
+
+/** Streams opened via common_popen(): FILE * -> child pid */
+static GHashTable *common_popen_lut = 0;
+
+/** Lock for common_popen_lut */
+static pthread_mutex_t common_popen_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* ========================================================================= *
  * Functions
@@ -112,6 +159,23 @@ const char *cable_state_repr(cable_state_t state)
     return lut[state];
 }
 
+/* ------------------------------------------------------------------------- *
+ * MODE_REASON
+ * ------------------------------------------------------------------------- */
+
+const char *mode_reason_repr(mode_reason_t reason)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const lut[MODE_REASON_NUMOF] = {
+        [MODE_REASON_CABLE]   = "cable",
+        [MODE_REASON_USER]    = "user",
+        [MODE_REASON_POLICY]  = "policy",
+        [MODE_REASON_TRIGGER] = "trigger",
+    };
+    return (reason < MODE_REASON_NUMOF) ? lut[reason] : "invalid";
+}
+
 /* ------------------------------------------------------------------------- *
  * MODE_MAPPING
  * ------------------------------------------------------------------------- */
@@ -272,90 +336,221 @@ void common_send_whitelisted_modes_signal(void)
 }
 
 /* ------------------------------------------------------------------------- *
- * SYSFS_IO
+ * BLOCKING_OPERATION
  * ------------------------------------------------------------------------- */
 
-/** Write string to already existing sysfs file
+/** Wait for child process to exit, with timeout
  *
- * Note: Attempts to write to nonexisting files are silently ignored.
+ * @param pid         child process id
+ * @param pid_fd      pidfd for the child, or -1
+ * @param timeout_ms  maximum time to wait [ms]
+ * @param status      where to store wait status
  *
- * @param path Where to write
- * @param text What to write
+ * @return true if child was reaped, false on timeout / failure
  */
-static void common_write_to_sysfs_file(const char *path, const char *text)
+static bool
+common_wait_child_timed(pid_t pid, int pid_fd, int timeout_ms, int *status)
 {
     LOG_REGISTER_CONTEXT;
 
-    int fd = -1;
+    int64_t due    = common_get_monotonic_ms() + timeout_ms;
+    int     nap_ms = 1;
 
-    if (!path || !text)
-        goto EXIT;
+    for( ;; ) {
+        pid_t rc = waitpid(pid, status, WNOHANG);
 
-    if ((fd = open(path, O_WRONLY)) == -1) {
-        if (errno != ENOENT) {
-            log_warning("%s: open for writing failed: %m", path);
-        }
-        goto EXIT;
-    }
+        if( rc == pid )
+            return true;
 
-    if (write(fd, text, strlen(text)) == -1) {
-        log_warning("%s: write failed : %m", path);
-        goto EXIT;
+        if( rc == -1 && errno != EINTR )
+            return false;
+
+        int64_t left = due - common_get_monotonic_ms();
+        if( left <= 0 )
+            return false;
+
+        struct pollfd pfd = { .fd = pid_fd, .events = POLLIN };
+        int wait_ms = (pid_fd == -1 && nap_ms < left) ? nap_ms : (int)left;
+        if( poll(&pfd, 1, wait_ms) == -1 && errno != EINTR )
+            return false;
+
+        if( nap_ms < 32 )
+            nap_ms *= 2;
     }
-EXIT:
-    if (fd != -1)
-        close(fd);
 }
 
-/* ------------------------------------------------------------------------- *
- * WAKELOCKS
- * ------------------------------------------------------------------------- */
-
-/** Acquire wakelock via sysfs
+/** Wait for child process to exit
  *
- * Wakelock must be released via common_release_wakelock().
+ * When called from the worker thread, the wait is abandoned if the
+ * ongoing mode switch gets canceled. The whole process group of the
+ * child is then sent SIGTERM, and SIGKILL if the child does not exit
+ * within COMMON_CHILD_TERM_TIMEOUT_MS, before reaping the child.
  *
- * Automatically terminating wakelock is used, so that we
- * do not block suspend  indefinately in case usb_moded
- * gets stuck or crashes.
+ * @param pid  process id of a child that is a process group leader
  *
- * Note: The name should be unique within the system.
- *
- * @param wakelock_name Wake lock to be acquired
+ * @return wait status of the child process, or -1 on failure
  */
-void common_acquire_wakelock(const char *wakelock_name)
+static int
+common_wait_child(pid_t pid)
 {
     LOG_REGISTER_CONTEXT;
 
-    char buff[256];
-    snprintf(buff, sizeof buff, "%s %lld",
-             wakelock_name,
-             USB_MODED_SUSPEND_DELAY_MAXIMUM_MS * 1000000LL);
-    common_write_to_sysfs_file("/sys/power/wake_lock", buff);
+    int status    = -1;
+    int cancel_fd = worker_get_cancel_fd();
+    int pid_fd    = -1;
+    int nap_ms    = 1;
+
+    if( cancel_fd == -1 )
+        goto REAP;
 
-#if VERBOSE_WAKELOCKING
-    log_debug("common_acquire_wakelock %s", wakelock_name);
+#ifdef SYS_pidfd_open
+    /* Use pidfd for exit notification when available, otherwise
+     * fall back to polling with exponential backoff. */
+    pid_fd = syscall(SYS_pidfd_open, pid, 0);
 #endif
+
+    for( ;; ) {
+        pid_t rc = waitpid(pid, &status, WNOHANG);
+
+        if( rc == pid )
+            goto EXIT;
+
+        if( rc == -1 && errno != EINTR ) {
+            log_warning("waitpid(%d): %m", (int)pid);
+            status = -1;
+            goto EXIT;
+        }
+
+        /* Note: poll() ignores negative file descriptors */
+        struct pollfd pfd[] = {
+            { .fd = cancel_fd, .events = POLLIN },
+            { .fd = pid_fd,    .events = POLLIN },
+        };
+
+        if( poll(pfd, G_N_ELEMENTS(pfd), (pid_fd == -1) ? nap_ms : -1) == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_warning("poll: %m");
+            goto REAP;
+        }
+
+        if( (pfd[0].revents & POLLIN) && worker_cancel_fd_triggered() ) {
+            log_warning("canceled; terminating pid %d", (int)pid);
+            kill(-pid, SIGTERM);
+            if( common_wait_child_timed(pid, pid_fd,
+                                        COMMON_CHILD_TERM_TIMEOUT_MS,
+                                        &status) )
+                goto EXIT;
+            log_warning("pid %d did not terminate; killing", (int)pid);
+            kill(-pid, SIGKILL);
+            goto REAP;
+        }
+
+        if( nap_ms < 32 )
+            nap_ms *= 2;
+    }
+
+REAP:
+    if( TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == -1 )
+        status = -1;
+
+EXIT:
+    if( pid_fd != -1 )
+        close(pid_fd);
+
+    return status;
 }
 
-/** Release wakelock via sysfs
+/** Start shell command with default signal mask and dispositions
  *
- * @param wakelock_name Wake lock to be released
+ * Signals that usb-moded keeps blocked for signalfd use are not
+ * inherited by the child process, and signal handling of the calling
+ * thread is not touched. The child is made a process group leader,
+ * so that it can be reaped via common_wait_child().
+ *
+ * @param command      shell command line to execute
+ * @param redirect_fd  file descriptor to pass to the child, or -1
+ * @param target_fd    descriptor number redirect_fd gets in the child
+ *
+ * @return pid of the child process, or -1 on failure
  */
-void common_release_wakelock(const char *wakelock_name)
+static pid_t
+common_spawn_child(const char *command, int redirect_fd, int target_fd)
 {
     LOG_REGISTER_CONTEXT;
 
-#if VERBOSE_WAKELOCKING
-    log_debug("common_release_wakelock %s", wakelock_name);
-#endif
+    extern char **environ;
+
+    pid_t                      pid     = -1;
+    bool                       actions = false;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t          attr;
+    sigset_t                   mask;
+    sigset_t                   dflt;
+    char                      *argv[]  = { "sh", "-c", (char *)command, NULL };
+
+    if( redirect_fd != -1 ) {
+        if( posix_spawn_file_actions_init(&fa) != 0 )
+            goto EXIT;
+        actions = true;
+        if( posix_spawn_file_actions_adddup2(&fa, redirect_fd, target_fd) != 0 )
+            goto EXIT;
+    }
+
+    if( posix_spawnattr_init(&attr) != 0 )
+        goto EXIT;
+
+    sigemptyset(&mask);
+    sigemptyset(&dflt);
+    sigaddset(&dflt, SIGINT);
+    sigaddset(&dflt, SIGQUIT);
+    sigaddset(&dflt, SIGTERM);
+    sigaddset(&dflt, SIGHUP);
 
-    common_write_to_sysfs_file("/sys/power/wake_unlock", wakelock_name);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &dflt);
+
+    /* Own process group, so that canceling also reaches processes
+     * the shell might spawn */
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    posix_spawnattr_setflags(&attr, (POSIX_SPAWN_SETSIGMASK |
+                                     POSIX_SPAWN_SETSIGDEF |
+                                     POSIX_SPAWN_SETPGROUP));
+
+    if( posix_spawn(&pid, "/bin/sh", actions ? &fa : 0, &attr, argv, environ) != 0 )
+        pid = -1;
+
+    posix_spawnattr_destroy(&attr);
+
+EXIT:
+    if( actions )
+        posix_spawn_file_actions_destroy(&fa);
+
+    return pid;
 }
 
-/* ------------------------------------------------------------------------- *
- * BLOCKING_OPERATION
- * ------------------------------------------------------------------------- */
+/** Execute shell command with default signal mask and dispositions
+ *
+ * Like system(), but see common_spawn_child().
+ *
+ * @param command  shell command line to execute
+ *
+ * @return wait status of the child process, or -1 on failure
+ */
+static int
+common_spawn_shell(const char *command)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int   status = -1;
+    pid_t pid    = common_spawn_child(command, -1, -1);
+
+    if( pid != -1 )
+        status = common_wait_child(pid);
+
+    return status;
+}
 
 /** Wrapper to give visibility to blocking system() calls usb-moded is making
  */
@@ -372,8 +567,9 @@ common_system_(const char *file, int line, const char *func,
     const char *dumped      = "";
 
     log_debug("EXEC %s; from %s:%d: %s()", command, file, line, func);
+    recorder_event(RECORDER_EXEC, 0, command, 0);
 
-    if( (status = system(command)) == -1 ) {
+    if( (status = common_spawn_shell(command)) == -1 ) {
         snprintf(exited, sizeof exited, " exec=failed");
     }
     else {
@@ -391,6 +587,8 @@ common_system_(const char *file, int line, const char *func,
         }
     }
 
+    recorder_event(RECORDER_EXEC_DONE, result, command, 0);
+
     if( result != 0 ) {
         log_warning("EXEC %s; from %s:%d: %s();%s%s%s result=%d",
                     command, file, line, func,
@@ -401,6 +599,13 @@ common_system_(const char *file, int line, const char *func,
 }
 
 /** Wrapper to give visibility subprocesses usb-moded is invoking via popen()
+ *
+ * Like popen(), but the child is started like in common_system().
+ * Streams must be closed with common_pclose().
+ *
+ * @param type  "r" to read child stdout, or "w" to write child stdin
+ *
+ * @return stream connected to the child, or NULL on failure
  */
 FILE *
 common_popen_(const char *file, int line, const char *func,
@@ -408,54 +613,175 @@ common_popen_(const char *file, int line, const char *func,
 {
     LOG_REGISTER_CONTEXT;
 
+    FILE  *stream = 0;
+    pid_t  pid    = -1;
+    int    fds[2] = { -1, -1 };
+    bool   input  = false;
+
     log_debug("EXEC %s; from %s:%d: %s()",
               command, file, line, func);
 
-    return popen(command, type);
+    if( !type || (*type != 'r' && *type != 'w') ) {
+        log_err("invalid popen type: %s", type ?: "null");
+        goto EXIT;
+    }
+    input = (*type == 'r');
+
+    if( pipe2(fds, O_CLOEXEC) == -1 ) {
+        log_err("pipe: %m");
+        goto EXIT;
+    }
+
+    /* fds[0] = read end, fds[1] = write end */
+    if( input )
+        pid = common_spawn_child(command, fds[1], STDOUT_FILENO);
+    else
+        pid = common_spawn_child(command, fds[0], STDIN_FILENO);
+
+    if( pid == -1 ) {
+        log_err("failed to execute: %s", command);
+        goto EXIT;
+    }
+
+    if( !(stream = fdopen(input ? fds[0] : fds[1], input ? "r" : "w")) ) {
+        log_err("fdopen: %m");
+        goto EXIT;
+    }
+
+    if( input )
+        fds[0] = -1;
+    else
+        fds[1] = -1;
+
+    pthread_mutex_lock(&common_popen_mutex);
+    if( !common_popen_lut )
+        common_popen_lut = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(common_popen_lut, stream, GINT_TO_POINTER(pid));
+    pthread_mutex_unlock(&common_popen_mutex);
+
+EXIT:
+    if( fds[0] != -1 )
+        close(fds[0]);
+    if( fds[1] != -1 )
+        close(fds[1]);
+
+    /* Child sees end of input / broken pipe */
+    if( pid != -1 && !stream )
+        common_wait_child(pid);
+
+    return stream;
+}
+
+/** Close stream opened via common_popen() and reap the child
+ *
+ * @param stream  stream returned by common_popen()
+ *
+ * @return wait status of the child process, or -1 on failure
+ */
+int
+common_pclose(FILE *stream)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int      status = -1;
+    gpointer pid    = 0;
+
+    if( !stream )
+        goto EXIT;
+
+    pthread_mutex_lock(&common_popen_mutex);
+    if( common_popen_lut ) {
+        pid = g_hash_table_lookup(common_popen_lut, stream);
+        g_hash_table_remove(common_popen_lut, stream);
+    }
+    pthread_mutex_unlock(&common_popen_mutex);
+
+    fclose(stream);
+
+    if( !pid ) {
+        log_err("stream was not opened via common_popen()");
+        goto EXIT;
+    }
+
+    status = common_wait_child(GPOINTER_TO_INT(pid));
+
+EXIT:
+    return status;
+}
+
+/** Get CLOCK_MONOTONIC time in milliseconds
+ *
+ * For measuring durations within usb-moded process.
+ */
+int64_t
+common_get_monotonic_ms(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+/** Wait until condition is met, timeout is reached, or job is canceled
+ *
+ * The condition callback is polled at 200 ms interval. When called from
+ * the worker thread, cancellation of the ongoing mode switch is noticed
+ * immediately.
+ *
+ * @param tot_ms    maximum time to wait [ms]
+ * @param ready_cb  condition callback, or NULL for plain sleep
+ * @param aptr      data to pass to ready_cb
+ *
+ * @return WAIT_READY, WAIT_TIMEOUT, or WAIT_FAILED if canceled
+ */
 waitres_t
 common_wait(unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    struct timespec ts;
-
     waitres_t res = WAIT_FAILED;
+    int64_t   due = common_get_monotonic_ms() + tot_ms;
 
     for( ;; ) {
-        unsigned nap_ms = (tot_ms > 200) ? 200 : tot_ms;
+        if( ready_cb && ready_cb(aptr) ) {
+            res = WAIT_READY;
+            goto EXIT;
+        }
 
-        ts.tv_sec  = (nap_ms / 1000);
-        ts.tv_nsec = (nap_ms % 1000);
-        ts.tv_nsec *= 1000 * 1000;
+        int64_t left = due - common_get_monotonic_ms();
 
-        for( ;; ) {
-            if( ready_cb && ready_cb(aptr) ) {
-                res = WAIT_READY;
-                goto EXIT;
-            }
+        if( left <= 0 ) {
+            res = WAIT_TIMEOUT;
+            goto EXIT;
+        }
 
-            if( tot_ms <= 0 ) {
-                res = WAIT_TIMEOUT;
-                goto EXIT;
-            }
+        if( worker_bailing_out() ) {
+            log_warning("wait canceled");
+            goto EXIT;
+        }
 
-            if( worker_bailing_out() ) {
-                log_warning("wait canceled");
-                goto EXIT;
-            }
+        int nap_ms = (ready_cb && left > 200) ? 200 : (int)left;
 
-            if( nanosleep(&ts, &ts) == 0 )
-                break;
+        /* Note: poll() ignores negative file descriptors */
+        struct pollfd pfd = {
+            .fd     = worker_get_cancel_fd(),
+            .events = POLLIN,
+        };
 
-            if( errno != EINTR ) {
-                log_warning("wait failed: %m");
-                goto EXIT;
-            }
+        int rc = poll(&pfd, 1, nap_ms);
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_warning("wait failed: %m");
+            goto EXIT;
         }
 
-        tot_ms -= nap_ms;
+        if( rc > 0 && worker_cancel_fd_triggered() ) {
+            log_warning("wait canceled");
+            goto EXIT;
+        }
     }
 
 EXIT:
@@ -626,3 +952,127 @@ EXIT:
 
     return g_string_free(mode_list_str, false);
 }
+
+/** Read android serial number from kernel command line
+ */
+gchar *
+common_get_android_serial(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char find[] = "androidboot.serialno=";
+    static const char pbrk[] = " \t\r\n,";
+
+    const char *path = common_root_path("/proc/cmdline");
+
+    char   *res  = 0;
+    FILE   *file = 0;
+    size_t  size = 0;
+    char   *data = 0;
+
+    if( !(file = fopen(path, "r")) ) {
+        log_warning("%s: %s: %m", path, "can't open");
+        goto EXIT;
+    }
+
+    if( getline(&data, &size, file) < 0 ) {
+        log_warning("%s: %s: %m", path, "can't read");
+        goto EXIT;
+    }
+
+    char *beg = strstr(data, find);
+    if( !beg ) {
+        log_warning("%s: no serial found", path);
+        goto EXIT;
+    }
+
+    beg += sizeof find - 1;
+    size_t len = strcspn(beg, pbrk);
+    if( len < 1 ) {
+        log_warning("%s: empty serial found", path);
+        goto EXIT;
+    }
+
+    res = g_strndup(beg, len);
+
+EXIT:
+
+    free(data);
+
+    if( file )
+        fclose(file);
+
+    return res;
+}
+
+/* ------------------------------------------------------------------------- *
+ * ROOT_PREFIX
+ * ------------------------------------------------------------------------- */
+
+/** Set directory under which all filesystem paths are looked up
+ *
+ * Allows running usb-moded against a fake sysfs / configfs / procfs
+ * tree, e.g. for benchmarking without real hardware. Must be called
+ * before any threads are started.
+ *
+ * @param prefix  Directory path, or NULL / "/" for real root
+ */
+void
+common_set_root_prefix(const char *prefix)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(common_root_prefix), common_root_prefix = 0;
+
+    if( prefix ) {
+        gchar *tmp = g_strdup(prefix);
+        size_t len = strlen(tmp);
+        while( len > 0 && tmp[len - 1] == '/' )
+            tmp[--len] = 0;
+        if( len > 0 )
+            common_root_prefix = tmp, tmp = 0;
+        g_free(tmp);
+    }
+
+    log_debug("root prefix: %s", common_root_prefix ?: "/");
+}
+
+/** Get directory under which all filesystem paths are looked up
+ *
+ * @return directory path, or NULL if real root is used
+ */
+const char *
+common_get_root_prefix(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return common_root_prefix;
+}
+
+/** Map absolute filesystem path under root prefix
+ *
+ * Relocated paths are interned, so the returned string can be
+ * used without any memory management.
+ *
+ * @param path  Absolute path, e.g. "/sys/class/udc"
+ *
+ * @return path relocated under root prefix, or path as is if no
+ *         prefix is in use / path is not absolute
+ */
+const char *
+common_root_path(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !common_root_prefix || !path || *path != '/' )
+        return path;
+
+    /* Already relocated */
+    size_t len = strlen(common_root_prefix);
+    if( !strncmp(path, common_root_prefix, len) && path[len] == '/' )
+        return path;
+
+    char buff[PATH_MAX];
+    snprintf(buff, sizeof buff, "%s%s", common_root_prefix, path);
+    return g_intern_string(buff);
+}
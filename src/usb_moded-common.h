@@ -29,6 +29,7 @@
 
 # include <stdio.h>
 # include <stdbool.h>
+# include <stdint.h>
 # include <glib.h>
 
 /* ========================================================================= *
@@ -52,6 +53,20 @@ typedef enum {
     CABLE_STATE_NUMOF
 } cable_state_t;
 
+/** Reason for requesting usb mode change
+ */
+typedef enum mode_reason_t {
+    /** Cable was connected or disconnected */
+    MODE_REASON_CABLE,
+    /** Mode was explicitly requested over D-Bus */
+    MODE_REASON_USER,
+    /** Configuration, device lock or device state changed */
+    MODE_REASON_POLICY,
+    /** Udev trigger event */
+    MODE_REASON_TRIGGER,
+    MODE_REASON_NUMOF
+} mode_reason_t;
+
 typedef enum waitres_t
 {
     WAIT_FAILED,
@@ -69,6 +84,12 @@ typedef enum waitres_t
 
 const char *cable_state_repr(cable_state_t state);
 
+/* ------------------------------------------------------------------------- *
+ * MODE_REASON
+ * ------------------------------------------------------------------------- */
+
+const char *mode_reason_repr(mode_reason_t reason);
+
 /* ------------------------------------------------------------------------- *
  * COMMON
  * ------------------------------------------------------------------------- */
@@ -79,15 +100,24 @@ void        common_send_supported_modes_signal  (void);
 void        common_send_available_modes_signal  (void);
 void        common_send_hidden_modes_signal     (void);
 void        common_send_whitelisted_modes_signal(void);
-void        common_acquire_wakelock             (const char *wakelock_name);
-void        common_release_wakelock             (const char *wakelock_name);
 int         common_system_                      (const char *file, int line, const char *func, const char *command);
 FILE       *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
+int         common_pclose                       (FILE *stream);
+int64_t     common_get_monotonic_ms             (void);
 waitres_t   common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
 bool        common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
 bool        common_modename_is_internal         (const char *modename);
 int         common_valid_mode                   (const char *mode);
 gchar      *common_get_mode_list                (mode_list_type_t type, uid_t uid);
+gchar      *common_get_android_serial           (void);
+
+/* ------------------------------------------------------------------------- *
+ * ROOT_PREFIX
+ * ------------------------------------------------------------------------- */
+
+void        common_set_root_prefix              (const char *prefix);
+const char *common_get_root_prefix              (void);
+const char *common_root_path                    (const char *path);
 
 /* ========================================================================= *
  * Macros
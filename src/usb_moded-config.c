@@ -34,6 +34,7 @@
 
 #include "usb_moded-config-private.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-dyn-config.h"
@@ -336,7 +337,7 @@ static char * config_get_kcmdline_string(const char *entry)
     GError *optErr = NULL;
     int i;
 
-    if ((fd = open("/proc/cmdline", O_RDONLY)) < 0)
+    if ((fd = open(common_root_path("/proc/cmdline"), O_RDONLY)) < 0)
     {
         log_debug("could not read /proc/cmdline");
         return ret;
@@ -623,7 +624,8 @@ set_config_result_t config_set_mode_whitelist(const char *whitelist)
         else if (strcmp(current_mode, MODE_CHARGING_FALLBACK) && strcmp(current_mode, MODE_ASK) && common_valid_mode(current_mode)) {
             /* Invalid mode that is not MODE_ASK or MODE_CHARGING_FALLBACK
              * -> switch to MODE_CHARGING_FALLBACK */
-            control_set_usb_mode(MODE_CHARGING_FALLBACK);
+            control_set_usb_mode(MODE_CHARGING_FALLBACK,
+                                 MODE_REASON_POLICY, UID_UNKNOWN);
         }
 
         umdbus_send_whitelisted_modes_signal(whitelist);
@@ -878,7 +880,8 @@ static void config_load_static_config(GKeyFile *ini)
 {
     LOG_REGISTER_CONTEXT;
 
-    static const char pattern[] = USB_MODED_STATIC_CONFIG_DIR"/*.ini";
+    const char *legacy  = common_root_path(USB_MODED_STATIC_CONFIG_FILE);
+    const char *pattern = common_root_path(USB_MODED_STATIC_CONFIG_DIR"/*.ini");
 
     glob_t gb = {};
 
@@ -891,7 +894,7 @@ static void config_load_static_config(GKeyFile *ini)
     /* Override with content from config files */
     for( size_t i = 0; i < gb.gl_pathc; ++i ) {
         const char *path = gb.gl_pathv[i];
-        if( strcmp(path, USB_MODED_STATIC_CONFIG_FILE) )
+        if( strcmp(path, legacy) )
             config_merge_from_file(ini, path);
     }
 
@@ -903,8 +906,10 @@ static bool config_load_legacy_config(GKeyFile *ini)
     LOG_REGISTER_CONTEXT;
 
     bool ack = false;
-    if( access(USB_MODED_STATIC_CONFIG_FILE, F_OK) != -1 )
-        ack = config_merge_from_file(ini, USB_MODED_STATIC_CONFIG_FILE);
+    const char *legacy = common_root_path(USB_MODED_STATIC_CONFIG_FILE);
+
+    if( access(legacy, F_OK) != -1 )
+        ack = config_merge_from_file(ini, legacy);
 
     /* A mode=ask setting in legacy config can be either
      * something user has selected, or merely configured
@@ -934,12 +939,14 @@ static void config_remove_legacy_config(void)
      *       -> do a separate existance check 1st.
      */
 
-    if( access(USB_MODED_STATIC_CONFIG_FILE, F_OK) == -1 && errno == ENOENT ) {
+    const char *legacy = common_root_path(USB_MODED_STATIC_CONFIG_FILE);
+
+    if( access(legacy, F_OK) == -1 && errno == ENOENT ) {
         /* nop */
     }
-    else if( unlink(USB_MODED_STATIC_CONFIG_FILE) == -1 && errno != ENOENT ) {
+    else if( unlink(legacy) == -1 && errno != ENOENT ) {
         log_warning("%s: can't remove stale config file: %m",
-                    USB_MODED_STATIC_CONFIG_FILE);
+                    legacy);
     }
 }
 
@@ -947,7 +954,7 @@ static void config_load_dynamic_config(GKeyFile *ini)
 {
     LOG_REGISTER_CONTEXT;
 
-    config_merge_from_file(ini, USB_MODED_DYNAMIC_CONFIG_FILE);
+    config_merge_from_file(ini, common_root_path(USB_MODED_DYNAMIC_CONFIG_FILE));
 }
 
 static void config_save_dynamic_config(GKeyFile *ini)
@@ -957,22 +964,23 @@ static void config_save_dynamic_config(GKeyFile *ini)
     gchar  *current_dta = 0;
     gchar  *previous_dta = 0;
 
+    const char *dir  = common_root_path(USB_MODED_DYNAMIC_CONFIG_DIR);
+    const char *file = common_root_path(USB_MODED_DYNAMIC_CONFIG_FILE);
+
     config_purge_empty_groups(ini);
     current_dta = g_key_file_to_data(ini, 0, 0);
 
-    g_file_get_contents(USB_MODED_DYNAMIC_CONFIG_FILE, &previous_dta, 0, 0);
+    g_file_get_contents(file, &previous_dta, 0, 0);
     if( g_strcmp0(previous_dta, current_dta) ) {
         GError *err = 0;
-        if( mkdir(USB_MODED_DYNAMIC_CONFIG_DIR, 0755) == -1 && errno != EEXIST ) {
-            log_err("%s: can't create dir: %m", USB_MODED_DYNAMIC_CONFIG_DIR);
+        if( mkdir(dir, 0755) == -1 && errno != EEXIST ) {
+            log_err("%s: can't create dir: %m", dir);
         }
-        else if( !g_file_set_contents(USB_MODED_DYNAMIC_CONFIG_FILE,
-                                      current_dta, -1, &err) ) {
-            log_err("%s: can't save: %s", USB_MODED_DYNAMIC_CONFIG_FILE,
-                    err->message);
+        else if( !g_file_set_contents(file, current_dta, -1, &err) ) {
+            log_err("%s: can't save: %s", file, err->message);
         }
         else {
-            log_debug("%s: updated", USB_MODED_DYNAMIC_CONFIG_FILE);
+            log_debug("%s: updated", file);
 
             /* The legacy file is not needed anymore */
             config_remove_legacy_config();
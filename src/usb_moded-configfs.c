@@ -24,11 +24,13 @@
 #include "usb_moded-configfs.h"
 
 #include "usb_moded.h"
-#include "usb_moded-android.h"
 #include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
+#include "usb_moded-gadget.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
+#include "usb_moded-recorder.h"
+#include "usb_moded-worker.h"
 
 #include <sys/stat.h>
 
@@ -109,6 +111,12 @@ bool               configfs_add_mass_storage_lun   (int lun);
 bool               configfs_remove_mass_storage_lun(int lun);
 bool               configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
 
+/* ------------------------------------------------------------------------- *
+ * CONFIGFS_BACKEND
+ * ------------------------------------------------------------------------- */
+
+static bool        configfs_backend_set_ids        (const char *product_id, const char *vendor_id);
+
 /* ========================================================================= *
  * Data
  * ========================================================================= */
@@ -173,9 +181,10 @@ static void configfs_read_configuration(void)
 
     /* Gadget directories
      */
-    GADGET_BASE_DIRECTORY =
-        configfs_get_conf("gadget_base_directory",
-                          DEFAULT_GADGET_BASE_DIRECTORY);
+    temp_setting = configfs_get_conf("gadget_base_directory",
+                                     DEFAULT_GADGET_BASE_DIRECTORY);
+    GADGET_BASE_DIRECTORY = g_strdup(common_root_path(temp_setting));
+    g_free(temp_setting);
 
     temp_setting = configfs_get_conf("gadget_func_directory",
                              DEFAULT_GADGET_FUNC_DIRECTORY);
@@ -459,6 +468,11 @@ configfs_enable_function(const char *function)
     char cpath[PATH_MAX];
     configfs_config_path(cpath, sizeof cpath, function);
 
+    if( worker_bailing_out() ) {
+        log_warning("%s: enable canceled", function);
+        goto EXIT;
+    }
+
     switch( configfs_file_type(cpath) ) {
     case S_IFLNK:
         if( unlink(cpath) == -1 ) {
@@ -603,7 +617,7 @@ configfs_udc_enable_value(void)
 
         /* Find first symlink in /sys/class/udc directory */
         struct dirent *de;
-        DIR *dir = opendir("/sys/class/udc");
+        DIR *dir = opendir(common_root_path("/sys/class/udc"));
         if( dir ) {
             while( (de = readdir(dir)) ) {
                 if( de->d_type != DT_LNK )
@@ -631,6 +645,14 @@ configfs_write_file(const char *path, const char *text)
     if( !path || !text )
         goto EXIT;
 
+    /* Writing non-empty values is part of gadget setup, which
+     * should be skipped once the mode switch has been canceled.
+     * Clearing values happens also during cleanup and is allowed. */
+    if( *text && worker_bailing_out() ) {
+        log_warning("%s: write canceled", path);
+        goto EXIT;
+    }
+
     log_debug("WRITE %s '%s'", path, text);
 
     char buff[64];
@@ -659,6 +681,11 @@ EXIT:
     if( fd != -1 )
         close(fd);
 
+    if( path && text ) {
+        const char *file = strrchr(path, '/');
+        recorder_event(RECORDER_WRITE, ack, file ? file + 1 : path, text);
+    }
+
     return ack;
 }
 
@@ -787,7 +814,7 @@ configfs_init(void)
         g_free(text);
     }
 
-    if( (text = android_get_serial()) ) {
+    if( (text = common_get_android_serial()) ) {
         configfs_write_file(GADGET_CTRL_SERIAL, text);
         g_free(text);
     }
@@ -1061,3 +1088,43 @@ configfs_set_mass_storage_attr(int lun, const char *attr, const char *value)
 EXIT:
     return ack;
 }
+
+/* ========================================================================= *
+ * CONFIGFS_BACKEND
+ * ========================================================================= */
+
+static bool
+configfs_backend_set_ids(const char *product_id, const char *vendor_id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+
+    if( product_id && !configfs_set_productid(product_id) )
+        ack = false;
+
+    if( vendor_id && !configfs_set_vendorid(vendor_id) )
+        ack = false;
+
+    return ack;
+}
+
+/** Gadget configuration via configfs */
+const gadget_backend_t configfs_backend =
+{
+    .gb_name            = "configfs",
+    .gb_last_resort     = false,
+    .gb_max_luns        = 0,
+    .gb_mtpd_before_udc = true,
+    .gb_extra_sysfs     = false,
+    .gb_charging_module = 0,
+    .gb_init            = configfs_init,
+    .gb_quit            = configfs_quit,
+    .gb_set_functions   = configfs_set_function,
+    .gb_set_ids         = configfs_backend_set_ids,
+    .gb_set_udc         = configfs_set_udc,
+    .gb_add_lun         = configfs_add_mass_storage_lun,
+    .gb_remove_lun      = configfs_remove_mass_storage_lun,
+    .gb_set_lun_attr    = configfs_set_mass_storage_attr,
+    .gb_set_charging    = configfs_set_charging_mode,
+};
@@ -27,8 +27,10 @@
 #include "usb_moded-config-private.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-dyn-config.h"
+#include "usb_moded-evloop.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-recorder.h"
 #include "usb_moded-worker.h"
 
 #include <string.h>
@@ -43,6 +45,23 @@
 # error if SAILFISH_ACCESS_CONTROL is defined, SYSTEMD must be defined as well
 #endif
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Where mode choices users have made in ask mode are stored */
+#define CONTROL_HISTORY_FILE    USB_MODED_DYNAMIC_CONFIG_DIR"/mode-history.ini"
+
+/** Per-mode choice count limit
+ *
+ * When exceeded, all counts of the user are halved so that
+ * recent choices weigh more than old ones.
+ */
+#define CONTROL_HISTORY_LIMIT   32
+
+/** Number of times a mode must have been chosen to be predicted */
+#define CONTROL_HISTORY_MINIMUM 2
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -61,9 +80,15 @@ static void    control_set_target_mode              (const char *mode);
 void           control_clear_target_mode            (void);
 const char    *control_get_usb_mode                 (void);
 void           control_clear_internal_mode          (void);
-void           control_set_usb_mode                 (const char *mode);
+static gchar  *control_history_group                (uid_t uid);
+static void    control_history_record               (uid_t uid, const char *mode);
+static gchar  *control_history_predict              (uid_t uid);
+void           control_set_usb_mode                 (const char *mode, mode_reason_t reason, uid_t uid);
 void           control_mode_switched                (const char *mode);
-void           control_select_usb_mode              (void);
+void           control_select_usb_mode              (mode_reason_t reason);
+static bool    control_grace_timer_cb               (void *aptr);
+static void    control_stop_grace_timer             (void);
+static bool    control_start_grace_timer            (void);
 void           control_set_cable_state              (cable_state_t cable_state);
 cable_state_t  control_get_cable_state              (void);
 void           control_clear_cable_state            (void);
@@ -100,6 +125,9 @@ static char *control_internal_mode = NULL;
  */
 static cable_state_t control_cable_state = CABLE_STATE_UNKNOWN;
 
+/** Timer for delayed cleanup after pc disconnect */
+static guint control_grace_timer_id = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -132,7 +160,7 @@ control_rethink_usb_charging_fallback(void)
     }
 
     log_debug("attempt to leave %s", usb_mode);
-    control_select_usb_mode();
+    control_select_usb_mode(MODE_REASON_POLICY);
 
 EXIT:
     return;
@@ -255,13 +283,144 @@ void control_clear_internal_mode(void)
 
     g_free(control_internal_mode),
         control_internal_mode = 0;
+    log_set_usb_mode(0);
+}
+
+/** Get mode history group name for a user
+ *
+ * @param uid  user
+ *
+ * @return group name, caller must release
+ */
+static gchar *control_history_group(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_strdup_printf("user_%u", (unsigned)uid);
+}
+
+/** Update mode history after user has made a choice in ask mode
+ *
+ * @param uid   user
+ * @param mode  mode user selected
+ */
+static void control_history_record(uid_t uid, const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile  *ini   = g_key_file_new();
+    gchar     *group = control_history_group(uid);
+    gchar    **keys  = 0;
+    gchar     *data  = 0;
+    GError    *err   = 0;
+
+    const char *file = common_root_path(CONTROL_HISTORY_FILE);
+
+    g_key_file_load_from_file(ini, file, G_KEY_FILE_NONE, 0);
+
+    int count = g_key_file_get_integer(ini, group, mode, 0) + 1;
+    g_key_file_set_integer(ini, group, mode, count);
+    log_debug("uid %u has chosen %s %d times", (unsigned)uid, mode, count);
+
+    if( count > CONTROL_HISTORY_LIMIT ) {
+        keys = g_key_file_get_keys(ini, group, 0, 0);
+        for( size_t i = 0; keys && keys[i]; ++i ) {
+            int value = g_key_file_get_integer(ini, group, keys[i], 0) / 2;
+            if( value > 0 )
+                g_key_file_set_integer(ini, group, keys[i], value);
+            else
+                g_key_file_remove_key(ini, group, keys[i], 0);
+        }
+    }
+
+    if( !(data = g_key_file_to_data(ini, 0, 0)) )
+        goto EXIT;
+
+    if( !g_file_set_contents(file, data, -1, &err) )
+        log_warning("%s: can't save: %s", file, err->message);
+
+EXIT:
+    g_clear_error(&err);
+    g_free(data);
+    g_strfreev(keys);
+    g_free(group);
+    g_key_file_free(ini);
+}
+
+/** Predict which mode user is going to choose in ask mode
+ *
+ * A prediction is made only if one available mode has been
+ * chosen more often than all the others combined.
+ *
+ * @param uid  user
+ *
+ * @return mode name, or NULL; caller must release
+ */
+static gchar *control_history_predict(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar     *mode      = 0;
+    GKeyFile  *ini       = g_key_file_new();
+    gchar     *group     = 0;
+    gchar    **keys      = 0;
+    gchar     *available = 0;
+    gchar    **modes     = 0;
+    gchar     *best      = 0;
+    int        best_cnt  = 0;
+    int        total     = 0;
+
+    if( uid == UID_UNKNOWN )
+        goto EXIT;
+
+    if( !g_key_file_load_from_file(ini, common_root_path(CONTROL_HISTORY_FILE),
+                                   G_KEY_FILE_NONE, 0) )
+        goto EXIT;
+
+    group = control_history_group(uid);
+    if( !(keys = g_key_file_get_keys(ini, group, 0, 0)) )
+        goto EXIT;
+
+    for( size_t i = 0; keys[i]; ++i ) {
+        int count = g_key_file_get_integer(ini, group, keys[i], 0);
+        total += count;
+        if( best_cnt < count )
+            best = keys[i], best_cnt = count;
+    }
+
+    if( !best || best_cnt < CONTROL_HISTORY_MINIMUM || best_cnt * 2 <= total )
+        goto EXIT;
+
+    /* Mode must still be available */
+    available = common_get_mode_list(AVAILABLE_MODES_LIST, uid);
+    modes = g_strsplit(available, ",", 0);
+    for( size_t i = 0; modes[i]; ++i ) {
+        if( !strcmp(g_strstrip(modes[i]), best) ) {
+            mode = g_strdup(best);
+            break;
+        }
+    }
+
+    log_debug("uid %u is likely to choose %s (%d/%d)%s", (unsigned)uid,
+              best, best_cnt, total, mode ? "" : "; not available");
+
+EXIT:
+    g_strfreev(modes);
+    g_free(available);
+    g_strfreev(keys);
+    g_free(group);
+    g_key_file_free(ini);
+
+    return mode;
 }
 
 /** set the usb mode
  *
- * @param mode The requested USB mode
+ * @param mode   The requested USB mode
+ * @param reason Why the mode change is requested
+ * @param uid    Requesting user, or UID_UNKNOWN if not applicable
  */
-void control_set_usb_mode(const char *mode)
+void control_set_usb_mode(const char *mode, mode_reason_t reason, uid_t uid)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -269,11 +428,17 @@ void control_set_usb_mode(const char *mode)
     if( !g_strcmp0(previous, mode) )
         goto EXIT;
 
-    log_debug("internal_mode: %s -> %s",
-              previous, mode);
+    log_debug("internal_mode: %s -> %s (%s)",
+              previous, mode, mode_reason_repr(reason));
+
+    /* Learn from choices user makes in ask mode */
+    if( reason == MODE_REASON_USER && !g_strcmp0(previous, MODE_ASK) &&
+        uid != UID_UNKNOWN )
+        control_history_record(uid, mode);
 
     control_internal_mode = g_strdup(mode);
     g_free(previous);
+    log_set_usb_mode(control_internal_mode);
 
     /* Update target mode before declaring busy */
     control_set_target_mode(control_internal_mode);
@@ -282,7 +447,15 @@ void control_set_usb_mode(const char *mode)
     control_set_external_mode(MODE_BUSY);
 
     /* Propagate down to gadget config */
-    worker_request_hardware_mode(control_internal_mode);
+    if( !strcmp(control_internal_mode, MODE_ASK) ) {
+        /* Let worker prepare likely choice while user is deciding */
+        gchar *prewarm = control_history_predict(control_get_current_user());
+        worker_request_hardware_ask(prewarm, reason, uid);
+        g_free(prewarm);
+    }
+    else {
+        worker_request_hardware_mode(control_internal_mode, reason, uid);
+    }
 
 EXIT:
     return;
@@ -303,6 +476,7 @@ void control_mode_switched(const char *mode)
                   control_internal_mode, mode);
         g_free(control_internal_mode),
             control_internal_mode = g_strdup(mode);
+        log_set_usb_mode(control_internal_mode);
     }
 
     /* Propagate up to D-Bus */
@@ -315,8 +489,9 @@ void control_mode_switched(const char *mode)
  *
  * gauge what mode to enter and then call control_set_usb_mode()
  *
+ * @param reason Why the mode selection is made
  */
-void control_select_usb_mode(void)
+void control_select_usb_mode(mode_reason_t reason)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -324,7 +499,7 @@ void control_select_usb_mode(void)
 
     if( usbmoded_get_rescue_mode() ) {
         log_debug("Entering rescue mode!\n");
-        control_set_usb_mode(MODE_DEVELOPER);
+        control_set_usb_mode(MODE_DEVELOPER, reason, UID_UNKNOWN);
         goto EXIT;
     }
 
@@ -338,7 +513,7 @@ void control_select_usb_mode(void)
         else {
             modedata_t *data = iter->data;
             log_debug("Entering diagnostic mode!");
-            control_set_usb_mode(data->mode_name);
+            control_set_usb_mode(data->mode_name, reason, UID_UNKNOWN);
         }
         goto EXIT;
     }
@@ -367,19 +542,92 @@ void control_select_usb_mode(void)
     }
 
     if( mode_to_set && usbmoded_can_export() ) {
-        control_set_usb_mode(mode_to_set);
+        control_set_usb_mode(mode_to_set, reason, UID_UNKNOWN);
     }
     else {
         /* config is corrupted or we do not have a mode configured, fallback to charging
          * We also fall back here in case the device is locked and we do not
          * export the system contents. Or if we are in acting dead mode.
          */
-        control_set_usb_mode(MODE_CHARGING_FALLBACK);
+        control_set_usb_mode(MODE_CHARGING_FALLBACK, reason, UID_UNKNOWN);
     }
 EXIT:
     free(mode_to_set);
 }
 
+/** Clean up mode that was left configured on pc disconnect
+ */
+static bool control_grace_timer_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    control_grace_timer_id = 0;
+
+    if( control_cable_state == CABLE_STATE_DISCONNECTED ) {
+        log_debug("reconnect grace period expired");
+        worker_request_hardware_mode(MODE_UNDEFINED, MODE_REASON_CABLE,
+                                     UID_UNKNOWN);
+    }
+
+    return false;
+}
+
+static void control_stop_grace_timer(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( control_grace_timer_id ) {
+        log_debug("reconnect grace period canceled");
+        evloop_remove(control_grace_timer_id),
+            control_grace_timer_id = 0;
+    }
+}
+
+/** Leave current mode configured, but detached, for a while
+ *
+ * If pc connection returns and the same mode gets selected before
+ * the timer expires, the worker thread just reattaches the gadget.
+ *
+ * @return true if grace period was started, false if current
+ *         mode must be cleaned up immediately
+ */
+static bool control_start_grace_timer(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack   = false;
+    int  grace = usbmoded_get_reconnect_grace();
+
+    if( grace <= 0 )
+        goto EXIT;
+
+    /* Only dynamic modes have something worth retaining */
+    if( common_modename_is_internal(control_get_usb_mode()) )
+        goto EXIT;
+
+    control_stop_grace_timer();
+
+    log_debug("internal_mode: %s -> %s (grace %d ms)",
+              control_internal_mode, MODE_UNDEFINED, grace);
+
+    g_free(control_internal_mode),
+        control_internal_mode = g_strdup(MODE_UNDEFINED);
+
+    control_set_target_mode(control_internal_mode);
+    control_set_external_mode(MODE_BUSY);
+
+    worker_request_hardware_linger(MODE_REASON_CABLE);
+
+    control_grace_timer_id = evloop_add_timer("reconnect-grace", grace, 0,
+                                              control_grace_timer_cb, 0);
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
 /** set the usb connection status
  *
  * @param cable_state CABLE_STATE_DISCONNECTED, ...
@@ -397,17 +645,25 @@ void control_set_cable_state(cable_state_t cable_state)
     log_debug("control_cable_state: %s -> %s",
               cable_state_repr(prev),
               cable_state_repr(control_cable_state));
+    recorder_event(RECORDER_CABLE, control_cable_state,
+                   cable_state_repr(control_cable_state), 0);
+    log_set_cable_state(cable_state_repr(control_cable_state));
+
+    /* Whatever happens next, it supersedes delayed cleanup */
+    control_stop_grace_timer();
 
     switch( control_cable_state ) {
     default:
     case CABLE_STATE_DISCONNECTED:
-        control_set_usb_mode(MODE_UNDEFINED);
+        if( prev == CABLE_STATE_PC_CONNECTED && control_start_grace_timer() )
+            break;
+        control_set_usb_mode(MODE_UNDEFINED, MODE_REASON_CABLE, UID_UNKNOWN);
         break;
     case CABLE_STATE_CHARGER_CONNECTED:
-        control_set_usb_mode(MODE_CHARGER);
+        control_set_usb_mode(MODE_CHARGER, MODE_REASON_CABLE, UID_UNKNOWN);
         break;
     case CABLE_STATE_PC_CONNECTED:
-        control_select_usb_mode();
+        control_select_usb_mode(MODE_REASON_CABLE);
         break;
     }
 
@@ -430,7 +686,9 @@ void control_clear_cable_state(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    control_stop_grace_timer();
     control_cable_state = CABLE_STATE_UNKNOWN;
+    log_set_cable_state(0);
 }
 
 /** Get if the cable (pc or charger) is connected or not
@@ -43,9 +43,9 @@ const char    *control_get_target_mode              (void);
 void           control_clear_target_mode            (void);
 const char    *control_get_usb_mode                 (void);
 void           control_clear_internal_mode          (void);
-void           control_set_usb_mode                 (const char *mode);
+void           control_set_usb_mode                 (const char *mode, mode_reason_t reason, uid_t uid);
 void           control_mode_switched                (const char *mode);
-void           control_select_usb_mode              (void);
+void           control_select_usb_mode              (mode_reason_t reason);
 void           control_set_cable_state              (cable_state_t cable_state);
 cable_state_t  control_get_cable_state              (void);
 void           control_clear_cable_state            (void);
@@ -50,6 +50,12 @@
 /** Logical name for org.freedesktop.DBus.GetNameOwner method */
 # define DBUS_GET_CONNECTION_PID_REQ     "GetConnectionUnixProcessID"
 
+/** Reply timeout for blocking method calls made by usb-moded [ms]
+ *
+ * Matches libdbus default timeout.
+ */
+# define UMDBUS_BLOCKING_CALL_TIMEOUT_MS 25000
+
 /* ========================================================================= *
  * Types
  * ========================================================================= */
@@ -70,6 +76,12 @@ void            umdbus_dump_busconfig_xml           (void);
 void            umdbus_send_config_signal           (const char *section, const char *key, const char *value);
 DBusConnection *umdbus_get_connection               (void);
 gboolean        umdbus_init_connection              (void);
+gboolean        umdbus_init_worker_connection       (void);
+void            umdbus_dispatch_worker_connection   (void);
+void            umdbus_cleanup_worker_connection    (void);
+gboolean        umdbus_attach_thread_connection     (void);
+void            umdbus_detach_thread_connection     (void);
+void            umdbus_cleanup_thread_connections   (void);
 gboolean        umdbus_init_service                 (void);
 void            umdbus_cleanup                      (void);
 void            umdbus_send_current_state_signal    (const char *state_ind);
@@ -109,6 +121,7 @@ bool            umdbus_append_int_variant           (DBusMessageIter *iter, int
 bool            umdbus_append_string_variant        (DBusMessageIter *iter, const char *val);
 bool            umdbus_append_args_va               (DBusMessageIter *iter, int type, va_list va);
 bool            umdbus_append_args                  (DBusMessageIter *iter, int arg_type, ...);
+DBusMessage    *umdbus_send_with_reply_and_block    (DBusConnection *con, DBusMessage *req, DBusError *err);
 DBusMessage    *umdbus_blocking_call                (DBusConnection *con, const char *dst, const char *obj, const char *iface, const char *meth, DBusError *err, int arg_type, ...);
 bool            umdbus_parse_reply                  (DBusMessage *rsp, int arg_type, ...);
 
@@ -34,16 +34,30 @@
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-dbus.h"
 
+#ifdef APP_SYNC
+# include "usb_moded-appsync.h"
+#endif
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
+#include "usb_moded-evloop.h"
+#include "usb_moded-latency.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-network.h"
+#include "usb_moded-recorder.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-udev.h"
+#include "usb_moded-wakelock.h"
+#include "usb_moded-worker.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/stat.h>
 
+#include <pthread.h>
+
 #include <dbus/dbus-glib-lowlevel.h>
 
 #ifdef SAILFISH_ACCESS_CONTROL
@@ -225,6 +239,21 @@ static void usb_moded_network_set_cb             (umdbus_context_t *context);
 static void usb_moded_network_get_cb             (umdbus_context_t *context);
 static void usb_moded_rescue_off_cb              (umdbus_context_t *context);
 static void usb_moded_user_config_clear_cb       (umdbus_context_t *context);
+static void usb_moded_wakeup_stats_get_cb        (umdbus_context_t *context);
+static void usb_moded_wakeup_stats_reset_cb      (umdbus_context_t *context);
+static void usb_moded_power_supply_get_cb        (umdbus_context_t *context);
+static void usb_moded_mtpd_stats_get_cb          (umdbus_context_t *context);
+static void usb_moded_latency_stats_get_cb       (umdbus_context_t *context);
+static void usb_moded_latency_stats_reset_cb     (umdbus_context_t *context);
+static void usb_moded_wakelock_stats_get_cb      (umdbus_context_t *context);
+static void usb_moded_wakelock_stats_reset_cb    (umdbus_context_t *context);
+static void usb_moded_flight_recorder_get_cb     (umdbus_context_t *context);
+static void usb_moded_trace_set_cb               (umdbus_context_t *context);
+static void usb_moded_trace_get_cb               (umdbus_context_t *context);
+#ifdef APP_SYNC
+static void usb_moded_appsync_stats_get_cb       (umdbus_context_t *context);
+static void usb_moded_appsync_stats_reset_cb     (umdbus_context_t *context);
+#endif
 
 /* ------------------------------------------------------------------------- *
  * UMDBUS
@@ -237,6 +266,12 @@ void                        umdbus_send_config_signal           (const char *sec
 static DBusHandlerResult    umdbus_msg_handler                  (DBusConnection *const connection, DBusMessage *const msg, gpointer const user_data);
 DBusConnection             *umdbus_get_connection               (void);
 gboolean                    umdbus_init_connection              (void);
+gboolean                    umdbus_init_worker_connection       (void);
+void                        umdbus_dispatch_worker_connection   (void);
+void                        umdbus_cleanup_worker_connection    (void);
+gboolean                    umdbus_attach_thread_connection     (void);
+void                        umdbus_detach_thread_connection     (void);
+void                        umdbus_cleanup_thread_connections   (void);
 gboolean                    umdbus_init_service                 (void);
 static void                 umdbus_cleanup_service              (void);
 void                        umdbus_cleanup                      (void);
@@ -287,6 +322,7 @@ bool                        umdbus_append_int_variant           (DBusMessageIter
 bool                        umdbus_append_string_variant        (DBusMessageIter *iter, const char *val);
 bool                        umdbus_append_args_va               (DBusMessageIter *iter, int type, va_list va);
 bool                        umdbus_append_args                  (DBusMessageIter *iter, int arg_type, ...);
+DBusMessage                *umdbus_send_with_reply_and_block    (DBusConnection *con, DBusMessage *req, DBusError *err);
 DBusMessage                *umdbus_blocking_call                (DBusConnection *con, const char *dst, const char *obj, const char *iface, const char *meth, DBusError *err, int arg_type, ...);
 bool                        umdbus_parse_reply                  (DBusMessage *rsp, int arg_type, ...);
 
@@ -297,6 +333,27 @@ bool                        umdbus_parse_reply                  (DBusMessage *rs
 static DBusConnection *umdbus_connection = NULL;
 static gboolean        umdbus_service_name_acquired   = FALSE;
 
+/** Private SystemBus connection used by the worker thread
+ *
+ * Blocking method calls made while switching usb modes go through
+ * this connection, so that they do not need to compete with the
+ * mainloop over the shared connection lock and message queue.
+ */
+static DBusConnection *umdbus_worker_connection = NULL;
+
+/** Private SystemBus connection attached to the calling thread
+ *
+ * Used by task graph helper threads that make blocking method calls
+ * on behalf of the worker thread, see umdbus_attach_thread_connection().
+ */
+static __thread DBusConnection *umdbus_thread_connection = NULL;
+
+/** Idle private SystemBus connections available for helper threads */
+static GSList *umdbus_thread_connection_pool = NULL;
+
+/** Lock for umdbus_thread_connection_pool */
+static pthread_mutex_t umdbus_thread_connection_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* ========================================================================= *
  * MEMBER_INFO
  * ========================================================================= */
@@ -585,7 +642,7 @@ usb_moded_state_set_cb(umdbus_context_t *context)
     else {
         log_debug("Mode '%s' requested", use);
         /* Initiate mode switch */
-        control_set_usb_mode(use);
+        control_set_usb_mode(use, MODE_REASON_USER, uid);
 
         /* Acknowledge that the mode request was accepted */
         if( (context->rsp = dbus_message_new_method_return(context->msg)) )
@@ -950,6 +1007,193 @@ usb_moded_rescue_off_cb(umdbus_context_t *context)
     context->rsp = dbus_message_new_method_return(context->msg);
 }
 
+/* ------------------------------------------------------------------------- *
+ * diagnostics
+ * ------------------------------------------------------------------------- */
+
+/** Get event loop wakeup counts as "source=count, ..." string
+ *
+ * Followed by uevent burst statistics.
+ */
+static void
+usb_moded_wakeup_stats_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *wakeups = evloop_get_stats();
+    gchar *bursts  = umudev_get_burst_stats();
+    gchar *stats   = g_strdup_printf("%s%s%s", wakeups,
+                                     *wakeups ? ", " : "", bursts);
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &stats, DBUS_TYPE_INVALID);
+    g_free(stats);
+    g_free(bursts);
+    g_free(wakeups);
+}
+
+/** Reset event loop wakeup counts and uevent burst statistics
+ */
+static void
+usb_moded_wakeup_stats_reset_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    evloop_reset_stats();
+    umudev_reset_burst_stats();
+    context->rsp = dbus_message_new_method_return(context->msg);
+}
+
+/** Get tracked power supply device details as "key=value, ..." string
+ */
+static void
+usb_moded_power_supply_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *info = umudev_get_power_supply_info();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &info, DBUS_TYPE_INVALID);
+    g_free(info);
+}
+
+/** Get mtp daemon linger statistics as "key=value, ..." string
+ */
+static void
+usb_moded_mtpd_stats_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *stats = worker_get_mtpd_stats();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &stats, DBUS_TYPE_INVALID);
+    g_free(stats);
+}
+
+/** Get mode switch latency histograms as "mode/phase: ..." lines
+ */
+static void
+usb_moded_latency_stats_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *stats = latency_get_stats();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &stats, DBUS_TYPE_INVALID);
+    g_free(stats);
+}
+
+/** Reset mode switch latency histograms
+ */
+static void
+usb_moded_latency_stats_reset_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    latency_reset_stats();
+    context->rsp = dbus_message_new_method_return(context->msg);
+}
+
+/** Get wakelock statistics as "name: key=value ..., ..." string
+ */
+static void
+usb_moded_wakelock_stats_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *stats = wakelock_get_stats();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &stats, DBUS_TYPE_INVALID);
+    g_free(stats);
+}
+
+/** Reset wakelock statistics
+ */
+static void
+usb_moded_wakelock_stats_reset_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    wakelock_reset_stats();
+    context->rsp = dbus_message_new_method_return(context->msg);
+}
+
+/** Get flight recorder contents, one event per line
+ */
+static void
+usb_moded_flight_recorder_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *dump = recorder_dump();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &dump, DBUS_TYPE_INVALID);
+    g_free(dump);
+}
+
+/** Select subsystems to trace, empty string disables tracing
+ */
+static void
+usb_moded_trace_set_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *list = 0;
+    DBusError   err  = DBUS_ERROR_INIT;
+
+    if( !dbus_message_get_args(context->msg, &err, DBUS_TYPE_STRING, &list, DBUS_TYPE_INVALID) ) {
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, context->member);
+    }
+    /* tracing writes to file system, allow only root to toggle it */
+    else if( umdbus_get_sender_uid(context->sender) != 0 ) {
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_ACCESS_DENIED, context->member);
+    }
+    else {
+        trace_set_subsystems(list);
+        list = trace_get_subsystems();
+        if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+            dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &list, DBUS_TYPE_INVALID);
+    }
+    dbus_error_free(&err);
+}
+
+/** Get comma separated list of traced subsystems
+ */
+static void
+usb_moded_trace_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *list = trace_get_subsystems();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &list, DBUS_TYPE_INVALID);
+}
+
+#ifdef APP_SYNC
+/** Get appsync unit start statistics as "unit: key=value ..., ..." string
+ */
+static void
+usb_moded_appsync_stats_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *stats = appsync_get_stats();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &stats, DBUS_TYPE_INVALID);
+    g_free(stats);
+}
+
+/** Reset appsync unit start statistics
+ */
+static void
+usb_moded_appsync_stats_reset_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    appsync_reset_stats();
+    context->rsp = dbus_message_new_method_return(context->msg);
+}
+#endif
+
 static const member_info_t usb_moded_members[] =
 {
     ADD_METHOD(USB_MODE_STATE_REQUEST,
@@ -1020,6 +1264,48 @@ static const member_info_t usb_moded_members[] =
     ADD_METHOD(USB_MODE_USER_CONFIG_CLEAR,
                usb_moded_user_config_clear_cb,
                "      <arg name=\"uid\" type=\"u\" direction=\"in\"/>\n"),
+    ADD_METHOD(USB_MODE_WAKEUP_STATS_GET,
+               usb_moded_wakeup_stats_get_cb,
+               "      <arg name=\"stats\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_WAKEUP_STATS_RESET,
+               usb_moded_wakeup_stats_reset_cb,
+               0),
+    ADD_METHOD(USB_MODE_POWER_SUPPLY_GET,
+               usb_moded_power_supply_get_cb,
+               "      <arg name=\"info\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_MTPD_STATS_GET,
+               usb_moded_mtpd_stats_get_cb,
+               "      <arg name=\"stats\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_LATENCY_STATS_GET,
+               usb_moded_latency_stats_get_cb,
+               "      <arg name=\"stats\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_LATENCY_STATS_RESET,
+               usb_moded_latency_stats_reset_cb,
+               0),
+    ADD_METHOD(USB_MODE_WAKELOCK_STATS_GET,
+               usb_moded_wakelock_stats_get_cb,
+               "      <arg name=\"stats\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_WAKELOCK_STATS_RESET,
+               usb_moded_wakelock_stats_reset_cb,
+               0),
+    ADD_METHOD(USB_MODE_FLIGHT_RECORDER_GET,
+               usb_moded_flight_recorder_get_cb,
+               "      <arg name=\"events\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_TRACE_SET,
+               usb_moded_trace_set_cb,
+               "      <arg name=\"subsystems\" type=\"s\" direction=\"in\"/>\n"
+               "      <arg name=\"subsystems\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_TRACE_GET,
+               usb_moded_trace_get_cb,
+               "      <arg name=\"subsystems\" type=\"s\" direction=\"out\"/>\n"),
+#ifdef APP_SYNC
+    ADD_METHOD(USB_MODE_APPSYNC_STATS_GET,
+               usb_moded_appsync_stats_get_cb,
+               "      <arg name=\"stats\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_APPSYNC_STATS_RESET,
+               usb_moded_appsync_stats_reset_cb,
+               0),
+#endif
     ADD_SIGNAL(USB_MODE_SIGNAL_NAME,
                "      <arg name=\"mode_or_event\" type=\"s\"/>\n"),
     ADD_SIGNAL(USB_MODE_CURRENT_STATE_SIGNAL_NAME,
@@ -1280,6 +1566,8 @@ static DBusHandlerResult umdbus_msg_handler(DBusConnection *const connection, DB
         goto EXIT;
     }
 
+    recorder_event(RECORDER_DBUS, 0, context.member, context.sender);
+
     /* Locate and use method call handler */
     context.object_info    = umdbus_get_object_info(context.object);
     context.interface_info = object_info_get_interface(context.object_info,
@@ -1324,12 +1612,27 @@ EXIT:
     return status;
 }
 
+/** Get SystemBus connection reference
+ *
+ * When called from a thread that has attached a private connection
+ * via umdbus_attach_thread_connection(), that connection is returned.
+ * When called from the worker thread, the private worker connection
+ * is returned. Otherwise the shared mainloop connection is used.
+ *
+ * Caller must release the returned reference via dbus_connection_unref().
+ *
+ * @return connection reference, or NULL
+ */
 DBusConnection *umdbus_get_connection(void)
 {
     LOG_REGISTER_CONTEXT;
 
     DBusConnection *connection = 0;
-    if( umdbus_connection )
+    if( umdbus_thread_connection )
+        connection = dbus_connection_ref(umdbus_thread_connection);
+    else if( worker_thread_p() && umdbus_worker_connection )
+        connection = dbus_connection_ref(umdbus_worker_connection);
+    else if( umdbus_connection )
         connection = dbus_connection_ref(umdbus_connection);
     else
         log_err("something asked for connection ref while unconnected");
@@ -1376,6 +1679,205 @@ EXIT:
     return status;
 }
 
+/** Establish private D-Bus SystemBus connection for the worker thread
+ *
+ * The connection is not attached to the mainloop. Replies to blocking
+ * calls are read directly by the calling thread, and anything else
+ * that might get queued is dropped via
+ * umdbus_dispatch_worker_connection().
+ *
+ * @return TRUE when everything went ok
+ */
+gboolean umdbus_init_worker_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gboolean status = FALSE;
+    DBusError error = DBUS_ERROR_INIT;
+
+    if( umdbus_worker_connection ) {
+        status = TRUE;
+        goto EXIT;
+    }
+
+    umdbus_worker_connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
+    if( !umdbus_worker_connection ) {
+        log_warning("Failed to open private connection to system message bus; %s\n",
+                    error.message);
+        goto EXIT;
+    }
+
+    /* Losing the worker connection must not terminate usb-moded */
+    dbus_connection_set_exit_on_disconnect(umdbus_worker_connection, FALSE);
+
+    log_debug("worker connection: %s",
+              dbus_bus_get_unique_name(umdbus_worker_connection));
+
+    status = TRUE;
+
+EXIT:
+    dbus_error_free(&error);
+    return status;
+}
+
+/** Process messages queued on private worker connection
+ *
+ * The worker connection does not have any message handlers, so this
+ * just makes sure that signals (NameAcquired etc) do not accumulate
+ * in the incoming queue.
+ */
+void umdbus_dispatch_worker_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !umdbus_worker_connection )
+        goto EXIT;
+
+    if( !dbus_connection_get_is_connected(umdbus_worker_connection) ) {
+        log_err("worker connection lost; using shared connection");
+        umdbus_cleanup_worker_connection();
+        goto EXIT;
+    }
+
+    dbus_connection_read_write(umdbus_worker_connection, 0);
+    while( dbus_connection_dispatch(umdbus_worker_connection) == DBUS_DISPATCH_DATA_REMAINS )
+        ;
+
+EXIT:
+    return;
+}
+
+/** Close private D-Bus SystemBus connection used by the worker thread
+ *
+ * Must be called only when the worker thread is not running.
+ */
+void umdbus_cleanup_worker_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umdbus_worker_connection ) {
+        dbus_connection_close(umdbus_worker_connection);
+        dbus_connection_unref(umdbus_worker_connection),
+            umdbus_worker_connection = NULL;
+    }
+}
+
+/** Attach private D-Bus SystemBus connection to the calling thread
+ *
+ * Meant for helper threads that make blocking method calls, so that
+ * they neither compete with the mainloop over the shared connection
+ * nor with each other. Connections are pooled and reused, so that
+ * a new connection is opened only when all idle ones are in use.
+ *
+ * Must be balanced with umdbus_detach_thread_connection().
+ *
+ * @return TRUE when everything went ok
+ */
+gboolean umdbus_attach_thread_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gboolean        status     = FALSE;
+    DBusError       error      = DBUS_ERROR_INIT;
+    DBusConnection *connection = NULL;
+
+    if( umdbus_thread_connection ) {
+        status = TRUE;
+        goto EXIT;
+    }
+
+    pthread_mutex_lock(&umdbus_thread_connection_mutex);
+    while( !connection && umdbus_thread_connection_pool ) {
+        connection = umdbus_thread_connection_pool->data;
+        umdbus_thread_connection_pool =
+            g_slist_delete_link(umdbus_thread_connection_pool,
+                                umdbus_thread_connection_pool);
+        if( !dbus_connection_get_is_connected(connection) ) {
+            dbus_connection_close(connection);
+            dbus_connection_unref(connection), connection = NULL;
+        }
+    }
+    pthread_mutex_unlock(&umdbus_thread_connection_mutex);
+
+    if( !connection ) {
+        connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
+        if( !connection ) {
+            log_warning("Failed to open private connection to system message bus; %s\n",
+                        error.message);
+            goto EXIT;
+        }
+
+        /* Losing the connection must not terminate usb-moded */
+        dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+        log_debug("thread connection: %s",
+                  dbus_bus_get_unique_name(connection));
+    }
+
+    umdbus_thread_connection = connection;
+    status = TRUE;
+
+EXIT:
+    dbus_error_free(&error);
+    return status;
+}
+
+/** Detach private D-Bus SystemBus connection from the calling thread
+ *
+ * Messages queued on the connection are dropped and it is returned
+ * to the pool for use by other helper threads.
+ */
+void umdbus_detach_thread_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusConnection *connection = umdbus_thread_connection;
+
+    if( !connection )
+        goto EXIT;
+
+    umdbus_thread_connection = NULL;
+
+    if( !dbus_connection_get_is_connected(connection) ) {
+        dbus_connection_close(connection);
+        dbus_connection_unref(connection);
+        goto EXIT;
+    }
+
+    /* No message handlers; just keep signals from accumulating */
+    dbus_connection_read_write(connection, 0);
+    while( dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS )
+        ;
+
+    pthread_mutex_lock(&umdbus_thread_connection_mutex);
+    umdbus_thread_connection_pool =
+        g_slist_prepend(umdbus_thread_connection_pool, connection);
+    pthread_mutex_unlock(&umdbus_thread_connection_mutex);
+
+EXIT:
+    return;
+}
+
+/** Close pooled private D-Bus SystemBus connections
+ *
+ * Must be called only when no helper threads are running.
+ */
+void umdbus_cleanup_thread_connections(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pthread_mutex_lock(&umdbus_thread_connection_mutex);
+    while( umdbus_thread_connection_pool ) {
+        DBusConnection *connection = umdbus_thread_connection_pool->data;
+        umdbus_thread_connection_pool =
+            g_slist_delete_link(umdbus_thread_connection_pool,
+                                umdbus_thread_connection_pool);
+        dbus_connection_close(connection);
+        dbus_connection_unref(connection);
+    }
+    pthread_mutex_unlock(&umdbus_thread_connection_mutex);
+}
+
 /**
  * Reserve "com.meego.usb_moded" D-Bus Service Name
  *
@@ -2463,6 +2965,109 @@ umdbus_append_args(DBusMessageIter *iter, int arg_type, ...)
     return ack;
 }
 
+/** Send method call and wait for reply; cancellable from worker thread
+ *
+ * Behaves like dbus_connection_send_with_reply_and_block() using the
+ * default timeout. But when called from the worker thread, the wait
+ * is abandoned as soon as the ongoing mode switch gets canceled.
+ *
+ * Interruptible waiting involves dispatching the connection, which
+ * is done only for private connections owned by the calling thread.
+ * On shared connections cancellation is checked only before sending.
+ *
+ * @param con  D-Bus connection that is not attached to mainloop
+ * @param req  method call message
+ * @param err  where to store error details
+ *
+ * @return reply message, or NULL on failure
+ */
+DBusMessage *
+umdbus_send_with_reply_and_block(DBusConnection *con, DBusMessage *req,
+                                 DBusError *err)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage     *rsp       = 0;
+    DBusPendingCall *pc        = 0;
+    int              cancel_fd = worker_get_cancel_fd();
+    int              bus_fd    = -1;
+    int64_t          due       = 0;
+
+    if( cancel_fd == -1 )
+        return dbus_connection_send_with_reply_and_block(con, req, -1, err);
+
+    /* Dispatching e.g. the mainloop connection from worker would
+     * execute message handlers and filters in the wrong thread */
+    bool owned = (con == umdbus_thread_connection ||
+                  (worker_thread_p() && con == umdbus_worker_connection));
+
+    if( !owned || !dbus_connection_get_unix_fd(con, &bus_fd) ) {
+        if( worker_cancel_fd_triggered() ) {
+            dbus_set_error(err, DBUS_ERROR_FAILED, "canceled");
+            return 0;
+        }
+        return dbus_connection_send_with_reply_and_block(con, req, -1, err);
+    }
+
+    if( !dbus_connection_send_with_reply(con, req, &pc, -1) || !pc ) {
+        dbus_set_error(err, DBUS_ERROR_DISCONNECTED, "failed to send");
+        goto EXIT;
+    }
+
+    dbus_connection_flush(con);
+
+    due = common_get_monotonic_ms() + UMDBUS_BLOCKING_CALL_TIMEOUT_MS;
+
+    for( ;; ) {
+        dbus_connection_read_write(con, 0);
+        while( dbus_connection_dispatch(con) == DBUS_DISPATCH_DATA_REMAINS )
+            ;
+
+        if( dbus_pending_call_get_completed(pc) ) {
+            rsp = dbus_pending_call_steal_reply(pc);
+            break;
+        }
+
+        if( !dbus_connection_get_is_connected(con) ) {
+            dbus_set_error(err, DBUS_ERROR_DISCONNECTED, "connection lost");
+            break;
+        }
+
+        int64_t left = due - common_get_monotonic_ms();
+        if( left <= 0 ) {
+            dbus_set_error(err, DBUS_ERROR_NO_REPLY, "timed out");
+            break;
+        }
+
+        struct pollfd pfd[] = {
+            { .fd = cancel_fd, .events = POLLIN },
+            { .fd = bus_fd,    .events = POLLIN },
+        };
+
+        if( poll(pfd, G_N_ELEMENTS(pfd), (int)left) == -1 ) {
+            if( errno == EINTR )
+                continue;
+            dbus_set_error(err, DBUS_ERROR_FAILED, "poll: %s",
+                           g_strerror(errno));
+            break;
+        }
+
+        if( (pfd[0].revents & POLLIN) && worker_cancel_fd_triggered() ) {
+            dbus_set_error(err, DBUS_ERROR_FAILED, "canceled");
+            break;
+        }
+    }
+
+    if( !rsp )
+        dbus_pending_call_cancel(pc);
+
+EXIT:
+    if( pc )
+        dbus_pending_call_unref(pc);
+
+    return rsp;
+}
+
 DBusMessage *
 umdbus_blocking_call(DBusConnection *con,
                      const char     *dst,
@@ -2492,7 +3097,7 @@ umdbus_blocking_call(DBusConnection *con,
     if( !umdbus_append_args_va(&body, arg_type, va) )
         goto EXIT;
 
-    if( !(rsp = dbus_connection_send_with_reply_and_block(con, req, -1, err)) ) {
+    if( !(rsp = umdbus_send_with_reply_and_block(con, req, err)) ) {
         log_warning("no reply to %s.%s(): %s: %s",
                     iface, meth, err->name, err->message);
         goto EXIT;
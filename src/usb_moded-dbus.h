@@ -81,6 +81,19 @@
 # define USB_MODE_AVAILABLE_MODES_FOR_USER   "get_available_modes_for_user" /* returns a comma separated list of modes which are currently available and permitted for user to select */
 # define USB_MODE_TARGET_CONFIG_GET          "get_target_mode_config" /* returns current target mode configuration */
 # define USB_MODE_USER_CONFIG_CLEAR          "clear_config" /* clear config for a user */
+# define USB_MODE_WAKEUP_STATS_GET           "get_wakeup_stats" /* returns comma separated list of event source wakeup counts */
+# define USB_MODE_WAKEUP_STATS_RESET         "reset_wakeup_stats" /* resets event source wakeup counts */
+# define USB_MODE_POWER_SUPPLY_GET           "get_power_supply" /* returns details of the tracked power supply device */
+# define USB_MODE_MTPD_STATS_GET             "get_mtpd_stats" /* returns comma separated list of mtp daemon linger statistics */
+# define USB_MODE_LATENCY_STATS_GET          "get_latency_stats" /* returns per mode and phase mode switch latency histograms, one per line */
+# define USB_MODE_LATENCY_STATS_RESET        "reset_latency_stats" /* resets mode switch latency histograms */
+# define USB_MODE_WAKELOCK_STATS_GET         "get_wakelock_stats" /* returns comma separated list of wakelock acquire counts and hold times */
+# define USB_MODE_WAKELOCK_STATS_RESET       "reset_wakelock_stats" /* resets wakelock acquire counts and hold times */
+# define USB_MODE_FLIGHT_RECORDER_GET        "get_flight_recorder" /* returns recent event history, one event per line */
+# define USB_MODE_TRACE_SET                  "set_trace" /* sets comma separated list of subsystems to trace, empty disables tracing */
+# define USB_MODE_TRACE_GET                  "get_trace" /* returns comma separated list of traced subsystems */
+# define USB_MODE_APPSYNC_STATS_GET          "get_appsync_stats" /* returns comma separated list of appsync unit start counts, latencies and results */
+# define USB_MODE_APPSYNC_STATS_RESET        "reset_appsync_stats" /* resets appsync unit start statistics */
 
 /**
  * (Transient) states reported by "sig_usb_state_ind" that are not modes.
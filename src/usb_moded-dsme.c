@@ -27,6 +27,7 @@
 
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-evloop.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modesetting.h"
 
@@ -85,7 +86,7 @@ static void     dsme_socket_processwd_pong(void);
 static void     dsme_socket_processwd_init(void);
 static void     dsme_socket_processwd_quit(void);
 static void     dsme_socket_query_state   (void);
-static gboolean dsme_socket_recv_cb       (GIOChannel *source, GIOCondition condition, gpointer data);
+static bool     dsme_socket_recv_cb       (int fd, uint32_t events, void *aptr);
 static bool     dsme_socket_is_connected  (void);
 static bool     dsme_socket_connect       (void);
 static void     dsme_socket_disconnect    (void);
@@ -343,31 +344,31 @@ dsme_socket_query_state(void)
 
 /** Callback for pending I/O from dsmesock
  *
- * @param source     (not used)
- * @param condition  I/O condition that caused the callback to be called
- * @param data       (not used)
+ * @param fd      (not used)
+ * @param events  epoll events that caused the callback to be called
+ * @param aptr    (not used)
  *
- * @return TRUE if iowatch is to be kept, or FALSE if it should be removed
+ * @return true if iowatch is to be kept, or false if it should be removed
  */
-static gboolean
-dsme_socket_recv_cb(GIOChannel *source,
-                    GIOCondition condition,
-                    gpointer data)
+static bool
+dsme_socket_recv_cb(int fd,
+                    uint32_t events,
+                    void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    gboolean keep_going = TRUE;
+    bool keep_going = true;
     dsmemsg_generic_t *msg = 0;
 
     DSM_MSGTYPE_STATE_CHANGE_IND *msg2;
 
-    (void)source;
-    (void)data;
+    (void)fd;
+    (void)aptr;
 
-    if( condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) ) {
+    if( events & (EPOLLERR | EPOLLHUP) ) {
         if( !dsme_state_is_shutdown() )
             log_crit("DSME socket hangup/error");
-        keep_going = FALSE;
+        keep_going = false;
         goto EXIT;
     }
 
@@ -377,7 +378,7 @@ dsme_socket_recv_cb(GIOChannel *source,
     if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
         if( !dsme_state_is_shutdown() )
             log_warning("DSME socket closed");
-        keep_going = FALSE;
+        keep_going = false;
     }
     else if( DSMEMSG_CAST(DSM_MSGTYPE_PROCESSWD_PING, msg) ) {
         dsme_socket_processwd_pong();
@@ -433,8 +434,6 @@ dsme_socket_connect(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    GIOChannel *iochan = NULL;
-
     /* No new connections during shutdown */
     if( dsme_state_is_shutdown() )
         goto EXIT;
@@ -456,16 +455,14 @@ dsme_socket_connect(void)
 
     log_debug("Adding DSME socket notifier");
 
-    if( !(iochan = g_io_channel_unix_new(dsme_socket_con->fd)) ) {
-        log_err("Failed to set up I/O channel for DSME socket");
+    dsme_socket_iowatch =
+        evloop_add_io("dsme", EVLOOP_PRIO_DSME, dsme_socket_con->fd,
+                      EPOLLIN, dsme_socket_recv_cb, NULL);
+    if( !dsme_socket_iowatch ) {
+        log_err("Failed to set up I/O notifier for DSME socket");
         goto EXIT;
     }
 
-    dsme_socket_iowatch =
-        g_io_add_watch(iochan,
-                       G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                       dsme_socket_recv_cb, NULL);
-
     /* Register with DSME's process watchdog */
     dsme_socket_processwd_init();
 
@@ -473,8 +470,6 @@ dsme_socket_connect(void)
     dsme_socket_query_state();
 
 EXIT:
-    if( iochan ) g_io_channel_unref(iochan);
-
     /* All or nothing */
     if( !dsme_socket_iowatch )
         dsme_socket_disconnect();
@@ -491,7 +486,7 @@ dsme_socket_disconnect(void)
 
     if( dsme_socket_iowatch ) {
         log_debug("Removing DSME socket notifier");
-        g_source_remove(dsme_socket_iowatch);
+        evloop_remove(dsme_socket_iowatch);
         dsme_socket_iowatch = 0;
 
         /* Still having had a live socket notifier means we have
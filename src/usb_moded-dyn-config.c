@@ -29,6 +29,7 @@
 
 #include "usb_moded-dyn-config.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-log.h"
 
 #include <stdlib.h>
@@ -297,7 +298,7 @@ modelist_load(bool diag)
     LOG_REGISTER_CONTEXT;
 
     GList      *modelist = 0;
-    const char *dirpath  = diag ? DIAG_DIR_PATH : MODE_DIR_PATH;
+    const char *dirpath  = common_root_path(diag ? DIAG_DIR_PATH : MODE_DIR_PATH);
     gchar      *pattern  = g_strdup_printf("%s/*.ini", dirpath);
     glob_t      gb       = {};
 
@@ -0,0 +1,751 @@
+/**
+ * @file usb_moded-evloop.c
+ *
+ * Unified epoll based event core
+ *
+ * Signals, worker notifications, udev monitors, dsme socket and
+ * timers are multiplexed through a single epoll file descriptor,
+ * which in turn is attached to glib mainloop as one io watch. This
+ * way all the sources that have become ready during one mainloop
+ * iteration get dispatched in predictable order and each source
+ * wakeup can be accounted for.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-evloop.h"
+
+#include "usb_moded.h"
+#include "usb_moded-log.h"
+#include "usb_moded-sigpipe.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/timerfd.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of epoll events handled per mainloop wakeup */
+#define EVLOOP_MAX_EVENTS 16
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Event source bookkeeping data */
+typedef struct evloop_source_t
+{
+    /** Source id, as returned to the caller */
+    guint              id;
+
+    /** Name used for logging and wakeup statistics */
+    gchar             *name;
+
+    /** Wakeup counter for the name, owned by evloop_wakeups */
+    guint             *wakeups;
+
+    /** Dispatch priority */
+    evloop_prio_t      prio;
+
+    /** File descriptor to watch */
+    int                fd;
+
+    /** Epoll events to watch */
+    uint32_t           events;
+
+    /** Callback for io sources */
+    evloop_io_fn       io_cb;
+
+    /** Callback for timer sources */
+    evloop_timer_fn    timer_cb;
+
+    /** Timer delay for re-arming */
+    unsigned           delay_ms;
+
+    /** Allowed timer expiry delay for wakeup coalescing */
+    unsigned           slack_ms;
+
+    /** User data for callbacks */
+    void              *aptr;
+
+    /** Callback to call when the source is removed */
+    evloop_destroy_fn  destroy_cb;
+
+    /** Flag for: callback is being executed */
+    bool               in_dispatch;
+
+    /** Flag for: source has been removed */
+    bool               removed;
+} evloop_source_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * EVLOOP_SOURCE
+ * ------------------------------------------------------------------------- */
+
+static evloop_source_t *evloop_source_create  (const char *name, evloop_prio_t prio, int fd, uint32_t events);
+static void             evloop_source_delete  (evloop_source_t *self);
+static bool             evloop_source_arm     (evloop_source_t *self);
+static bool             evloop_source_attach  (evloop_source_t *self);
+static void             evloop_source_detach  (evloop_source_t *self);
+static void             evloop_source_dispatch(evloop_source_t *self, uint32_t events);
+
+/* ------------------------------------------------------------------------- *
+ * EVLOOP_STATS
+ * ------------------------------------------------------------------------- */
+
+static guint *evloop_stats_slot(const char *name);
+
+/* ------------------------------------------------------------------------- *
+ * EVLOOP
+ * ------------------------------------------------------------------------- */
+
+static int      evloop_compare_events_cb(const void *a, const void *b);
+static gboolean evloop_epoll_cb         (GIOChannel *channel, GIOCondition condition, gpointer data);
+guint           evloop_add_io_full      (const char *name, evloop_prio_t prio, int fd, uint32_t events, evloop_io_fn io_cb, void *aptr, evloop_destroy_fn destroy_cb);
+guint           evloop_add_io           (const char *name, evloop_prio_t prio, int fd, uint32_t events, evloop_io_fn io_cb, void *aptr);
+guint           evloop_add_timer        (const char *name, unsigned delay_ms, unsigned slack_ms, evloop_timer_fn timer_cb, void *aptr);
+bool            evloop_remove           (guint id);
+gchar          *evloop_get_stats        (void);
+void            evloop_reset_stats      (void);
+bool            evloop_init             (void);
+void            evloop_quit             (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Epoll file descriptor */
+static int evloop_epoll_fd = -1;
+
+/** Glib io watch for epoll file descriptor */
+static guint evloop_epoll_watch_id = 0;
+
+/** Registered sources: id -> evloop_source_t */
+static GHashTable *evloop_sources = NULL;
+
+/** Wakeup counts: source name -> guint counter
+ *
+ * Counters are shared by sources with the same name and must stay
+ * in place while sources refer to them, i.e. they are zeroed instead
+ * of removed on reset.
+ */
+static GHashTable *evloop_wakeups = NULL;
+
+/** Previously used source id */
+static guint evloop_last_id = 0;
+
+/* ========================================================================= *
+ * EVLOOP_SOURCE
+ * ========================================================================= */
+
+static evloop_source_t *
+evloop_source_create(const char *name, evloop_prio_t prio, int fd,
+                     uint32_t events)
+{
+    LOG_REGISTER_CONTEXT;
+
+    evloop_source_t *self = g_malloc0(sizeof *self);
+
+    /* Skip zero on wraparound, it is used as "no source" */
+    if( ++evloop_last_id == 0 )
+        ++evloop_last_id;
+
+    self->id          = evloop_last_id;
+    self->name        = g_strdup(name ?: "unknown");
+    self->wakeups     = evloop_stats_slot(self->name);
+    self->prio        = prio;
+    self->fd          = fd;
+    self->events      = events;
+    self->io_cb       = 0;
+    self->timer_cb    = 0;
+    self->delay_ms    = 0;
+    self->slack_ms    = 0;
+    self->aptr        = 0;
+    self->destroy_cb  = 0;
+    self->in_dispatch = false;
+    self->removed     = false;
+
+    return self;
+}
+
+static void
+evloop_source_delete(evloop_source_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        /* Timer file descriptors are owned by evloop */
+        if( self->timer_cb && self->fd != -1 )
+            close(self->fd);
+        g_free(self->name);
+        g_free(self);
+    }
+}
+
+/** Program timer expiry
+ *
+ * The expiry time is rounded up to the next multiple of slack
+ * time, so that timers with similar expiry times and non-zero
+ * slack end up waking up the process only once.
+ *
+ * @param self  timer source
+ *
+ * @return true on success, or false in case of errors
+ */
+static bool
+evloop_source_arm(evloop_source_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    struct timespec now = { 0, 0 };
+    struct itimerspec its;
+
+    if( clock_gettime(CLOCK_MONOTONIC, &now) == -1 ) {
+        log_err("%s: clock_gettime: %m", self->name);
+        goto EXIT;
+    }
+
+    uint64_t ms = ((uint64_t)now.tv_sec * 1000 +
+                   (uint64_t)now.tv_nsec / 1000000 +
+                   self->delay_ms);
+
+    if( self->slack_ms > 0 )
+        ms = (ms + self->slack_ms - 1) / self->slack_ms * self->slack_ms;
+
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec  = (time_t)(ms / 1000);
+    its.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+
+    /* Zero value would disarm the timer */
+    if( its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0 )
+        its.it_value.tv_nsec = 1;
+
+    if( timerfd_settime(self->fd, TFD_TIMER_ABSTIME, &its, 0) == -1 ) {
+        log_err("%s: timerfd_settime: %m", self->name);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+static bool
+evloop_source_attach(evloop_source_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    struct epoll_event eve;
+
+    if( evloop_epoll_fd == -1 ) {
+        log_err("%s: event loop not initialized", self->name);
+        goto EXIT;
+    }
+
+    memset(&eve, 0, sizeof eve);
+    eve.events   = self->events;
+    eve.data.u64 = self->id;
+
+    if( epoll_ctl(evloop_epoll_fd, EPOLL_CTL_ADD, self->fd, &eve) == -1 ) {
+        log_err("%s: epoll_ctl(ADD, %d): %m", self->name, self->fd);
+        goto EXIT;
+    }
+
+    g_hash_table_replace(evloop_sources, GUINT_TO_POINTER(self->id), self);
+
+    log_debug("%s: added source %u fd %d", self->name, self->id, self->fd);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+static void
+evloop_source_detach(evloop_source_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self->removed )
+        goto EXIT;
+
+    self->removed = true;
+
+    log_debug("%s: remove source %u fd %d", self->name, self->id, self->fd);
+
+    g_hash_table_steal(evloop_sources, GUINT_TO_POINTER(self->id));
+
+    /* Sources that return false from callback might have closed
+     * the fd already, in which case kernel has dropped it from the
+     * epoll set and failures can be ignored. */
+    if( epoll_ctl(evloop_epoll_fd, EPOLL_CTL_DEL, self->fd, 0) == -1 ) {
+        if( errno != EBADF && errno != ENOENT )
+            log_warning("%s: epoll_ctl(DEL, %d): %m", self->name, self->fd);
+    }
+
+    if( self->destroy_cb )
+        self->destroy_cb(self->aptr);
+
+    /* Defer release of sources that remove themselves */
+    if( !self->in_dispatch )
+        evloop_source_delete(self);
+
+EXIT:
+    return;
+}
+
+static void
+evloop_source_dispatch(evloop_source_t *self, uint32_t events)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool keep = false;
+
+    if( self->wakeups )
+        *self->wakeups += 1;
+
+    self->in_dispatch = true;
+
+    if( self->timer_cb ) {
+        uint64_t cnt = 0;
+        if( TEMP_FAILURE_RETRY(read(self->fd, &cnt, sizeof cnt)) == -1 ) {
+            if( errno == EAGAIN ) {
+                /* Spurious wakeup, e.g. timer was re-armed */
+                keep = true;
+                goto EXIT;
+            }
+            log_err("%s: timerfd read: %m", self->name);
+            goto EXIT;
+        }
+        if( !self->timer_cb(self->aptr) )
+            goto EXIT;
+        if( self->removed )
+            goto EXIT;
+        keep = evloop_source_arm(self);
+    }
+    else {
+        keep = self->io_cb(self->fd, events, self->aptr);
+    }
+
+EXIT:
+    if( !keep )
+        evloop_source_detach(self);
+
+    self->in_dispatch = false;
+
+    if( self->removed )
+        evloop_source_delete(self);
+}
+
+/* ========================================================================= *
+ * EVLOOP_STATS
+ * ========================================================================= */
+
+/** Get wakeup counter for a source name
+ *
+ * Looked up once when a source is created, so that dispatching
+ * does not need to allocate or hash anything.
+ *
+ * @param name  source name
+ *
+ * @return counter, or NULL if event loop is not initialized
+ */
+static guint *
+evloop_stats_slot(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    guint *cnt = 0;
+
+    if( !evloop_wakeups )
+        goto EXIT;
+
+    if( !(cnt = g_hash_table_lookup(evloop_wakeups, name)) ) {
+        cnt = g_new0(guint, 1);
+        g_hash_table_replace(evloop_wakeups, g_strdup(name), cnt);
+    }
+
+EXIT:
+    return cnt;
+}
+
+/** Get wakeup statistics
+ *
+ * @return "name=count, ..." string; caller must release with g_free()
+ */
+gchar *
+evloop_get_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *buff = g_string_new(0);
+
+    if( evloop_wakeups ) {
+        GList *keys = g_hash_table_get_keys(evloop_wakeups);
+        keys = g_list_sort(keys, (GCompareFunc)strcmp);
+        for( GList *iter = keys; iter; iter = iter->next ) {
+            const char *name = iter->data;
+            guint      *cnt  = g_hash_table_lookup(evloop_wakeups, name);
+            if( !*cnt )
+                continue;
+            if( buff->len )
+                g_string_append(buff, ", ");
+            g_string_append_printf(buff, "%s=%u", name, *cnt);
+        }
+        g_list_free(keys);
+    }
+
+    return g_string_free(buff, FALSE);
+}
+
+/** Reset wakeup statistics
+ */
+void
+evloop_reset_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( evloop_wakeups ) {
+        GHashTableIter iter;
+        gpointer       cnt;
+        g_hash_table_iter_init(&iter, evloop_wakeups);
+        while( g_hash_table_iter_next(&iter, 0, &cnt) )
+            *(guint *)cnt = 0;
+    }
+}
+
+/* ========================================================================= *
+ * EVLOOP
+ * ========================================================================= */
+
+/** Sort ready events into dispatch order
+ */
+static int
+evloop_compare_events_cb(const void *a, const void *b)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const struct epoll_event *eve_a = a;
+    const struct epoll_event *eve_b = b;
+
+    evloop_source_t *src_a =
+        g_hash_table_lookup(evloop_sources,
+                            GUINT_TO_POINTER((guint)eve_a->data.u64));
+    evloop_source_t *src_b =
+        g_hash_table_lookup(evloop_sources,
+                            GUINT_TO_POINTER((guint)eve_b->data.u64));
+
+    int prio_a = src_a ? (int)src_a->prio : EVLOOP_PRIO_NUMOF;
+    int prio_b = src_b ? (int)src_b->prio : EVLOOP_PRIO_NUMOF;
+
+    if( prio_a != prio_b )
+        return (prio_a < prio_b) ? -1 : 1;
+
+    if( eve_a->data.u64 != eve_b->data.u64 )
+        return (eve_a->data.u64 < eve_b->data.u64) ? -1 : 1;
+
+    return 0;
+}
+
+/** Glib io watch callback for epoll file descriptor
+ *
+ * @param channel   glib io channel
+ * @param condition wakeup reason
+ * @param data      user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean
+evloop_epoll_cb(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)channel;
+    (void)data;
+
+    gboolean keep_watch = FALSE;
+    struct epoll_event eve[EVLOOP_MAX_EVENTS];
+
+    if( condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) ) {
+        log_crit("epoll fd in unexpected state");
+        goto EXIT;
+    }
+
+    int cnt = TEMP_FAILURE_RETRY(epoll_wait(evloop_epoll_fd, eve,
+                                            EVLOOP_MAX_EVENTS, 0));
+    if( cnt == -1 ) {
+        /* Transient failure: retry on the next wakeup */
+        if( errno == EAGAIN || errno == ENOMEM ) {
+            log_warning("epoll_wait: %m");
+            keep_watch = TRUE;
+        }
+        else {
+            log_crit("epoll_wait: %m");
+        }
+        goto EXIT;
+    }
+
+    keep_watch = TRUE;
+
+    if( cnt > 1 )
+        qsort(eve, (size_t)cnt, sizeof *eve, evloop_compare_events_cb);
+
+    for( int i = 0; i < cnt; ++i ) {
+        /* Sources might get removed by earlier callbacks */
+        evloop_source_t *src =
+            g_hash_table_lookup(evloop_sources,
+                                GUINT_TO_POINTER((guint)eve[i].data.u64));
+        if( src )
+            evloop_source_dispatch(src, eve[i].events);
+    }
+
+EXIT:
+    if( !keep_watch ) {
+        /* Without the io watch no event sources would get dispatched;
+         * exit and let systemd restart usb-moded */
+        log_crit("disabled event loop io watch");
+        evloop_epoll_watch_id = 0;
+        usbmoded_exit_mainloop(EXIT_FAILURE);
+    }
+
+    return keep_watch;
+}
+
+/** Add file descriptor event source
+ *
+ * The file descriptor remains owned by the caller and must stay open
+ * until the source has been removed.
+ *
+ * @param name        source name for logging and statistics
+ * @param prio        dispatch priority
+ * @param fd          file descriptor to watch
+ * @param events      epoll events to watch, e.g. EPOLLIN
+ * @param io_cb       callback to call when fd is ready
+ * @param aptr        user data to pass to callbacks
+ * @param destroy_cb  callback to call when source is removed, or NULL
+ *
+ * @return source id, or 0 in case of errors
+ */
+guint
+evloop_add_io_full(const char *name, evloop_prio_t prio, int fd,
+                   uint32_t events, evloop_io_fn io_cb, void *aptr,
+                   evloop_destroy_fn destroy_cb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    guint id = 0;
+    evloop_source_t *src = evloop_source_create(name, prio, fd, events);
+
+    src->io_cb      = io_cb;
+    src->aptr       = aptr;
+    src->destroy_cb = destroy_cb;
+
+    if( !evloop_source_attach(src) )
+        goto EXIT;
+
+    id = src->id, src = 0;
+
+EXIT:
+    evloop_source_delete(src);
+
+    return id;
+}
+
+/** Add file descriptor event source without destroy notification
+ *
+ * See #evloop_add_io_full() for details.
+ */
+guint
+evloop_add_io(const char *name, evloop_prio_t prio, int fd,
+              uint32_t events, evloop_io_fn io_cb, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return evloop_add_io_full(name, prio, fd, events, io_cb, aptr, 0);
+}
+
+/** Add timer event source
+ *
+ * Like g_timeout_add(), the timer is re-armed for as long as the
+ * callback function returns true.
+ *
+ * @param name      source name for logging and statistics
+ * @param delay_ms  timer delay in milliseconds
+ * @param slack_ms  how much expiry can be delayed to coalesce wakeups
+ * @param timer_cb  callback to call on expiry
+ * @param aptr      user data to pass to callback
+ *
+ * @return source id, or 0 in case of errors
+ */
+guint
+evloop_add_timer(const char *name, unsigned delay_ms, unsigned slack_ms,
+                 evloop_timer_fn timer_cb, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    guint id = 0;
+    evloop_source_t *src = 0;
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if( fd == -1 ) {
+        log_err("%s: timerfd_create: %m", name);
+        goto EXIT;
+    }
+
+    src = evloop_source_create(name, EVLOOP_PRIO_TIMER, fd, EPOLLIN);
+    src->timer_cb = timer_cb;
+    src->delay_ms = delay_ms;
+    src->slack_ms = slack_ms;
+    src->aptr     = aptr;
+
+    if( !evloop_source_arm(src) )
+        goto EXIT;
+
+    if( !evloop_source_attach(src) )
+        goto EXIT;
+
+    id = src->id, src = 0;
+
+EXIT:
+    evloop_source_delete(src);
+
+    return id;
+}
+
+/** Remove event source
+ *
+ * @param id  source id, as returned by evloop_add_xxx() functions
+ *
+ * @return true if source was removed, false if it did not exist
+ */
+bool
+evloop_remove(guint id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    evloop_source_t *src = 0;
+
+    if( !id || !evloop_sources )
+        goto EXIT;
+
+    src = g_hash_table_lookup(evloop_sources, GUINT_TO_POINTER(id));
+    if( !src ) {
+        log_warning("source %u does not exist", id);
+        goto EXIT;
+    }
+
+    evloop_source_detach(src);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Initialize event loop
+ *
+ * @return true on success, or false in case of errors
+ */
+bool
+evloop_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    GIOChannel *chn = 0;
+
+    if( evloop_epoll_fd != -1 ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( (evloop_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ) {
+        log_err("epoll_create: %m");
+        goto EXIT;
+    }
+
+    evloop_sources = g_hash_table_new(g_direct_hash, g_direct_equal);
+    evloop_wakeups = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, g_free);
+
+    if( (chn = g_io_channel_unix_new(evloop_epoll_fd)) == 0 )
+        goto EXIT;
+
+    evloop_epoll_watch_id =
+        g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                       evloop_epoll_cb, 0);
+    if( !evloop_epoll_watch_id )
+        goto EXIT;
+
+    ack = true;
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( !ack )
+        evloop_quit();
+
+    return ack;
+}
+
+/** Release event loop resources
+ */
+void
+evloop_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( evloop_epoll_watch_id ) {
+        g_source_remove(evloop_epoll_watch_id),
+            evloop_epoll_watch_id = 0;
+    }
+
+    if( evloop_sources ) {
+        GList *srcs = g_hash_table_get_values(evloop_sources);
+        for( GList *iter = srcs; iter; iter = iter->next ) {
+            evloop_source_t *src = iter->data;
+            log_warning("%s: source %u still active on exit",
+                        src->name, src->id);
+            evloop_source_detach(src);
+        }
+        g_list_free(srcs);
+        g_hash_table_unref(evloop_sources), evloop_sources = 0;
+    }
+
+    if( evloop_wakeups ) {
+        g_hash_table_unref(evloop_wakeups), evloop_wakeups = 0;
+    }
+
+    if( evloop_epoll_fd != -1 ) {
+        close(evloop_epoll_fd), evloop_epoll_fd = -1;
+    }
+}
@@ -0,0 +1,98 @@
+/**
+ * @file usb_moded-evloop.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_EVLOOP_H_
+# define USB_MODED_EVLOOP_H_
+
+# include <stdbool.h>
+# include <stdint.h>
+
+# include <sys/epoll.h>
+
+# include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Dispatch order for event sources that become ready simultaneously
+ *
+ * Lower values are dispatched first.
+ */
+typedef enum evloop_prio_t
+{
+    /** Signals delivered via signalfd */
+    EVLOOP_PRIO_SIGNAL,
+    /** Notifications from worker thread */
+    EVLOOP_PRIO_WORKER,
+    /** Power supply uevents */
+    EVLOOP_PRIO_UDEV,
+    /** Trigger uevents */
+    EVLOOP_PRIO_TRIGGER,
+    /** DSME socket ipc */
+    EVLOOP_PRIO_DSME,
+    /** Expired timers */
+    EVLOOP_PRIO_TIMER,
+
+    EVLOOP_PRIO_NUMOF
+} evloop_prio_t;
+
+/** Callback for file descriptor readiness
+ *
+ * @param fd     File descriptor
+ * @param events Epoll event mask
+ * @param aptr   User data
+ *
+ * @return true to keep the source, or false to remove it
+ */
+typedef bool (*evloop_io_fn)(int fd, uint32_t events, void *aptr);
+
+/** Callback for timer expiry
+ *
+ * @param aptr   User data
+ *
+ * @return true to re-arm the timer, or false to remove it
+ */
+typedef bool (*evloop_timer_fn)(void *aptr);
+
+/** Callback for source removal notification
+ *
+ * @param aptr   User data
+ */
+typedef void (*evloop_destroy_fn)(void *aptr);
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * EVLOOP
+ * ------------------------------------------------------------------------- */
+
+guint  evloop_add_io_full (const char *name, evloop_prio_t prio, int fd, uint32_t events, evloop_io_fn io_cb, void *aptr, evloop_destroy_fn destroy_cb);
+guint  evloop_add_io      (const char *name, evloop_prio_t prio, int fd, uint32_t events, evloop_io_fn io_cb, void *aptr);
+guint  evloop_add_timer   (const char *name, unsigned delay_ms, unsigned slack_ms, evloop_timer_fn timer_cb, void *aptr);
+bool   evloop_remove      (guint id);
+gchar *evloop_get_stats   (void);
+void   evloop_reset_stats (void);
+bool   evloop_init        (void);
+void   evloop_quit        (void);
+
+#endif /* USB_MODED_EVLOOP_H_ */
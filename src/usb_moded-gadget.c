@@ -0,0 +1,352 @@
+/**
+ * @file usb_moded-gadget.c
+ *
+ * Gadget configuration backend selection
+ *
+ * Backends that are enabled at build time are probed in priority
+ * order during startup, and the first one that is usable gets
+ * selected. After that all gadget configuration is made through
+ * the selected backend's operations table.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-gadget.h"
+
+#include "usb_moded-log.h"
+
+#include <stddef.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * GADGET
+ * ------------------------------------------------------------------------- */
+
+bool        gadget_init               (bool last_resort);
+void        gadget_quit               (void);
+bool        gadget_in_use             (void);
+const char *gadget_name               (void);
+int         gadget_max_luns           (void);
+bool        gadget_mtpd_before_udc    (void);
+bool        gadget_extra_sysfs        (void);
+const char *gadget_charging_module    (void);
+bool        gadget_set_functions      (const char *functions);
+bool        gadget_set_ids            (const char *product_id, const char *vendor_id);
+bool        gadget_set_udc            (bool enable);
+bool        gadget_add_lun            (int lun);
+bool        gadget_remove_lun         (int lun);
+bool        gadget_set_lun_attr       (int lun, const char *attr, const char *value);
+bool        gadget_set_charging_mode  (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Backends enabled at build time, in probing order
+ *
+ * The simulated backend is usable only when root prefix has been
+ * set, and thus needs to be probed before real backends.
+ */
+static const gadget_backend_t * const gadget_backend_lut[] = {
+#ifdef GADGET_SIMULATED
+    &simulated_backend,
+#endif
+#ifdef GADGET_CONFIGFS
+    &configfs_backend,
+#endif
+#ifdef GADGET_ANDROID
+    &android_backend,
+#endif
+#ifdef GADGET_MODULES
+    &modules_backend,
+#endif
+    0
+};
+
+/** Selected backend, or NULL if none is available */
+static const gadget_backend_t *gadget_backend = 0;
+
+/* ========================================================================= *
+ * GADGET
+ * ========================================================================= */
+
+/** Probe for usable gadget configuration backend
+ *
+ * Regular backends are tried first. Last resort backends are tried
+ * only when explicitly requested - or when no regular backends are
+ * enabled at build time, in which case there is no point in waiting
+ * for sysfs control structures to appear.
+ *
+ * @param last_resort  true to probe last resort backends
+ *
+ * @return true if a backend is selected, false otherwise
+ */
+bool
+gadget_init(bool last_resort)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool have_regular = false;
+
+    if( gadget_backend )
+        goto EXIT;
+
+    for( size_t i = 0; gadget_backend_lut[i]; ++i ) {
+        if( !gadget_backend_lut[i]->gb_last_resort )
+            have_regular = true;
+    }
+
+    if( !have_regular )
+        last_resort = true;
+
+    for( size_t i = 0; gadget_backend_lut[i]; ++i ) {
+        const gadget_backend_t *backend = gadget_backend_lut[i];
+
+        if( backend->gb_last_resort != last_resort )
+            continue;
+
+        if( backend->gb_init() ) {
+            gadget_backend = backend;
+            log_debug("gadget backend: %s", backend->gb_name);
+            break;
+        }
+    }
+
+EXIT:
+    return gadget_in_use();
+}
+
+/** Release resources allocated by all backends
+ */
+void
+gadget_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; gadget_backend_lut[i]; ++i )
+        gadget_backend_lut[i]->gb_quit();
+
+    gadget_backend = 0;
+}
+
+/** Check whether a gadget configuration backend has been selected
+ *
+ * @return true if a backend is available, false otherwise
+ */
+bool
+gadget_in_use(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return gadget_backend != 0;
+}
+
+/** Get name of the selected backend
+ *
+ * @return backend name, or "none"
+ */
+const char *
+gadget_name(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return gadget_backend ? gadget_backend->gb_name : "none";
+}
+
+/** Get maximum number of mass storage luns
+ *
+ * @return lun count limit, or zero if there is no limit
+ */
+int
+gadget_max_luns(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return gadget_backend ? gadget_backend->gb_max_luns : 0;
+}
+
+/** Check whether mtp daemon must be started before attaching gadget
+ *
+ * With FunctionFS the daemon must set up endpoints before the gadget
+ * can be attached, which also allows keeping the daemon running while
+ * the gadget is detached.
+ *
+ * @return true if mtpd must be started first, false otherwise
+ */
+bool
+gadget_mtpd_before_udc(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return gadget_backend && gadget_backend->gb_mtpd_before_udc;
+}
+
+/** Check whether mode specific android extra sysfs settings apply
+ *
+ * @return true if the settings should be written, false otherwise
+ */
+bool
+gadget_extra_sysfs(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return gadget_backend && gadget_backend->gb_extra_sysfs;
+}
+
+/** Get kernel module that provides charging mode
+ *
+ * @return module name, or NULL if gadget_set_charging_mode() is used
+ */
+const char *
+gadget_charging_module(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return gadget_backend ? gadget_backend->gb_charging_module : 0;
+}
+
+/** Select gadget functions
+ *
+ * @param functions  Comma separated function list, or NULL to clear
+ *
+ * @return true on success, false on failure
+ */
+bool
+gadget_set_functions(const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !gadget_backend )
+        return false;
+
+    if( !gadget_backend->gb_set_functions )
+        return true;
+
+    return gadget_backend->gb_set_functions(functions);
+}
+
+/** Set gadget product and vendor ids
+ *
+ * @param product_id  Product id, or NULL to leave as is
+ * @param vendor_id   Vendor id, or NULL to leave as is
+ *
+ * @return true on success, false on failure
+ */
+bool
+gadget_set_ids(const char *product_id, const char *vendor_id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !gadget_backend )
+        return false;
+
+    if( !gadget_backend->gb_set_ids )
+        return true;
+
+    return gadget_backend->gb_set_ids(product_id, vendor_id);
+}
+
+/** Attach gadget to / detach gadget from the bus
+ *
+ * @param enable  true to attach, false to detach
+ *
+ * @return true on success, false on failure / if not supported
+ */
+bool
+gadget_set_udc(bool enable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !gadget_backend || !gadget_backend->gb_set_udc )
+        return false;
+
+    return gadget_backend->gb_set_udc(enable);
+}
+
+/** Make mass storage lun available
+ *
+ * @param lun  Lun index
+ *
+ * @return true on success, false on failure / if not supported
+ */
+bool
+gadget_add_lun(int lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !gadget_backend || !gadget_backend->gb_add_lun )
+        return false;
+
+    return gadget_backend->gb_add_lun(lun);
+}
+
+/** Remove mass storage lun
+ *
+ * @param lun  Lun index
+ *
+ * @return true on success, false on failure
+ */
+bool
+gadget_remove_lun(int lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !gadget_backend )
+        return false;
+
+    if( !gadget_backend->gb_remove_lun )
+        return true;
+
+    return gadget_backend->gb_remove_lun(lun);
+}
+
+/** Set mass storage lun attribute
+ *
+ * @param lun    Lun index
+ * @param attr   Attribute name, e.g. "file"
+ * @param value  Attribute value
+ *
+ * @return true on success, false on failure / if not supported
+ */
+bool
+gadget_set_lun_attr(int lun, const char *attr, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !gadget_backend || !gadget_backend->gb_set_lun_attr )
+        return false;
+
+    return gadget_backend->gb_set_lun_attr(lun, attr, value);
+}
+
+/** Configure and attach charging only gadget
+ *
+ * @return true on success, false on failure / if not supported
+ */
+bool
+gadget_set_charging_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !gadget_backend || !gadget_backend->gb_set_charging )
+        return false;
+
+    return gadget_backend->gb_set_charging();
+}
@@ -0,0 +1,125 @@
+/**
+ * @file usb_moded-gadget.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_GADGET_H_
+# define USB_MODED_GADGET_H_
+
+# include <stdbool.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Gadget configuration backend
+ *
+ * Each backend fills in the operations it supports. Missing optional
+ * operations are treated as successful no-ops, see gadget_xxx() wrapper
+ * functions for details.
+ */
+typedef struct gadget_backend_t
+{
+    /** Backend name, for diagnostic logging */
+    const char *gb_name;
+
+    /** Backend is probed only when no other backend is available */
+    bool        gb_last_resort;
+
+    /** Maximum number of mass storage luns, or zero for no limit */
+    int         gb_max_luns;
+
+    /** MTP daemon must be running before gadget is attached to the bus */
+    bool        gb_mtpd_before_udc;
+
+    /** Mode specific android extra sysfs settings apply */
+    bool        gb_extra_sysfs;
+
+    /** Kernel module to load for charging, or NULL to use gb_set_charging */
+    const char *gb_charging_module;
+
+    /** Probe and initialize, returns true if the backend can be used */
+    bool      (*gb_init)         (void);
+
+    /** Release resources allocated by gb_init */
+    void      (*gb_quit)         (void);
+
+    /** Select comma separated gadget functions, or clear with NULL */
+    bool      (*gb_set_functions)(const char *functions);
+
+    /** Set product and vendor ids, either can be NULL */
+    bool      (*gb_set_ids)      (const char *product_id, const char *vendor_id);
+
+    /** Attach gadget to / detach gadget from the bus */
+    bool      (*gb_set_udc)      (bool enable);
+
+    /** Make mass storage lun available */
+    bool      (*gb_add_lun)      (int lun);
+
+    /** Remove mass storage lun */
+    bool      (*gb_remove_lun)   (int lun);
+
+    /** Set mass storage lun attribute */
+    bool      (*gb_set_lun_attr) (int lun, const char *attr, const char *value);
+
+    /** Configure and attach charging only gadget */
+    bool      (*gb_set_charging) (void);
+} gadget_backend_t;
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+# ifdef GADGET_SIMULATED
+extern const gadget_backend_t simulated_backend;
+# endif
+# ifdef GADGET_CONFIGFS
+extern const gadget_backend_t configfs_backend;
+# endif
+# ifdef GADGET_ANDROID
+extern const gadget_backend_t android_backend;
+# endif
+# ifdef GADGET_MODULES
+extern const gadget_backend_t modules_backend;
+# endif
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * GADGET
+ * ------------------------------------------------------------------------- */
+
+bool        gadget_init               (bool last_resort);
+void        gadget_quit               (void);
+bool        gadget_in_use             (void);
+const char *gadget_name               (void);
+int         gadget_max_luns           (void);
+bool        gadget_mtpd_before_udc    (void);
+bool        gadget_extra_sysfs        (void);
+const char *gadget_charging_module    (void);
+bool        gadget_set_functions      (const char *functions);
+bool        gadget_set_ids            (const char *product_id, const char *vendor_id);
+bool        gadget_set_udc            (bool enable);
+bool        gadget_add_lun            (int lun);
+bool        gadget_remove_lun         (int lun);
+bool        gadget_set_lun_attr       (int lun, const char *attr, const char *value);
+bool        gadget_set_charging_mode  (void);
+
+#endif /* USB_MODED_GADGET_H_ */
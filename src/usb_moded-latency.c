@@ -0,0 +1,258 @@
+/**
+ * @file usb_moded-latency.c
+ *
+ * Mode switch latency histograms
+ *
+ * Durations of individual mode switch phases are collected into
+ * fixed-bucket histograms, separately for each mode. Samples are
+ * recorded from the worker thread and from mode setup helper
+ * threads, while the statistics are read and reset from the main
+ * thread - hence all access is serialized with a mutex.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-latency.h"
+
+#include "usb_moded-common.h"
+#include "usb_moded-log.h"
+
+#include <string.h>
+
+#include <pthread.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of histogram buckets, the last one is open ended */
+#define LATENCY_BUCKETS 10
+
+/** Upper bounds of histogram buckets [ms] */
+static const unsigned latency_bucket_limit[LATENCY_BUCKETS - 1] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000,
+};
+
+/** Phase names used in statistics output */
+static const char * const latency_phase_name[LATENCY_PHASE_NUMOF] = {
+    [LATENCY_PHASE_MTPD_STOP]    = "mtpd-stop",
+    [LATENCY_PHASE_UNMOUNT]      = "unmount",
+    [LATENCY_PHASE_MODULE]       = "module",
+    [LATENCY_PHASE_GADGET]       = "gadget",
+    [LATENCY_PHASE_UDC_BIND]     = "udc-bind",
+    [LATENCY_PHASE_NETWORK]      = "network",
+    [LATENCY_PHASE_APPSYNC_PRE]  = "appsync-pre",
+    [LATENCY_PHASE_APPSYNC_POST] = "appsync-post",
+    [LATENCY_PHASE_TETHERING]    = "tethering",
+    [LATENCY_PHASE_MTPD_START]   = "mtpd-start",
+    [LATENCY_PHASE_TOTAL]        = "total",
+};
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Histogram for one phase */
+typedef struct latency_histogram_t
+{
+    /** Number of samples */
+    unsigned count;
+
+    /** Longest duration seen [ms] */
+    int64_t  max;
+
+    /** Sum of durations [ms] */
+    int64_t  sum;
+
+    /** Samples per bucket */
+    unsigned bucket[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+/** Histograms for all phases of one mode */
+typedef struct latency_mode_t
+{
+    latency_histogram_t phase[LATENCY_PHASE_NUMOF];
+} latency_mode_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * LATENCY
+ * ------------------------------------------------------------------------- */
+
+static unsigned latency_bucket      (int64_t elapsed);
+void            latency_record      (const char *mode, latency_phase_t phase, int64_t started);
+gchar          *latency_get_stats   (void);
+void            latency_reset_stats (void);
+void            latency_quit        (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Lock for serializing access to latency_modes */
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Mode name -> latency_mode_t lookup table */
+static GHashTable *latency_modes = 0;
+
+/* ========================================================================= *
+ * LATENCY
+ * ========================================================================= */
+
+/** Map duration to histogram bucket
+ *
+ * @param elapsed  Duration [ms]
+ *
+ * @return bucket index
+ */
+static unsigned
+latency_bucket(int64_t elapsed)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned i = 0;
+    while( i < LATENCY_BUCKETS - 1 && elapsed > latency_bucket_limit[i] )
+        ++i;
+    return i;
+}
+
+/** Record duration of a mode switch phase
+ *
+ * Can be called from any thread.
+ *
+ * @param mode     Name of the mode being activated
+ * @param phase    Phase that was timed
+ * @param started  Monotonic time at start of the phase [ms]
+ */
+void
+latency_record(const char *mode, latency_phase_t phase, int64_t started)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int64_t elapsed = common_get_monotonic_ms() - started;
+
+    if( !mode || phase < 0 || phase >= LATENCY_PHASE_NUMOF )
+        goto EXIT;
+
+    log_debug("latency: %s/%s = %lld ms", mode, latency_phase_name[phase],
+              (long long)elapsed);
+
+    pthread_mutex_lock(&latency_mutex);
+
+    if( !latency_modes )
+        latency_modes = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, g_free);
+
+    latency_mode_t *stats = g_hash_table_lookup(latency_modes, mode);
+    if( !stats ) {
+        stats = g_malloc0(sizeof *stats);
+        g_hash_table_replace(latency_modes, g_strdup(mode), stats);
+    }
+
+    latency_histogram_t *hist = &stats->phase[phase];
+    hist->count += 1;
+    hist->sum   += elapsed;
+    if( hist->max < elapsed )
+        hist->max = elapsed;
+    hist->bucket[latency_bucket(elapsed)] += 1;
+
+    pthread_mutex_unlock(&latency_mutex);
+
+EXIT:
+    return;
+}
+
+/** Get latency statistics
+ *
+ * One line per mode and phase that has samples:
+ *
+ *   "mode/phase: n=count avg=ms max=ms <=10=count ... >5000=count"
+ *
+ * @return statistics string; caller must release with g_free()
+ */
+gchar *
+latency_get_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *buff = g_string_new(0);
+
+    pthread_mutex_lock(&latency_mutex);
+
+    if( latency_modes ) {
+        GList *keys = g_hash_table_get_keys(latency_modes);
+        keys = g_list_sort(keys, (GCompareFunc)strcmp);
+        for( GList *iter = keys; iter; iter = iter->next ) {
+            const char *mode = iter->data;
+            const latency_mode_t *stats = g_hash_table_lookup(latency_modes,
+                                                              mode);
+            for( int phase = 0; phase < LATENCY_PHASE_NUMOF; ++phase ) {
+                const latency_histogram_t *hist = &stats->phase[phase];
+                if( !hist->count )
+                    continue;
+                g_string_append_printf(buff, "%s/%s: n=%u avg=%lld max=%lld",
+                                       mode, latency_phase_name[phase],
+                                       hist->count,
+                                       (long long)(hist->sum / hist->count),
+                                       (long long)hist->max);
+                for( unsigned i = 0; i < LATENCY_BUCKETS - 1; ++i )
+                    g_string_append_printf(buff, " <=%u=%u",
+                                           latency_bucket_limit[i],
+                                           hist->bucket[i]);
+                g_string_append_printf(buff, " >%u=%u\n",
+                                       latency_bucket_limit[LATENCY_BUCKETS - 2],
+                                       hist->bucket[LATENCY_BUCKETS - 1]);
+            }
+        }
+        g_list_free(keys);
+    }
+
+    pthread_mutex_unlock(&latency_mutex);
+
+    return g_string_free(buff, FALSE);
+}
+
+/** Reset latency statistics
+ */
+void
+latency_reset_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pthread_mutex_lock(&latency_mutex);
+    if( latency_modes )
+        g_hash_table_remove_all(latency_modes);
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+/** Release latency statistics
+ *
+ * Must be called after worker thread has been stopped.
+ */
+void
+latency_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pthread_mutex_lock(&latency_mutex);
+    if( latency_modes )
+        g_hash_table_unref(latency_modes), latency_modes = 0;
+    pthread_mutex_unlock(&latency_mutex);
+}
@@ -0,0 +1,75 @@
+/**
+ * @file usb_moded-latency.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_LATENCY_H_
+# define USB_MODED_LATENCY_H_
+
+# include <stdint.h>
+
+# include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Mode switch phases that are timed
+ */
+typedef enum latency_phase_t
+{
+    /** Stopping mtp daemon of the previous mode */
+    LATENCY_PHASE_MTPD_STOP,
+    /** Unmounting mtp device of the previous mode */
+    LATENCY_PHASE_UNMOUNT,
+    /** Kernel module change */
+    LATENCY_PHASE_MODULE,
+    /** Gadget function, product and vendor configuration */
+    LATENCY_PHASE_GADGET,
+    /** Attaching gadget to the bus */
+    LATENCY_PHASE_UDC_BIND,
+    /** Bringing up the usb network */
+    LATENCY_PHASE_NETWORK,
+    /** Pre-enum app sync */
+    LATENCY_PHASE_APPSYNC_PRE,
+    /** Post-enum app sync */
+    LATENCY_PHASE_APPSYNC_POST,
+    /** Enabling connman tethering */
+    LATENCY_PHASE_TETHERING,
+    /** Mounting mtp device and starting mtp daemon */
+    LATENCY_PHASE_MTPD_START,
+    /** Whole mode switch */
+    LATENCY_PHASE_TOTAL,
+
+    LATENCY_PHASE_NUMOF
+} latency_phase_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * LATENCY
+ * ------------------------------------------------------------------------- */
+
+void   latency_record      (const char *mode, latency_phase_t phase, int64_t started);
+gchar *latency_get_stats   (void);
+void   latency_reset_stats (void);
+void   latency_quit        (void);
+
+#endif /* USB_MODED_LATENCY_H_ */
@@ -29,23 +29,134 @@
 #include "usb_moded-log.h"
 
 #include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/syscall.h>
+
+#ifdef SYSTEMD
+/* Code location fields are filled in from log_emit() call site */
+# define SD_JOURNAL_SUPPRESS_LOCATION
+# include <systemd/sd-journal.h>
+#endif
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of records in log ring buffer, must be a power of two */
+#define LOG_RING_SIZE 256
+
+/** Maximum length of formatted log record, including prefixes */
+#define LOG_RECORD_SIZE 640
+
+/** Maximum length of usb mode name attached to journal records */
+#define LOG_MODE_SIZE 48
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Formatted log message waiting to be written out */
+typedef struct log_record_t
+{
+    /** Ring slot sequence number, see log_ring_reserve() */
+    uint32_t seq;
+
+    /** Logging type in effect when the record was made */
+    int      type;
+
+    /** Logging level */
+    int      lev;
+
+    /** Formatted message */
+    char     text[LOG_RECORD_SIZE];
+
+    /* Structured fields for LOG_TO_JOURNAL, pointers refer to
+     * static strings that outlive the record */
+
+    /** Source file name */
+    const char *file;
+
+    /** Function name */
+    const char *func;
+
+    /** Line in source file */
+    int         line;
+
+    /** Thread id of the caller */
+    int         tid;
+
+    /** Thread name of the caller, or NULL */
+    const char *thread;
+
+    /** Mode setup phase the caller was executing, or NULL */
+    const char *phase;
+
+    /** Cable state, or NULL */
+    const char *cable;
+
+    /** Active usb mode, or empty string */
+    char        mode[LOG_MODE_SIZE];
+} log_record_t;
 
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * LOG_RING
+ * ------------------------------------------------------------------------- */
+
+static void          log_ring_init    (void);
+static log_record_t *log_ring_reserve (void);
+static void          log_ring_commit  (log_record_t *rec);
+static log_record_t *log_ring_peek    (void);
+static void          log_ring_release (log_record_t *rec);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_CONTEXT
+ * ------------------------------------------------------------------------- */
+
+static void          log_context_fill   (log_record_t *rec, const char *file, const char *func, int line);
+void                 log_set_thread_name(const char *name);
+void                 log_set_phase      (const char *phase);
+const char          *log_get_phase      (void);
+void                 log_set_usb_mode   (const char *mode);
+void                 log_set_cable_state(const char *state);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_JOURNAL
+ * ------------------------------------------------------------------------- */
+
+static void          log_journal_write(const log_record_t *rec);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_THREAD
+ * ------------------------------------------------------------------------- */
+
+static void          log_thread_write (int type, int lev, const char *text);
+static void          log_thread_drain (void);
+static void         *log_thread_cb    (void *aptr);
+static void          log_thread_wakeup(void);
+bool                 log_start_thread (void);
+void                 log_stop_thread  (void);
+
 /* ------------------------------------------------------------------------- *
  * LOG
  * ------------------------------------------------------------------------- */
 
 static char *log_strip       (char *str);
 static void  log_gettime     (struct timeval *tv);
+static void  log_format      (char *buf, size_t size, const char *file, const char *func, int line, int lev, const char *fmt, va_list va);
 void         log_emit_va     (const char *file, const char *func, int line, int lev, const char *fmt, va_list va);
 void         log_emit_real   (const char *file, const char *func, int line, int lev, const char *fmt, ...);
 void         log_debugf      (const char *fmt, ...);
@@ -70,104 +181,450 @@ static int log_type  = LOG_TO_STDERR;
 static bool log_lineinfo = false;
 static struct timeval log_begtime = { 0, 0 };
 
+/** Log records, written by any thread and drained by log thread */
+static log_record_t log_ring[LOG_RING_SIZE];
+
+/** Next ring position to reserve, shared by producers */
+static uint32_t log_ring_head = 0;
+
+/** Next ring position to drain, used only by log thread */
+static uint32_t log_ring_tail = 0;
+
+/** Number of messages dropped due to full ring buffer */
+static uint32_t log_ring_dropped = 0;
+
+/** Flag for: log thread is running and accepting records */
+static bool log_thread_active = false;
+
+/** Flag for: log thread is about to block and needs a wakeup */
+static bool log_thread_sleeping = false;
+
+/** Flag for: log thread should exit after draining */
+static bool log_thread_quit = false;
+
+/** Eventfd for waking up log thread */
+static int log_thread_evfd = -1;
+
+/** Log thread id */
+static pthread_t log_thread_id;
+
+/** Name of the calling thread, for journal records */
+static __thread const char *log_context_thread = 0;
+
+/** Mode setup phase the calling thread is executing */
+static __thread const char *log_context_phase = 0;
+
+/** Cached thread id of the calling thread */
+static __thread int log_context_tid = 0;
+
+/** Lock for usb mode and cable state context */
+static pthread_mutex_t log_context_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Active usb mode, for journal records */
+static char log_context_mode[LOG_MODE_SIZE] = "";
+
+/** Cable state, for journal records */
+static const char *log_context_cable = 0;
+
 /* ========================================================================= *
- * CONTEXT STACK
+ * LOG_RING
  * ========================================================================= */
 
-#if LOG_ENABLE_CONTEXT
-typedef struct context_entry_t
+/* Bounded multi-producer, single-consumer queue.
+ *
+ * Each slot carries a sequence number. Producer that manages to
+ * advance log_ring_head from pos to pos+1 owns slot pos and publishes
+ * it by setting slot sequence to pos+1. The log thread drains slots in
+ * order and hands them back to producers by setting slot sequence to
+ * pos+LOG_RING_SIZE. No locks are taken, and producers never wait for
+ * the consumer - when the ring is full the message is dropped.
+ */
+
+static void
+log_ring_init(void)
 {
-    const char *func;
-    bool        done;
-} context_entry_t;
+    for( uint32_t i = 0; i < LOG_RING_SIZE; ++i )
+        __atomic_store_n(&log_ring[i].seq, i, __ATOMIC_RELAXED);
+    log_ring_head = 0;
+    log_ring_tail = 0;
+}
+
+/** Reserve a ring slot for writing
+ *
+ * @return slot to fill and pass to log_ring_commit(),
+ *         or NULL if the ring is full
+ */
+static log_record_t *
+log_ring_reserve(void)
+{
+    uint32_t pos = __atomic_load_n(&log_ring_head, __ATOMIC_RELAXED);
+
+    for( ;; ) {
+        log_record_t *rec  = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        uint32_t      seq  = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        int32_t       diff = (int32_t)(seq - pos);
+
+        if( diff == 0 ) {
+            if( __atomic_compare_exchange_n(&log_ring_head, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED) )
+                return rec;
+            /* pos was updated by failed compare exchange */
+        }
+        else if( diff < 0 ) {
+            __atomic_add_fetch(&log_ring_dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&log_ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/** Publish filled ring slot to the log thread
+ *
+ * @param rec  Slot obtained via log_ring_reserve()
+ */
+static void
+log_ring_commit(log_record_t *rec)
+{
+    uint32_t pos = rec->seq;
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    log_thread_wakeup();
+}
+
+/** Get the oldest published ring slot
+ *
+ * Must be called only from the log thread.
+ *
+ * @return published slot, or NULL if the ring is empty
+ */
+static log_record_t *
+log_ring_peek(void)
+{
+    log_record_t *rec = &log_ring[log_ring_tail & (LOG_RING_SIZE - 1)];
+    uint32_t      seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+    if( (int32_t)(seq - (log_ring_tail + 1)) < 0 )
+        return 0;
+
+    return rec;
+}
+
+/** Hand drained ring slot back to producers
+ *
+ * Must be called only from the log thread.
+ *
+ * @param rec  Slot obtained via log_ring_peek()
+ */
+static void
+log_ring_release(log_record_t *rec)
+{
+    __atomic_store_n(&rec->seq, log_ring_tail + LOG_RING_SIZE,
+                     __ATOMIC_RELEASE);
+    log_ring_tail += 1;
+}
+
+/* ========================================================================= *
+ * LOG_CONTEXT
+ * ========================================================================= */
+
+/** Attach structured context fields to log record
+ *
+ * @param rec   Log record
+ * @param file  Source file name
+ * @param func  Function name
+ * @param line  Line in source file
+ */
+static void
+log_context_fill(log_record_t *rec, const char *file, const char *func, int line)
+{
+    if( !log_context_tid )
+        log_context_tid = (int)syscall(SYS_gettid);
+
+    rec->file   = file;
+    rec->func   = func;
+    rec->line   = line;
+    rec->tid    = log_context_tid;
+    rec->thread = log_context_thread;
+    rec->phase  = log_context_phase;
+
+    pthread_mutex_lock(&log_context_mutex);
+    rec->cable = log_context_cable;
+    memcpy(rec->mode, log_context_mode, sizeof rec->mode);
+    pthread_mutex_unlock(&log_context_mutex);
+}
+
+/** Set name of the calling thread for journal records
+ *
+ * @param name  Static thread name string
+ */
+void
+log_set_thread_name(const char *name)
+{
+    log_context_thread = name;
+}
+
+/** Set mode setup phase the calling thread is executing
+ *
+ * @param phase  Static phase name string, or NULL when done
+ */
+void
+log_set_phase(const char *phase)
+{
+    log_context_phase = phase;
+}
+
+/** Get mode setup phase the calling thread is executing
+ *
+ * @return phase name, or NULL if not set
+ */
+const char *
+log_get_phase(void)
+{
+    return log_context_phase;
+}
+
+/** Set active usb mode for journal records
+ *
+ * @param mode  Usb mode name, or NULL
+ */
+void
+log_set_usb_mode(const char *mode)
+{
+    pthread_mutex_lock(&log_context_mutex);
+    snprintf(log_context_mode, sizeof log_context_mode, "%s", mode ?: "");
+    pthread_mutex_unlock(&log_context_mutex);
+}
+
+/** Set cable state for journal records
+ *
+ * @param state  Static cable state string, or NULL
+ */
+void
+log_set_cable_state(const char *state)
+{
+    pthread_mutex_lock(&log_context_mutex);
+    log_context_cable = state;
+    pthread_mutex_unlock(&log_context_mutex);
+}
+
+/* ========================================================================= *
+ * LOG_JOURNAL
+ * ========================================================================= */
 
-typedef struct context_stack_t
+/** Send log record to systemd journal
+ *
+ * The message is sent as is, and context is attached as separate
+ * fields so that e.g. "journalctl USB_MODE=mtp_mode" can be used for
+ * filtering. Without systemd support falls back to syslog.
+ *
+ * @param rec  Log record
+ */
+static void
+log_journal_write(const log_record_t *rec)
 {
-    context_entry_t stk[256];
-    int             sp;
-    int             id;
-} context_stack_t;
+#ifdef SYSTEMD
+    char tid[16];
+    snprintf(tid, sizeof tid, "%d", rec->tid);
+
+    sd_journal_send("MESSAGE=%s", rec->text,
+                    "PRIORITY=%d", rec->lev,
+                    "SYSLOG_IDENTIFIER=%s", log_name,
+                    "CODE_FILE=%s", rec->file ?: "",
+                    "CODE_LINE=%d", rec->line,
+                    "CODE_FUNC=%s", rec->func ?: "",
+                    "THREAD=%s", rec->thread ?: tid,
+                    "TID=%s", tid,
+                    "USB_MODE=%s", *rec->mode ? rec->mode : "undefined",
+                    "CABLE_STATE=%s", rec->cable ?: "unknown",
+                    "USB_MODED_PHASE=%s", rec->phase ?: "none",
+                    NULL);
+#else
+    syslog(rec->lev, "%s", rec->text);
+#endif
+}
 
-static int context_count = 0;
-static __thread context_stack_t *context_stack = 0;
+/* ========================================================================= *
+ * LOG_THREAD
+ * ========================================================================= */
 
-static bool log_entry = false;
-static bool log_leave = false;
+/** Write out one log record
+ *
+ * @param type  Logging type
+ * @param lev   Logging level
+ * @param text  Formatted message
+ */
+static void
+log_thread_write(int type, int lev, const char *text)
+{
+    switch( type ) {
+    case LOG_TO_SYSLOG:
+    case LOG_TO_JOURNAL:
+        syslog(lev, "%s", text);
+        break;
+    case LOG_TO_STDERR:
+        fprintf(stderr, "%s\n", text);
+        break;
+    default:
+        break;
+    }
+}
 
+/** Write out all queued log records
+ */
 static void
-context_write(int tab, const char *msg)
+log_thread_drain(void)
 {
-    int tag = 0;
-    if( context_stack ) {
-        tag = context_stack->id;
-        if( tab < 0 && context_stack->sp > 0 )
-            tab = context_stack->sp;
+    bool          written = false;
+    log_record_t *rec;
+
+    while( (rec = log_ring_peek()) ) {
+        if( rec->type == LOG_TO_JOURNAL )
+            log_journal_write(rec);
+        else
+            log_thread_write(rec->type, rec->lev, rec->text);
+        log_ring_release(rec);
+        written = true;
     }
-    tab = (tab <= 0) ? 0 : (tab * 4);
-    char *txt = 0;
-    int   len = asprintf(&txt, "T%d %*s%s\n",
-                         tag,
-                         tab, "",
-                         msg);
-    if( len > 0 ) {
-        if( write(STDERR_FILENO, txt, len) == - 1 ) {
-            // this is debug logging - do not really care
+
+    uint32_t dropped = __atomic_exchange_n(&log_ring_dropped, 0,
+                                           __ATOMIC_RELAXED);
+    if( dropped ) {
+        char text[64];
+        snprintf(text, sizeof text, "%s: W: %u log messages dropped",
+                 log_name, (unsigned)dropped);
+        log_thread_write(log_type, LOG_WARNING, text);
+        written = true;
+    }
+
+    /* One flush per batch instead of one per message */
+    if( written )
+        fflush(stderr);
+}
+
+/** Log thread entry point
+ *
+ * @param aptr  (unused)
+ *
+ * @return NULL
+ */
+static void *
+log_thread_cb(void *aptr)
+{
+    (void)aptr;
+
+    for( ;; ) {
+        log_thread_drain();
+
+        if( __atomic_load_n(&log_thread_quit, __ATOMIC_ACQUIRE) )
+            break;
+
+        /* Announce intent to sleep, then check once more so that
+         * records committed in between are not left waiting */
+        __atomic_store_n(&log_thread_sleeping, true, __ATOMIC_SEQ_CST);
+        if( log_ring_peek() ) {
+            __atomic_store_n(&log_thread_sleeping, false, __ATOMIC_SEQ_CST);
+            continue;
         }
-        free(txt);
+
+        uint64_t cnt = 0;
+        if( read(log_thread_evfd, &cnt, sizeof cnt) == -1 && errno != EINTR )
+            break;
     }
+
+    log_thread_drain();
+    return 0;
 }
 
+/** Wake up log thread if it is sleeping
+ *
+ * Costs a syscall only for the first record after the log thread
+ * has gone idle.
+ */
 static void
-context_flush(void)
+log_thread_wakeup(void)
 {
-    for( int i = 0; i < context_stack->sp; ++i ) {
-        char msg[256];
-        if( context_stack->stk[i].done )
-            continue;
-        context_stack->stk[i].done = true;
-        if( log_leave )
-            snprintf(msg, sizeof msg, "%s() { ...",
-                     context_stack->stk[i].func);
-        else
-            snprintf(msg, sizeof msg, "%s()",
-                     context_stack->stk[i].func);
-        context_write(i, msg);
+    if( !__atomic_exchange_n(&log_thread_sleeping, false, __ATOMIC_SEQ_CST) )
+        return;
+
+    uint64_t cnt = 1;
+    if( write(log_thread_evfd, &cnt, sizeof cnt) == -1 ) {
+        // nothing sensible can be done about it
     }
 }
 
-const char *
-context_enter(const char *func)
+/** Start writing log messages asynchronously
+ *
+ * After this, formatted messages are queued in a lock-free ring
+ * buffer and written out by a dedicated thread, so that callers do
+ * not block on log output. If the ring buffer fills up, messages are
+ * dropped and a count of dropped messages is logged later on.
+ *
+ * The queue is drained at exit via log_stop_thread().
+ *
+ * @return true if log thread is running, false otherwise
+ */
+bool
+log_start_thread(void)
 {
-    if( !context_stack ) {
-        context_stack = calloc(1, sizeof *context_stack);
-        context_stack->id = ++context_count;
+    sigset_t all, old;
+
+    if( log_thread_active )
+        goto EXIT;
+
+    if( (log_thread_evfd = eventfd(0, EFD_CLOEXEC)) == -1 ) {
+        log_warning("failed to create log eventfd: %m");
+        goto EXIT;
     }
 
-    context_stack->stk[context_stack->sp].func = func;
-    context_stack->stk[context_stack->sp].done = false;
-    context_stack->sp += 1;
+    log_ring_init();
+    log_thread_quit     = false;
+    log_thread_sleeping = false;
+
+    /* Log thread must not handle any signals */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&log_thread_id, 0, log_thread_cb, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
 
-    if( log_entry )
-        context_flush();
+    if( err ) {
+        log_warning("failed to start log thread: %s", strerror(err));
+        close(log_thread_evfd), log_thread_evfd = -1;
+        goto EXIT;
+    }
 
-    return func;
+    __atomic_store_n(&log_thread_active, true, __ATOMIC_RELEASE);
+    atexit(log_stop_thread);
+
+EXIT:
+    return log_thread_active;
 }
 
+/** Stop log thread after writing out all queued messages
+ *
+ * Logging continues synchronously afterwards.
+ */
 void
-context_leave(void *aptr)
+log_stop_thread(void)
 {
-    const char *func = *(const char **)aptr;
-    assert( context_stack->sp > 0 );
-    context_stack->sp -= 1;
+    if( !log_thread_active )
+        goto EXIT;
+
+    __atomic_store_n(&log_thread_active, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_thread_quit, true, __ATOMIC_RELEASE);
 
-    if( log_leave && context_stack->stk[context_stack->sp].done ) {
-        char msg[256];
-        snprintf(msg, sizeof msg, "} %s()", func);
-        context_write(-1, msg);
+    uint64_t cnt = 1;
+    if( write(log_thread_evfd, &cnt, sizeof cnt) == -1 ) {
+        // nothing sensible can be done about it
     }
-    assert( context_stack->stk[context_stack->sp].func == func );
+
+    pthread_join(log_thread_id, 0);
+    close(log_thread_evfd), log_thread_evfd = -1;
+
+EXIT:
+    return;
 }
-#endif
 
 /* ========================================================================= *
  * Functions
@@ -197,8 +654,10 @@ static void log_gettime(struct timeval *tv)
     timersub(tv, &log_begtime, tv);
 }
 
-/** Print the logged messages to the selected output
+/** Format log message for stderr output
  *
+ * @param buf   Buffer to format to
+ * @param size  Size of the buffer
  * @param file  Source file name
  * @param func  Function name
  * @param line  Line in source file
@@ -206,78 +665,126 @@ static void log_gettime(struct timeval *tv)
  * @param fmt   The message format string
  * @param va    Arguments for the format string
  */
-void log_emit_va(const char *file, const char *func, int line, int lev, const char *fmt, va_list va)
+static void log_format(char *buf, size_t size, const char *file, const char *func, int line, int lev, const char *fmt, va_list va)
 {
     int saved = errno;
     char lineinfo[128] = "";
     char timeinfo[32] = "";
     char levelinfo[8] = "";
+
+    if( log_get_lineinfo() ) {
+        /* Use gcc error like prefix for logging so
+         * that logs can be analyzed with jump to
+         * line parsing  available in editors. */
+        snprintf(lineinfo, sizeof lineinfo,
+                 "%s:%d: %s(): ", file, line, func);
+    }
+    else {
+        snprintf(lineinfo, sizeof lineinfo,
+                 "%s: ", log_get_name());
+    }
+
+#if LOG_ENABLE_TIMESTAMPS
+    {
+        struct timeval tv;
+        log_gettime(&tv);
+        snprintf(timeinfo, sizeof timeinfo,
+                 "%3ld.%03ld ",
+                (long)tv.tv_sec,
+                (long)tv.tv_usec/1000);
+    }
+#endif
+
+#if LOG_ENABLE_LEVELTAGS
+    {
+        const char *tag = "U:";
+        switch( lev )
+        {
+        case LOG_CRIT:    tag = "C:"; break;
+        case LOG_ERR:     tag = "E:"; break;
+        case LOG_WARNING: tag = "W:"; break;
+        case LOG_NOTICE:  tag = "N:"; break;
+        case LOG_INFO:    tag = "I:"; break;
+        case LOG_DEBUG:   tag = "D:"; break;
+        }
+        snprintf(levelinfo, sizeof levelinfo,
+                 "%s ", tag);
+    }
+#endif
+
+    int len = snprintf(buf, size, "%s%s%s", lineinfo, timeinfo, levelinfo);
+    if( len < 0 || (size_t)len >= size )
+        len = 0;
+
+    // squeeze whitespace like syslog does
+    errno = saved;
+    vsnprintf(buf + len, size - len, fmt, va);
+    log_strip(buf + len);
+}
+
+/** Print the logged messages to the selected output
+ *
+ * When log thread is running, the message is formatted directly into
+ * the log ring buffer and written out asynchronously.
+ *
+ * @param file  Source file name
+ * @param func  Function name
+ * @param line  Line in source file
+ * @param lev   The wanted log level
+ * @param fmt   The message format string
+ * @param va    Arguments for the format string
+ */
+void log_emit_va(const char *file, const char *func, int line, int lev, const char *fmt, va_list va)
+{
+    int saved = errno;
     if( log_p(lev) )
     {
-        switch( log_type )
+        int type = log_type;
+
+        if( __atomic_load_n(&log_thread_active, __ATOMIC_ACQUIRE) &&
+            (type == LOG_TO_SYSLOG || type == LOG_TO_STDERR ||
+             type == LOG_TO_JOURNAL) ) {
+            log_record_t *rec = log_ring_reserve();
+            if( rec ) {
+                rec->type = type;
+                rec->lev  = lev;
+                if( type == LOG_TO_JOURNAL )
+                    log_context_fill(rec, file, func, line);
+                errno = saved;
+                if( type != LOG_TO_STDERR )
+                    vsnprintf(rec->text, sizeof rec->text, fmt, va);
+                else
+                    log_format(rec->text, sizeof rec->text,
+                               file, func, line, lev, fmt, va);
+                log_ring_commit(rec);
+            }
+            goto EXIT;
+        }
+
+        switch( type )
         {
         case LOG_TO_SYSLOG:
 
+            errno = saved;
             vsyslog(lev, fmt, va);
             break;
 
-        case LOG_TO_STDERR:
-
-            if( log_get_lineinfo() ) {
-                /* Use gcc error like prefix for logging so
-                 * that logs can be analyzed with jump to
-                 * line parsing  available in editors. */
-                snprintf(lineinfo, sizeof lineinfo,
-                         "%s:%d: %s(): ", file, line, func);
-            }
-            else {
-                snprintf(lineinfo, sizeof lineinfo,
-                         "%s: ", log_get_name());
-            }
-
-#if LOG_ENABLE_TIMESTAMPS
+        case LOG_TO_JOURNAL:
             {
-                struct timeval tv;
-                log_gettime(&tv);
-                snprintf(timeinfo, sizeof timeinfo,
-                         "%3ld.%03ld ",
-                        (long)tv.tv_sec,
-                        (long)tv.tv_usec/1000);
+                log_record_t rec = { .type = type, .lev = lev };
+                log_context_fill(&rec, file, func, line);
+                errno = saved;
+                vsnprintf(rec.text, sizeof rec.text, fmt, va);
+                log_journal_write(&rec);
             }
-#endif
+            break;
 
-#if LOG_ENABLE_LEVELTAGS
-            {
-                static const char *tag = "U:";
-                switch( lev )
-                {
-                case LOG_CRIT:    tag = "C:"; break;
-                case LOG_ERR:     tag = "E:"; break;
-                case LOG_WARNING: tag = "W:"; break;
-                case LOG_NOTICE:  tag = "N:"; break;
-                case LOG_INFO:    tag = "I:"; break;
-                case LOG_DEBUG:   tag = "D:"; break;
-                }
-                snprintf(levelinfo, sizeof levelinfo,
-                         "%s ", tag);
-            }
-#endif
+        case LOG_TO_STDERR:
             {
-                // squeeze whitespace like syslog does
-                char msg[512];
+                char buf[LOG_RECORD_SIZE];
                 errno = saved;
-                vsnprintf(msg, sizeof msg, fmt, va);
-                log_strip(msg);
-#if LOG_ENABLE_CONTEXT
-                char buf[1024];
-                snprintf(buf, sizeof buf, "%s%s%s%s",
-                         lineinfo, timeinfo, levelinfo, msg);
-                context_flush();
-                context_write(-1, buf);
-#else
-                fprintf(stderr, "%s%s%s%s\n",
-                        lineinfo, timeinfo, levelinfo, msg);
-#endif
+                log_format(buf, sizeof buf, file, func, line, lev, fmt, va);
+                fprintf(stderr, "%s\n", buf);
             }
             fflush(stderr);
             break;
@@ -287,6 +794,7 @@ void log_emit_va(const char *file, const char *func, int line, int lev, const ch
             break;
         }
     }
+EXIT:
     errno = saved;
 }
 
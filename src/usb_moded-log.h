@@ -30,6 +30,8 @@
 # include <stdarg.h>
 # include <syslog.h>
 
+# include "usb_moded-trace.h"
+
 /* Logging functionality */
 
 /* ========================================================================= *
@@ -39,12 +41,12 @@
 # define LOG_ENABLE_DEBUG      01
 # define LOG_ENABLE_TIMESTAMPS 01
 # define LOG_ENABLE_LEVELTAGS  01
-# define LOG_ENABLE_CONTEXT    0
 
 enum
 {
     LOG_TO_STDERR, // log to stderr
     LOG_TO_SYSLOG, // log to syslog
+    LOG_TO_JOURNAL, // log to systemd journal with structured fields
 };
 
 enum
@@ -54,20 +56,11 @@ enum
 };
 
 /* ========================================================================= *
- * CONTEXT STACK
+ * CONTEXT TRACING
  * ========================================================================= */
 
-# if LOG_ENABLE_CONTEXT
-const char *context_enter(const char *func);
-void        context_leave(void *aptr);
-
-#  define LOG_REGISTER_CONTEXT\
-     __attribute__((cleanup(context_leave))) const char *qqq =\
-         context_enter(__func__)
-#else
-# define LOG_REGISTER_CONTEXT\
-     do{}while(0)
-#endif
+/* Every function registers itself as a trace point, see usb_moded-trace.h */
+# define LOG_REGISTER_CONTEXT TRACE_FUNCTION
 
 /* ========================================================================= *
  * Prototypes
@@ -90,6 +83,18 @@ void        log_set_name    (const char *name);
 void        log_set_lineinfo(bool lineinfo);
 bool        log_get_lineinfo(void);
 void        log_init        (void);
+bool        log_start_thread(void);
+void        log_stop_thread (void);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_CONTEXT
+ * ------------------------------------------------------------------------- */
+
+void        log_set_thread_name(const char *name);
+void        log_set_phase      (const char *phase);
+const char *log_get_phase      (void);
+void        log_set_usb_mode   (const char *mode);
+void        log_set_cable_state(const char *state);
 
 /* ========================================================================= *
  * Macros
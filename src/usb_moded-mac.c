@@ -24,6 +24,7 @@
 
 #include "usb_moded-mac.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-log.h"
 
 #include <stdio.h>
@@ -77,7 +78,7 @@ void mac_generate_random_mac (void)
     log_debug("Getting random usb ethernet mac\n");
     mac_random_ether_addr(addr);
 
-    g_ether = fopen("/etc/modprobe.d/g_ether.conf", "w");
+    g_ether = fopen(common_root_path("/etc/modprobe.d/g_ether.conf"), "w");
     if(!g_ether)
     {
         log_warning("Failed to write mac address to /etc/modprobe.d/g_ether.conf\n");
@@ -102,7 +103,7 @@ char * mac_read_mac(void)
     size_t read = 0;
     int test = 0;
 
-    g_ether = fopen("/etc/modprobe.d/g_ether.conf", "r");
+    g_ether = fopen(common_root_path("/etc/modprobe.d/g_ether.conf"), "r");
     if(!g_ether)
     {
         log_warning("Failed to read mac address from /etc/modprobe.d/g_ether.conf\n");
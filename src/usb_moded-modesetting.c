@@ -37,11 +37,12 @@
 #include "usb_moded-appsync.h"
 #include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
-#include "usb_moded-configfs.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-gadget.h"
+#include "usb_moded-latency.h"
 #include "usb_moded-log.h"
-#include "usb_moded-modules.h"
 #include "usb_moded-network.h"
+#include "usb_moded-taskgraph.h"
 #include "usb_moded-worker.h"
 
 #include <unistd.h>
@@ -66,6 +67,35 @@ typedef struct storage_info_t
     gchar *si_mountdevice;;
 } storage_info_t;
 
+/** Dynamic mode setup steps
+ *
+ * Used as indexes to the task graph executed by
+ * modesetting_enter_dynamic_mode().
+ */
+typedef enum setup_step_t
+{
+    SETUP_STEP_PRE_APPSYNC,
+    SETUP_STEP_GADGET,
+    SETUP_STEP_NETWORK,
+    SETUP_STEP_CONNECTION,
+    SETUP_STEP_UDHCPD,
+    SETUP_STEP_POST_APPSYNC,
+    SETUP_STEP_TETHERING,
+
+    SETUP_STEP_NUMOF
+} setup_step_t;
+
+/** State shared between dynamic mode setup steps
+ */
+typedef struct setup_context_t
+{
+    /** Mode being activated */
+    const modedata_t *data;
+
+    /** Connection details for nat, from connection step to udhcpd step */
+    ipforward_data_t *ipforward;
+} setup_context_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -88,8 +118,17 @@ static storage_info_t *modesetting_get_storage_info           (size_t *pcount);
 static bool            modesetting_enter_mass_storage_mode    (const modedata_t *data);
 static int             modesetting_leave_mass_storage_mode    (const modedata_t *data);
 static void            modesetting_report_mass_storage_blocker(const char *mountpoint, int try);
+static bool            modesetting_setup_pre_appsync          (void *aptr);
+static bool            modesetting_setup_gadget               (void *aptr);
+static bool            modesetting_setup_network              (void *aptr);
+static bool            modesetting_setup_connection           (void *aptr);
+static bool            modesetting_setup_udhcpd               (void *aptr);
+static bool            modesetting_setup_post_appsync         (void *aptr);
+static bool            modesetting_setup_tethering            (void *aptr);
 bool                   modesetting_enter_dynamic_mode         (void);
 void                   modesetting_leave_dynamic_mode         (void);
+bool                   modesetting_suspend_dynamic_mode       (void);
+bool                   modesetting_resume_dynamic_mode        (void);
 void                   modesetting_init                       (void);
 void                   modesetting_quit                       (void);
 
@@ -246,7 +285,7 @@ int modesetting_write_to_file_real(const char *file, int line, const char *func,
      * - Ignore resulting write error under default logging level
      * - Assume reading from sysfs will result in empty string
      */
-    if( !strcmp(path, ANDROID0_FUNCTIONS) ) {
+    if( !strcmp(path, common_root_path(ANDROID0_FUNCTIONS)) ) {
         if( !strcmp(text, "") || !strcmp(text, "none") ) {
             text = "none";
             clear = true;
@@ -440,8 +479,7 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
     size_t          count = 0;
     storage_info_t *info  = 0;
     int             nofua = 0;
-
-    char tmp[256];
+    bool           *added = 0;
 
     /* Get mountpoint info */
     if( !(info = modesetting_get_storage_info(&count)) )
@@ -454,9 +492,10 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
     nofua = config_find_sync();
 
     /* Android usb mass-storage is expected to support only onle lun */
-    if( android_in_use()&& count > 1 ) {
+    int max_luns = gadget_max_luns();
+    if( max_luns > 0 && count > (size_t)max_luns ) {
         log_warning("ignoring excess mountpoints");
-        count = 1;
+        count = max_luns;
     }
 
     /* Umount filesystems */
@@ -465,6 +504,13 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
         const gchar *mountpnt = info[i].si_mountpoint;
         for( int tries = 0; ; ) {
 
+            /* Canceled commands fail - do not mistake that as
+             * mountpoint being unmounted */
+            if( worker_bailing_out() ) {
+                log_warning("unmounting %s canceled", mountpnt);
+                goto EXIT;
+            }
+
             if( !modesetting_is_mounted(mountpnt) ) {
                 log_debug("%s is not mounted", mountpnt);
                 break;
@@ -484,78 +530,58 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
 
             log_warning("failed to unmount %s - wait a bit", mountpnt);
             modesetting_report_mass_storage_blocker(mountpnt, 1);
-            common_sleep(1);
+            if( !common_sleep(1) ) {
+                log_warning("unmounting %s canceled", mountpnt);
+                goto EXIT;
+            }
         }
     }
 
     /* Backend specific actions */
-    if( android_in_use() ) {
-        const gchar *mountdev = info[0].si_mountdevice;
-        android_set_enabled(false);
-        android_set_function("mass_storage");
-        android_set_attr("f_mass_storage", "lun/nofua", nofua ? "1" : "0");
-        android_set_attr("f_mass_storage", "lun/file", mountdev);
-        android_set_enabled(true);
-    }
-    else if( configfs_in_use() ) {
-        configfs_set_udc(false);
-        configfs_set_function(0);
-
-        for( size_t i = 0 ; i < count; ++i ) {
-            const gchar *mountdev = info[i].si_mountdevice;
-            if( configfs_add_mass_storage_lun(i) ) {
-                configfs_set_mass_storage_attr(i, "cdrom", "0");
-                configfs_set_mass_storage_attr(i, "nofua", nofua ? "1" : "0");
-                configfs_set_mass_storage_attr(i, "removable", "1");
-                configfs_set_mass_storage_attr(i, "ro", "0");
-                configfs_set_mass_storage_attr(i, "file", mountdev);
-            }
-        }
-        configfs_set_function("mass_storage");
-        configfs_set_udc(true);
+    if( !gadget_in_use() ) {
+        log_err("no suitable backend for mass-storage mode");
+        goto EXIT;
     }
-    else if( modules_in_use() ) {
-        /* check if the file storage module has been loaded with sufficient luns in the parameter,
-         * if not, unload and reload or load it. Since  mountpoints start at 0 the amount of them is one more than their id */
 
-        snprintf(tmp, sizeof tmp,
-                 "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/file",
-                 count - 1);
-
-        if( access(tmp, R_OK) == -1 )
-        {
-            log_debug("%s does not exist, unloading and reloading mass_storage\n", tmp);
-            modules_unload_module(MODULE_MASS_STORAGE);
-            snprintf(tmp, sizeof tmp, "modprobe %s luns=%zd", MODULE_MASS_STORAGE, count);
-            log_debug("usb-load command = %s", tmp);
-            if( common_system(tmp) != 0 )
-                goto EXIT;
-        }
+    if( !worker_finish_kernel_module() )
+        goto EXIT;
 
-        /* activate mounts after sleeping 1s to be sure enumeration happened and autoplay will work in windows*/
-        common_sleep(1);
+    gadget_set_udc(false);
+    gadget_set_functions(0);
 
-        for( size_t i = 0 ; i < count; ++i ) {
-            const gchar *mountdev = info[i].si_mountdevice;
+    /* Luns are added in descending order so that backends which
+     * need to know the lun count up front can set up all of them
+     * in one go. */
+    added = g_new0(bool, count);
+    for( size_t i = count; i-- > 0; )
+        added[i] = gadget_add_lun(i);
 
-            snprintf(tmp, sizeof tmp, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/nofua", i);
-            write_to_file(tmp, nofua ? "1" : "0");
-
-            snprintf(tmp, sizeof tmp, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/file", i);
-            write_to_file(tmp, mountdev);
-            log_debug("usb lun = %s active\n", mountdev);
-        }
-    }
-    else {
-        log_err("no suitable backend for mass-storage mode");
+    if( !added[0] ) {
+        log_err("failed to set up mass-storage luns");
         goto EXIT;
     }
 
+    for( size_t i = 0 ; i < count; ++i ) {
+        const gchar *mountdev = info[i].si_mountdevice;
+        if( !added[i] )
+            continue;
+        gadget_set_lun_attr(i, "cdrom", "0");
+        gadget_set_lun_attr(i, "nofua", nofua ? "1" : "0");
+        gadget_set_lun_attr(i, "removable", "1");
+        gadget_set_lun_attr(i, "ro", "0");
+        gadget_set_lun_attr(i, "file", mountdev);
+        log_debug("usb lun = %s active\n", mountdev);
+    }
+
+    gadget_set_functions("mass_storage");
+    gadget_set_udc(true);
+
     /* Success */
     ack = true;
 
 EXIT:
 
+    g_free(added);
     modesetting_free_storage_info(info);
 
     if( ack ) {
@@ -588,34 +614,22 @@ static int modesetting_leave_mass_storage_mode(const modedata_t *data)
         goto EXIT;
 
     /* Backend specific actions */
-    if( android_in_use() ) {
-        log_debug("Disable android mass storage\n");
-        android_set_enabled(false);
-        android_set_attr("f_mass_storage", "lun/file", "");
-    }
-    else if( configfs_in_use() ) {
-        log_debug("Disable configfs mass storage\n");
-        configfs_set_udc(false);
-        configfs_set_function(0);
+    if( gadget_in_use() ) {
+        log_debug("Disable %s mass storage\n", gadget_name());
+        gadget_set_udc(false);
+        gadget_set_functions(0);
 
         // reset lun0, remove the rest altogether
         for( size_t i = 0 ; i < count; ++i ) {
             // reset
-            configfs_set_mass_storage_attr(i, "cdrom", "0");
-            configfs_set_mass_storage_attr(i, "nofua", "0");
-            configfs_set_mass_storage_attr(i, "removable", "1");
-            configfs_set_mass_storage_attr(i, "ro", "0");
-            configfs_set_mass_storage_attr(i, "file", "");
+            gadget_set_lun_attr(i, "cdrom", "0");
+            gadget_set_lun_attr(i, "nofua", "0");
+            gadget_set_lun_attr(i, "removable", "1");
+            gadget_set_lun_attr(i, "ro", "0");
+            gadget_set_lun_attr(i, "file", "");
             // remove
             if( i > 0 )
-                configfs_remove_mass_storage_lun(i);
-        }
-    }
-    else if( modules_in_use() ) {
-        for( size_t i = 0 ; i < count; ++i ) {
-            snprintf(tmp, sizeof tmp, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/file", i);
-            write_to_file(tmp, "");
-            log_debug("usb lun = %s inactive\n", tmp);
+                gadget_remove_lun(i);
         }
     }
     else {
@@ -695,7 +709,7 @@ static void modesetting_report_mass_storage_blocker(const char *mountpoint, int
             }
             count++;
         }
-        pclose(stream);
+        common_pclose(stream);
         free(text);
     }
     g_free(lsof_command);
@@ -704,6 +718,222 @@ static void modesetting_report_mass_storage_blocker(const char *mountpoint, int
 
 }
 
+/** Start pre-enum app sync
+ *
+ * @param aptr  Setup context
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_setup_pre_appsync(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+
+#ifdef APP_SYNC
+    const setup_context_t *context = aptr;
+    const modedata_t      *data    = context->data;
+    int64_t                started = common_get_monotonic_ms();
+
+    log_debug("Dynamic mode is appsync: do pre actions");
+    if( appsync_activate_sync(data->mode_name) != 0 ) {
+        log_debug("Appsync failure");
+        ack = false;
+    }
+    latency_record(data->mode_name, LATENCY_PHASE_APPSYNC_PRE, started);
+#else
+    (void)aptr;
+#endif
+
+    return ack;
+}
+
+/** Configure gadget and attach it to the bus
+ *
+ * Only sysfs writes are made, so this can be run in a helper thread.
+ *
+ * @param aptr  Setup context
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_setup_gadget(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const setup_context_t *context = aptr;
+    const modedata_t      *data    = context->data;
+    bool                   ack     = false;
+    int64_t                started = common_get_monotonic_ms();
+
+    if( !gadget_in_use() ) {
+        log_crit("no backend is selected, can't set dynamic mode");
+        goto EXIT;
+    }
+
+    /* Module insertion was started by the worker before setup
+     * steps were launched, wait for it to finish. */
+    if( !worker_finish_kernel_module() )
+        goto EXIT;
+
+    gadget_set_functions(data->sysfs_value);
+    char *id = config_get_android_vendor_id();
+    gadget_set_ids(data->idProduct, data->idVendorOverride ?: id);
+    free(id);
+    if( gadget_extra_sysfs() ) {
+        write_to_file(data->android_extra_sysfs_path, data->android_extra_sysfs_value);
+        write_to_file(data->android_extra_sysfs_path2, data->android_extra_sysfs_value2);
+    }
+    latency_record(data->mode_name, LATENCY_PHASE_GADGET, started);
+
+    started = common_get_monotonic_ms();
+    if( !gadget_set_udc(true) )
+        goto EXIT;
+    latency_record(data->mode_name, LATENCY_PHASE_UDC_BIND, started);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Bring up the usb network interface
+ *
+ * Only external commands are executed, so this can be run in a
+ * helper thread.
+ *
+ * @param aptr  Setup context
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_setup_network(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const setup_context_t *context = aptr;
+    const modedata_t      *data    = context->data;
+    bool                   ack     = false;
+    int64_t                started = common_get_monotonic_ms();
+
+    /* functionality should be enabled, so we can enable the network now */
+    log_debug("Dynamic mode is network");
+#ifdef DEBIAN
+    char command[256];
+
+    g_snprintf(command, sizeof command, "ifdown %s ; ifup %s", data->network_interface, data->network_interface);
+    common_system(command);
+#else
+    network_down(data);
+    int error = network_up(data);
+
+    /* In case of failure, retry upto 3 times */
+    for( int i = 0; error && i < 3; ++i ) {
+        log_warning("Retry setting up the network");
+        if( !common_msleep(1000) )
+            break;
+        if( !(error = network_up(data)) )
+            log_warning("Setting up the network succeeded");
+    }
+    if( error ) {
+        log_err("Setting up the network failed");
+        goto EXIT;
+    }
+#endif /* DEBIAN */
+
+    latency_record(data->mode_name, LATENCY_PHASE_NETWORK, started);
+    ack = true;
+
+#ifndef DEBIAN
+EXIT:
+#endif
+    return ack;
+}
+
+/** Look up the connection to share via nat
+ *
+ * Makes D-Bus queries, so this must be run in the worker thread.
+ *
+ * @param aptr  Setup context
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_setup_connection(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    setup_context_t *context = aptr;
+
+    return network_get_connection_data(context->data,
+                                       &context->ipforward) == 0;
+}
+
+/** Write udhcpd config and enable ip forwarding as needed
+ *
+ * @param aptr  Setup context
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_setup_udhcpd(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const setup_context_t *context = aptr;
+
+    /* Needs to be done before application post synching so
+     * that the dhcp server has the right config */
+    return network_apply_udhcpd_config(context->data,
+                                       context->ipforward) == 0;
+}
+
+/** Start post-enum app sync
+ *
+ * @param aptr  Setup context
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_setup_post_appsync(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const setup_context_t *context = aptr;
+    const modedata_t      *data    = context->data;
+    int64_t                started = common_get_monotonic_ms();
+
+    log_debug("Dynamic mode is appsync: do post actions");
+    /* Units are started in dependency order and waited for until
+     * systemd reports them active, instead of a fixed settle delay */
+    appsync_activate_sync_post(data->mode_name);
+    latency_record(data->mode_name, LATENCY_PHASE_APPSYNC_POST, started);
+    return true;
+}
+
+/** Start tethering
+ *
+ * @param aptr  Setup context
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_setup_tethering(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+
+#ifdef CONNMAN
+    const setup_context_t *context = aptr;
+    const modedata_t      *data    = context->data;
+    int64_t                started = common_get_monotonic_ms();
+
+    log_debug("Dynamic mode is tethering");
+    if( !connman_set_tethering(data->connman_tethering, true) )
+        ack = false;
+    latency_record(data->mode_name, LATENCY_PHASE_TETHERING, started);
+#else
+    (void)aptr;
+#endif
+
+    return ack;
+}
+
 bool modesetting_enter_dynamic_mode(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -745,123 +975,101 @@ bool modesetting_enter_dynamic_mode(void)
     }
 
     /* - - - - - - - - - - - - - - - - - - - *
-     * Start pre-enum app sync
-     * - - - - - - - - - - - - - - - - - - - */
-
-#ifdef APP_SYNC
-    if( data->appsync ) {
-        log_debug("Dynamic mode is appsync: do pre actions");
-        if( appsync_activate_sync(data->mode_name) != 0 ) {
-            log_debug("Appsync failure");
-            goto EXIT;
-        }
-    }
-#endif
-
-    /* - - - - - - - - - - - - - - - - - - - *
-     * Configure gadget
-     * - - - - - - - - - - - - - - - - - - - */
-
-    if( configfs_in_use() ) {
-        /* Configfs based gadget configuration */
-        configfs_set_function(data->sysfs_value);
-        configfs_set_productid(data->idProduct);
-        char *id = config_get_android_vendor_id();
-        configfs_set_vendorid(data->idVendorOverride ?: id);
-        free(id);
-        if( !configfs_set_udc(true) )
-            goto EXIT;
-    }
-    else if( android_in_use() ) {
-        /* Android USB based gadget configuration */
-        android_set_function(data->sysfs_value);
-        android_set_productid(data->idProduct);
-        char *id = config_get_android_vendor_id();
-        android_set_vendorid(data->idVendorOverride ?: id);
-        free(id);
-        write_to_file(data->android_extra_sysfs_path, data->android_extra_sysfs_value);
-        write_to_file(data->android_extra_sysfs_path2, data->android_extra_sysfs_value2);
-        if( !android_set_enabled(true) )
-            goto EXIT;
-    }
-    else if( modules_in_use() ) {
-        /* Assume relevant module has already been successfully loaded
-         * from somewhere else.
-         */
-        // nop
-    }
-    else {
-        log_crit("no backend is selected, can't set dynamic mode");
-        goto EXIT;
-    }
-
-    /* - - - - - - - - - - - - - - - - - - - *
-     * Setup network
+     * Execute setup steps
      * - - - - - - - - - - - - - - - - - - - */
 
-    /* functionality should be enabled, so we can enable the network now */
-    if(data->network)
-    {
-        log_debug("Dynamic mode is network");
-#ifdef DEBIAN
-        char command[256];
-
-        g_snprintf(command, sizeof command, "ifdown %s ; ifup %s", data->network_interface, data->network_interface);
-        common_system(command);
+    /* Ordering constraints:
+     * - pre-enum appsync before gadget is exposed to the host
+     * - network interface exists only after gadget is configured
+     * - udhcpd config and ip forwarding refer to the network
+     *   interface in sysfs, i.e. need gadget and network setup
+     * - udhcpd config must be in place before post-enum appsync
+     *   starts the dhcp server
+     * - tethering is enabled only after everything else is done
+     *
+     * Disabled steps count as finished, so indirect dependencies are
+     * listed explicitly. Only the connection lookup does not depend
+     * on the gadget and can proceed while the gadget is being
+     * configured in a helper thread.
+     */
+    const taskgraph_task_t steps[SETUP_STEP_NUMOF] = {
+        [SETUP_STEP_PRE_APPSYNC] = {
+            .name    = "pre-appsync",
+            .fn      = modesetting_setup_pre_appsync,
+            .after   = 0,
+            .run_on  = TASKGRAPH_RUN_ON_CALLER,
+            .enabled = data->appsync,
+        },
+        [SETUP_STEP_GADGET] = {
+            .name    = "gadget",
+            .fn      = modesetting_setup_gadget,
+            .after   = TASKGRAPH_DEP(SETUP_STEP_PRE_APPSYNC),
+            .run_on  = TASKGRAPH_RUN_ON_HELPER,
+            .enabled = true,
+        },
+        [SETUP_STEP_NETWORK] = {
+            .name    = "network",
+            .fn      = modesetting_setup_network,
+            .after   = TASKGRAPH_DEP(SETUP_STEP_GADGET),
+            .run_on  = TASKGRAPH_RUN_ON_HELPER,
+            .enabled = data->network,
+        },
+        [SETUP_STEP_CONNECTION] = {
+            .name    = "connection",
+            .fn      = modesetting_setup_connection,
+            .after   = 0,
+            .run_on  = TASKGRAPH_RUN_ON_CALLER,
+            .enabled = data->nat,
+        },
+        [SETUP_STEP_UDHCPD] = {
+            .name    = "udhcpd",
+            .fn      = modesetting_setup_udhcpd,
+            .after   = (TASKGRAPH_DEP(SETUP_STEP_CONNECTION) |
+                        TASKGRAPH_DEP(SETUP_STEP_GADGET) |
+                        TASKGRAPH_DEP(SETUP_STEP_NETWORK)),
+            .run_on  = TASKGRAPH_RUN_ON_CALLER,
+            /* FIXME: The used condition is a bit questionable as dhcpd
+             * service is started based on appsync config - i.e. NOT
+             * based on either nat or setting in modedata ...
+             */
+            .enabled = data->nat || data->dhcp_server,
+        },
+        [SETUP_STEP_POST_APPSYNC] = {
+            .name    = "post-appsync",
+            .fn      = modesetting_setup_post_appsync,
+            .after   = (TASKGRAPH_DEP(SETUP_STEP_GADGET) |
+                        TASKGRAPH_DEP(SETUP_STEP_NETWORK) |
+                        TASKGRAPH_DEP(SETUP_STEP_UDHCPD)),
+            .run_on  = TASKGRAPH_RUN_ON_CALLER,
+            .enabled = data->appsync,
+        },
+        [SETUP_STEP_TETHERING] = {
+            .name    = "tethering",
+            .fn      = modesetting_setup_tethering,
+            .after   = (TASKGRAPH_DEP(SETUP_STEP_GADGET) |
+                        TASKGRAPH_DEP(SETUP_STEP_NETWORK) |
+                        TASKGRAPH_DEP(SETUP_STEP_UDHCPD) |
+                        TASKGRAPH_DEP(SETUP_STEP_POST_APPSYNC)),
+            .run_on  = TASKGRAPH_RUN_ON_CALLER,
+#ifdef CONNMAN
+            .enabled = data->connman_tethering != 0,
 #else
-        network_down(data);
-        int error = network_up(data);
-
-        /* In case of failure, retry upto 3 times */
-        for( int i = 0; error && i < 3; ++i ) {
-            log_warning("Retry setting up the network");
-            if( !common_msleep(1000) )
-                break;
-            if( !(error = network_up(data)) )
-                log_warning("Setting up the network succeeded");
-        }
-        if( error ) {
-            log_err("Setting up the network failed");
-            goto EXIT;
-        }
-#endif /* DEBIAN */
-    }
-
-    /* Needs to be called before application post synching so
-     * that the dhcp server has the right config */
-    if(data->nat || data->dhcp_server) {
-        /* FIXME: The used condition is a bit questionable as dhcpd
-         * service is started based on appsync config - i.e. NOT
-         * based on either nat or setting in modedata ...
-         */
-        if( network_update_udhcpd_config(data) != 0 )
-            goto EXIT;
-    }
+            .enabled = false,
+#endif
+        },
+    };
 
-    /* - - - - - - - - - - - - - - - - - - - *
-     * Start post-enum app sync
-     * - - - - - - - - - - - - - - - - - - - */
+    setup_context_t context = {
+        .data      = data,
+        .ipforward = 0,
+    };
 
-    /* no need to execute the post sync if there was an error setting the mode */
-    if(data->appsync )
-    {
-        log_debug("Dynamic mode is appsync: do post actions");
-        /* let's sleep for a bit (350ms) to allow interfaces to settle before running postsync */
-        common_msleep(350);
-        appsync_activate_sync_post(data->mode_name);
-    }
+    bool success = taskgraph_run(steps, SETUP_STEP_NUMOF, &context,
+                                 worker_bailing_out);
+    ipforward_data_delete(context.ipforward);
 
-    /* - - - - - - - - - - - - - - - - - - - *
-     * Start tethering
-     * - - - - - - - - - - - - - - - - - - - */
-
-#ifdef CONNMAN
-    if( data->connman_tethering ) {
-        log_debug("Dynamic mode is tethering");
-        if( !connman_set_tethering(data->connman_tethering, true) )
-            goto EXIT;
-    }
-#endif
+    if( !success )
+        goto EXIT;
 
     ack = true;
 
@@ -936,19 +1144,12 @@ void modesetting_leave_dynamic_mode(void)
      * Configure gadget
      * - - - - - - - - - - - - - - - - - - - */
 
-    if( configfs_in_use() ) {
-        /* Leave as is. We will reprogram wnen mode is
-         * set, not when it is unset.
-         */
-    }
-    else if( android_in_use() ) {
+    if( gadget_in_use() ) {
         /* Leave as is. We will reprogram wnen mode is
-         * set, not when it is unset.
+         * set, not when it is unset. Kernel module unloading
+         * happens somewhere else.
          */
     }
-    else if( modules_in_use() ) {
-        /* Assume unloading happens somewhere else */
-    }
     else {
         log_crit("no backend is selected, can't unset dynamic mode");
     }
@@ -969,6 +1170,89 @@ EXIT:
     return;
 }
 
+/** Detach gadget of the current dynamic mode from the bus
+ *
+ * Used on cable disconnect when there is a chance that the same
+ * mode gets selected again on reconnect: gadget functions, mtpd
+ * and network setup are left as is, only the UDC is unbound and
+ * post-enum appsync applications are stopped.
+ *
+ * @return true if the mode was suspended, or false if full
+ *         cleanup via modesetting_leave_dynamic_mode() is needed
+ */
+bool modesetting_suspend_dynamic_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    log_debug("DYNAMIC MODE: SUSPEND");
+
+    const modedata_t *data = worker_get_usb_mode_data();
+
+    if( !data ) {
+        log_debug("No dynamic mode data to suspend");
+        goto EXIT;
+    }
+
+    /* Exported file systems must be returned to the device
+     * side without delay */
+    if( data->mass_storage ) {
+        log_debug("Dynamic mode is mass storage; can't suspend");
+        goto EXIT;
+    }
+
+    /* Kernel modules can't be detached without unloading */
+    if( !gadget_set_udc(false) ) {
+        log_debug("%s backend could not suspend", gadget_name());
+        goto EXIT;
+    }
+
+    if( data->appsync ) {
+        log_debug("Dynamic mode is appsync: suspend post actions");
+        appsync_stop_apps(1);
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Reattach gadget that was detached by modesetting_suspend_dynamic_mode()
+ *
+ * @return true if the mode was resumed, or false if it needs to be
+ *         set up from scratch
+ */
+bool modesetting_resume_dynamic_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    log_debug("DYNAMIC MODE: RESUME");
+
+    const modedata_t *data = worker_get_usb_mode_data();
+
+    if( !data ) {
+        log_debug("No dynamic mode data to resume");
+        goto EXIT;
+    }
+
+    if( !gadget_set_udc(true) )
+        goto EXIT;
+
+    if( data->appsync ) {
+        log_debug("Dynamic mode is appsync: resume post actions");
+        appsync_activate_sync_post(data->mode_name);
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
 /** Allocate modesetting related dynamic resouces
  */
 void modesetting_init(void)
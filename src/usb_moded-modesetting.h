@@ -40,15 +40,17 @@
  * MODESETTING
  * ------------------------------------------------------------------------- */
 
-void modesetting_verify_values     (void);
-int  modesetting_write_to_file_real(const char *file, int line, const char *func, const char *path, const char *text);
-bool modesetting_is_mounted        (const char *mountpoint);
-bool modesetting_mount             (const char *mountpoint);
-bool modesetting_unmount           (const char *mountpoint);
-bool modesetting_enter_dynamic_mode(void);
-void modesetting_leave_dynamic_mode(void);
-void modesetting_init              (void);
-void modesetting_quit              (void);
+void modesetting_verify_values       (void);
+int  modesetting_write_to_file_real  (const char *file, int line, const char *func, const char *path, const char *text);
+bool modesetting_is_mounted          (const char *mountpoint);
+bool modesetting_mount               (const char *mountpoint);
+bool modesetting_unmount             (const char *mountpoint);
+bool modesetting_enter_dynamic_mode  (void);
+void modesetting_leave_dynamic_mode  (void);
+bool modesetting_suspend_dynamic_mode(void);
+bool modesetting_resume_dynamic_mode (void);
+void modesetting_init                (void);
+void modesetting_quit                (void);
 
 /* ========================================================================= *
  * Macros
@@ -30,30 +30,89 @@
 
 #include "usb_moded-modules.h"
 
+#include "usb_moded-common.h"
+#include "usb_moded-gadget.h"
 #include "usb_moded-log.h"
+#include "usb_moded-modesetting.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
 
 #include <libkmod.h>
 
 #include <glib.h>
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Format string for mass storage lun attribute paths */
+#define MODULES_LUN_ATTR_FMT "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%d/%s"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Pre-resolved module load specification
+ *
+ * Module specifications are strings like "g_mass_storage luns=1" that
+ * consist of module name optionally followed by module parameters.
+ */
+typedef struct modules_entry_t
+{
+    /** Resolved kmod module handle */
+    struct kmod_module *me_module;
+
+    /** Module parameters, or NULL */
+    gchar              *me_args;
+} modules_entry_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * MODULES_ENTRY
+ * ------------------------------------------------------------------------- */
+
+static void             modules_entry_delete_cb(void *aptr);
+static modules_entry_t *modules_entry_create   (const char *spec);
+static modules_entry_t *modules_entry_lookup   (const char *spec);
+
 /* ------------------------------------------------------------------------- *
  * MODULES
  * ------------------------------------------------------------------------- */
 
-static bool modules_have_module  (const char *module);
-bool        modules_in_use       (void);
-static bool modules_probe        (void);
-bool        modules_init         (void);
-void        modules_quit         (void);
-int         modules_load_module  (const char *module);
-int         modules_unload_module(const char *module);
+static bool  modules_have_module          (const char *module);
+bool         modules_in_use               (void);
+static bool  modules_probe                (void);
+static void  modules_preload              (void);
+bool         modules_init                 (void);
+void         modules_quit                 (void);
+static int   modules_insert_locked        (const char *module, const char *args);
+int          modules_load_module          (const char *module);
+int          modules_load_module_with_args(const char *module, const char *args);
+int          modules_unload_module        (const char *module);
+
+/* ------------------------------------------------------------------------- *
+ * MODULES_ASYNC
+ * ------------------------------------------------------------------------- */
+
+static void *modules_async_cb             (void *aptr);
+bool         modules_load_module_async    (const char *module);
+int          modules_load_module_wait     (void);
+
+/* ------------------------------------------------------------------------- *
+ * MODULES_BACKEND
+ * ------------------------------------------------------------------------- */
+
+static bool  modules_backend_set_udc      (bool enable);
+static bool  modules_backend_add_lun      (int lun);
+static bool  modules_backend_set_lun_attr (int lun, const char *attr, const char *value);
 
 /* ========================================================================= *
  * Data
@@ -71,10 +130,128 @@ static int modules_probed = -1;
  *  and cleaned up by ctx_cleanup() functions */
 static struct kmod_ctx *modules_ctx = 0;
 
+/** Module specification string -> modules_entry_t lookup table */
+static GHashTable *modules_entry_lut = 0;
+
+/** Lock for serializing kmod context and lookup table access
+ *
+ * The kmod context is not thread safe, and asynchronous module
+ * insertion uses it from a helper thread.
+ */
+static pthread_mutex_t modules_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Whether asynchronous module insertion needs to be waited for */
+static bool modules_async_pending = false;
+
+/** Thread executing asynchronous module insertion */
+static pthread_t modules_async_thread;
+
+/** Module specification being loaded asynchronously */
+static gchar *modules_async_module = 0;
+
+/** Result of asynchronous module insertion */
+static int modules_async_result = 0;
+
 /* ========================================================================= *
- * Functions
+ * MODULES_ENTRY
  * ========================================================================= */
 
+static void modules_entry_delete_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modules_entry_t *self = aptr;
+
+    if( self ) {
+        if( self->me_module )
+            kmod_module_unref(self->me_module);
+        g_free(self->me_args);
+        g_free(self);
+    }
+}
+
+/** Resolve module specification to kmod module handle
+ *
+ * Must be called while holding modules_mutex.
+ *
+ * @param spec  Module name, optionally followed by parameters
+ *
+ * @return module entry, or NULL on failure
+ */
+static modules_entry_t *modules_entry_create(const char *spec)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modules_entry_t *self = 0;
+    gchar           *name = g_strdup(spec);
+    gchar           *args = strchr(name, ' ');
+
+    if( args ) {
+        *args++ = 0;
+        g_strstrip(args);
+    }
+
+    self = g_malloc0(sizeof *self);
+    self->me_args = (args && *args) ? g_strdup(args) : 0;
+
+    if( kmod_module_new_from_name(modules_ctx, name, &self->me_module) < 0 ) {
+        log_err("%s: failed to resolve module", name);
+        modules_entry_delete_cb(self), self = 0;
+        goto EXIT;
+    }
+
+    /* kmod_module_new_from_name() does not check if the module
+     * exists, so test its path in case we deal with mass-storage
+     * and fall back to the older file storage module as needed */
+    if( !strcmp(name, MODULE_MASS_STORAGE) &&
+        !kmod_module_get_path(self->me_module) ) {
+        struct kmod_module *mod = 0;
+        if( kmod_module_new_from_name(modules_ctx, MODULE_FILE_STORAGE, &mod) >= 0 ) {
+            log_debug("Fallback on older %s", MODULE_FILE_STORAGE);
+            kmod_module_unref(self->me_module);
+            self->me_module = mod;
+        }
+    }
+
+    log_debug("module %s -> %s (%s)", spec,
+              kmod_module_get_name(self->me_module),
+              self->me_args ?: "no args");
+
+EXIT:
+    g_free(name);
+    return self;
+}
+
+/** Lookup cached module entry, resolving it on first use
+ *
+ * Must be called while holding modules_mutex.
+ *
+ * @param spec  Module name, optionally followed by parameters
+ *
+ * @return module entry, or NULL on failure
+ */
+static modules_entry_t *modules_entry_lookup(const char *spec)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modules_entry_t *self = 0;
+
+    if( !modules_ctx || !modules_entry_lut )
+        goto EXIT;
+
+    if( (self = g_hash_table_lookup(modules_entry_lut, spec)) )
+        goto EXIT;
+
+    if( (self = modules_entry_create(spec)) )
+        g_hash_table_replace(modules_entry_lut, g_strdup(spec), self);
+
+EXIT:
+    return self;
+}
+
+/* ========================================================================= *
+ * MODULES
+ * ========================================================================= */
 static bool modules_have_module(const char *module)
 {
     LOG_REGISTER_CONTEXT;
@@ -140,6 +317,29 @@ static bool modules_probe(void)
     return modules_in_use();
 }
 
+/** Resolve module handles for all modes before they are needed
+ *
+ * Avoids module index lookups and fallback probing from mode switch
+ * critical paths.
+ */
+static void modules_preload(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const lut[] = {
+        MODULE_MASS_STORAGE,
+        MODULE_CHARGING,
+        MODULE_DEVELOPER,
+        MODULE_MTP,
+        0
+    };
+
+    pthread_mutex_lock(&modules_mutex);
+    for( size_t i = 0; lut[i]; ++i )
+        modules_entry_lookup(lut[i]);
+    pthread_mutex_unlock(&modules_mutex);
+}
+
 /** kmod module init
  *
  * @return true if modules backend is ready for use, false otherwise
@@ -155,12 +355,20 @@ bool modules_init(void)
             goto EXIT;
     }
 
+    if( !modules_entry_lut ) {
+        modules_entry_lut = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  g_free,
+                                                  modules_entry_delete_cb);
+    }
+
     if( kmod_load_resources(modules_ctx) < 0 )
         goto EXIT;
 
     if( !modules_probe() )
         goto EXIT;
 
+    modules_preload();
+
     ack = true;
 EXIT:
     return ack;
@@ -171,13 +379,51 @@ void modules_quit(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    modules_load_module_wait();
+
+    if( modules_entry_lut )
+        g_hash_table_unref(modules_entry_lut), modules_entry_lut = 0;
+
     if( modules_ctx )
         kmod_unref(modules_ctx), modules_ctx = 0;
 }
 
+/** Insert module using cached kmod handle
+ *
+ * Must be called while holding modules_mutex.
+ *
+ * @param module  Module name, optionally followed by parameters
+ * @param args    Module parameters overriding the ones in module
+ *                specification, or NULL
+ *
+ * @return 0 on success, non-zero on failure
+ */
+static int modules_insert_locked(const char *module, const char *args)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const int        probe_flags = KMOD_PROBE_APPLY_BLACKLIST;
+    int              ret         = -1;
+    modules_entry_t *entry       = modules_entry_lookup(module);
+
+    if( !entry )
+        goto EXIT;
+
+    ret = kmod_module_probe_insert_module(entry->me_module, probe_flags,
+                                          args ?: entry->me_args,
+                                          NULL, NULL, NULL);
+EXIT:
+    if( ret == 0)
+        log_info("Module %s loaded successfully\n", module);
+    else
+        log_info("Module %s failed to load\n", module);
+    return ret;
+}
+
 /** load module
  *
- * @param module Name of the module to load
+ * @param module Name of the module to load, optionally followed by
+ *               module parameters
  * @return 0 on success, non-zero on failure
  *
  */
@@ -185,12 +431,21 @@ int modules_load_module(const char *module)
 {
     LOG_REGISTER_CONTEXT;
 
-    int ret = 0;
+    return modules_load_module_with_args(module, 0);
+}
+
+/** load module with explicitly given parameters
+ *
+ * @param module Name of the module to load
+ * @param args   Module parameters, e.g. "luns=2", or NULL
+ * @return 0 on success, non-zero on failure
+ *
+ */
+int modules_load_module_with_args(const char *module, const char *args)
+{
+    LOG_REGISTER_CONTEXT;
 
-    const int probe_flags = KMOD_PROBE_APPLY_BLACKLIST;
-    struct kmod_module *mod;
-    char *charging_args = NULL;
-    char *load = NULL;
+    int ret = -1;
 
     if(!strcmp(module, MODULE_NONE))
         return 0;
@@ -200,50 +455,10 @@ int modules_load_module(const char *module)
         return -1;
     }
 
-    /* copy module to load as it might be modified if we're trying charging mode */
-    load = strdup(module);
-    if(!strcmp(module, MODULE_CHARGING) || !strcmp(module, MODULE_CHARGE_FALLBACK))
-    {
-        /* split the string in module name and argument, they are the same for MODULE_CHARGE_FALLBACK
-         * so no need to handle them separately  */
-        gchar **strings;
-
-        /* since the mass_storage module is the newer one and we check against it to avoid
-         * loading failures we use it here, as we fall back to g_file_storage if g_mass_storage
-         * fails to load */
-        strings = g_strsplit(MODULE_CHARGE_FALLBACK, " ", 2);
-        //log_debug("module args = %s, module = %s\n", strings[1], strings[0]);
-        charging_args = strdup(strings[1]);
-        /* load was already assigned. Free it to re-assign */
-        free(load);
-        load = strdup(strings[0]);
-        g_strfreev(strings);
-
-    }
-    ret = kmod_module_new_from_name(modules_ctx, load, &mod);
-    /* since kmod_module_new_from_name does not check if the module
-     * exists we test it's path in case we deal with the mass-storage one */
-    if(!strcmp(module, MODULE_MASS_STORAGE) &&
-       (kmod_module_get_path(mod) == NULL))
-    {
-        log_debug("Fallback on older g_file_storage\n");
-        ret = kmod_module_new_from_name(modules_ctx, MODULE_FILE_STORAGE, &mod);
-    }
-
-    if(!charging_args)
-        ret = kmod_module_probe_insert_module(mod, probe_flags, NULL, NULL, NULL, NULL);
-    else
-    {
-        ret = kmod_module_probe_insert_module(mod, probe_flags, charging_args, NULL, NULL, NULL);
-        free(charging_args);
-    }
-    kmod_module_unref(mod);
-    free(load);
+    pthread_mutex_lock(&modules_mutex);
+    ret = modules_insert_locked(module, args);
+    pthread_mutex_unlock(&modules_mutex);
 
-    if( ret == 0)
-        log_info("Module %s loaded successfully\n", module);
-    else
-        log_info("Module %s failed to load\n", module);
     return ret;
 }
 
@@ -257,9 +472,9 @@ int modules_unload_module(const char *module)
 {
     LOG_REGISTER_CONTEXT;
 
-    int ret = 0;
+    int ret = -1;
 
-    struct kmod_module *mod;
+    modules_entry_t *entry;
 
     if(!strcmp(module, MODULE_NONE))
         return 0;
@@ -269,9 +484,187 @@ int modules_unload_module(const char *module)
         return -1;
     }
 
-    kmod_module_new_from_name(modules_ctx, module, &mod);
-    ret = kmod_module_remove_module(mod, KMOD_REMOVE_NOWAIT);
-    kmod_module_unref(mod);
+    pthread_mutex_lock(&modules_mutex);
+    if( (entry = modules_entry_lookup(module)) )
+        ret = kmod_module_remove_module(entry->me_module, KMOD_REMOVE_NOWAIT);
+    pthread_mutex_unlock(&modules_mutex);
+
+    return ret;
+}
+
+/* ========================================================================= *
+ * MODULES_ASYNC
+ * ========================================================================= */
+
+/** Asynchronous module insertion thread entry point
+ *
+ * @param aptr  Module specification
+ *
+ * @return NULL
+ */
+static void *modules_async_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *module = aptr;
+
+    log_set_thread_name("kmod");
+    log_set_phase("module");
+    modules_async_result = modules_load_module(module);
+    log_set_phase(0);
+
+    return NULL;
+}
+
+/** Start loading module in a helper thread
+ *
+ * Allows module insertion to overlap with other mode setup steps
+ * that do not depend on the gadget driver. The result must be
+ * collected with modules_load_module_wait() before the next
+ * modules_load_module_async() call.
+ *
+ * If helper thread can't be started, module is loaded synchronously
+ * and the result is made available via modules_load_module_wait().
+ *
+ * @param module Name of the module to load, optionally followed by
+ *               module parameters
+ * @return true if module insertion was initiated, false otherwise
+ */
+bool modules_load_module_async(const char *module)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( modules_async_pending ) {
+        log_err("load module %s - previous load still pending", module);
+        goto EXIT;
+    }
+
+    g_free(modules_async_module),
+        modules_async_module = g_strdup(module);
+    modules_async_result = 0;
+
+    int err = pthread_create(&modules_async_thread, 0, modules_async_cb,
+                             modules_async_module);
+    if( err ) {
+        log_warning("load module %s - failed to start helper thread: %s",
+                    module, strerror(err));
+        modules_async_result = modules_load_module(module);
+    }
+    else {
+        modules_async_pending = true;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Wait for asynchronous module insertion to finish
+ *
+ * @return 0 on success / when there is nothing to wait for,
+ *         non-zero on failure
+ */
+int modules_load_module_wait(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( modules_async_pending ) {
+        pthread_join(modules_async_thread, 0);
+        modules_async_pending = false;
+    }
+
+    int ret = modules_async_result;
+    modules_async_result = 0;
+
+    g_free(modules_async_module),
+        modules_async_module = 0;
 
     return ret;
 }
+
+/* ========================================================================= *
+ * MODULES_BACKEND
+ * ========================================================================= */
+
+static bool modules_backend_set_udc(bool enable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Gadget is attached when the module is loaded, and it can't
+     * be detached without unloading the module */
+    return enable;
+}
+
+/** Make sure mass storage module has been loaded with enough luns
+ *
+ * Luns are added in descending order, so the module gets reloaded
+ * with sufficient lun count at most once.
+ *
+ * @param lun  Lun index
+ *
+ * @return true on success, false on failure
+ */
+static bool modules_backend_add_lun(int lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    char path[256];
+    char args[32];
+
+    snprintf(path, sizeof path, MODULES_LUN_ATTR_FMT, lun, "file");
+
+    if( access(common_root_path(path), R_OK) == -1 ) {
+        log_debug("%s does not exist, unloading and reloading mass_storage\n", path);
+        modules_unload_module(MODULE_MASS_STORAGE);
+        snprintf(args, sizeof args, "luns=%d", lun + 1);
+        if( modules_load_module_with_args(MODULE_MASS_STORAGE, args) != 0 )
+            goto EXIT;
+    }
+
+    /* Lun zero is added last - activate mounts after sleeping 1s to be
+     * sure enumeration happened and autoplay will work in windows */
+    if( lun == 0 )
+        common_sleep(1);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+static bool modules_backend_set_lun_attr(int lun, const char *attr, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Other attributes are not exposed by the gadget modules */
+    if( strcmp(attr, "file") && strcmp(attr, "nofua") )
+        return true;
+
+    char path[256];
+    snprintf(path, sizeof path, MODULES_LUN_ATTR_FMT, lun, attr);
+    return write_to_file(common_root_path(path), value) == 0;
+}
+
+/** Gadget configuration via kernel modules */
+const gadget_backend_t modules_backend =
+{
+    .gb_name            = "modules",
+    .gb_last_resort     = true,
+    .gb_max_luns        = 0,
+    .gb_mtpd_before_udc = false,
+    .gb_extra_sysfs     = false,
+    .gb_charging_module = MODULE_MASS_STORAGE,
+    .gb_init            = modules_init,
+    .gb_quit            = modules_quit,
+    .gb_set_functions   = 0,
+    .gb_set_ids         = 0,
+    .gb_set_udc         = modules_backend_set_udc,
+    .gb_add_lun         = modules_backend_add_lun,
+    .gb_remove_lun      = 0,
+    .gb_set_lun_attr    = modules_backend_set_lun_attr,
+    .gb_set_charging    = 0,
+};
@@ -53,10 +53,18 @@
  * MODULES
  * ------------------------------------------------------------------------- */
 
-bool modules_in_use       (void);
-bool modules_init         (void);
-void modules_quit         (void);
-int  modules_load_module  (const char *module);
-int  modules_unload_module(const char *module);
+bool modules_in_use               (void);
+bool modules_init                 (void);
+void modules_quit                 (void);
+int  modules_load_module          (const char *module);
+int  modules_load_module_with_args(const char *module, const char *args);
+int  modules_unload_module        (const char *module);
+
+/* ------------------------------------------------------------------------- *
+ * MODULES_ASYNC
+ * ------------------------------------------------------------------------- */
+
+bool modules_load_module_async    (const char *module);
+int  modules_load_module_wait     (void);
 
 #endif /* USB_MODED_MODULES_H_ */
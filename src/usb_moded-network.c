@@ -33,6 +33,7 @@
 
 #include "usb_moded-network.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
 #include "usb_moded-log.h"
@@ -46,6 +47,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
 /* ========================================================================= *
  * Constants
@@ -60,7 +62,7 @@
  * ========================================================================= */
 
 /** IP forwarding configuration block */
-typedef struct ipforward_data_t
+struct ipforward_data_t
 {
     /** Address of primary DNS */
     char *dns1;
@@ -68,7 +70,7 @@ typedef struct ipforward_data_t
     char *dns2;
     /** Interface from which packets should be forwarded */
     char *nat_interface;
-} ipforward_data_t;
+};
 
 /* ========================================================================= *
  * Prototypes
@@ -79,7 +81,7 @@ typedef struct ipforward_data_t
  * ------------------------------------------------------------------------- */
 
 static ipforward_data_t *ipforward_data_create           (void);
-static void              ipforward_data_delete           (ipforward_data_t *self);
+void                     ipforward_data_delete           (ipforward_data_t *self);
 static void              ipforward_data_clear            (ipforward_data_t *self);
 static void              ipforward_data_set_dns1         (ipforward_data_t *self, const char *dns);
 static void              ipforward_data_set_dns2         (ipforward_data_t *self, const char *dns);
@@ -125,6 +127,8 @@ static int   network_setup_ip_forwarding  (const modedata_t *data, ipforward_dat
 static void  network_cleanup_ip_forwarding(void);
 static int   network_check_udhcpd_symlink (void);
 static int   network_write_udhcpd_config  (const modedata_t *data, ipforward_data_t *ipforward);
+int          network_get_connection_data  (const modedata_t *data, ipforward_data_t **pipforward);
+int          network_apply_udhcpd_config  (const modedata_t *data, ipforward_data_t *ipforward);
 int          network_update_udhcpd_config (const modedata_t *data);
 int          network_up                   (const modedata_t *data);
 void         network_down                 (const modedata_t *data);
@@ -154,7 +158,7 @@ ipforward_data_create(void)
     return self;
 }
 
-static void
+void
 ipforward_data_delete(ipforward_data_t *self)
 {
     LOG_REGISTER_CONTEXT;
@@ -737,7 +741,7 @@ legacy_get_connection_data(ipforward_data_t *ipforward)
 {
     LOG_REGISTER_CONTEXT;
 
-    static const char path[] = "/etc/resolv.conf";
+    const char *path = common_root_path("/etc/resolv.conf");
 
     bool    ack  = false;
     FILE   *file = 0;
@@ -812,7 +816,7 @@ network_interface_exists(char *interface)
     {
         char path[PATH_MAX];
         snprintf(path, sizeof path, "/sys/class/net/%s", interface);
-        ack = (access(path, F_OK) == 0);
+        ack = (access(common_root_path(path), F_OK) == 0);
     }
 
     return ack;
@@ -889,7 +893,7 @@ network_setup_ip_forwarding(const modedata_t *data, ipforward_data_t *ipforward)
         nat_interface = strdup(ipforward->nat_interface);
     }
 
-    write_to_file("/proc/sys/net/ipv4/ip_forward", "1");
+    write_to_file(common_root_path("/proc/sys/net/ipv4/ip_forward"), "1");
 
     snprintf(command, sizeof command, "/sbin/iptables -t nat -A POSTROUTING -o %s -j MASQUERADE", nat_interface);
     common_system(command);
@@ -917,7 +921,7 @@ network_cleanup_ip_forwarding(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    write_to_file("/proc/sys/net/ipv4/ip_forward", "0");
+    write_to_file(common_root_path("/proc/sys/net/ipv4/ip_forward"), "0");
 
     common_system("/sbin/iptables -F FORWARD");
 }
@@ -932,17 +936,19 @@ network_check_udhcpd_symlink(void)
     LOG_REGISTER_CONTEXT;
 
     int ret = -1;
-    char dest[sizeof UDHCP_CONFIG_PATH + 1];
-    ssize_t rc = readlink(UDHCP_CONFIG_LINK, dest, sizeof dest - 1);
+    const char *path = common_root_path(UDHCP_CONFIG_PATH);
+    const char *link = common_root_path(UDHCP_CONFIG_LINK);
+    char dest[PATH_MAX];
+    ssize_t rc = readlink(link, dest, sizeof dest - 1);
 
     if( rc < 0 ) {
         if( errno != ENOENT )
-            log_err("%s: can't read symlink: %m", UDHCP_CONFIG_LINK);
+            log_err("%s: can't read symlink: %m", link);
     }
     else if( (size_t)rc < sizeof dest ) {
         dest[rc] = 0;
-        if( strcmp(dest, UDHCP_CONFIG_PATH) )
-            log_warning("%s: symlink is invalid", UDHCP_CONFIG_LINK);
+        if( strcmp(dest, path) )
+            log_warning("%s: symlink is invalid", link);
         else
             ret = 0;
     }
@@ -969,6 +975,10 @@ network_write_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
     char  *ip = 0;
     char  *netmask = 0;
 
+    const char *conf_dir  = common_root_path(UDHCP_CONFIG_DIR);
+    const char *conf_path = common_root_path(UDHCP_CONFIG_PATH);
+    const char *conf_link = common_root_path(UDHCP_CONFIG_LINK);
+
     if( !(interface = network_get_interface(data)) ) {
         log_err("no network interface");
         goto EXIT;
@@ -992,13 +1002,13 @@ network_write_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
     }
 
     /* /tmp and /run is often tmpfs, so we avoid writing to flash */
-    if( mkdir(UDHCP_CONFIG_DIR, 0775) == -1 && errno != EEXIST ) {
-        log_warning("%s: can't create directory: %m", UDHCP_CONFIG_DIR);
+    if( mkdir(conf_dir, 0775) == -1 && errno != EEXIST ) {
+        log_warning("%s: can't create directory: %m", conf_dir);
     }
 
     /* print all data in the file */
-    if( !(conffile = fopen(UDHCP_CONFIG_PATH, "w")) ) {
-        log_err("%s: can't open for writing: %m", UDHCP_CONFIG_PATH);
+    if( !(conffile = fopen(conf_path, "w")) ) {
+        log_err("%s: can't open for writing: %m", conf_path);
         goto EXIT;
     }
 
@@ -1022,16 +1032,16 @@ network_write_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
 
     /* check that we have a valid symlink */
     if( network_check_udhcpd_symlink() != 0 ) {
-        if( unlink(UDHCP_CONFIG_LINK) == -1 && errno != ENOENT )
-            log_warning("%s: can't remove invalid config: %m", UDHCP_CONFIG_LINK);
+        if( unlink(conf_link) == -1 && errno != ENOENT )
+            log_warning("%s: can't remove invalid config: %m", conf_link);
 
-        if( symlink(UDHCP_CONFIG_PATH, UDHCP_CONFIG_LINK) == -1 ) {
+        if( symlink(conf_path, conf_link) == -1 ) {
             log_err("%s: can't create symlink to %s: %m",
-                    UDHCP_CONFIG_LINK, UDHCP_CONFIG_PATH);
+                    conf_link, conf_path);
             goto EXIT;
         }
         log_debug("%s: symlink to %s created",
-                  UDHCP_CONFIG_LINK, UDHCP_CONFIG_PATH);
+                  conf_link, conf_path);
     }
 
     // success
@@ -1047,19 +1057,20 @@ EXIT:
     return err;
 }
 
-/** Update udhcpd.conf
+/** Get upstream connection data needed for udhcpd.conf
  *
- * Must be succesfully called before starting udhcpd to ensure
- * /etc/udhcpd.conf points to valid data.
+ * Involves blocking D-Bus calls to ofono and connman, but does not
+ * depend on usb gadget or network interface state.
  *
- * No cleanup required (the config file can be left behind).
- *
- * @param data  Dynamic mode data
+ * @param data        Dynamic mode data
+ * @param pipforward  Where to store connection data, or NULL if nat
+ *                    is not used; caller must release with
+ *                    ipforward_data_delete()
  *
  * @return zero on success, non-zero on failure
  */
 int
-network_update_udhcpd_config(const modedata_t *data)
+network_get_connection_data(const modedata_t *data, ipforward_data_t **pipforward)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -1095,13 +1106,60 @@ network_update_udhcpd_config(const modedata_t *data)
 #endif
     }
 
+    ret = 0;
+
+EXIT:
+    if( ret == 0 )
+        *pipforward = ipforward, ipforward = 0;
+    ipforward_data_delete(ipforward);
+
+    return ret;
+}
+
+/** Write udhcpd.conf and set up nat using obtained connection data
+ *
+ * @param data       Dynamic mode data
+ * @param ipforward  Data from network_get_connection_data()
+ *
+ * @return zero on success, non-zero on failure
+ */
+int
+network_apply_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
+{
+    LOG_REGISTER_CONTEXT;
+
     /* ipforward can be NULL here, which is expected and handled in this function */
-    ret = network_write_udhcpd_config(data, ipforward);
+    int ret = network_write_udhcpd_config(data, ipforward);
 
     if( ret == 0 && data->nat )
         ret = network_setup_ip_forwarding(data, ipforward);
 
-EXIT:
+    return ret;
+}
+
+/** Update udhcpd.conf
+ *
+ * Must be succesfully called before starting udhcpd to ensure
+ * /etc/udhcpd.conf points to valid data.
+ *
+ * No cleanup required (the config file can be left behind).
+ *
+ * @param data  Dynamic mode data
+ *
+ * @return zero on success, non-zero on failure
+ */
+int
+network_update_udhcpd_config(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    ipforward_data_t *ipforward = NULL;
+
+    int ret = network_get_connection_data(data, &ipforward);
+
+    if( ret == 0 )
+        ret = network_apply_udhcpd_config(data, ipforward);
+
     ipforward_data_delete(ipforward);
 
     return ret;
@@ -32,10 +32,22 @@
 
 # include "usb_moded-dyn-config.h"
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+typedef struct ipforward_data_t ipforward_data_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * IPFORWARD_DATA
+ * ------------------------------------------------------------------------- */
+
+void ipforward_data_delete(ipforward_data_t *self);
+
 /* ------------------------------------------------------------------------- *
  * CONNMAN
  * ------------------------------------------------------------------------- */
@@ -46,6 +58,8 @@ bool connman_set_tethering(const char *technology, bool on);
  * NETWORK
  * ------------------------------------------------------------------------- */
 
+int  network_get_connection_data (const modedata_t *data, ipforward_data_t **pipforward);
+int  network_apply_udhcpd_config (const modedata_t *data, ipforward_data_t *ipforward);
 int  network_update_udhcpd_config(const modedata_t *data);
 int  network_up                  (const modedata_t *data);
 void network_down                (const modedata_t *data);
@@ -0,0 +1,264 @@
+/**
+ * @file usb_moded-recorder.c
+ *
+ * Always-on in-memory flight recorder
+ *
+ * Noteworthy events - cable state changes, worker jobs, executed
+ * commands, configfs writes and D-Bus requests - are stored in a
+ * fixed-size binary ring buffer regardless of logging level. Recording
+ * an event costs a clock read, an atomic increment and a short string
+ * copy. The ring can be dumped as text via D-Bus or on SIGUSR2, so that
+ * recent history is available even when debug logging was not enabled.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-recorder.h"
+
+#include "usb_moded-log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of entries in the ring, must be a power of two */
+#define RECORDER_SIZE 2048
+
+/** Maximum length of event text, including terminator */
+#define RECORDER_TEXT_SIZE 46
+
+/** Event type names used in dumps */
+static const char * const recorder_type_name[RECORDER_NUMOF] = {
+    [RECORDER_CABLE]     = "cable",
+    [RECORDER_JOB_BEGIN] = "job-begin",
+    [RECORDER_JOB_END]   = "job-end",
+    [RECORDER_EXEC]      = "exec",
+    [RECORDER_EXEC_DONE] = "exec-done",
+    [RECORDER_WRITE]     = "write",
+    [RECORDER_DBUS]      = "dbus",
+    [RECORDER_SIGNAL]    = "signal",
+};
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** One recorded event, 64 bytes */
+typedef struct recorder_entry_t
+{
+    /** CLOCK_MONOTONIC time stamp [ns] */
+    int64_t  stamp;
+
+    /** Ring position + 1 when complete, 0 while being written */
+    uint32_t seq;
+
+    /** Event specific numeric argument */
+    int32_t  arg;
+
+    /** Event type, see recorder_type_t */
+    uint16_t type;
+
+    /** Event specific text, possibly truncated */
+    char     text[RECORDER_TEXT_SIZE];
+} recorder_entry_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * RECORDER
+ * ------------------------------------------------------------------------- */
+
+static int64_t recorder_now_ns  (clockid_t clk);
+void           recorder_event   (recorder_type_t type, int arg, const char *text, const char *more);
+gchar         *recorder_dump    (void);
+bool           recorder_dump_to (const char *path);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Event ring, written by any thread */
+static recorder_entry_t recorder_ring[RECORDER_SIZE];
+
+/** Next ring position to write */
+static uint32_t recorder_head = 0;
+
+/* ========================================================================= *
+ * RECORDER
+ * ========================================================================= */
+
+/** Get current time from given clock
+ *
+ * @param clk  Clock to read
+ *
+ * @return time stamp [ns]
+ */
+static int64_t
+recorder_now_ns(clockid_t clk)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** Record an event
+ *
+ * Can be called from any thread. Does not allocate memory, take
+ * locks or make syscalls beyond reading the monotonic clock.
+ *
+ * @param type  Event type
+ * @param arg   Event specific numeric argument
+ * @param text  Event specific text, or NULL
+ * @param more  Additional text appended after a space, or NULL
+ */
+void
+recorder_event(recorder_type_t type, int arg, const char *text,
+               const char *more)
+{
+    uint32_t          pos   = __atomic_fetch_add(&recorder_head, 1,
+                                                 __ATOMIC_RELAXED);
+    recorder_entry_t *entry = &recorder_ring[pos & (RECORDER_SIZE - 1)];
+
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry->stamp = recorder_now_ns(CLOCK_MONOTONIC);
+    entry->type  = (uint16_t)type;
+    entry->arg   = arg;
+
+    size_t len = 0;
+    if( text ) {
+        while( text[len] && len < RECORDER_TEXT_SIZE - 1 ) {
+            entry->text[len] = text[len];
+            ++len;
+        }
+    }
+    if( more && len < RECORDER_TEXT_SIZE - 1 ) {
+        if( len )
+            entry->text[len++] = ' ';
+        for( ; *more && len < RECORDER_TEXT_SIZE - 1; ++more )
+            entry->text[len++] = *more;
+    }
+    entry->text[len] = 0;
+
+    __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/** Format recorded events as text, oldest first
+ *
+ * Each line contains seconds elapsed before the dump, estimated wall
+ * clock time, event type, numeric argument and text.
+ *
+ * @return recorder dump; caller must release with g_free()
+ */
+gchar *
+recorder_dump(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *buff     = g_string_new(0);
+    int64_t  mono_now = recorder_now_ns(CLOCK_MONOTONIC);
+    int64_t  real_now = recorder_now_ns(CLOCK_REALTIME);
+    uint32_t head     = __atomic_load_n(&recorder_head, __ATOMIC_ACQUIRE);
+    uint32_t pos      = head > RECORDER_SIZE ? head - RECORDER_SIZE : 0;
+
+    g_string_append(buff, "#  age [s] time                    type        arg text\n");
+
+    for( ; pos != head; ++pos ) {
+        const recorder_entry_t *entry =
+            &recorder_ring[pos & (RECORDER_SIZE - 1)];
+
+        if( __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != pos + 1 )
+            continue;
+
+        recorder_entry_t copy = *entry;
+
+        /* Skip entries that were overwritten while being copied */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if( __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != pos + 1 )
+            continue;
+
+        copy.text[RECORDER_TEXT_SIZE - 1] = 0;
+
+        int64_t   age  = mono_now - copy.stamp;
+        int64_t   real = real_now - age;
+        time_t    secs = (time_t)(real / 1000000000);
+        struct tm tm;
+        char      when[32] = "";
+        if( localtime_r(&secs, &tm) )
+            strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &tm);
+
+        const char *name = (copy.type < RECORDER_NUMOF ?
+                            recorder_type_name[copy.type] : "?");
+
+        g_string_append_printf(buff, "%8lld.%03lld %s.%03lld %-9s %5d %s\n",
+                               (long long)(age / 1000000000),
+                               (long long)((age / 1000000) % 1000),
+                               when,
+                               (long long)((real / 1000000) % 1000),
+                               name, copy.arg, copy.text);
+    }
+
+    return g_string_free(buff, FALSE);
+}
+
+/** Write recorder dump to a file
+ *
+ * @param path  File to write
+ *
+ * @return true on success, or false on failure
+ */
+bool
+recorder_dump_to(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   ack  = false;
+    int    fd   = -1;
+    gchar *dump = recorder_dump();
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+              0600);
+    if( fd == -1 ) {
+        log_err("%s: can't open for writing: %m", path);
+        goto EXIT;
+    }
+
+    size_t size = strlen(dump);
+    if( write(fd, dump, size) != (ssize_t)size ) {
+        log_err("%s: write failure: %m", path);
+        goto EXIT;
+    }
+
+    log_warning("flight recorder dumped to %s", path);
+    ack = true;
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+    g_free(dump);
+
+    return ack;
+}
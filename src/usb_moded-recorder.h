@@ -0,0 +1,76 @@
+/**
+ * @file usb_moded-recorder.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_RECORDER_H_
+# define USB_MODED_RECORDER_H_
+
+# include <stdbool.h>
+# include <stdint.h>
+
+# include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Where flight recorder is dumped on SIGUSR2 */
+# define RECORDER_DUMP_PATH "/run/usb_moded-flight-recorder.txt"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Flight recorder event types
+ */
+typedef enum recorder_type_t
+{
+    /** Cable state change; arg=state, text=state name */
+    RECORDER_CABLE,
+    /** Worker job picked up; arg=job id, text=mode */
+    RECORDER_JOB_BEGIN,
+    /** Worker job finished; arg=job id, text=activated mode */
+    RECORDER_JOB_END,
+    /** Shell command started; text=command */
+    RECORDER_EXEC,
+    /** Shell command finished; arg=result, text=command */
+    RECORDER_EXEC_DONE,
+    /** Configfs write; arg=success, text=file and value */
+    RECORDER_WRITE,
+    /** D-Bus method call; text=member and sender */
+    RECORDER_DBUS,
+    /** Signal handled; arg=signal number */
+    RECORDER_SIGNAL,
+
+    RECORDER_NUMOF
+} recorder_type_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * RECORDER
+ * ------------------------------------------------------------------------- */
+
+void   recorder_event   (recorder_type_t type, int arg, const char *text, const char *more);
+gchar *recorder_dump    (void);
+bool   recorder_dump_to (const char *path);
+
+#endif /* USB_MODED_RECORDER_H_ */
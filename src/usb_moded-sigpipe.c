@@ -22,6 +22,7 @@
 #include "usb_moded-sigpipe.h"
 
 #include "usb_moded.h"
+#include "usb_moded-evloop.h"
 #include "usb_moded-log.h"
 
 #include <stdlib.h>
@@ -29,6 +30,8 @@
 #include <errno.h>
 #include <fcntl.h>
 
+#include <sys/signalfd.h>
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -37,68 +40,94 @@
  * SIGPIPE
  * ------------------------------------------------------------------------- */
 
-static gboolean sigpipe_read_signal_cb(GIOChannel *channel, GIOCondition condition, gpointer data);
-static void     sigpipe_trap_signal_cb(int sig);
-static bool     sigpipe_crate_pipe    (void);
-static void     sigpipe_trap_signals  (void);
-bool            sigpipe_init          (void);
+static bool sigpipe_read_signal_cb(int fd, uint32_t events, void *aptr);
+static void sigpipe_trap_signal_cb(int sig);
+static void sigpipe_fill_sigset   (sigset_t *ss);
+static bool sigpipe_crate_pipe    (void);
+static void sigpipe_trap_signals  (void);
+bool        sigpipe_init          (void);
+void        sigpipe_quit          (void);
 
 /* ========================================================================= *
  * Data
  * ========================================================================= */
 
-/** Pipe fd for transferring signals to mainloop context */
+/** Signalfd for transferring signals to mainloop context */
 static int sigpipe_fd = -1;
 
-/** Glib io watch callback for reading signals from signal pipe
+/** Event loop watch id for sigpipe_fd */
+static guint sigpipe_watch_id = 0;
+
+/** Event loop callback for reading signals from signalfd
  *
- * @param channel   glib io channel
- * @param condition wakeup reason
- * @param data      user data (unused)
+ * @param fd      signalfd file descriptor
+ * @param events  wakeup reason
+ * @param aptr    user data (unused)
  *
- * @return TRUE to keep the iowatch, or FALSE to disable it
+ * @return true to keep the iowatch, or false to disable it
  */
-static gboolean
-sigpipe_read_signal_cb(GIOChannel *channel,
-                       GIOCondition condition,
-                       gpointer data)
+static bool
+sigpipe_read_signal_cb(int fd, uint32_t events, void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    gboolean keep_watch = FALSE;
+    bool keep_watch = false;
 
-    int fd, rc, sig;
+    struct signalfd_siginfo ssi;
+    int rc, sig;
 
-    (void)data;
+    (void)aptr;
 
     /* Should never happen, but we must disable the io watch
-     * if the pipe fd still goes into unexpected state ... */
-    if( condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
+     * if the signalfd still goes into unexpected state ... */
+    if( events & (EPOLLERR | EPOLLHUP) )
         goto EXIT;
 
-    if( (fd = g_io_channel_unix_get_fd(channel)) == -1 )
+    rc = TEMP_FAILURE_RETRY(read(fd, &ssi, sizeof ssi));
+
+    if( rc == -1 && errno == EAGAIN ) {
+        keep_watch = true;
         goto EXIT;
+    }
 
     /* If the actual read fails, terminate with core dump */
-    rc = TEMP_FAILURE_RETRY(read(fd, &sig, sizeof sig));
-    if( rc != (int)sizeof sig )
+    if( rc != (int)sizeof ssi )
         abort();
 
+    sig = (int)ssi.ssi_signo;
+
+    switch( sig )
+    {
+    case SIGINT:
+    case SIGQUIT:
+    case SIGTERM:
+        /* Further exit signals are not routed via mainloop. If
+         * we receive them, assume that exit is stuck and terminate
+         * with core dump. */
+        sigpipe_trap_signals();
+        break;
+
+    default:
+        break;
+    }
+
     /* handle the signal */
     usbmoded_handle_signal(sig);
 
-    keep_watch = TRUE;
+    keep_watch = true;
 
 EXIT:
-    if( !keep_watch )
+    if( !keep_watch ) {
         log_crit("disabled signal handler io watch\n");
+        sigpipe_watch_id = 0;
+    }
 
     return keep_watch;
 }
 
-/** Async signal handler for writing signals to signal pipe
+/** Async signal handler for exit signals received during exit
  *
- * @param sig the signal number to pass to mainloop via pipe
+ * @param sig the signal number
  */
 static void
 sigpipe_trap_signal_cb(int sig)
@@ -107,38 +136,32 @@ sigpipe_trap_signal_cb(int sig)
 
     /* NOTE: This function *MUST* be kept async-signal-safe! */
 
-    static volatile int exit_tries = 0;
-
-    int rc;
-
-    /* Restore signal handler */
-    signal(sig, sigpipe_trap_signal_cb);
-
-    switch( sig )
-    {
-    case SIGINT:
-    case SIGQUIT:
-    case SIGTERM:
-        /* If we receive multiple signals that should have
-         * caused the process to exit, assume that mainloop
-         * is stuck and terminate with core dump. */
-        if( ++exit_tries >= 2 )
-            abort();
-        break;
+    (void)sig;
 
-    default:
-        break;
-    }
+    abort();
+}
 
-    /* Transfer the signal to mainloop via pipe ... */
-    rc = TEMP_FAILURE_RETRY(write(sigpipe_fd, &sig, sizeof sig));
+/** Fill in set of signals handled via signalfd
+ *
+ * @param ss  signal set to fill in
+ */
+static void
+sigpipe_fill_sigset(sigset_t *ss)
+{
+    LOG_REGISTER_CONTEXT;
 
-    /* ... or terminate with core dump in case of failures */
-    if( rc != (int)sizeof sig )
-        abort();
+    sigemptyset(ss);
+    sigaddset(ss, SIGINT);
+    sigaddset(ss, SIGQUIT);
+    sigaddset(ss, SIGTERM);
+    sigaddset(ss, SIGHUP);
+    sigaddset(ss, SIGUSR2);
 }
 
-/** Create a pipe and io watch for handling signal from glib mainloop
+/** Block signals and create signalfd for handling them from mainloop
+ *
+ * Must be called before any threads are created so that the signal
+ * mask is inherited by all of them.
  *
  * @return true on success, or false in case of errors
  */
@@ -147,34 +170,37 @@ sigpipe_crate_pipe(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool        res    = false;
-    GIOChannel *chn    = 0;
-    int         pfd[2] = { -1, -1 };
+    bool     res = false;
+    int      fd  = -1;
+    sigset_t ss;
 
-    if( pipe2(pfd, O_CLOEXEC) == -1 )
+    sigpipe_fill_sigset(&ss);
+
+    if( sigprocmask(SIG_BLOCK, &ss, 0) == -1 )
         goto EXIT;
 
-    if( (chn = g_io_channel_unix_new(pfd[0])) == 0 )
+    if( (fd = signalfd(-1, &ss, SFD_CLOEXEC | SFD_NONBLOCK)) == -1 )
         goto EXIT;
 
-    if( !g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                        sigpipe_read_signal_cb, 0) )
+    sigpipe_watch_id = evloop_add_io("signal", EVLOOP_PRIO_SIGNAL, fd,
+                                     EPOLLIN, sigpipe_read_signal_cb, 0);
+    if( !sigpipe_watch_id )
         goto EXIT;
 
-    g_io_channel_set_close_on_unref(chn, true), pfd[0] = -1;
-    sigpipe_fd = pfd[1], pfd[1] = -1;
+    sigpipe_fd = fd, fd = -1;
 
     res = true;
 
 EXIT:
-    if( chn ) g_io_channel_unref(chn);
-    if( pfd[0] != -1 ) close(pfd[0]);
-    if( pfd[1] != -1 ) close(pfd[1]);
+    if( fd != -1 ) close(fd);
 
     return res;
 }
 
-/** Install async signal handlers
+/** Install async signal handlers for exit signals
+ *
+ * Used after the first exit signal has been processed. Any further
+ * exit signals lead to immediate termination with core dump.
  */
 static void
 sigpipe_trap_signals(void)
@@ -186,14 +212,19 @@ sigpipe_trap_signals(void)
         SIGINT,
         SIGQUIT,
         SIGTERM,
-        SIGHUP,
         -1
     };
 
+    sigset_t ss;
+    sigemptyset(&ss);
+
     for( size_t i = 0; sig[i] != -1; ++i )
     {
         signal(sig[i], sigpipe_trap_signal_cb);
+        sigaddset(&ss, sig[i]);
     }
+
+    sigprocmask(SIG_UNBLOCK, &ss, 0);
 }
 
 /** Initialize signal trapping
@@ -210,10 +241,22 @@ sigpipe_init(void)
     if( !sigpipe_crate_pipe() )
         goto EXIT;
 
-    sigpipe_trap_signals();
-
     success = true;
 
 EXIT:
     return success;
 }
+
+/** Stop signal trapping
+ */
+void
+sigpipe_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( sigpipe_watch_id )
+        evloop_remove(sigpipe_watch_id), sigpipe_watch_id = 0;
+
+    if( sigpipe_fd != -1 )
+        close(sigpipe_fd), sigpipe_fd = -1;
+}
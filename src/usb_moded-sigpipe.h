@@ -36,6 +36,7 @@
  * ------------------------------------------------------------------------- */
 
 bool sigpipe_init(void);
+void sigpipe_quit(void);
 
 /* Used to retry syscalls that can return EINTR. Taken from Bionic unistd.h */
 #ifndef TEMP_FAILURE_RETRY
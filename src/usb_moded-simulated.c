@@ -0,0 +1,481 @@
+/**
+ * @file usb_moded-simulated.c
+ *
+ * Simulated gadget configuration backend
+ *
+ * Mimics configfs gadget layout in a plain directory tree under the
+ * root prefix given with --root-prefix option. Directories and
+ * attribute files that the kernel would create are made on demand,
+ * which allows running the whole daemon unprivileged on a build
+ * machine for benchmarking and regression testing purposes.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-gadget.h"
+
+#include "usb_moded-common.h"
+#include "usb_moded-config-private.h"
+#include "usb_moded-log.h"
+#include "usb_moded-recorder.h"
+#include "usb_moded-worker.h"
+
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Gadget directory, relative to root prefix */
+#define SIMULATED_GADGET_DIRECTORY  "/config/usb_gadget/g1"
+
+/** UDC class directory, relative to root prefix */
+#define SIMULATED_UDC_DIRECTORY     "/sys/class/udc"
+
+/** Name of the simulated UDC */
+#define SIMULATED_UDC_NAME          "dummy_udc.0"
+
+#define SIMULATED_FUNC_DIRECTORY    "functions"
+#define SIMULATED_CONF_DIRECTORY    "configs/b.1"
+
+#define SIMULATED_FUNCTION_MASS_STORAGE "mass_storage.usb0"
+#define SIMULATED_FUNCTION_RNDIS        "rndis_bam.rndis"
+#define SIMULATED_FUNCTION_MTP          "ffs.mtp"
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * SIMULATED
+ * ------------------------------------------------------------------------- */
+
+static const char *simulated_path          (char *buff, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static bool        simulated_mkdir         (const char *path);
+static bool        simulated_rmdir         (const char *path);
+static bool        simulated_write_file    (const char *path, const char *text);
+static const char *simulated_map_function  (const char *func);
+static bool        simulated_init          (void);
+static void        simulated_quit          (void);
+static bool        simulated_set_functions (const char *functions);
+static bool        simulated_set_ids       (const char *product_id, const char *vendor_id);
+static bool        simulated_set_udc       (bool enable);
+static bool        simulated_add_lun       (int lun);
+static bool        simulated_remove_lun    (int lun);
+static bool        simulated_set_lun_attr  (int lun, const char *attr, const char *value);
+static bool        simulated_set_charging  (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Relocated gadget directory, or NULL when backend is not in use */
+static gchar *simulated_gadget_dir = 0;
+
+/* ========================================================================= *
+ * SIMULATED
+ * ========================================================================= */
+
+/** Construct path under simulated gadget directory
+ *
+ * @param buff  Output buffer
+ * @param size  Size of output buffer
+ * @param fmt   Relative path format string
+ *
+ * @return buff
+ */
+static const char *
+simulated_path(char *buff, size_t size, const char *fmt, ...)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int len = snprintf(buff, size, "%s/", simulated_gadget_dir);
+
+    if( len >= 0 && (size_t)len < size ) {
+        va_list va;
+        va_start(va, fmt);
+        vsnprintf(buff + len, size - len, fmt, va);
+        va_end(va);
+    }
+
+    return buff;
+}
+
+static bool
+simulated_mkdir(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+
+    if( g_mkdir_with_parents(path, 0775) == -1 ) {
+        log_err("%s: mkdir failed: %m", path);
+        ack = false;
+    }
+
+    return ack;
+}
+
+/** Remove directory, including attribute files created for it
+ */
+static bool
+simulated_rmdir(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    DIR *dir = opendir(path);
+
+    if( !dir ) {
+        ack = (errno == ENOENT);
+        if( !ack )
+            log_err("%s: opendir failed: %m", path);
+        goto EXIT;
+    }
+
+    struct dirent *de;
+    while( (de = readdir(dir)) ) {
+        if( de->d_type == DT_REG )
+            unlinkat(dirfd(dir), de->d_name, 0);
+    }
+
+    if( rmdir(path) == -1 && errno != ENOENT ) {
+        log_err("%s: rmdir failed: %m", path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    if( dir )
+        closedir(dir);
+
+    return ack;
+}
+
+/** Write attribute file, creating it if needed
+ *
+ * Follows the same rules as configfs_write_file() so that simulated
+ * mode switches produce equivalent recorder events and honor
+ * cancellation in the same way.
+ */
+static bool
+simulated_write_file(const char *path, const char *text)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    int  fd  = -1;
+
+    if( *text && worker_bailing_out() ) {
+        log_warning("%s: write canceled", path);
+        goto EXIT;
+    }
+
+    log_debug("WRITE %s '%s'", path, text);
+
+    if( (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ) {
+        log_err("%s: can't open for writing: %m", path);
+        goto EXIT;
+    }
+
+    char buff[64];
+    snprintf(buff, sizeof buff, "%s\n", text);
+    size_t size = strlen(buff);
+
+    if( write(fd, buff, size) != (ssize_t)size ) {
+        log_err("%s: write failure: %m", path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    const char *file = strrchr(path, '/');
+    recorder_event(RECORDER_WRITE, ack, file ? file + 1 : path, text);
+
+    return ack;
+}
+
+static const char *
+simulated_map_function(const char *func)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !strcmp(func, "mass_storage") )
+        func = SIMULATED_FUNCTION_MASS_STORAGE;
+    else if( !strcmp(func, "rndis") )
+        func = SIMULATED_FUNCTION_RNDIS;
+    else if( !strcmp(func, "mtp") || !strcmp(func, "ffs") )
+        func = SIMULATED_FUNCTION_MTP;
+    return func;
+}
+
+/** Set up simulated gadget tree
+ *
+ * Available only when a root prefix has been set, so that the
+ * backend can never be selected on real hardware by accident.
+ *
+ * @return true if backend is ready for use, false otherwise
+ */
+static bool
+simulated_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char   path[PATH_MAX];
+    gchar *text = 0;
+
+    if( simulated_gadget_dir )
+        goto EXIT;
+
+    if( !common_get_root_prefix() )
+        goto EXIT;
+
+    simulated_gadget_dir = g_strdup(common_root_path(SIMULATED_GADGET_DIRECTORY));
+
+    snprintf(path, sizeof path, "%s/%s",
+             common_root_path(SIMULATED_UDC_DIRECTORY), SIMULATED_UDC_NAME);
+    if( !simulated_mkdir(path) )
+        goto FAIL;
+
+    if( !simulated_mkdir(simulated_path(path, sizeof path,
+                                        SIMULATED_CONF_DIRECTORY)) )
+        goto FAIL;
+
+    if( !simulated_mkdir(simulated_path(path, sizeof path,
+                                        SIMULATED_FUNC_DIRECTORY)) )
+        goto FAIL;
+
+    if( !simulated_mkdir(simulated_path(path, sizeof path,
+                                        "strings/0x409")) )
+        goto FAIL;
+
+    if( !simulated_write_file(simulated_path(path, sizeof path, "UDC"), "") )
+        goto FAIL;
+
+    if( (text = config_get_android_vendor_id()) )
+        simulated_write_file(simulated_path(path, sizeof path, "idVendor"), text);
+    g_free(text);
+
+    if( (text = config_get_android_product_id()) )
+        simulated_write_file(simulated_path(path, sizeof path, "idProduct"), text);
+    g_free(text);
+
+    if( (text = common_get_android_serial()) )
+        simulated_write_file(simulated_path(path, sizeof path,
+                                            "strings/0x409/serialnumber"), text);
+    g_free(text);
+
+    log_warning("SIMULATED gadget in %s", simulated_gadget_dir);
+
+EXIT:
+    return simulated_gadget_dir != 0;
+
+FAIL:
+    simulated_quit();
+    goto EXIT;
+}
+
+static void
+simulated_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(simulated_gadget_dir), simulated_gadget_dir = 0;
+}
+
+/** Select gadget functions
+ *
+ * Like with configfs, functions are enabled by symlinking function
+ * directories to configuration directory.
+ */
+static bool
+simulated_set_functions(const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack  = false;
+    gchar **vec  = 0;
+    DIR    *dir  = 0;
+    char    conf[PATH_MAX];
+    char    func[PATH_MAX];
+    char    link[PATH_MAX];
+
+    if( !simulated_set_udc(false) )
+        goto EXIT;
+
+    simulated_path(conf, sizeof conf, SIMULATED_CONF_DIRECTORY);
+    if( (dir = opendir(conf)) ) {
+        struct dirent *de;
+        while( (de = readdir(dir)) ) {
+            if( de->d_type == DT_LNK )
+                unlinkat(dirfd(dir), de->d_name, 0);
+        }
+        closedir(dir);
+    }
+
+    if( functions ) {
+        vec = g_strsplit(functions, ",", 0);
+        for( size_t i = 0; vec[i]; ++i ) {
+            if( !*vec[i] )
+                continue;
+
+            const char *use = simulated_map_function(vec[i]);
+            simulated_path(func, sizeof func, SIMULATED_FUNC_DIRECTORY "/%s", use);
+            if( !simulated_mkdir(func) )
+                goto EXIT;
+
+            snprintf(link, sizeof link, "%s/%s", conf, use);
+            if( symlink(func, link) == -1 && errno != EEXIST ) {
+                log_err("%s: can't create symlink to %s: %m", link, func);
+                goto EXIT;
+            }
+        }
+    }
+
+    ack = true;
+
+EXIT:
+    log_debug("SIMULATED %s(%s) -> %d", __func__, functions, ack);
+    g_strfreev(vec);
+    return ack;
+}
+
+static bool
+simulated_set_ids(const char *product_id, const char *vendor_id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+    char path[PATH_MAX];
+
+    if( product_id &&
+        !simulated_write_file(simulated_path(path, sizeof path, "idProduct"),
+                              product_id) )
+        ack = false;
+
+    if( vendor_id &&
+        !simulated_write_file(simulated_path(path, sizeof path, "idVendor"),
+                              vendor_id) )
+        ack = false;
+
+    return ack;
+}
+
+static bool
+simulated_set_udc(bool enable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    log_debug("UDC - %s", enable ? "ENABLE" : "DISABLE");
+
+    char path[PATH_MAX];
+    return simulated_write_file(simulated_path(path, sizeof path, "UDC"),
+                                enable ? SIMULATED_UDC_NAME : "");
+}
+
+static bool
+simulated_add_lun(int lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char path[PATH_MAX];
+    simulated_path(path, sizeof path, SIMULATED_FUNC_DIRECTORY "/%s/lun.%d",
+                   SIMULATED_FUNCTION_MASS_STORAGE, lun);
+    return simulated_mkdir(path);
+}
+
+static bool
+simulated_remove_lun(int lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char path[PATH_MAX];
+    simulated_path(path, sizeof path, SIMULATED_FUNC_DIRECTORY "/%s/lun.%d",
+                   SIMULATED_FUNCTION_MASS_STORAGE, lun);
+    return simulated_rmdir(path);
+}
+
+static bool
+simulated_set_lun_attr(int lun, const char *attr, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char path[PATH_MAX];
+    simulated_path(path, sizeof path, SIMULATED_FUNC_DIRECTORY "/%s/lun.%d/%s",
+                   SIMULATED_FUNCTION_MASS_STORAGE, lun, attr);
+    return simulated_write_file(path, value);
+}
+
+static bool
+simulated_set_charging(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( !simulated_set_functions("mass_storage") )
+        goto EXIT;
+
+    simulated_set_ids("0AFE", 0);
+
+    if( !simulated_set_udc(true) )
+        goto EXIT;
+
+    ack = true;
+
+EXIT:
+    log_debug("SIMULATED %s() -> %d", __func__, ack);
+    return ack;
+}
+
+/** Gadget configuration in simulated configfs tree
+ *
+ * MTP endpoints are not simulated, so mtp daemon is started only
+ * after the gadget has been attached.
+ */
+const gadget_backend_t simulated_backend =
+{
+    .gb_name            = "simulated",
+    .gb_last_resort     = false,
+    .gb_max_luns        = 0,
+    .gb_mtpd_before_udc = false,
+    .gb_extra_sysfs     = false,
+    .gb_charging_module = 0,
+    .gb_init            = simulated_init,
+    .gb_quit            = simulated_quit,
+    .gb_set_functions   = simulated_set_functions,
+    .gb_set_ids         = simulated_set_ids,
+    .gb_set_udc         = simulated_set_udc,
+    .gb_add_lun         = simulated_add_lun,
+    .gb_remove_lun      = simulated_remove_lun,
+    .gb_set_lun_attr    = simulated_set_lun_attr,
+    .gb_set_charging    = simulated_set_charging,
+};
@@ -25,9 +25,16 @@
 
 #include "usb_moded-systemd.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <pthread.h>
+
 /* ========================================================================= *
  * Constants
  * ========================================================================= */
@@ -36,6 +43,42 @@
 #define SYSTEMD_DBUS_PATH      "/org/freedesktop/systemd1"
 #define SYSTEMD_DBUS_INTERFACE "org.freedesktop.systemd1.Manager"
 
+/** Signal emitted by systemd when a job finishes */
+#define SYSTEMD_JOB_REMOVED    "JobRemoved"
+
+/** Match rule for SYSTEMD_JOB_REMOVED signals */
+#define SYSTEMD_JOB_REMOVED_RULE\
+    "type='signal'"\
+    ",sender='"SYSTEMD_DBUS_SERVICE"'"\
+    ",path='"SYSTEMD_DBUS_PATH"'"\
+    ",interface='"SYSTEMD_DBUS_INTERFACE"'"\
+    ",member='"SYSTEMD_JOB_REMOVED"'"
+
+/** Maximum time to wait for a job to finish [ms]
+ *
+ * Units that take longer than this are assumed to be still
+ * starting up rather than failed.
+ */
+#define SYSTEMD_JOB_TIMEOUT_MS 5000
+
+/** How often job waits check for cancellation [ms] */
+#define SYSTEMD_JOB_POLL_MS    100
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Thread waiting for a job to finish
+ */
+typedef struct systemd_waiter_t
+{
+    /** Unit name the job was queued for */
+    const char *unit;
+
+    /** Finished jobs for the unit: job path -> result */
+    GHashTable *removed;
+} systemd_waiter_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -44,9 +87,19 @@
  * SYSTEMD
  * ------------------------------------------------------------------------- */
 
-gboolean systemd_control_service(const char *name, const char *method);
-gboolean systemd_control_start  (void);
-void     systemd_control_stop   (void);
+static gchar             *systemd_control_job     (const char *name, const char *method);
+gboolean                  systemd_control_service (const char *name, const char *method);
+gboolean                  systemd_control_wait    (const char *name, const char *method, gchar **result, systemd_cancel_fn cancel_cb);
+gboolean                  systemd_control_start   (void);
+void                      systemd_control_stop    (void);
+
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_JOB
+ * ------------------------------------------------------------------------- */
+
+static DBusHandlerResult  systemd_job_filter_cb   (DBusConnection *con, DBusMessage *msg, void *aptr);
+static void               systemd_job_track       (void);
+static void               systemd_job_untrack     (void);
 
 /* ========================================================================= *
  * Data
@@ -55,6 +108,18 @@ void     systemd_control_stop   (void);
 /* SystemBus connection ref used for systemd control ipc */
 static DBusConnection *systemd_con = NULL;
 
+/** Flag for: SYSTEMD_JOB_REMOVED signals are being tracked */
+static bool systemd_job_tracking = false;
+
+/** Lock for systemd_waiter_list */
+static pthread_mutex_t systemd_job_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when jobs are removed */
+static pthread_cond_t systemd_job_cond = PTHREAD_COND_INITIALIZER;
+
+/** Threads waiting for jobs to finish */
+static GSList *systemd_waiter_list = NULL;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -62,12 +127,20 @@ static DBusConnection *systemd_con = NULL;
 // QDBusObjectPath org.freedesktop.systemd1.Manager.StartUnit(QString name, QString mode)
 // QDBusObjectPath org.freedesktop.systemd1.Manager.StopUnit(QString name, QString mode)
 
-//  mode = replace
-//  method = StartUnit or StopUnit
-gboolean systemd_control_service(const char *name, const char *method)
+/** Queue systemd unit start/stop job
+ *
+ * mode = replace
+ *
+ * @param name    Unit name
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @return job object path, or NULL on failure; caller must release
+ */
+static gchar *systemd_control_job(const char *name, const char *method)
 {
     LOG_REGISTER_CONTEXT;
 
+    DBusConnection *con = NULL;
     DBusMessage    *req = NULL;
     DBusMessage    *rsp = NULL;
     DBusError       err = DBUS_ERROR_INIT;
@@ -81,6 +154,10 @@ gboolean systemd_control_service(const char *name, const char *method)
         goto EXIT;
     }
 
+    /* Worker and helper threads get private connections */
+    if( !(con = umdbus_get_connection()) )
+        goto EXIT;
+
     req = dbus_message_new_method_call(SYSTEMD_DBUS_SERVICE,
                                        SYSTEMD_DBUS_PATH,
                                        SYSTEMD_DBUS_INTERFACE,
@@ -101,7 +178,7 @@ gboolean systemd_control_service(const char *name, const char *method)
         goto EXIT;
     }
 
-    rsp = dbus_connection_send_with_reply_and_block(systemd_con, req, -1, &err);
+    rsp = umdbus_send_with_reply_and_block(con, req, &err);
     if( !rsp ) {
         log_err("no reply to %s.%s request: %s: %s",
                 SYSTEMD_DBUS_INTERFACE,
@@ -132,12 +209,248 @@ EXIT:
 
     dbus_error_free(&err);
 
+    /* Reply owns the job path string */
+    log_debug("%s(%s) -> %s", method, name, res ?: "N/A");
+    gchar *job = g_strdup(res);
+
     if( rsp ) dbus_message_unref(rsp);
     if( req ) dbus_message_unref(req);
+    if( con ) dbus_connection_unref(con);
 
-    log_debug("%s(%s) -> %s", method, name, res ?: "N/A");
+    return job;
+}
+
+//  mode = replace
+//  method = StartUnit or StopUnit
+gboolean systemd_control_service(const char *name, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
 
-    return res != 0;
+    gchar *job = systemd_control_job(name, method);
+    gboolean ack = (job != 0);
+    g_free(job);
+    return ack;
+}
+
+/** Start/stop systemd unit and wait for the job to finish
+ *
+ * Unlike systemd_control_service(), which returns as soon as
+ * systemd has accepted the job, this waits until the unit has
+ * actually reached the requested state or failed to do so.
+ *
+ * If the job does not finish within SYSTEMD_JOB_TIMEOUT_MS, or job
+ * tracking is not available, the unit is assumed to be on its way
+ * and "timeout" / "untracked" is reported as result.
+ *
+ * The wait is abandoned, with "canceled" as result, when cancel_cb
+ * returns true. As the callback is explicit, this works regardless
+ * of which thread the wait is made from.
+ *
+ * @param name       Unit name
+ * @param method     SYSTEMD_START or SYSTEMD_STOP
+ * @param result     Where to store job result string, or NULL;
+ *                   caller must release with g_free()
+ * @param cancel_cb  Cancellation check, or NULL
+ *
+ * @return TRUE if job finished successfully or could not be
+ *         tracked, FALSE if it could not be queued or it failed
+ */
+gboolean systemd_control_wait(const char *name, const char *method, gchar **result,
+                              systemd_cancel_fn cancel_cb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gboolean          ack    = FALSE;
+    gchar            *job    = 0;
+    const char       *res    = 0;
+    systemd_waiter_t  waiter = {
+        .unit    = name,
+        .removed = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         g_free, g_free),
+    };
+
+    /* Start collecting results before queuing the job, as the job
+     * might finish before the reply to StartUnit is processed */
+    pthread_mutex_lock(&systemd_job_mutex);
+    systemd_waiter_list = g_slist_prepend(systemd_waiter_list, &waiter);
+    pthread_mutex_unlock(&systemd_job_mutex);
+
+    if( !(job = systemd_control_job(name, method)) ) {
+        res = "not-queued";
+        goto EXIT;
+    }
+
+    if( !systemd_job_tracking ) {
+        res = "untracked";
+        ack = TRUE;
+        goto EXIT;
+    }
+
+    int64_t due = common_get_monotonic_ms() + SYSTEMD_JOB_TIMEOUT_MS;
+
+    pthread_mutex_lock(&systemd_job_mutex);
+    while( !(res = g_hash_table_lookup(waiter.removed, job)) ) {
+        int64_t left = due - common_get_monotonic_ms();
+        if( left <= 0 ) {
+            res = "timeout";
+            break;
+        }
+        if( cancel_cb && cancel_cb() ) {
+            res = "canceled";
+            break;
+        }
+        if( left > SYSTEMD_JOB_POLL_MS )
+            left = SYSTEMD_JOB_POLL_MS;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += left / 1000;
+        ts.tv_nsec += (left % 1000) * 1000000;
+        if( ts.tv_nsec >= 1000000000 )
+            ts.tv_sec += 1, ts.tv_nsec -= 1000000000;
+        pthread_cond_timedwait(&systemd_job_cond, &systemd_job_mutex, &ts);
+    }
+    res = g_intern_string(res);
+    pthread_mutex_unlock(&systemd_job_mutex);
+
+    if( !strcmp(res, "done") ) {
+        ack = TRUE;
+    }
+    else if( !strcmp(res, "timeout") ) {
+        log_warning("%s(%s): job did not finish in %d ms",
+                    method, name, SYSTEMD_JOB_TIMEOUT_MS);
+        ack = TRUE;
+    }
+    else {
+        log_warning("%s(%s): job finished with result: %s",
+                    method, name, res);
+    }
+
+EXIT:
+    pthread_mutex_lock(&systemd_job_mutex);
+    systemd_waiter_list = g_slist_remove(systemd_waiter_list, &waiter);
+    pthread_mutex_unlock(&systemd_job_mutex);
+
+    g_hash_table_unref(waiter.removed);
+    g_free(job);
+
+    if( result )
+        *result = g_strdup(res);
+
+    return ack;
+}
+
+/* ========================================================================= *
+ * SYSTEMD_JOB
+ * ========================================================================= */
+
+/** D-Bus message filter for tracking finished systemd jobs
+ *
+ * Executed in mainloop context, wakes up threads blocked in
+ * systemd_control_wait().
+ *
+ * @param con   D-Bus connection
+ * @param msg   Incoming message
+ * @param aptr  (unused)
+ *
+ * @return DBUS_HANDLER_RESULT_NOT_YET_HANDLED
+ */
+static DBusHandlerResult
+systemd_job_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)con;
+    (void)aptr;
+
+    DBusError     err    = DBUS_ERROR_INIT;
+    dbus_uint32_t id     = 0;
+    const char   *job    = 0;
+    const char   *unit   = 0;
+    const char   *result = 0;
+
+    if( !dbus_message_is_signal(msg, SYSTEMD_DBUS_INTERFACE, SYSTEMD_JOB_REMOVED) )
+        goto EXIT;
+
+    if( !dbus_message_get_args(msg, &err,
+                               DBUS_TYPE_UINT32, &id,
+                               DBUS_TYPE_OBJECT_PATH, &job,
+                               DBUS_TYPE_STRING, &unit,
+                               DBUS_TYPE_STRING, &result,
+                               DBUS_TYPE_INVALID) ) {
+        log_err("failed to parse %s signal: %s: %s",
+                SYSTEMD_JOB_REMOVED, err.name, err.message);
+        goto EXIT;
+    }
+
+    pthread_mutex_lock(&systemd_job_mutex);
+    for( GSList *iter = systemd_waiter_list; iter; iter = iter->next ) {
+        systemd_waiter_t *waiter = iter->data;
+        if( !strcmp(waiter->unit, unit) )
+            g_hash_table_replace(waiter->removed, g_strdup(job), g_strdup(result));
+    }
+    pthread_cond_broadcast(&systemd_job_cond);
+    pthread_mutex_unlock(&systemd_job_mutex);
+
+EXIT:
+    dbus_error_free(&err);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/** Start tracking systemd job completion signals
+ *
+ * Systemd broadcasts job signals only after some client has
+ * subscribed to them.
+ */
+static void
+systemd_job_track(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage *req = 0;
+
+    if( systemd_job_tracking || !systemd_con )
+        goto EXIT;
+
+    if( !dbus_connection_add_filter(systemd_con, systemd_job_filter_cb, 0, 0) )
+        goto EXIT;
+
+    dbus_bus_add_match(systemd_con, SYSTEMD_JOB_REMOVED_RULE, 0);
+
+    req = dbus_message_new_method_call(SYSTEMD_DBUS_SERVICE,
+                                       SYSTEMD_DBUS_PATH,
+                                       SYSTEMD_DBUS_INTERFACE,
+                                       "Subscribe");
+    if( req ) {
+        dbus_message_set_no_reply(req, TRUE);
+        dbus_connection_send(systemd_con, req, 0);
+    }
+
+    systemd_job_tracking = true;
+
+EXIT:
+    if( req )
+        dbus_message_unref(req);
+}
+
+/** Stop tracking systemd job completion signals
+ */
+static void
+systemd_job_untrack(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !systemd_job_tracking )
+        goto EXIT;
+
+    systemd_job_tracking = false;
+
+    if( dbus_connection_get_is_connected(systemd_con) )
+        dbus_bus_remove_match(systemd_con, SYSTEMD_JOB_REMOVED_RULE, 0);
+    dbus_connection_remove_filter(systemd_con, systemd_job_filter_cb, 0);
+
+EXIT:
+    return;
 }
 
 /* ========================================================================= *
@@ -159,6 +472,10 @@ systemd_control_start(void)
         log_err("Could not connect to dbus for systemd control\n");
         goto cleanup;
     }
+
+    /* Allow waiting for start/stop jobs to finish */
+    systemd_job_track();
+
     ack = TRUE;
 
 cleanup:
@@ -175,6 +492,8 @@ systemd_control_stop(void)
 
     if(systemd_con)
     {
+        systemd_job_untrack();
+
         /* Let go of connection ref */
         dbus_connection_unref(systemd_con),
             systemd_con = 0;
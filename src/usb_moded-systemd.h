@@ -27,6 +27,8 @@
 
 # include <glib.h>
 
+# include <stdbool.h>
+
 /* ========================================================================= *
  * Constants
  * ========================================================================= */
@@ -34,6 +36,13 @@
 # define SYSTEMD_STOP   "StopUnit"
 # define SYSTEMD_START   "StartUnit"
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Callback for checking whether a job wait should be abandoned */
+typedef bool (*systemd_cancel_fn)(void);
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -43,6 +52,7 @@
  * ------------------------------------------------------------------------- */
 
 gboolean systemd_control_service(const char *name, const char *method);
+gboolean systemd_control_wait   (const char *name, const char *method, gchar **result, systemd_cancel_fn cancel_cb);
 gboolean systemd_control_start  (void);
 void     systemd_control_stop   (void);
 
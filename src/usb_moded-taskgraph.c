@@ -0,0 +1,412 @@
+/**
+ * @file usb_moded-taskgraph.c
+ *
+ * Dependency graph executor for mode setup steps
+ *
+ * Tasks whose dependencies have been satisfied are started as soon
+ * as possible. Tasks that are allowed to run outside the calling
+ * thread get a helper thread of their own, while the rest are run
+ * one at a time in the calling thread. After the first failure - or
+ * when the caller requests cancellation - no further tasks are
+ * launched, but the ones already running are waited for before
+ * returning.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-taskgraph.h"
+
+#include "usb_moded-common.h"
+#include "usb_moded-log.h"
+
+#include <string.h>
+
+#include <pthread.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Task execution state */
+typedef enum taskgraph_state_t
+{
+    TASKGRAPH_STATE_PENDING,
+    TASKGRAPH_STATE_RUNNING,
+    TASKGRAPH_STATE_DONE,
+    TASKGRAPH_STATE_FAILED,
+} taskgraph_state_t;
+
+/** Bookkeeping data for one taskgraph_run() invocation */
+typedef struct taskgraph_exec_t
+{
+    /** Task table given by the caller */
+    const taskgraph_task_t *tasks;
+
+    /** Number of tasks in the table */
+    size_t                  count;
+
+    /** User data passed to task functions */
+    void                   *aptr;
+
+    /** Phase of the calling thread, inherited by nested task graphs */
+    const char             *phase;
+
+    /** Thread on whose behalf the tasks are executed */
+    pthread_t               owner;
+
+    /** Lock protecting the rest of the data */
+    pthread_mutex_t         mutex;
+
+    /** Signaled whenever a task finishes */
+    pthread_cond_t          cond;
+
+    /** Per task execution state */
+    taskgraph_state_t       state[TASKGRAPH_MAX_TASKS];
+
+    /** Per task start time */
+    int64_t                 started[TASKGRAPH_MAX_TASKS];
+
+    /** Per task helper thread, if any */
+    pthread_t               thread[TASKGRAPH_MAX_TASKS];
+
+    /** Per task flag: helper thread needs to be joined */
+    bool                    joinable[TASKGRAPH_MAX_TASKS];
+
+    /** Mask of successfully finished tasks */
+    uint32_t                done;
+
+    /** Number of tasks currently running */
+    size_t                  running;
+
+    /** Set when any task has failed */
+    bool                    failed;
+} taskgraph_exec_t;
+
+/** Helper thread argument */
+typedef struct taskgraph_helper_t
+{
+    taskgraph_exec_t *exec;
+    size_t            index;
+} taskgraph_helper_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TASKGRAPH
+ * ------------------------------------------------------------------------- */
+
+static bool  taskgraph_is_ready  (const taskgraph_exec_t *exec, size_t index);
+static void  taskgraph_begin     (taskgraph_exec_t *exec, size_t index);
+static void  taskgraph_finish    (taskgraph_exec_t *exec, size_t index, bool success);
+static void *taskgraph_helper_cb (void *aptr);
+static bool  taskgraph_spawn     (taskgraph_exec_t *exec, size_t index);
+bool         taskgraph_run       (const taskgraph_task_t *tasks, size_t count, void *aptr, taskgraph_cancel_fn cancel_cb);
+bool         taskgraph_helper_of (pthread_t thread);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Thread on whose behalf the calling helper thread executes tasks */
+static __thread pthread_t taskgraph_owner_id;
+
+/** Flag for: taskgraph_owner_id is valid, i.e. this is a helper thread */
+static __thread bool      taskgraph_owner_set = false;
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TASKGRAPH
+ * ------------------------------------------------------------------------- */
+
+/** Check if task can be started
+ *
+ * Must be called while holding exec->mutex.
+ *
+ * @param exec   Execution bookkeeping data
+ * @param index  Task index
+ *
+ * @return true if task is pending and all dependencies are done
+ */
+static bool
+taskgraph_is_ready(const taskgraph_exec_t *exec, size_t index)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( exec->state[index] != TASKGRAPH_STATE_PENDING )
+        return false;
+
+    return (exec->tasks[index].after & ~exec->done) == 0;
+}
+
+/** Mark task as running
+ *
+ * Must be called while holding exec->mutex.
+ *
+ * @param exec   Execution bookkeeping data
+ * @param index  Task index
+ */
+static void
+taskgraph_begin(taskgraph_exec_t *exec, size_t index)
+{
+    LOG_REGISTER_CONTEXT;
+
+    exec->state[index]   = TASKGRAPH_STATE_RUNNING;
+    exec->started[index] = common_get_monotonic_ms();
+    exec->running += 1;
+
+    log_debug("task %s: started", exec->tasks[index].name);
+}
+
+/** Mark task as finished and wake up the dispatcher
+ *
+ * Must be called without holding exec->mutex.
+ *
+ * @param exec     Execution bookkeeping data
+ * @param index    Task index
+ * @param success  Return value of the task function
+ */
+static void
+taskgraph_finish(taskgraph_exec_t *exec, size_t index, bool success)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pthread_mutex_lock(&exec->mutex);
+
+    int64_t elapsed = common_get_monotonic_ms() - exec->started[index];
+
+    if( success ) {
+        exec->state[index] = TASKGRAPH_STATE_DONE;
+        exec->done |= TASKGRAPH_DEP(index);
+        log_debug("task %s: done in %lld ms", exec->tasks[index].name,
+                  (long long)elapsed);
+    }
+    else {
+        exec->state[index] = TASKGRAPH_STATE_FAILED;
+        exec->failed = true;
+        log_warning("task %s: failed in %lld ms", exec->tasks[index].name,
+                    (long long)elapsed);
+    }
+
+    exec->running -= 1;
+    pthread_cond_broadcast(&exec->cond);
+    pthread_mutex_unlock(&exec->mutex);
+}
+
+/** Helper thread entry point
+ *
+ * @param aptr  Helper thread argument, ownership is transferred
+ *
+ * @return NULL
+ */
+static void *
+taskgraph_helper_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    taskgraph_helper_t *helper = aptr;
+    taskgraph_exec_t   *exec   = helper->exec;
+    size_t              index  = helper->index;
+
+    g_free(helper);
+
+    taskgraph_owner_id  = exec->owner;
+    taskgraph_owner_set = true;
+
+    log_set_thread_name("taskgraph");
+    log_set_phase(exec->phase ?: exec->tasks[index].name);
+    bool success = exec->tasks[index].fn(exec->tasks[index].aptr ?: exec->aptr);
+    log_set_phase(0);
+    taskgraph_finish(exec, index, success);
+
+    return NULL;
+}
+
+/** Start task in a helper thread
+ *
+ * Must be called while holding exec->mutex.
+ *
+ * @param exec   Execution bookkeeping data
+ * @param index  Task index
+ *
+ * @return true if helper thread was started, false otherwise
+ */
+static bool
+taskgraph_spawn(taskgraph_exec_t *exec, size_t index)
+{
+    LOG_REGISTER_CONTEXT;
+
+    taskgraph_helper_t *helper = g_malloc0(sizeof *helper);
+    helper->exec  = exec;
+    helper->index = index;
+
+    taskgraph_begin(exec, index);
+
+    int err = pthread_create(&exec->thread[index], 0,
+                             taskgraph_helper_cb, helper);
+    if( err ) {
+        log_warning("task %s: failed to start helper thread: %s",
+                    exec->tasks[index].name, strerror(err));
+        exec->state[index] = TASKGRAPH_STATE_PENDING;
+        exec->running -= 1;
+        g_free(helper);
+        return false;
+    }
+
+    exec->joinable[index] = true;
+    return true;
+}
+
+/** Execute tasks in dependency order
+ *
+ * Tasks marked with TASKGRAPH_RUN_ON_HELPER are started in separate
+ * threads as soon as their dependencies have finished. Remaining
+ * tasks are executed in the calling thread.
+ *
+ * The cancel callback, if given, is invoked from the calling thread
+ * before launching new tasks.
+ *
+ * @param tasks      Array of task descriptions
+ * @param count      Number of tasks, at most TASKGRAPH_MAX_TASKS
+ * @param aptr       User data to pass to task functions
+ * @param cancel_cb  Cancellation check callback, or NULL
+ *
+ * @return true if all enabled tasks were executed successfully,
+ *         false otherwise
+ */
+bool
+taskgraph_run(const taskgraph_task_t *tasks, size_t count, void *aptr,
+              taskgraph_cancel_fn cancel_cb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool             ack       = false;
+    bool             cancelled = false;
+    int64_t          started   = common_get_monotonic_ms();
+    taskgraph_exec_t exec;
+
+    if( count > TASKGRAPH_MAX_TASKS ) {
+        log_crit("too many tasks: %zu", count);
+        goto EXIT;
+    }
+
+    memset(&exec, 0, sizeof exec);
+    exec.tasks = tasks;
+    exec.count = count;
+    exec.aptr  = aptr;
+    exec.phase = log_get_phase();
+    exec.owner = taskgraph_owner_set ? taskgraph_owner_id : pthread_self();
+    pthread_mutex_init(&exec.mutex, 0);
+    pthread_cond_init(&exec.cond, 0);
+
+    /* Disabled tasks are considered finished from the start */
+    for( size_t i = 0; i < count; ++i ) {
+        if( !tasks[i].enabled ) {
+            exec.state[i] = TASKGRAPH_STATE_DONE;
+            exec.done |= TASKGRAPH_DEP(i);
+        }
+    }
+
+    pthread_mutex_lock(&exec.mutex);
+
+    for( ;; ) {
+        size_t inline_task = count;
+
+        if( !exec.failed && !cancelled && cancel_cb && cancel_cb() ) {
+            log_warning("task graph execution canceled");
+            cancelled = true;
+        }
+
+        if( !exec.failed && !cancelled ) {
+            for( size_t i = 0; i < count; ++i ) {
+                if( !taskgraph_is_ready(&exec, i) )
+                    continue;
+
+                if( tasks[i].run_on == TASKGRAPH_RUN_ON_HELPER &&
+                    taskgraph_spawn(&exec, i) )
+                    continue;
+
+                if( inline_task == count )
+                    inline_task = i;
+            }
+        }
+
+        if( inline_task != count ) {
+            taskgraph_begin(&exec, inline_task);
+            pthread_mutex_unlock(&exec.mutex);
+            log_set_phase(exec.phase ?: tasks[inline_task].name);
+            bool success = tasks[inline_task].fn(tasks[inline_task].aptr ?: aptr);
+            log_set_phase(exec.phase);
+            taskgraph_finish(&exec, inline_task, success);
+            pthread_mutex_lock(&exec.mutex);
+            continue;
+        }
+
+        if( exec.running == 0 )
+            break;
+
+        pthread_cond_wait(&exec.cond, &exec.mutex);
+    }
+
+    pthread_mutex_unlock(&exec.mutex);
+
+    for( size_t i = 0; i < count; ++i ) {
+        if( exec.joinable[i] )
+            pthread_join(exec.thread[i], 0);
+    }
+
+    pthread_cond_destroy(&exec.cond);
+    pthread_mutex_destroy(&exec.mutex);
+
+    ack = !exec.failed && !cancelled;
+
+    for( size_t i = 0; ack && i < count; ++i ) {
+        if( exec.state[i] != TASKGRAPH_STATE_DONE ) {
+            log_crit("task %s: dependencies can't be satisfied",
+                     tasks[i].name);
+            ack = false;
+        }
+    }
+
+EXIT:
+    log_debug("task graph %s in %lld ms", ack ? "done" : "failed",
+              (long long)(common_get_monotonic_ms() - started));
+    return ack;
+}
+
+/** Check if calling thread is a helper acting on behalf of given thread
+ *
+ * Ownership is inherited by nested task graphs, so that helpers of
+ * helpers are attributed to the thread that started the outermost
+ * graph.
+ *
+ * @param thread  Thread that is expected to own the helper
+ *
+ * @return true if calling thread executes tasks for the given thread,
+ *         false otherwise
+ */
+bool
+taskgraph_helper_of(pthread_t thread)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return taskgraph_owner_set && pthread_equal(taskgraph_owner_id, thread);
+}
@@ -0,0 +1,119 @@
+/**
+ * @file usb_moded-taskgraph.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_TASKGRAPH_H_
+# define USB_MODED_TASKGRAPH_H_
+
+# include <stdbool.h>
+# include <stddef.h>
+# include <stdint.h>
+
+# include <pthread.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of tasks in one graph */
+# define TASKGRAPH_MAX_TASKS 32
+
+/** Dependency mask bit for task at given index */
+# define TASKGRAPH_DEP(index) (UINT32_C(1) << (index))
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Thread on which a task is executed
+ */
+typedef enum taskgraph_run_on_t
+{
+    /** Task must run in the thread that called taskgraph_run()
+     *
+     * Use for steps that need thread bound resources, e.g.
+     * private D-Bus connections.
+     */
+    TASKGRAPH_RUN_ON_CALLER,
+
+    /** Task may run in a short lived helper thread
+     *
+     * Use for blocking steps that touch only sysfs, spawn
+     * external commands or make D-Bus calls over a private
+     * connection of their own. Helper threads are considered
+     * to act on behalf of the thread that started the graph,
+     * so worker cancellation checks work also there, see
+     * taskgraph_helper_of().
+     */
+    TASKGRAPH_RUN_ON_HELPER,
+} taskgraph_run_on_t;
+
+/** Task callback
+ *
+ * @param aptr  Task specific user data, or if not set, user data
+ *              passed to taskgraph_run()
+ *
+ * @return true on success, or false on failure
+ */
+typedef bool (*taskgraph_fn)(void *aptr);
+
+/** Task description
+ */
+typedef struct taskgraph_task_t
+{
+    /** Task name, for diagnostic logging */
+    const char         *name;
+
+    /** Function doing the work */
+    taskgraph_fn        fn;
+
+    /** Mask of TASKGRAPH_DEP() bits for tasks that must finish first */
+    uint32_t            after;
+
+    /** Where to run the task */
+    taskgraph_run_on_t  run_on;
+
+    /** Task specific user data, or NULL to use taskgraph_run() data */
+    void               *aptr;
+
+    /** Whether the task needs to be executed at all
+     *
+     * Disabled tasks are treated as already finished.
+     */
+    bool                enabled;
+} taskgraph_task_t;
+
+/** Callback for checking whether execution should be abandoned
+ *
+ * @return true to stop launching new tasks, false to continue
+ */
+typedef bool (*taskgraph_cancel_fn)(void);
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TASKGRAPH
+ * ------------------------------------------------------------------------- */
+
+bool taskgraph_run      (const taskgraph_task_t *tasks, size_t count, void *aptr, taskgraph_cancel_fn cancel_cb);
+bool taskgraph_helper_of(pthread_t thread);
+
+#endif /* USB_MODED_TASKGRAPH_H_ */
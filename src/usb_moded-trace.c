@@ -0,0 +1,705 @@
+/**
+ * @file usb_moded-trace.c
+ *
+ * Low overhead function tracing
+ *
+ * Every function declares a static trace point via LOG_REGISTER_CONTEXT.
+ * Trace points are grouped to subsystems by source file name, e.g.
+ * usb_moded-worker.c belongs to "worker". While no subsystem is enabled,
+ * a trace point costs a single load and branch on entry and exit.
+ *
+ * For enabled subsystems the function duration is stored into a
+ * lock-free ring buffer at exit. The ring is periodically drained from
+ * the mainloop and streamed to TRACE_OUTPUT_PATH in Chrome trace event
+ * format, which can be loaded as is to e.g. Perfetto UI.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-trace.h"
+
+#include "usb_moded-common.h"
+#include "usb_moded-evloop.h"
+#include "usb_moded-log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/syscall.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of records in trace ring buffer, must be a power of two */
+#define TRACE_RING_SIZE 4096
+
+/** Maximum number of distinct subsystems */
+#define TRACE_MAX_SUBSYSTEMS 63
+
+/** Subsystem bit used when registry is full */
+#define TRACE_OVERFLOW_MASK (UINT64_C(1) << TRACE_MAX_SUBSYSTEMS)
+
+/** How often trace ring is drained to output file [ms] */
+#define TRACE_DRAIN_INTERVAL_MS 250
+
+/** Maximum size of trace output file [bytes]
+ *
+ * Output lives in tmpfs, so tracing is stopped rather than
+ * allowed to eat up memory when left enabled for a long time.
+ */
+#define TRACE_OUTPUT_LIMIT (16 * 1024 * 1024)
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Completed function call */
+typedef struct trace_record_t
+{
+    /** Ring slot sequence number, see trace_ring_reserve() */
+    uint32_t            seq;
+
+    /** Thread id of the caller */
+    int32_t             tid;
+
+    /** Trace point */
+    const trace_site_t *site;
+
+    /** Entry time [ns] */
+    int64_t             start;
+
+    /** Duration [ns] */
+    int64_t             duration;
+} trace_record_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TRACE_SUBSYSTEM
+ * ------------------------------------------------------------------------- */
+
+static gchar      *trace_subsystem_name   (const char *file);
+static bool        trace_subsystem_wanted (const char *name);
+static uint64_t    trace_subsystem_resolve(trace_site_t *site);
+static const char *trace_subsystem_lookup (uint64_t mask);
+static void        trace_subsystem_rethink(void);
+
+/* ------------------------------------------------------------------------- *
+ * TRACE_RING
+ * ------------------------------------------------------------------------- */
+
+static trace_record_t *trace_ring_reserve(void);
+static trace_record_t *trace_ring_peek   (void);
+static void            trace_ring_release(trace_record_t *rec);
+
+/* ------------------------------------------------------------------------- *
+ * TRACE_OUTPUT
+ * ------------------------------------------------------------------------- */
+
+static void trace_output_open   (void);
+static void trace_output_close  (void);
+static void trace_output_drain  (void);
+static bool trace_output_timer_cb(void *aptr);
+static void trace_output_rethink(void);
+
+/* ------------------------------------------------------------------------- *
+ * TRACE
+ * ------------------------------------------------------------------------- */
+
+static int64_t trace_now_ns        (void);
+static int32_t trace_tid           (void);
+trace_frame_t  trace_enter_slow    (trace_site_t *site);
+void           trace_leave_slow    (trace_frame_t *frame);
+void           trace_set_subsystems(const char *list);
+const char    *trace_get_subsystems(void);
+void           trace_init          (void);
+void           trace_quit          (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Bitmask of subsystems for which tracing is enabled */
+uint64_t trace_enabled_mask = 0;
+
+/** Lock for subsystem registry */
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Registered subsystem names, index = bit number */
+static gchar *trace_subsystem[TRACE_MAX_SUBSYSTEMS];
+
+/** Number of registered subsystems */
+static unsigned trace_subsystem_count = 0;
+
+/** Requested subsystems as comma separated list, or "all"
+ *
+ * Modified only by the main thread while holding trace_mutex.
+ */
+static gchar *trace_requested = 0;
+
+/** Trace records, written by any thread and drained by main thread */
+static trace_record_t trace_ring[TRACE_RING_SIZE];
+
+/** Next ring position to reserve, shared by producers */
+static uint32_t trace_ring_head = 0;
+
+/** Next ring position to drain, used only by main thread */
+static uint32_t trace_ring_tail = 0;
+
+/** Number of records dropped due to full ring buffer */
+static uint32_t trace_ring_dropped = 0;
+
+/** Cached thread id */
+static __thread int32_t trace_thread_id = 0;
+
+/** Output file descriptor */
+static int trace_output_fd = -1;
+
+/** Number of bytes written to output file */
+static size_t trace_output_size = 0;
+
+/** Flag for: TRACE_OUTPUT_LIMIT has been reached */
+static bool trace_output_full = false;
+
+/** Timer for draining the ring buffer */
+static guint trace_output_timer_id = 0;
+
+/** Flag for: trace_init() has been called */
+static bool trace_initialized = false;
+
+/* ========================================================================= *
+ * TRACE_SUBSYSTEM
+ * ========================================================================= */
+
+/** Derive subsystem name from source file name
+ *
+ * "src/usb_moded-worker.c" -> "worker", "src/usb_moded.c" -> "main"
+ *
+ * @param file  Source file path
+ *
+ * @return subsystem name; caller must release with g_free()
+ */
+static gchar *
+trace_subsystem_name(const char *file)
+{
+    const char *base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+
+    if( !strncmp(base, "usb_moded-", 10) )
+        base += 10;
+    else if( !strcmp(base, "usb_moded.c") )
+        return g_strdup("main");
+
+    const char *end = strrchr(base, '.');
+    return end ? g_strndup(base, end - base) : g_strdup(base);
+}
+
+/** Check if subsystem has been requested to be traced
+ *
+ * Must be called while holding trace_mutex.
+ *
+ * @param name  Subsystem name
+ *
+ * @return true if subsystem should be traced, false otherwise
+ */
+static bool
+trace_subsystem_wanted(const char *name)
+{
+    bool wanted = false;
+
+    if( !trace_requested )
+        goto EXIT;
+
+    gchar **vec = g_strsplit(trace_requested, ",", 0);
+    for( size_t i = 0; vec[i]; ++i ) {
+        const char *item = g_strstrip(vec[i]);
+        if( !strcmp(item, "all") || !strcmp(item, name) ) {
+            wanted = true;
+            break;
+        }
+    }
+    g_strfreev(vec);
+
+EXIT:
+    return wanted;
+}
+
+/** Assign subsystem bit for trace point
+ *
+ * @param site  Trace point
+ *
+ * @return subsystem bit
+ */
+static uint64_t
+trace_subsystem_resolve(trace_site_t *site)
+{
+    uint64_t mask = __atomic_load_n(&site->mask, __ATOMIC_RELAXED);
+    if( mask )
+        goto EXIT;
+
+    gchar *name = trace_subsystem_name(site->file);
+
+    pthread_mutex_lock(&trace_mutex);
+
+    mask = TRACE_OVERFLOW_MASK;
+    for( unsigned i = 0; i < trace_subsystem_count; ++i ) {
+        if( !strcmp(trace_subsystem[i], name) ) {
+            mask = UINT64_C(1) << i;
+            break;
+        }
+    }
+
+    if( mask == TRACE_OVERFLOW_MASK &&
+        trace_subsystem_count < TRACE_MAX_SUBSYSTEMS ) {
+        unsigned bit = trace_subsystem_count++;
+        trace_subsystem[bit] = name, name = 0;
+        mask = UINT64_C(1) << bit;
+        if( trace_subsystem_wanted(trace_subsystem[bit]) )
+            __atomic_or_fetch(&trace_enabled_mask, mask, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    g_free(name);
+    __atomic_store_n(&site->mask, mask, __ATOMIC_RELAXED);
+
+EXIT:
+    return mask;
+}
+
+/** Get subsystem name for a bit
+ *
+ * Registered names are never released while tracing, so returned
+ * pointer stays valid.
+ *
+ * @param mask  Subsystem bit
+ *
+ * @return subsystem name
+ */
+static const char *
+trace_subsystem_lookup(uint64_t mask)
+{
+    for( unsigned i = 0; i < TRACE_MAX_SUBSYSTEMS; ++i ) {
+        if( mask == (UINT64_C(1) << i) )
+            return trace_subsystem[i] ?: "unknown";
+    }
+    return "other";
+}
+
+/** Re-evaluate enabled mask after change in requested subsystems
+ *
+ * Subsystems are registered lazily, so a subsystem that has not been
+ * seen yet is enabled when its first trace point is hit. To make that
+ * happen, at least one bit is kept set while anything is requested.
+ */
+static void
+trace_subsystem_rethink(void)
+{
+    uint64_t mask = 0;
+
+    pthread_mutex_lock(&trace_mutex);
+
+    if( trace_requested ) {
+        /* Unregistered subsystems are resolved via the slow path */
+        mask |= TRACE_OVERFLOW_MASK;
+        for( unsigned i = 0; i < trace_subsystem_count; ++i ) {
+            if( trace_subsystem_wanted(trace_subsystem[i]) )
+                mask |= UINT64_C(1) << i;
+        }
+        if( !trace_subsystem_wanted("other") &&
+            trace_subsystem_count >= TRACE_MAX_SUBSYSTEMS )
+            mask &= ~TRACE_OVERFLOW_MASK;
+    }
+
+    __atomic_store_n(&trace_enabled_mask, mask, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+/* ========================================================================= *
+ * TRACE_RING
+ * ========================================================================= */
+
+/* Bounded multi-producer, single-consumer queue - see the log ring
+ * buffer in usb_moded-log.c for description of the algorithm. */
+
+/** Reserve a ring slot for writing
+ *
+ * @return slot to fill, or NULL if the ring is full
+ */
+static trace_record_t *
+trace_ring_reserve(void)
+{
+    uint32_t pos = __atomic_load_n(&trace_ring_head, __ATOMIC_RELAXED);
+
+    for( ;; ) {
+        trace_record_t *rec  = &trace_ring[pos & (TRACE_RING_SIZE - 1)];
+        uint32_t        seq  = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        int32_t         diff = (int32_t)(seq - pos);
+
+        if( diff == 0 ) {
+            if( __atomic_compare_exchange_n(&trace_ring_head, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED) )
+                return rec;
+        }
+        else if( diff < 0 ) {
+            __atomic_add_fetch(&trace_ring_dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&trace_ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/** Get the oldest published ring slot
+ *
+ * @return published slot, or NULL if the ring is empty
+ */
+static trace_record_t *
+trace_ring_peek(void)
+{
+    trace_record_t *rec = &trace_ring[trace_ring_tail & (TRACE_RING_SIZE - 1)];
+    uint32_t        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+    if( (int32_t)(seq - (trace_ring_tail + 1)) < 0 )
+        return 0;
+
+    return rec;
+}
+
+/** Hand drained ring slot back to producers
+ *
+ * @param rec  Slot obtained via trace_ring_peek()
+ */
+static void
+trace_ring_release(trace_record_t *rec)
+{
+    __atomic_store_n(&rec->seq, trace_ring_tail + TRACE_RING_SIZE,
+                     __ATOMIC_RELEASE);
+    trace_ring_tail += 1;
+}
+
+/* ========================================================================= *
+ * TRACE_OUTPUT
+ * ========================================================================= */
+
+/** Open trace output file and write trace event array header
+ */
+static void
+trace_output_open(void)
+{
+    const char *path = common_root_path(TRACE_OUTPUT_PATH);
+
+    if( trace_output_fd != -1 )
+        goto EXIT;
+
+    trace_output_fd = open(path,
+                           O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                           O_CLOEXEC, 0600);
+    if( trace_output_fd == -1 ) {
+        log_err("%s: can't open for writing: %m", path);
+        goto EXIT;
+    }
+
+    trace_output_size = 0;
+    trace_output_full = false;
+
+    /* Closing bracket is optional for trace viewers, which allows
+     * streaming and loading files from interrupted sessions */
+    if( write(trace_output_fd, "[\n", 2) == -1 )
+        log_warning("%s: write failure: %m", path);
+    else
+        trace_output_size += 2;
+
+    log_debug("tracing to %s", path);
+
+EXIT:
+    return;
+}
+
+/** Close trace output file
+ */
+static void
+trace_output_close(void)
+{
+    if( trace_output_fd != -1 )
+        close(trace_output_fd), trace_output_fd = -1;
+}
+
+/** Write queued trace records to output file
+ *
+ * When TRACE_OUTPUT_LIMIT would be exceeded, a marker event is
+ * written instead and further records are discarded until tracing
+ * is restarted.
+ */
+static void
+trace_output_drain(void)
+{
+    GString        *buff = g_string_new(0);
+    trace_record_t *rec;
+    pid_t           pid  = getpid();
+
+    while( (rec = trace_ring_peek()) ) {
+        g_string_append_printf(buff,
+                               "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                               "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,"
+                               "\"pid\":%d,\"tid\":%d},\n",
+                               rec->site->func,
+                               trace_subsystem_lookup(rec->site->mask),
+                               (long long)(rec->start / 1000),
+                               (long long)(rec->start % 1000),
+                               (long long)(rec->duration / 1000),
+                               (long long)(rec->duration % 1000),
+                               (int)pid, (int)rec->tid);
+        trace_ring_release(rec);
+    }
+
+    uint32_t dropped = __atomic_exchange_n(&trace_ring_dropped, 0,
+                                           __ATOMIC_RELAXED);
+    if( dropped ) {
+        g_string_append_printf(buff,
+                               "{\"name\":\"dropped %u\",\"ph\":\"i\","
+                               "\"s\":\"g\",\"ts\":%lld,\"pid\":%d},\n",
+                               (unsigned)dropped,
+                               (long long)(trace_now_ns() / 1000),
+                               (int)pid);
+    }
+
+    if( trace_output_fd == -1 || trace_output_full )
+        g_string_truncate(buff, 0);
+
+    if( buff->len && trace_output_size + buff->len > TRACE_OUTPUT_LIMIT ) {
+        log_warning("%s: size limit of %d bytes reached; tracing stopped",
+                    TRACE_OUTPUT_PATH, TRACE_OUTPUT_LIMIT);
+        trace_output_full = true;
+        g_string_printf(buff,
+                        "{\"name\":\"size limit reached\",\"ph\":\"i\","
+                        "\"s\":\"g\",\"ts\":%lld,\"pid\":%d},\n",
+                        (long long)(trace_now_ns() / 1000),
+                        (int)pid);
+    }
+
+    if( buff->len ) {
+        if( write(trace_output_fd, buff->str, buff->len) == -1 )
+            log_warning("%s: write failure: %m", TRACE_OUTPUT_PATH);
+        else
+            trace_output_size += buff->len;
+    }
+
+    g_string_free(buff, TRUE);
+}
+
+/** Timer callback for periodically draining the ring buffer
+ *
+ * @param aptr  (unused)
+ *
+ * @return true to keep the timer running
+ */
+static bool
+trace_output_timer_cb(void *aptr)
+{
+    (void)aptr;
+
+    trace_output_drain();
+
+    /* Removes this timer too */
+    if( trace_output_full )
+        trace_set_subsystems(0);
+
+    return true;
+}
+
+/** Start/stop streaming based on whether anything is being traced
+ */
+static void
+trace_output_rethink(void)
+{
+    if( !trace_initialized )
+        goto EXIT;
+
+    if( trace_requested ) {
+        trace_output_open();
+        if( !trace_output_timer_id )
+            trace_output_timer_id =
+                evloop_add_timer("trace-drain", TRACE_DRAIN_INTERVAL_MS,
+                                 TRACE_DRAIN_INTERVAL_MS / 2,
+                                 trace_output_timer_cb, 0);
+    }
+    else {
+        if( trace_output_timer_id )
+            evloop_remove(trace_output_timer_id), trace_output_timer_id = 0;
+        trace_output_drain();
+        trace_output_close();
+    }
+
+EXIT:
+    return;
+}
+
+/* ========================================================================= *
+ * TRACE
+ * ========================================================================= */
+
+/** Get monotonic time stamp
+ *
+ * @return CLOCK_MONOTONIC time [ns]
+ */
+static int64_t
+trace_now_ns(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** Get cached thread id of the calling thread
+ *
+ * @return thread id
+ */
+static int32_t
+trace_tid(void)
+{
+    if( !trace_thread_id )
+        trace_thread_id = (int32_t)syscall(SYS_gettid);
+    return trace_thread_id;
+}
+
+/** Trace point entry, used when some subsystem is being traced
+ *
+ * @param site  Trace point
+ *
+ * @return activation record
+ */
+trace_frame_t
+trace_enter_slow(trace_site_t *site)
+{
+    trace_frame_t frame = { .site = 0, .start = 0 };
+
+    uint64_t mask = trace_subsystem_resolve(site);
+    if( mask & __atomic_load_n(&trace_enabled_mask, __ATOMIC_RELAXED) ) {
+        frame.site  = site;
+        frame.start = trace_now_ns();
+    }
+
+    return frame;
+}
+
+/** Trace point exit, used for traced calls
+ *
+ * @param frame  Activation record from trace_enter_slow()
+ */
+void
+trace_leave_slow(trace_frame_t *frame)
+{
+    int64_t         now = trace_now_ns();
+    trace_record_t *rec = trace_ring_reserve();
+
+    if( !rec )
+        goto EXIT;
+
+    rec->tid      = trace_tid();
+    rec->site     = frame->site;
+    rec->start    = frame->start;
+    rec->duration = now - frame->start;
+
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELEASE);
+
+EXIT:
+    return;
+}
+
+/** Select subsystems to trace
+ *
+ * @param list  Comma separated list of subsystem names, "all" for
+ *              everything, or NULL / empty string to disable tracing
+ */
+void
+trace_set_subsystems(const char *list)
+{
+    gchar *prev = 0;
+
+    /* Other threads read trace_requested while holding trace_mutex */
+    pthread_mutex_lock(&trace_mutex);
+    prev = trace_requested;
+    trace_requested = (list && *list) ? g_strdup(list) : 0;
+    pthread_mutex_unlock(&trace_mutex);
+
+    g_free(prev);
+
+    log_debug("tracing: %s", trace_requested ?: "disabled");
+
+    trace_subsystem_rethink();
+    trace_output_rethink();
+}
+
+/** Get currently traced subsystems
+ *
+ * @return comma separated list of subsystem names, or empty string
+ */
+const char *
+trace_get_subsystems(void)
+{
+    return trace_requested ?: "";
+}
+
+/** Start streaming trace data, if tracing was requested
+ *
+ * Must be called after evloop_init().
+ */
+void
+trace_init(void)
+{
+    for( uint32_t i = 0; i < TRACE_RING_SIZE; ++i )
+        __atomic_store_n(&trace_ring[i].seq, i, __ATOMIC_RELAXED);
+
+    trace_initialized = true;
+    trace_output_rethink();
+}
+
+/** Stop tracing and write out queued trace records
+ */
+void
+trace_quit(void)
+{
+    __atomic_store_n(&trace_enabled_mask, 0, __ATOMIC_RELAXED);
+
+    if( trace_initialized ) {
+        if( trace_output_timer_id )
+            evloop_remove(trace_output_timer_id), trace_output_timer_id = 0;
+        trace_output_drain();
+        trace_output_close();
+        trace_initialized = false;
+    }
+
+    pthread_mutex_lock(&trace_mutex);
+    gchar *prev = trace_requested;
+    trace_requested = 0;
+    pthread_mutex_unlock(&trace_mutex);
+
+    g_free(prev);
+}
@@ -0,0 +1,132 @@
+/**
+ * @file usb_moded-trace.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_TRACE_H_
+# define USB_MODED_TRACE_H_
+
+# include <stdbool.h>
+# include <stdint.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Where trace events are streamed while tracing is enabled */
+# define TRACE_OUTPUT_PATH "/run/usb_moded-trace.json"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Static trace point, one per traced function
+ */
+typedef struct trace_site_t
+{
+    /** Function name */
+    const char *func;
+
+    /** Source file name, determines subsystem */
+    const char *file;
+
+    /** Subsystem bit, or zero if not resolved yet */
+    uint64_t    mask;
+} trace_site_t;
+
+/** Trace point activation record
+ */
+typedef struct trace_frame_t
+{
+    /** Trace point, or NULL if the call is not traced */
+    const trace_site_t *site;
+
+    /** Entry time [ns] */
+    int64_t             start;
+} trace_frame_t;
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Bitmask of subsystems for which tracing is enabled */
+extern uint64_t trace_enabled_mask;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TRACE
+ * ------------------------------------------------------------------------- */
+
+trace_frame_t trace_enter_slow    (trace_site_t *site);
+void          trace_leave_slow    (trace_frame_t *frame);
+void          trace_set_subsystems(const char *list);
+const char   *trace_get_subsystems(void);
+void          trace_init          (void);
+void          trace_quit          (void);
+
+/* ========================================================================= *
+ * Inline Functions
+ * ========================================================================= */
+
+/** Trace point entry hook
+ *
+ * When tracing is disabled, costs one load and a predictable branch.
+ *
+ * @param site  Trace point
+ *
+ * @return activation record to pass to trace_leave()
+ */
+static inline trace_frame_t
+trace_enter(trace_site_t *site)
+{
+    if( __builtin_expect(__atomic_load_n(&trace_enabled_mask,
+                                         __ATOMIC_RELAXED) == 0, 1) )
+        return (trace_frame_t){ .site = 0, .start = 0 };
+    return trace_enter_slow(site);
+}
+
+/** Trace point exit hook, invoked as cleanup handler
+ *
+ * @param frame  Activation record from trace_enter()
+ */
+static inline void
+trace_leave(trace_frame_t *frame)
+{
+    if( __builtin_expect(frame->site == 0, 1) )
+        return;
+    trace_leave_slow(frame);
+}
+
+/* ========================================================================= *
+ * Macros
+ * ========================================================================= */
+
+/** Declare a trace point for the enclosing function
+ *
+ * Entry and exit of the function are recorded when tracing has been
+ * enabled for the subsystem the source file belongs to.
+ */
+# define TRACE_FUNCTION \
+     static trace_site_t trace_site_ = { __func__, __FILE__, 0 };\
+     __attribute__((cleanup(trace_leave), unused))\
+         trace_frame_t trace_frame_ = trace_enter(&trace_site_)
+
+#endif /* USB_MODED_TRACE_H_ */
@@ -30,6 +30,7 @@
 
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
+#include "usb_moded-evloop.h"
 #include "usb_moded-log.h"
 
 #include <stdlib.h>
@@ -45,9 +46,9 @@
  * TRIGGER
  * ------------------------------------------------------------------------- */
 
-static void     trigger_udev_error_cb        (gpointer data);
+static void     trigger_udev_error_cb        (void *aptr);
 bool            trigger_init                 (void);
-static gboolean trigger_udev_input_cb        (GIOChannel *iochannel, GIOCondition cond, gpointer data);
+static bool     trigger_udev_input_cb        (int fd, uint32_t events, void *aptr);
 void            trigger_stop                 (void);
 static void     trigger_parse_udev_properties(struct udev_device *dev);
 
@@ -64,11 +65,11 @@ static gchar               *trigger_udev_sysname   = 0;
  * Functions
  * ========================================================================= */
 
-static void trigger_udev_error_cb (gpointer data)
+static void trigger_udev_error_cb (void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    (void)data;
+    (void)aptr;
 
     log_debug("trigger watch destroyed\n!");
     /* clean up & restart trigger */
@@ -85,7 +86,6 @@ bool trigger_init(void)
     gchar *devpath   = 0;
     gchar *subsystem = 0;
     struct udev_device *dev = 0;
-    GIOChannel          *chn = 0;
 
     int ret;
 
@@ -137,25 +137,19 @@ bool trigger_init(void)
     /* check if we are already connected */
     trigger_parse_udev_properties(dev);
 
-    chn = g_io_channel_unix_new(udev_monitor_get_fd(trigger_udev_monitor));
-    if( !chn )
+    trigger_udev_watch_id =
+        evloop_add_io_full("trigger", EVLOOP_PRIO_TRIGGER,
+                           udev_monitor_get_fd(trigger_udev_monitor),
+                           EPOLLIN, trigger_udev_input_cb, 0,
+                           trigger_udev_error_cb);
+    if( !trigger_udev_watch_id )
         goto EXIT;
 
-    trigger_udev_watch_id = g_io_add_watch_full(chn,
-                                                0,
-                                                G_IO_IN,
-                                                trigger_udev_input_cb,
-                                                NULL,
-                                                trigger_udev_error_cb);
-
     /* everything went well */
     log_debug("Trigger enabled!\n");
     ack = true;
 
 EXIT:
-    if(chn)
-        g_io_channel_unref(chn);
-
     if( dev )
         udev_device_unref(dev);
 
@@ -169,16 +163,16 @@ EXIT:
     return ack;
 }
 
-static gboolean trigger_udev_input_cb(GIOChannel *iochannel G_GNUC_UNUSED, GIOCondition cond,
-                                      gpointer data G_GNUC_UNUSED)
+static bool trigger_udev_input_cb(int fd G_GNUC_UNUSED, uint32_t events,
+                                  void *aptr G_GNUC_UNUSED)
 {
     LOG_REGISTER_CONTEXT;
 
     struct udev_device *dev;
 
-    if(cond & G_IO_IN)
+    if(events & EPOLLIN)
     {
-        /* This normally blocks but G_IO_IN indicates that we can read */
+        /* This normally blocks but EPOLLIN indicates that we can read */
         dev = udev_monitor_receive_device (trigger_udev_monitor);
         if (dev)
         {
@@ -186,7 +180,8 @@ static gboolean trigger_udev_input_cb(GIOChannel *iochannel G_GNUC_UNUSED, GIOCo
             if(strcmp(trigger_udev_sysname, udev_device_get_sysname(dev))) {
                 log_crit("name does not match, disabling udev trigger io-watch");
                 trigger_udev_watch_id = 0;
-                return FALSE;
+                udev_device_unref(dev);
+                return false;
             }
 
             if(!strcmp(udev_device_get_action(dev), "change"))
@@ -202,12 +197,12 @@ static gboolean trigger_udev_input_cb(GIOChannel *iochannel G_GNUC_UNUSED, GIOCo
             log_debug("Bad trigger data. Stopping\n");
             trigger_udev_watch_id = 0;
             trigger_stop();
-            return FALSE;
+            return false;
         }
     }
 
     /* keep watching */
-    return TRUE;
+    return true;
 }
 
 void trigger_stop(void)
@@ -216,7 +211,7 @@ void trigger_stop(void)
 
     if(trigger_udev_watch_id)
     {
-        g_source_remove(trigger_udev_watch_id);
+        evloop_remove(trigger_udev_watch_id);
         trigger_udev_watch_id = 0;
     }
     if(trigger_udev_monitor)
@@ -260,7 +255,7 @@ static void trigger_parse_udev_properties(struct udev_device *dev)
             goto EXIT;
     }
 
-    control_set_usb_mode(trigger_mode);
+    control_set_usb_mode(trigger_mode, MODE_REASON_TRIGGER, UID_UNKNOWN);
 
 EXIT:
     free(trigger_value);
@@ -33,12 +33,142 @@
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-evloop.h"
 #include "usb_moded-log.h"
+#include "usb_moded-wakelock.h"
+
+#include <sys/socket.h>
 
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include <linux/filter.h>
 
 #include <libudev.h>
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of uevents to receive per input callback
+ *
+ * Events that do not fit will be handled on the next iteration.
+ */
+#define UMUDEV_BURST_LIMIT 64
+
+/** Number of connect / disconnect transitions kept in history */
+#define UMUDEV_FLAP_HISTORY       8
+
+/** Time window for counting recent transitions [ms] */
+#define UMUDEV_FLAP_WINDOW_MS     10000
+
+/** Number of transitions within window that is considered flapping */
+#define UMUDEV_FLAP_ENTER         4
+
+/** Time without transitions after which flapping is over [ms] */
+#define UMUDEV_FLAP_LEAVE_MS      30000
+
+/** Debounce delay limits while flapping [ms] */
+#define UMUDEV_FLAP_DELAY_MIN_MS  1000
+#define UMUDEV_FLAP_DELAY_MAX_MS  8000
+
+/** Group name used in power supply selection cache files */
+#define UMUDEV_CACHE_GROUP        "power_supply"
+
+/** Power supply selection cache, valid until reboot */
+#define UMUDEV_CACHE_RUNTIME_DIR  "/run/usb-moded"
+#define UMUDEV_CACHE_RUNTIME_FILE UMUDEV_CACHE_RUNTIME_DIR"/power-supply.ini"
+
+/** Power supply selection cache, persists over reboots */
+#define UMUDEV_CACHE_PERSIST_FILE USB_MODED_DYNAMIC_CONFIG_DIR"/power-supply.ini"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Uevent burst size buckets for diagnostics */
+typedef enum
+{
+    UMUDEV_BURST_1,
+    UMUDEV_BURST_2,
+    UMUDEV_BURST_3_4,
+    UMUDEV_BURST_5_8,
+    UMUDEV_BURST_MANY,
+    UMUDEV_BURST_NUMOF
+} umudev_burst_t;
+
+/** Cable detection sources fused into cable state
+ *
+ * Each source reports a cable state hint, where CABLE_STATE_UNKNOWN
+ * means that the source has no opinion.
+ */
+typedef enum
+{
+    /** POWER_SUPPLY_TYPE / POWER_SUPPLY_REAL_TYPE property */
+    UMUDEV_HINT_POWER_SUPPLY,
+    /** POWER_SUPPLY_USB_TYPE property */
+    UMUDEV_HINT_USB_TYPE,
+    /** Type-C port partner presence and data role */
+    UMUDEV_HINT_TYPEC,
+    /** Extcon USB / SDP / DCP / ... cable states */
+    UMUDEV_HINT_EXTCON,
+    UMUDEV_HINT_NUMOF
+} umudev_hint_t;
+
+/** How the tracked power supply device was selected */
+typedef enum
+{
+    UMUDEV_SOURCE_NONE,
+    UMUDEV_SOURCE_CONFIGURED,
+    UMUDEV_SOURCE_CACHED,
+    UMUDEV_SOURCE_SCANNED,
+    UMUDEV_SOURCE_NUMOF
+} umudev_source_t;
+
+/** Connection history of a power supply device */
+typedef struct
+{
+    /** Power supply device the history applies to */
+    char     syspath[256];
+    /** Connect / disconnect times, ring buffer indexed by transitions */
+    int64_t  stamp[UMUDEV_FLAP_HISTORY];
+    /** Number of connect / disconnect transitions */
+    unsigned transitions;
+    /** Number of flapping episodes detected */
+    unsigned episodes;
+    /** Number of transitions that got debounced away */
+    unsigned suppressed;
+    /** Number of pc connections that got reclassified as charger */
+    unsigned corrections;
+    /** Number of consecutive pc connections without reclassification,
+     *  for diagnostics only - history does not make detection reliable */
+    unsigned clean_pc;
+    /** Flapping is in progress */
+    bool     flapping;
+    /** Current debounce delay while flapping [ms] */
+    int      delay;
+} umudev_flap_t;
+
+/** Inputs for umudev_score_as_power_supply() heuristics */
+typedef struct
+{
+    /** Sysname suggests battery - device is rejected */
+    bool battery;
+    /** Sysname contains "usb" */
+    bool name_usb;
+    /** Sysname contains "charger" */
+    bool name_charger;
+    /** Has POWER_SUPPLY_PRESENT property */
+    bool present;
+    /** Has POWER_SUPPLY_ONLINE property */
+    bool online;
+    /** Has POWER_SUPPLY_TYPE property */
+    bool type;
+    /** Resulting score */
+    int  score;
+} umudev_score_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -47,7 +177,7 @@
  * UMUDEV
  * ------------------------------------------------------------------------- */
 
-static gboolean      umudev_cable_state_timer_cb   (gpointer aptr);
+static bool          umudev_cable_state_timer_cb   (void *aptr);
 static void          umudev_cable_state_stop_timer (void);
 static void          umudev_cable_state_start_timer(gint delay);
 static bool          umudev_cable_state_connected  (void);
@@ -55,10 +185,38 @@ static cable_state_t umudev_cable_state_get        (void);
 static void          umudev_cable_state_set        (cable_state_t state);
 static void          umudev_cable_state_changed    (void);
 static void          umudev_cable_state_from_udev  (cable_state_t curr);
-static void          umudev_io_error_cb            (gpointer data);
-static gboolean      umudev_io_input_cb            (GIOChannel *iochannel, GIOCondition cond, gpointer data);
+static bool          umudev_cable_state_is_connected(cable_state_t state);
+static void          umudev_flap_bind              (const char *syspath);
+static void          umudev_flap_record            (int64_t now);
+static void          umudev_flap_track_active      (cable_state_t prev, cable_state_t curr);
+static int           umudev_flap_delay             (cable_state_t prev, cable_state_t curr);
+static bool          umudev_active_token           (const char *text, char *buff, size_t size);
+static cable_state_t umudev_hint_from_usb_type     (const char *usb_type);
+static cable_state_t umudev_hint_from_typec        (struct udev_enumerate *list);
+static cable_state_t umudev_hint_from_extcon       (struct udev_enumerate *list);
+static void          umudev_hint_set               (umudev_hint_t hint, cable_state_t state);
+static bool          umudev_hint_pc_is_definitive  (void);
+static void          umudev_hint_evaluate          (void);
+static void          umudev_aux_rescan             (void);
+static bool          umudev_aux_input_cb           (int fd, uint32_t events, void *aptr);
+static void          umudev_aux_start              (void);
+static void          umudev_aux_stop               (void);
+static void          umudev_burst_stats_update     (unsigned events, unsigned matched);
+gchar               *umudev_get_burst_stats        (void);
+void                 umudev_reset_burst_stats      (void);
+static void          umudev_io_error_cb            (void *aptr);
+static bool          umudev_io_input_cb            (int fd, uint32_t events, void *aptr);
 static void          umudev_parse_properties       (struct udev_device *dev, bool initial);
-static int           umudev_score_as_power_supply  (const char *syspath);
+static int           umudev_score_as_power_supply  (const char *syspath, umudev_score_t *inputs);
+static gchar        *umudev_scan_power_supply      (umudev_score_t *inputs);
+static void          umudev_cache_set_score        (GKeyFile *ini, const umudev_score_t *inputs);
+static gchar        *umudev_cache_load             (const char *path, const char *configured, umudev_score_t *inputs);
+static void          umudev_cache_save             (const char *path, const char *configured, const char *syspath, const umudev_score_t *inputs);
+static gchar        *umudev_cache_lookup           (const char *configured, umudev_score_t *inputs);
+static void          umudev_cache_update           (const char *configured, const char *syspath, const umudev_score_t *inputs);
+gchar               *umudev_get_power_supply_info  (void);
+static bool          umudev_monitor_attach_filter  (int fd, const char *devpath);
+static struct udev_monitor *umudev_monitor_create  (struct udev_device *dev, const char *subsystem);
 gboolean             umudev_init                   (void);
 void                 umudev_quit                   (void);
 
@@ -86,11 +244,79 @@ static cable_state_t umudev_cable_state_previous = CABLE_STATE_UNKNOWN;
 static guint umudev_cable_state_timer_id = 0;
 static gint  umudev_cable_state_timer_delay = -1;
 
+/** Number of uevents received */
+static unsigned umudev_burst_events = 0;
+
+/** Number of uevents concerning the tracked device */
+static unsigned umudev_burst_matched = 0;
+
+/** Number of uevents that were skipped as superseded */
+static unsigned umudev_burst_skipped = 0;
+
+/** Largest number of uevents received in one go */
+static unsigned umudev_burst_max = 0;
+
+/** Number of input callbacks, bucketed by number of received uevents */
+static unsigned umudev_burst_count[UMUDEV_BURST_NUMOF];
+
+/** Connection history of the tracked power supply
+ *
+ * Survives udev restarts, but is reset if tracked device changes.
+ */
+static umudev_flap_t umudev_flap = { .transitions = 0 };
+
+/** Cable state hints from detection sources */
+static cable_state_t umudev_hint_state[UMUDEV_HINT_NUMOF];
+
+/** Labels for umudev_hint_t values */
+static const char * const umudev_hint_name[UMUDEV_HINT_NUMOF] = {
+    [UMUDEV_HINT_POWER_SUPPLY] = "power_supply",
+    [UMUDEV_HINT_USB_TYPE]     = "usb_type",
+    [UMUDEV_HINT_TYPEC]        = "typec",
+    [UMUDEV_HINT_EXTCON]       = "extcon",
+};
+
+/** Power supply reports voltage on usb */
+static bool umudev_power_supply_connected = false;
+
+/** Power supply has usable present / online property */
+static bool umudev_power_supply_usable = false;
+
+/** Monitor for typec and extcon subsystem uevents */
+static struct udev_monitor *umudev_aux_monitor  = 0;
+static guint                umudev_aux_watch_id = 0;
+
+/** Syspath of the tracked power supply device */
+static gchar          *umudev_syspath = 0;
+
+/** How umudev_syspath was selected */
+static umudev_source_t umudev_source  = UMUDEV_SOURCE_NONE;
+
+/** Heuristic score inputs for umudev_syspath */
+static umudev_score_t  umudev_score   = { .score = 0 };
+
+/** Labels for umudev_source_t values */
+static const char * const umudev_source_name[UMUDEV_SOURCE_NUMOF] = {
+    [UMUDEV_SOURCE_NONE]       = "none",
+    [UMUDEV_SOURCE_CONFIGURED] = "configured",
+    [UMUDEV_SOURCE_CACHED]     = "cached",
+    [UMUDEV_SOURCE_SCANNED]    = "scanned",
+};
+
+/** Labels for umudev_burst_count[] buckets */
+static const char * const umudev_burst_name[UMUDEV_BURST_NUMOF] = {
+    [UMUDEV_BURST_1]    = "1",
+    [UMUDEV_BURST_2]    = "2",
+    [UMUDEV_BURST_3_4]  = "3-4",
+    [UMUDEV_BURST_5_8]  = "5-8",
+    [UMUDEV_BURST_MANY] = "9+",
+};
+
 /* ========================================================================= *
  * cable state
  * ========================================================================= */
 
-static gboolean umudev_cable_state_timer_cb(gpointer aptr)
+static bool umudev_cable_state_timer_cb(void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -101,7 +327,7 @@ static gboolean umudev_cable_state_timer_cb(gpointer aptr)
     log_debug("trigger delayed transfer to: %s",
               cable_state_repr(umudev_cable_state_current));
     umudev_cable_state_set(umudev_cable_state_current);
-    return FALSE;
+    return false;
 }
 
 static void umudev_cable_state_stop_timer(void)
@@ -111,7 +337,7 @@ static void umudev_cable_state_stop_timer(void)
     if( umudev_cable_state_timer_id ) {
         log_debug("cancel delayed transfer to: %s",
                   cable_state_repr(umudev_cable_state_current));
-        g_source_remove(umudev_cable_state_timer_id),
+        evloop_remove(umudev_cable_state_timer_id),
             umudev_cable_state_timer_id = 0;
         umudev_cable_state_timer_delay = -1;
     }
@@ -129,8 +355,8 @@ static void umudev_cable_state_start_timer(gint delay)
         log_debug("schedule delayed transfer to: %s",
                   cable_state_repr(umudev_cable_state_current));
         umudev_cable_state_timer_id =
-            g_timeout_add(delay,
-                          umudev_cable_state_timer_cb, 0);
+            evloop_add_timer("udev-cable-state", delay, 0,
+                             umudev_cable_state_timer_cb, 0);
         umudev_cable_state_timer_delay = delay;
     }
 }
@@ -171,6 +397,9 @@ static void umudev_cable_state_set(cable_state_t state)
     umudev_cable_state_previous = umudev_cable_state_active;
     umudev_cable_state_active   = state;
 
+    umudev_flap_track_active(umudev_cable_state_previous,
+                             umudev_cable_state_active);
+
     log_debug("cable_state: %s -> %s",
               cable_state_repr(umudev_cable_state_previous),
               cable_state_repr(umudev_cable_state_active));
@@ -240,47 +469,637 @@ static void umudev_cable_state_from_udev(cable_state_t curr)
               cable_state_repr(prev),
               cable_state_repr(curr));
 
-    /* Because mode transitions are handled synchronously and can thus
-     * block the usb-moded mainloop, we might end up receiving a bursts
-     * of stale udev events after returning from mode switch - including
-     * multiple cable connect / disconnect events due to user replugging
-     * the cable in frustration of things taking too long.
-     */
+    /* Returning to active state before pending transition got
+     * applied = flap that was debounced away */
+    if( umudev_cable_state_timer_id && curr == umudev_cable_state_active )
+        umudev_flap.suppressed += 1;
 
-    if( curr == CABLE_STATE_DISCONNECTED ) {
-        /* If we see any disconnect events, those must be acted on
-         * immediately to get the 1st disconnect handled.
-         */
+    gint delay = umudev_flap_delay(prev, curr);
+
+    if( delay <= 0 ) {
         umudev_cable_state_set(curr);
     }
     else {
-        /* All other transitions are handled with at least 100 ms delay.
-         * This should compress multiple stale disconnect + connect
-         * pairs into single action.
-         */
-        gint delay = 100;
+        /* Cable state must remain stable for the whole delay */
+        umudev_cable_state_stop_timer();
+        umudev_cable_state_start_timer(delay);
+    }
+
+EXIT:
+    return;
+}
+
+static bool umudev_cable_state_is_connected(cable_state_t state)
+{
+    LOG_REGISTER_CONTEXT;
 
-        if( curr == CABLE_STATE_PC_CONNECTED && prev != CABLE_STATE_UNKNOWN ) {
-            if( delay < usbmoded_get_cable_connection_delay() )
-                delay = usbmoded_get_cable_connection_delay();
+    return (state == CABLE_STATE_CHARGER_CONNECTED ||
+            state == CABLE_STATE_PC_CONNECTED);
+}
+
+/* ========================================================================= *
+ * cable flap debouncing
+ * ========================================================================= */
+
+/** Attach connection history to power supply device
+ *
+ * @param syspath  tracked power supply device
+ */
+static void umudev_flap_bind(const char *syspath)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !syspath || !strcmp(umudev_flap.syspath, syspath) )
+        goto EXIT;
+
+    memset(&umudev_flap, 0, sizeof umudev_flap);
+    snprintf(umudev_flap.syspath, sizeof umudev_flap.syspath, "%s", syspath);
+
+EXIT:
+    return;
+}
+
+/** Record connect / disconnect transition and update flapping state
+ *
+ * Hysteresis: Flapping starts when there are UMUDEV_FLAP_ENTER
+ * transitions within UMUDEV_FLAP_WINDOW_MS, and ends only after
+ * there have been no transitions for UMUDEV_FLAP_LEAVE_MS.
+ *
+ * @param now  current monotonic time [ms]
+ */
+static void umudev_flap_record(int64_t now)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umudev_flap_t *flap = &umudev_flap;
+
+    if( flap->flapping && flap->transitions > 0 ) {
+        int64_t last = flap->stamp[(flap->transitions - 1) % UMUDEV_FLAP_HISTORY];
+        if( now - last >= UMUDEV_FLAP_LEAVE_MS ) {
+            log_info("cable flapping ended");
+            flap->flapping = false;
         }
+    }
 
-        umudev_cable_state_start_timer(delay);
+    flap->stamp[flap->transitions++ % UMUDEV_FLAP_HISTORY] = now;
+
+    unsigned kept   = MIN(flap->transitions, UMUDEV_FLAP_HISTORY);
+    unsigned recent = 0;
+    for( unsigned i = 0; i < kept; ++i ) {
+        if( now - flap->stamp[i] <= UMUDEV_FLAP_WINDOW_MS )
+            ++recent;
+    }
+
+    if( !flap->flapping ) {
+        if( recent >= UMUDEV_FLAP_ENTER ) {
+            flap->flapping = true;
+            flap->episodes += 1;
+            flap->delay = MAX(usbmoded_get_cable_connection_delay(),
+                              UMUDEV_FLAP_DELAY_MIN_MS);
+            log_warning("cable flapping detected: %u transitions in %d ms;"
+                        " debouncing with %d ms delay", recent,
+                        UMUDEV_FLAP_WINDOW_MS, flap->delay);
+        }
+    }
+    else {
+        /* Keep backing off while flapping continues */
+        flap->delay = MIN(flap->delay * 2, UMUDEV_FLAP_DELAY_MAX_MS);
+        log_debug("cable still flapping; delay = %d ms", flap->delay);
+    }
+}
+
+/** Update pc detection statistics after active cable state change
+ *
+ * @param prev  previously active cable state
+ * @param curr  currently active cable state
+ */
+static void umudev_flap_track_active(cable_state_t prev, cable_state_t curr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( prev != CABLE_STATE_PC_CONNECTED )
+        goto EXIT;
+
+    if( curr == CABLE_STATE_CHARGER_CONNECTED ) {
+        umudev_flap.corrections += 1;
+        umudev_flap.clean_pc = 0;
+    }
+    else if( curr == CABLE_STATE_DISCONNECTED ) {
+        umudev_flap.clean_pc += 1;
+    }
+
+EXIT:
+    return;
+}
+
+/** Decide how long reported cable state must be stable before use
+ *
+ * - Initial state and disconnects are acted on immediately
+ * - Everything is delayed while cable is flapping
+ * - Pc connections are delayed by the configured cable connection
+ *   delay, unless charger detection has explicitly classified the
+ *   supply as pc, see umudev_hint_pc_is_definitive()
+ * - Otherwise there is no delay
+ *
+ * @param prev  previously reported cable state
+ * @param curr  currently reported cable state
+ *
+ * @return delay in milliseconds
+ */
+static int umudev_flap_delay(cable_state_t prev, cable_state_t curr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int delay = 0;
+
+    if( prev == CABLE_STATE_UNKNOWN )
+        goto EXIT;
+
+    if( umudev_cable_state_is_connected(prev) !=
+        umudev_cable_state_is_connected(curr) )
+        umudev_flap_record(common_get_monotonic_ms());
+
+    if( umudev_flap.flapping ) {
+        delay = umudev_flap.delay;
+        goto EXIT;
     }
 
+    if( curr != CABLE_STATE_PC_CONNECTED )
+        goto EXIT;
+
+    if( umudev_hint_pc_is_definitive() )
+        goto EXIT;
+
+    delay = usbmoded_get_cable_connection_delay();
+
+EXIT:
+    return delay;
+}
+
+/* ========================================================================= *
+ * cable detection sources
+ * ========================================================================= */
+
+/** Get active choice from sysfs style "foo [bar] baz" value
+ *
+ * Values without brackets are assumed to hold a single choice.
+ *
+ * @param text  value to parse
+ * @param buff  where to store the active choice
+ * @param size  size of buff
+ *
+ * @return true if active choice was found, false otherwise
+ */
+static bool umudev_active_token(const char *text, char *buff, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *beg = 0;
+    size_t      len = 0;
+
+    if( !text )
+        goto EXIT;
+
+    if( (beg = strchr(text, '[')) ) {
+        const char *end = strchr(++beg, ']');
+        if( !end )
+            goto EXIT;
+        len = end - beg;
+    }
+    else {
+        beg = text + strspn(text, " \t\n");
+        len = strcspn(beg, " \t\n");
+    }
+
+    if( len == 0 || len >= size )
+        goto EXIT;
+
+    memcpy(buff, beg, len);
+    buff[len] = 0;
+
+EXIT:
+    return len > 0 && len < size;
+}
+
+static cable_state_t umudev_hint_from_usb_type(const char *usb_type)
+{
+    LOG_REGISTER_CONTEXT;
+
+    cable_state_t state = CABLE_STATE_UNKNOWN;
+    char          active[32];
+
+    if( !umudev_active_token(usb_type, active, sizeof active) )
+        goto EXIT;
+
+    /* Note: Type-C / PD sources ("C", "PD", ...) can be either
+     *       chargers or hosts, so those are left undecided */
+    if( !strcmp(active, "SDP") || !strcmp(active, "CDP") )
+        state = CABLE_STATE_PC_CONNECTED;
+    else if( !strcmp(active, "DCP") ||
+             !strcmp(active, "ACA") ||
+             !strcmp(active, "BrickID") )
+        state = CABLE_STATE_CHARGER_CONNECTED;
+
+EXIT:
+    return state;
+}
+
+/** Evaluate Type-C ports
+ *
+ * A port that has a partner and operates in device data role is
+ * likely to be connected to a usb host. However, also dedicated
+ * chargers leave the port in device data role, so this is just
+ * a weak hint that is used only when supply type is not known,
+ * see umudev_hint_evaluate().
+ *
+ * @param list  enumeration of typec subsystem devices
+ *
+ * @return CABLE_STATE_PC_CONNECTED, or CABLE_STATE_UNKNOWN
+ */
+static cable_state_t umudev_hint_from_typec(struct udev_enumerate *list)
+{
+    LOG_REGISTER_CONTEXT;
+
+    cable_state_t           state = CABLE_STATE_UNKNOWN;
+    struct udev_list_entry *entry = 0;
+
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(list)) {
+        const char *syspath = udev_list_entry_get_name(entry);
+        const char *sysname = strrchr(syspath, '/');
+        struct udev_device *port = 0;
+        char  partner[PATH_MAX];
+        char  role[32];
+
+        /* Ports are named "portN", partners "portN-partner" */
+        if( !sysname || strncmp(++sysname, "port", 4) || strchr(sysname, '-') )
+            continue;
+
+        snprintf(partner, sizeof partner, "%s/%s-partner", syspath, sysname);
+        if( access(partner, F_OK) == -1 )
+            continue;
+
+        if( !(port = udev_device_new_from_syspath(umudev_object, syspath)) )
+            continue;
+
+        if( umudev_active_token(udev_device_get_sysattr_value(port, "data_role"),
+                                role, sizeof role) &&
+            !strcmp(role, "device") )
+            state = CABLE_STATE_PC_CONNECTED;
+
+        udev_device_unref(port);
+
+        if( state == CABLE_STATE_PC_CONNECTED )
+            break;
+    }
+
+    return state;
+}
+
+/** Evaluate extcon cable states
+ *
+ * @param list  enumeration of extcon subsystem devices
+ *
+ * @return CABLE_STATE_PC_CONNECTED, CABLE_STATE_CHARGER_CONNECTED,
+ *         or CABLE_STATE_UNKNOWN
+ */
+static cable_state_t umudev_hint_from_extcon(struct udev_enumerate *list)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const pc_cables[] = {
+        "USB", "SDP", "CDP", 0
+    };
+    static const char * const charger_cables[] = {
+        "DCP", "ACA", "FAST-CHARGER", "SLOW-CHARGER", "TA", 0
+    };
+
+    bool                    pc      = false;
+    bool                    charger = false;
+    struct udev_list_entry *entry   = 0;
+
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(list)) {
+        const char *syspath = udev_list_entry_get_name(entry);
+        struct udev_device *dev = 0;
+        gchar **lines = 0;
+
+        if( !(dev = udev_device_new_from_syspath(umudev_object, syspath)) )
+            continue;
+
+        /* State is reported as "NAME=0|1" lines */
+        const char *text = udev_device_get_sysattr_value(dev, "state");
+        if( text )
+            lines = g_strsplit(text, "\n", 0);
+
+        for( size_t i = 0; lines && lines[i]; ++i ) {
+            char *val = strchr(lines[i], '=');
+            if( !val || strcmp(val + 1, "1") )
+                continue;
+            *val = 0;
+            for( size_t k = 0; pc_cables[k]; ++k )
+                if( !strcmp(lines[i], pc_cables[k]) )
+                    pc = true;
+            for( size_t k = 0; charger_cables[k]; ++k )
+                if( !strcmp(lines[i], charger_cables[k]) )
+                    charger = true;
+        }
+
+        g_strfreev(lines);
+        udev_device_unref(dev);
+    }
+
+    return (pc ? CABLE_STATE_PC_CONNECTED :
+            charger ? CABLE_STATE_CHARGER_CONNECTED :
+            CABLE_STATE_UNKNOWN);
+}
+
+static void umudev_hint_set(umudev_hint_t hint, cable_state_t state)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umudev_hint_state[hint] != state ) {
+        log_debug("%s hint: %s -> %s", umudev_hint_name[hint],
+                  cable_state_repr(umudev_hint_state[hint]),
+                  cable_state_repr(state));
+        umudev_hint_state[hint] = state;
+    }
+}
+
+/** Check if pc connection is backed by explicit charger detection
+ *
+ * USB type and extcon sources reflect completed charger detection.
+ * Power supply type can report plain "USB" before detection has
+ * finished, and Type-C can't tell hosts from chargers at all, so
+ * those are not considered definitive.
+ *
+ * @return true if pc connection is definitive, false otherwise
+ */
+static bool umudev_hint_pc_is_definitive(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool pc = false;
+
+    for( int i = 0; i < UMUDEV_HINT_NUMOF; ++i ) {
+        if( umudev_hint_state[i] == CABLE_STATE_CHARGER_CONNECTED )
+            return false;
+    }
+
+    if( umudev_hint_state[UMUDEV_HINT_USB_TYPE] == CABLE_STATE_PC_CONNECTED ||
+        umudev_hint_state[UMUDEV_HINT_EXTCON] == CABLE_STATE_PC_CONNECTED )
+        pc = true;
+
+    return pc;
+}
+
+/** Fuse cable state hints from all sources into reported cable state
+ *
+ * Supply type classifying sources (power supply type, usb type and
+ * extcon) take precedence, and explicit charger classification wins
+ * over pc classification. Type-C is consulted only when supply type
+ * is not known. If power supply says that there is no voltage on usb,
+ * other sources are not consulted.
+ */
+static void umudev_hint_evaluate(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    cable_state_t state   = CABLE_STATE_DISCONNECTED;
+    cable_state_t supply  = umudev_hint_state[UMUDEV_HINT_POWER_SUPPLY];
+    bool          pc      = false;
+    bool          charger = false;
+
+    for( int i = 0; i < UMUDEV_HINT_NUMOF; ++i ) {
+        if( i == UMUDEV_HINT_TYPEC )
+            continue;
+        if( umudev_hint_state[i] == CABLE_STATE_PC_CONNECTED )
+            pc = true;
+        else if( umudev_hint_state[i] == CABLE_STATE_CHARGER_CONNECTED )
+            charger = true;
+    }
+
+    /* Without usable present / online property, power supply hint
+     * is derived from missing data and says nothing about type */
+    bool type_unknown = (!umudev_power_supply_usable ||
+                         supply == CABLE_STATE_UNKNOWN);
+
+    if( !umudev_power_supply_connected && umudev_power_supply_usable )
+        state = CABLE_STATE_DISCONNECTED;
+    else if( charger )
+        state = CABLE_STATE_CHARGER_CONNECTED;
+    else if( pc )
+        state = CABLE_STATE_PC_CONNECTED;
+    else if( type_unknown &&
+             umudev_hint_state[UMUDEV_HINT_TYPEC] == CABLE_STATE_PC_CONNECTED )
+        state = CABLE_STATE_PC_CONNECTED;
+    else if( !umudev_power_supply_connected )
+        state = CABLE_STATE_DISCONNECTED;
+    else if( supply == CABLE_STATE_UNKNOWN )
+        /* No type information: connect on any voltage on charger */
+        state = CABLE_STATE_PC_CONNECTED;
+    else
+        state = supply;
+
+    umudev_cable_state_from_udev(state);
+}
+
+/** Re-evaluate typec and extcon cable detection sources
+ */
+static void umudev_aux_rescan(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct udev_enumerate *list = 0;
+
+    if( (list = udev_enumerate_new(umudev_object)) ) {
+        udev_enumerate_add_match_subsystem(list, "typec");
+        udev_enumerate_scan_devices(list);
+        umudev_hint_set(UMUDEV_HINT_TYPEC, umudev_hint_from_typec(list));
+        udev_enumerate_unref(list);
+    }
+
+    if( (list = udev_enumerate_new(umudev_object)) ) {
+        udev_enumerate_add_match_subsystem(list, "extcon");
+        udev_enumerate_scan_devices(list);
+        umudev_hint_set(UMUDEV_HINT_EXTCON, umudev_hint_from_extcon(list));
+        udev_enumerate_unref(list);
+    }
+}
+
+static bool umudev_aux_input_cb(int fd, uint32_t events, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)fd;
+    (void)aptr;
+
+    bool     keep_going = true;
+    unsigned count      = 0;
+
+    wakelock_acquire(USB_MODED_WAKELOCK_PROCESS_INPUT);
+
+    if( events & EPOLLIN ) {
+        struct udev_device *dev;
+        while( count < UMUDEV_BURST_LIMIT &&
+               (dev = udev_monitor_receive_device(umudev_aux_monitor)) ) {
+            udev_device_unref(dev);
+            ++count;
+        }
+        if( count == 0 )
+            keep_going = false;
+    }
+
+    if( events & (EPOLLERR | EPOLLHUP) )
+        keep_going = false;
+
+    /* Port / partner / extcon states are few and cheap to check,
+     * just evaluate all of them once per burst */
+    if( count > 0 ) {
+        umudev_aux_rescan();
+        umudev_hint_evaluate();
+    }
+
+    if( !keep_going ) {
+        umudev_aux_watch_id = 0;
+        log_warning("typec/extcon io watch disabled");
+    }
+
+    wakelock_release(USB_MODED_WAKELOCK_PROCESS_INPUT);
+
+    return keep_going;
+}
+
+/** Start tracking typec and extcon cable detection sources
+ *
+ * These are optional; failures are logged but are not fatal.
+ */
+static void umudev_aux_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !(umudev_aux_monitor = udev_monitor_new_from_netlink(umudev_object, "udev")) )
+        goto FAIL;
+
+    if( udev_monitor_filter_add_match_subsystem_devtype(umudev_aux_monitor, "typec", NULL) != 0 ||
+        udev_monitor_filter_add_match_subsystem_devtype(umudev_aux_monitor, "extcon", NULL) != 0 )
+        goto FAIL;
+
+    if( udev_monitor_enable_receiving(umudev_aux_monitor) != 0 )
+        goto FAIL;
+
+    umudev_aux_watch_id = evloop_add_io("udev-aux", EVLOOP_PRIO_UDEV,
+                                        udev_monitor_get_fd(umudev_aux_monitor),
+                                        EPOLLIN, umudev_aux_input_cb, 0);
+    if( !umudev_aux_watch_id )
+        goto FAIL;
+
+    umudev_aux_rescan();
+    umudev_hint_evaluate();
+    goto EXIT;
+
+FAIL:
+    log_warning("typec/extcon cable detection not available");
+    umudev_aux_stop();
+
 EXIT:
     return;
 }
 
+static void umudev_aux_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umudev_aux_watch_id ) {
+        evloop_remove(umudev_aux_watch_id),
+            umudev_aux_watch_id = 0;
+    }
+
+    if( umudev_aux_monitor ) {
+        udev_monitor_unref(umudev_aux_monitor),
+            umudev_aux_monitor = 0;
+    }
+
+    for( int i = 0; i < UMUDEV_HINT_NUMOF; ++i )
+        umudev_hint_state[i] = CABLE_STATE_UNKNOWN;
+    umudev_power_supply_connected = false;
+    umudev_power_supply_usable = false;
+}
+
+/* ========================================================================= *
+ * burst stats
+ * ========================================================================= */
+
+static void umudev_burst_stats_update(unsigned events, unsigned matched)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umudev_burst_t bucket = UMUDEV_BURST_MANY;
+
+    if( events <= 1 )
+        bucket = UMUDEV_BURST_1;
+    else if( events <= 2 )
+        bucket = UMUDEV_BURST_2;
+    else if( events <= 4 )
+        bucket = UMUDEV_BURST_3_4;
+    else if( events <= 8 )
+        bucket = UMUDEV_BURST_5_8;
+
+    umudev_burst_count[bucket] += 1;
+    umudev_burst_events  += events;
+    umudev_burst_matched += matched;
+    if( matched > 1 )
+        umudev_burst_skipped += matched - 1;
+    if( umudev_burst_max < events )
+        umudev_burst_max = events;
+
+    if( events > 1 )
+        log_debug("uevent burst: %u events, %u for tracked device",
+                  events, matched);
+}
+
+/** Get uevent burst statistics as "key=value, ..." string
+ *
+ * @return string to be released with g_free()
+ */
+gchar *umudev_get_burst_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *buf = g_string_new(0);
+
+    g_string_append_printf(buf, "uevents=%u, uevents-matched=%u, "
+                           "uevents-skipped=%u, uevent-burst-max=%u",
+                           umudev_burst_events, umudev_burst_matched,
+                           umudev_burst_skipped, umudev_burst_max);
+
+    for( int i = 0; i < UMUDEV_BURST_NUMOF; ++i )
+        g_string_append_printf(buf, ", uevent-burst-%s=%u",
+                               umudev_burst_name[i], umudev_burst_count[i]);
+
+    return g_string_free(buf, FALSE);
+}
+
+/** Reset uevent burst statistics
+ */
+void umudev_reset_burst_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umudev_burst_events  = 0;
+    umudev_burst_matched = 0;
+    umudev_burst_skipped = 0;
+    umudev_burst_max     = 0;
+    memset(umudev_burst_count, 0, sizeof umudev_burst_count);
+}
+
 /* ========================================================================= *
  * legacy code
  * ========================================================================= */
 
-static void umudev_io_error_cb(gpointer data)
+static void umudev_io_error_cb(void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    (void)data;
+    (void)aptr;
 
     /* we do not want to restart when we try to clean up */
     if( !umudev_in_cleanup ) {
@@ -291,46 +1110,74 @@ static void umudev_io_error_cb(gpointer data)
     }
 }
 
-static gboolean umudev_io_input_cb(GIOChannel *iochannel, GIOCondition cond, gpointer data)
+static bool umudev_io_input_cb(int fd, uint32_t events, void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    (void)iochannel;
-    (void)data;
+    (void)fd;
+    (void)aptr;
 
-    gboolean continue_watching = TRUE;
+    bool continue_watching = true;
 
-    /* No code paths are allowed to bypass the common_release_wakelock() call below */
-    common_acquire_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+    /* No code paths are allowed to bypass the wakelock_release() call below */
+    wakelock_acquire(USB_MODED_WAKELOCK_PROCESS_INPUT);
 
-    if( cond & G_IO_IN )
+    if( events & EPOLLIN )
     {
-        /* This normally blocks but G_IO_IN indicates that we can read */
-        struct udev_device *dev = udev_monitor_receive_device(umudev_monitor);
-        if( !dev )
+        /* Drain everything that is available (the monitor socket is
+         * non-blocking) and keep only the latest change notification
+         * for the tracked device - it has the full property set, so
+         * evaluating the older ones would be just wasted effort. */
+        struct udev_device *latest  = 0;
+        unsigned            count   = 0;
+        unsigned            matched = 0;
+
+        while( count < UMUDEV_BURST_LIMIT )
+        {
+            struct udev_device *dev = udev_monitor_receive_device(umudev_monitor);
+            if( !dev )
+                break;
+
+            ++count;
+
+            /* check if it is the actual device we want to check
+             * - normally guaranteed by socket filter, but not
+             *   when using subsystem filtering fallback */
+            if( !strcmp(umudev_sysname, udev_device_get_sysname(dev)) &&
+                !strcmp(udev_device_get_action(dev), "change") )
+            {
+                ++matched;
+                if( latest )
+                    udev_device_unref(latest);
+                latest = dev;
+            }
+            else
+            {
+                udev_device_unref(dev);
+            }
+        }
+
+        if( count == 0 )
         {
             /* if we get something else something bad happened stop watching to avoid busylooping */
-            continue_watching = FALSE;
+            continue_watching = false;
         }
         else
         {
-            /* check if it is the actual device we want to check */
-            if( !strcmp(umudev_sysname, udev_device_get_sysname(dev)) )
-            {
-                if( !strcmp(udev_device_get_action(dev), "change") )
-                {
-                    umudev_parse_properties(dev, false);
-                }
-            }
+            umudev_burst_stats_update(count, matched);
+        }
 
-            udev_device_unref(dev);
+        if( latest )
+        {
+            umudev_parse_properties(latest, false);
+            udev_device_unref(latest);
         }
     }
 
-    if( cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
+    if( events & (EPOLLERR | EPOLLHUP) )
     {
         /* Unhandled errors turn io watch to virtual busyloop too */
-        continue_watching = FALSE;
+        continue_watching = false;
     }
 
     if( !continue_watching && umudev_watch_id )
@@ -339,7 +1186,7 @@ static gboolean umudev_io_input_cb(GIOChannel *iochannel, GIOCondition cond, gpo
         log_crit("udev io watch disabled");
     }
 
-    common_release_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+    wakelock_release(USB_MODED_WAKELOCK_PROCESS_INPUT);
 
     return continue_watching;
 }
@@ -358,6 +1205,9 @@ static void umudev_parse_properties(struct udev_device *dev, bool initial)
     /* Assume there is no usb connection until proven otherwise */
     bool connected  = false;
 
+    /* Cable state as seen from power supply type */
+    cable_state_t state = CABLE_STATE_DISCONNECTED;
+
     /* Unless debug logging has been request via command line,
      * suppress warnings about potential property issues and/or
      * fallback strategies applied (to avoid spamming due to the
@@ -388,12 +1238,20 @@ static void umudev_parse_properties(struct udev_device *dev, bool initial)
         usbmoded_delay_suspend();
     }
 
+    umudev_power_supply_connected = connected;
+    umudev_power_supply_usable    = (power_supply_present != 0);
+
+    /* Charger type as reported by newer kernels, e.g. "Unknown [SDP] DCP" */
+    umudev_hint_set(UMUDEV_HINT_USB_TYPE,
+                    connected ? umudev_hint_from_usb_type(udev_device_get_property_value(dev, "POWER_SUPPLY_USB_TYPE"))
+                    : CABLE_STATE_UNKNOWN);
+
     if( !connected ) {
         /* Handle: Disconnected */
 
         if( warnings && !power_supply_present )
             log_err("No usable power supply indicator\n");
-        umudev_cable_state_from_udev(CABLE_STATE_DISCONNECTED);
+        state = CABLE_STATE_DISCONNECTED;
     }
     else {
         if( warnings && power_supply_online )
@@ -408,14 +1266,14 @@ static void umudev_parse_properties(struct udev_device *dev, bool initial)
             power_supply_type = udev_device_get_property_value(dev, "POWER_SUPPLY_TYPE");
         /*
          * Power supply type might not exist also :(
-         * Send connected event but this will not be able
-         * to discriminate between charger/cable.
+         * Unless other sources can tell, send connected event but
+         * this will not be able to discriminate between charger/cable.
          */
         if( !power_supply_type ) {
             if( warnings )
                 log_warning("Fallback since cable detection might not be accurate. "
                             "Will connect on any voltage on charger.\n");
-            umudev_cable_state_from_udev(CABLE_STATE_PC_CONNECTED);
+            state = CABLE_STATE_UNKNOWN;
             goto cleanup;
         }
 
@@ -423,35 +1281,36 @@ static void umudev_parse_properties(struct udev_device *dev, bool initial)
 
         if( !strcmp(power_supply_type, "USB") ||
             !strcmp(power_supply_type, "USB_CDP") ) {
-            umudev_cable_state_from_udev(CABLE_STATE_PC_CONNECTED);
+            state = CABLE_STATE_PC_CONNECTED;
         }
         else if( !strcmp(power_supply_type, "USB_DCP") ||
                  !strcmp(power_supply_type, "USB_HVDCP") ||
                  !strcmp(power_supply_type, "USB_HVDCP_3") ) {
-            umudev_cable_state_from_udev(CABLE_STATE_CHARGER_CONNECTED);
+            state = CABLE_STATE_CHARGER_CONNECTED;
         }
         else if( !strcmp(power_supply_type, "USB_FLOAT")) {
             if( !umudev_cable_state_connected() )
                 log_warning("connection type detection failed, assuming charger");
-            umudev_cable_state_from_udev(CABLE_STATE_CHARGER_CONNECTED);
+            state = CABLE_STATE_CHARGER_CONNECTED;
         }
         else if( !strcmp(power_supply_type, "Unknown")) {
             // nop
             log_warning("unknown connection type reported, assuming disconnected");
-            umudev_cable_state_from_udev(CABLE_STATE_DISCONNECTED);
+            state = CABLE_STATE_DISCONNECTED;
         }
         else {
             if( warnings )
                 log_warning("unhandled power supply type: %s", power_supply_type);
-            umudev_cable_state_from_udev(CABLE_STATE_DISCONNECTED);
+            state = CABLE_STATE_DISCONNECTED;
         }
     }
 
 cleanup:
-    return;
+    umudev_hint_set(UMUDEV_HINT_POWER_SUPPLY, state);
+    umudev_hint_evaluate();
 }
 
-static int umudev_score_as_power_supply(const char *syspath)
+static int umudev_score_as_power_supply(const char *syspath, umudev_score_t *inputs)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -459,6 +1318,8 @@ static int umudev_score_as_power_supply(const char *syspath)
     struct udev_device *dev     = 0;
     const char         *sysname = 0;
 
+    memset(inputs, 0, sizeof *inputs);
+
     if( !umudev_object )
         goto EXIT;
 
@@ -471,27 +1332,29 @@ static int umudev_score_as_power_supply(const char *syspath)
     /* try to assign a weighed score */
 
     /* check that it is not a battery */
-    if(strstr(sysname, "battery") || strstr(sysname, "BAT"))
+    if(strstr(sysname, "battery") || strstr(sysname, "BAT")) {
+        inputs->battery = true;
         goto EXIT;
+    }
 
     /* if it contains usb in the name it very likely is good */
-    if(strstr(sysname, "usb"))
+    if( (inputs->name_usb = strstr(sysname, "usb") != 0) )
         score = score + 10;
 
     /* often charger is also mentioned in the name */
-    if(strstr(sysname, "charger"))
+    if( (inputs->name_charger = strstr(sysname, "charger") != 0) )
         score = score + 5;
 
     /* present property is used to detect activity, however online is better */
-    if(udev_device_get_property_value(dev, "POWER_SUPPLY_PRESENT"))
+    if( (inputs->present = udev_device_get_property_value(dev, "POWER_SUPPLY_PRESENT") != 0) )
         score = score + 5;
 
-    if(udev_device_get_property_value(dev, "POWER_SUPPLY_ONLINE"))
+    if( (inputs->online = udev_device_get_property_value(dev, "POWER_SUPPLY_ONLINE") != 0) )
         score = score + 10;
 
     /* type is used to detect if it is a cable or dedicated charger.
      * Bonus points if it is there. */
-    if(udev_device_get_property_value(dev, "POWER_SUPPLY_TYPE"))
+    if( (inputs->type = udev_device_get_property_value(dev, "POWER_SUPPLY_TYPE") != 0) )
         score = score + 10;
 
 EXIT:
@@ -499,9 +1362,386 @@ EXIT:
     if( dev )
         udev_device_unref(dev);
 
+    inputs->score = score;
+
     return score;
 }
 
+/** Find the best power supply device via heuristics
+ *
+ * @param inputs  where to store score inputs of the best match
+ *
+ * @return syspath of the best match, or NULL if none scored
+ */
+static gchar *umudev_scan_power_supply(umudev_score_t *inputs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar          *best_name  = 0;
+    umudev_score_t  best_score = { .score = 0 };
+    unsigned        scanned    = 0;
+
+    struct udev_enumerate  *list;
+    struct udev_list_entry *list_entry;
+    struct udev_list_entry *first_entry;
+
+    log_debug("Trying to guess $power_supply device.\n");
+
+    if( !(list = udev_enumerate_new(umudev_object)) )
+        goto EXIT;
+
+    udev_enumerate_add_match_subsystem(list, "power_supply");
+    udev_enumerate_scan_devices(list);
+    first_entry = udev_enumerate_get_list_entry(list);
+    udev_list_entry_foreach(list_entry, first_entry) {
+        const char     *name  = udev_list_entry_get_name(list_entry);
+        umudev_score_t  score;
+        ++scanned;
+        if( best_score.score < umudev_score_as_power_supply(name, &score) ) {
+            g_free(best_name);
+            best_name  = g_strdup(name);
+            best_score = score;
+        }
+    }
+    udev_enumerate_unref(list);
+
+    log_debug("scanned %u devices; best = %s (score %d)",
+              scanned, best_name ?: "none", best_score.score);
+
+EXIT:
+    *inputs = best_score;
+    return best_name;
+}
+
+/* ========================================================================= *
+ * selection cache
+ * ========================================================================= */
+
+static void umudev_cache_set_score(GKeyFile *ini, const umudev_score_t *inputs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_key_file_set_integer(ini, UMUDEV_CACHE_GROUP, "score", inputs->score);
+    g_key_file_set_boolean(ini, UMUDEV_CACHE_GROUP, "name_usb", inputs->name_usb);
+    g_key_file_set_boolean(ini, UMUDEV_CACHE_GROUP, "name_charger", inputs->name_charger);
+    g_key_file_set_boolean(ini, UMUDEV_CACHE_GROUP, "present", inputs->present);
+    g_key_file_set_boolean(ini, UMUDEV_CACHE_GROUP, "online", inputs->online);
+    g_key_file_set_boolean(ini, UMUDEV_CACHE_GROUP, "type", inputs->type);
+}
+
+/** Load and revalidate cached power supply selection
+ *
+ * The cached entry is accepted if it was made for the same configured
+ * device path, and re-scoring just the cached device gives the same
+ * result as before.
+ *
+ * @param path        cache file path
+ * @param configured  currently configured udev path
+ * @param inputs      where to store score inputs of the cached device
+ *
+ * @return syspath of the cached device, or NULL if not valid
+ */
+static gchar *umudev_cache_load(const char *path, const char *configured,
+                                umudev_score_t *inputs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar    *syspath = 0;
+    gchar    *config  = 0;
+    GKeyFile *ini     = g_key_file_new();
+    int       score   = 0;
+
+    if( !g_key_file_load_from_file(ini, path, G_KEY_FILE_NONE, 0) )
+        goto EXIT;
+
+    config  = g_key_file_get_string(ini, UMUDEV_CACHE_GROUP, "configured", 0);
+    syspath = g_key_file_get_string(ini, UMUDEV_CACHE_GROUP, "syspath", 0);
+    score   = g_key_file_get_integer(ini, UMUDEV_CACHE_GROUP, "score", 0);
+
+    if( !syspath || g_strcmp0(config, configured) ) {
+        log_debug("%s: not applicable", path);
+        goto FAIL;
+    }
+
+    if( score <= 0 || umudev_score_as_power_supply(syspath, inputs) != score ) {
+        log_debug("%s: %s: score changed", path, syspath);
+        goto FAIL;
+    }
+
+    log_debug("%s: using %s (score %d)", path, syspath, score);
+    goto EXIT;
+
+FAIL:
+    g_free(syspath), syspath = 0;
+
+EXIT:
+    g_free(config);
+    g_key_file_free(ini);
+
+    return syspath;
+}
+
+/** Store power supply selection to cache file
+ *
+ * File is not rewritten if content would not change.
+ *
+ * @param path        cache file path
+ * @param configured  currently configured udev path
+ * @param syspath     selected device
+ * @param inputs      score inputs of the selected device
+ */
+static void umudev_cache_save(const char *path, const char *configured,
+                              const char *syspath, const umudev_score_t *inputs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *ini  = g_key_file_new();
+    gchar    *data = 0;
+    gchar    *prev = 0;
+    GError   *err  = 0;
+
+    g_key_file_set_string(ini, UMUDEV_CACHE_GROUP, "configured", configured);
+    g_key_file_set_string(ini, UMUDEV_CACHE_GROUP, "syspath", syspath);
+    umudev_cache_set_score(ini, inputs);
+
+    if( !(data = g_key_file_to_data(ini, 0, 0)) )
+        goto EXIT;
+
+    if( g_file_get_contents(path, &prev, 0, 0) && !strcmp(prev, data) )
+        goto EXIT;
+
+    if( !g_file_set_contents(path, data, -1, &err) ) {
+        log_warning("%s: can't save: %s", path, err->message);
+        goto EXIT;
+    }
+
+    log_debug("%s: saved", path);
+
+EXIT:
+    g_clear_error(&err);
+    g_free(prev);
+    g_free(data);
+    g_key_file_free(ini);
+}
+
+/** Lookup power supply selection from runtime or persistent cache
+ *
+ * @param configured  currently configured udev path
+ * @param inputs      where to store score inputs of the cached device
+ *
+ * @return syspath of the cached device, or NULL if none is valid
+ */
+static gchar *umudev_cache_lookup(const char *configured, umudev_score_t *inputs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *syspath = 0;
+
+    if( !(syspath = umudev_cache_load(common_root_path(UMUDEV_CACHE_RUNTIME_FILE),
+                                      configured, inputs)) )
+        syspath = umudev_cache_load(common_root_path(UMUDEV_CACHE_PERSIST_FILE),
+                                    configured, inputs);
+
+    return syspath;
+}
+
+/** Update runtime and persistent power supply selection caches
+ *
+ * @param configured  currently configured udev path
+ * @param syspath     selected device
+ * @param inputs      score inputs of the selected device
+ */
+static void umudev_cache_update(const char *configured, const char *syspath,
+                                const umudev_score_t *inputs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *runtime_dir = common_root_path(UMUDEV_CACHE_RUNTIME_DIR);
+    const char *persist_dir = common_root_path(USB_MODED_DYNAMIC_CONFIG_DIR);
+
+    if( g_mkdir_with_parents(runtime_dir, 0755) == -1 )
+        log_warning("%s: mkdir failed: %m", runtime_dir);
+    else
+        umudev_cache_save(common_root_path(UMUDEV_CACHE_RUNTIME_FILE),
+                          configured, syspath, inputs);
+
+    if( g_mkdir_with_parents(persist_dir, 0755) == -1 )
+        log_warning("%s: mkdir failed: %m", persist_dir);
+    else
+        umudev_cache_save(common_root_path(UMUDEV_CACHE_PERSIST_FILE),
+                          configured, syspath, inputs);
+}
+
+/** Get tracked power supply device details as "key=value, ..." string
+ *
+ * @return string to be released with g_free()
+ */
+gchar *umudev_get_power_supply_info(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *buf = g_string_new(0);
+
+    g_string_append_printf(buf, "syspath=%s, source=%s, score=%d, name_usb=%d, "
+                           "name_charger=%d, present=%d, online=%d, type=%d",
+                           umudev_syspath ?: "", umudev_source_name[umudev_source],
+                           umudev_score.score, umudev_score.name_usb,
+                           umudev_score.name_charger, umudev_score.present,
+                           umudev_score.online, umudev_score.type);
+
+    for( int i = 0; i < UMUDEV_HINT_NUMOF; ++i )
+        g_string_append_printf(buf, ", hint-%s=%s", umudev_hint_name[i],
+                               cable_state_repr(umudev_hint_state[i]));
+
+    g_string_append_printf(buf, ", flapping=%d, flap-delay=%d, "
+                           "flap-episodes=%u, flap-suppressed=%u, "
+                           "cable-transitions=%u, pc-corrections=%u, "
+                           "pc-clean=%u",
+                           umudev_flap.flapping, umudev_flap.delay,
+                           umudev_flap.episodes, umudev_flap.suppressed,
+                           umudev_flap.transitions, umudev_flap.corrections,
+                           umudev_flap.clean_pc);
+
+    return g_string_free(buf, FALSE);
+}
+
+/** Attach socket filter passing only change uevents of one device
+ *
+ * Kernel uevent messages start with "ACTION@DEVPATH" string. This is
+ * compared in 32/16/8 bit chunks, and anything that does not match
+ * is dropped already in the kernel - i.e. the daemon is not woken up
+ * by changes in battery capacity, temperature, etc.
+ *
+ * @param fd       kernel uevent netlink socket
+ * @param devpath  device path of the tracked device
+ *
+ * @return true if filter was attached, false otherwise
+ */
+static bool
+umudev_monitor_attach_filter(int fd, const char *devpath)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool                ack  = false;
+    gchar              *key  = g_strdup_printf("change@%s", devpath);
+    size_t              size = strlen(key) + 1;
+    const uint8_t      *data = (const uint8_t *)key;
+    struct sock_filter *code = 0;
+    size_t              used = 0;
+
+    /* Up to three instructions per chunk, plus final accept */
+    code = g_new0(struct sock_filter, 3 * size + 1);
+
+    for( size_t offs = 0; offs < size; ) {
+        uint32_t val  = 0;
+        uint16_t mode = 0;
+        size_t   todo = size - offs;
+
+        if( todo >= 4 ) {
+            val  = ((uint32_t)data[offs+0] << 24 |
+                    (uint32_t)data[offs+1] << 16 |
+                    (uint32_t)data[offs+2] <<  8 |
+                    (uint32_t)data[offs+3] <<  0);
+            mode = BPF_W, todo = 4;
+        }
+        else if( todo >= 2 ) {
+            val  = ((uint32_t)data[offs+0] <<  8 |
+                    (uint32_t)data[offs+1] <<  0);
+            mode = BPF_H, todo = 2;
+        }
+        else {
+            val  = data[offs];
+            mode = BPF_B, todo = 1;
+        }
+
+        /* A = packet[offs]; if( A != val ) return 0; */
+        code[used++] = (struct sock_filter)BPF_STMT(BPF_LD | mode | BPF_ABS, offs);
+        code[used++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, val, 1, 0);
+        code[used++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+        offs += todo;
+    }
+
+    /* Pass the whole message */
+    code[used++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+    struct sock_fprog prog = {
+        .len    = used,
+        .filter = code,
+    };
+
+    if( setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog) == -1 ) {
+        log_warning("failed to attach uevent filter: %m");
+        goto EXIT;
+    }
+
+    log_debug("uevent filter: %s (%zu insn)", key, used);
+    ack = true;
+
+EXIT:
+    g_free(code);
+    g_free(key);
+
+    return ack;
+}
+
+/** Create udev monitor for tracking power supply device changes
+ *
+ * Preferably kernel uevents are monitored, using a socket filter that
+ * passes only change notifications for the tracked device. If that
+ * is not possible, fall back to monitoring all events from the given
+ * subsystem as broadcast by udevd.
+ *
+ * @param dev        tracked device
+ * @param subsystem  subsystem to monitor in fallback mode
+ *
+ * @return udev monitor object that is receiving events, or NULL
+ */
+static struct udev_monitor *
+umudev_monitor_create(struct udev_device *dev, const char *subsystem)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct udev_monitor *mon = 0;
+
+    const char *devpath = udev_device_get_devpath(dev);
+
+    if( devpath && (mon = udev_monitor_new_from_netlink(umudev_object, "kernel")) ) {
+        /* Note: Enabling applies libudev filters, which would
+         *       replace the custom one - so attach it afterwards */
+        if( udev_monitor_enable_receiving(mon) == 0 &&
+            umudev_monitor_attach_filter(udev_monitor_get_fd(mon), devpath) )
+            goto EXIT;
+
+        udev_monitor_unref(mon), mon = 0;
+    }
+
+    log_warning("falling back to %s subsystem uevent monitoring", subsystem);
+
+    if( !(mon = udev_monitor_new_from_netlink(umudev_object, "udev")) ) {
+        log_err("Unable to monitor the netlink\n");
+        goto EXIT;
+    }
+
+    if( udev_monitor_filter_add_match_subsystem_devtype(mon, subsystem, NULL) != 0 ) {
+        log_err("Udev match failed.\n");
+        goto FAIL;
+    }
+
+    if( udev_monitor_enable_receiving(mon) != 0 ) {
+        log_err("Failed to enable monitor recieving.\n");
+        goto FAIL;
+    }
+
+    goto EXIT;
+
+FAIL:
+    udev_monitor_unref(mon), mon = 0;
+
+EXIT:
+    return mon;
+}
+
 gboolean umudev_init(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -511,9 +1751,6 @@ gboolean umudev_init(void)
     char                   *configured_device = NULL;
     char                   *configured_subsystem = NULL;
     struct udev_device     *dev = 0;
-    GIOChannel             *iochannel = 0;
-
-    int ret = 0;
 
     /* Clear in-cleanup in case of restart */
     umudev_in_cleanup = false;
@@ -531,37 +1768,28 @@ gboolean umudev_init(void)
         configured_subsystem = g_strdup("power_supply");
 
     /* Try with configured / default device */
-    dev = udev_device_new_from_syspath(umudev_object, configured_device);
+    if( (dev = udev_device_new_from_syspath(umudev_object, configured_device)) ) {
+        umudev_source = UMUDEV_SOURCE_CONFIGURED;
+        umudev_score_as_power_supply(configured_device, &umudev_score);
+    }
 
-    /* If needed, try heuristics */
+    /* Then device selected via heuristics earlier */
     if( !dev ) {
-        log_debug("Trying to guess $power_supply device.\n");
-
-        int    current_score = 0;
-        gchar *current_name  = 0;
-
-        struct udev_enumerate  *list;
-        struct udev_list_entry *list_entry;
-        struct udev_list_entry *first_entry;
+        gchar *cached = umudev_cache_lookup(configured_device, &umudev_score);
+        if( cached && (dev = udev_device_new_from_syspath(umudev_object, cached)) )
+            umudev_source = UMUDEV_SOURCE_CACHED;
+        g_free(cached);
+    }
 
-        list = udev_enumerate_new(umudev_object);
-        udev_enumerate_add_match_subsystem(list, "power_supply");
-        udev_enumerate_scan_devices(list);
-        first_entry = udev_enumerate_get_list_entry(list);
-        udev_list_entry_foreach(list_entry, first_entry) {
-            const char *name = udev_list_entry_get_name(list_entry);
-            int score = umudev_score_as_power_supply(name);
-            if( current_score < score ) {
-                g_free(current_name);
-                current_name = g_strdup(name);
-                current_score = score;
-            }
-        }
+    /* If needed, try heuristics */
+    if( !dev ) {
+        gchar *scanned = umudev_scan_power_supply(&umudev_score);
         /* check if we found anything with some kind of score */
-        if(current_score > 0) {
-            dev = udev_device_new_from_syspath(umudev_object, current_name);
+        if( scanned && (dev = udev_device_new_from_syspath(umudev_object, scanned)) ) {
+            umudev_source = UMUDEV_SOURCE_SCANNED;
+            umudev_cache_update(configured_device, scanned, &umudev_score);
         }
-        g_free(current_name);
+        g_free(scanned);
     }
 
     /* Give up if no power supply device was found */
@@ -572,39 +1800,23 @@ gboolean umudev_init(void)
     }
 
     /* Cache device name */
+    umudev_syspath = g_strdup(udev_device_get_syspath(dev));
+    umudev_flap_bind(umudev_syspath);
     umudev_sysname = g_strdup(udev_device_get_sysname(dev));
     log_debug("device name = %s\n", umudev_sysname);
 
     /* Start monitoring for changes */
-    umudev_monitor = udev_monitor_new_from_netlink(umudev_object, "udev");
+    umudev_monitor = umudev_monitor_create(dev, configured_subsystem);
     if( !umudev_monitor )
     {
-        log_err("Unable to monitor the netlink\n");
         /* communicate failure, mainloop will exit and call appropriate clean-up */
         goto EXIT;
     }
 
-    ret = udev_monitor_filter_add_match_subsystem_devtype(umudev_monitor,
-                                                          configured_subsystem,
-                                                          NULL);
-    if(ret != 0)
-    {
-        log_err("Udev match failed.\n");
-        goto EXIT;
-    }
-
-    ret = udev_monitor_enable_receiving(umudev_monitor);
-    if(ret != 0)
-    {
-        log_err("Failed to enable monitor recieving.\n");
-        goto EXIT;
-    }
-
-    iochannel = g_io_channel_unix_new(udev_monitor_get_fd(umudev_monitor));
-    if( !iochannel )
-        goto EXIT;
-
-    umudev_watch_id = g_io_add_watch_full(iochannel, 0, G_IO_IN, umudev_io_input_cb, NULL, umudev_io_error_cb);
+    umudev_watch_id = evloop_add_io_full("udev", EVLOOP_PRIO_UDEV,
+                                         udev_monitor_get_fd(umudev_monitor),
+                                         EPOLLIN, umudev_io_input_cb, 0,
+                                         umudev_io_error_cb);
     if( !umudev_watch_id )
         goto EXIT;
 
@@ -614,11 +1826,11 @@ gboolean umudev_init(void)
     /* check initial status */
     umudev_parse_properties(dev, true);
 
+    /* Start optional cable detection sources */
+    umudev_aux_start();
+
 EXIT:
     /* Cleanup local resources */
-    if( iochannel )
-        g_io_channel_unref(iochannel);
-
     if( dev )
         udev_device_unref(dev);
 
@@ -642,7 +1854,7 @@ void umudev_quit(void)
 
     if( umudev_watch_id )
     {
-        g_source_remove(umudev_watch_id),
+        evloop_remove(umudev_watch_id),
             umudev_watch_id = 0;
     }
 
@@ -651,6 +1863,8 @@ void umudev_quit(void)
             umudev_monitor = 0;
     }
 
+    umudev_aux_stop();
+
     if( umudev_object ) {
         udev_unref(umudev_object),
             umudev_object =0 ;
@@ -659,5 +1873,10 @@ void umudev_quit(void)
     g_free(umudev_sysname),
         umudev_sysname = 0;
 
+    g_free(umudev_syspath),
+        umudev_syspath = 0;
+    umudev_source = UMUDEV_SOURCE_NONE;
+    memset(&umudev_score, 0, sizeof umudev_score);
+
     umudev_cable_state_stop_timer();
 }
@@ -43,7 +43,10 @@
  * UMUDEV
  * ------------------------------------------------------------------------- */
 
-gboolean umudev_init(void);
-void     umudev_quit(void);
+gchar   *umudev_get_power_supply_info(void);
+gchar   *umudev_get_burst_stats      (void);
+void     umudev_reset_burst_stats    (void);
+gboolean umudev_init                 (void);
+void     umudev_quit                 (void);
 
 #endif /* USB_MODED_UDEV_H_ */
@@ -50,6 +50,12 @@ static int util_set_unhide_mode_config(char *mode);
 static int util_get_hiddenlist        (void);
 static int util_handle_network        (char *network);
 static int util_clear_user_config     (char *uid);
+static int util_get_wakeup_stats      (void);
+static int util_reset_wakeup_stats    (void);
+static int util_get_latency_stats     (void);
+static int util_reset_latency_stats   (void);
+static int util_get_flight_recorder   (void);
+static int util_get_power_supply      (void);
 
 /* ------------------------------------------------------------------------- *
  * MAIN
@@ -397,10 +403,166 @@ static int util_clear_user_config(char *uid)
     return ret;
 }
 
+static int util_get_wakeup_stats (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    char *ret = 0;
+    char *tmp = 0;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_WAKEUP_STATS_GET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            /* String is owned by the reply message */
+            if( dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &tmp, DBUS_TYPE_INVALID) )
+                ret = g_strdup(tmp);
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+    }
+
+    if(ret)
+    {
+        printf("wakeups = %s\n", ret);
+        g_free(ret);
+        return 0;
+    }
+
+    /* not everything went as planned, return error */
+    return 1;
+}
+
+static int util_reset_wakeup_stats (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    int ret = 1;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_WAKEUP_STATS_RESET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            dbus_message_unref(reply);
+            ret = 0;
+        }
+        dbus_message_unref(req);
+    }
+
+    if(!ret)
+        printf("wakeup statistics reset\n");
+
+    return ret;
+}
+
+static int util_get_latency_stats (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    char *ret = 0;
+    char *tmp = 0;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_LATENCY_STATS_GET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            /* String is owned by the reply message */
+            if( dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &tmp, DBUS_TYPE_INVALID) )
+                ret = g_strdup(tmp);
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+    }
+
+    if(ret)
+    {
+        printf("%s", ret);
+        g_free(ret);
+        return 0;
+    }
+
+    /* not everything went as planned, return error */
+    return 1;
+}
+
+static int util_reset_latency_stats (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    int ret = 1;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_LATENCY_STATS_RESET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            dbus_message_unref(reply);
+            ret = 0;
+        }
+        dbus_message_unref(req);
+    }
+
+    if(!ret)
+        printf("latency statistics reset\n");
+
+    return ret;
+}
+
+static int util_get_flight_recorder (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    char *ret = 0;
+    char *tmp = 0;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_FLIGHT_RECORDER_GET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            /* String is owned by the reply message */
+            if( dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &tmp, DBUS_TYPE_INVALID) )
+                ret = g_strdup(tmp);
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+    }
+
+    if(ret)
+    {
+        printf("%s", ret);
+        g_free(ret);
+        return 0;
+    }
+
+    /* not everything went as planned, return error */
+    return 1;
+}
+
+static int util_get_power_supply (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    char *ret = 0;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_POWER_SUPPLY_GET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &ret, DBUS_TYPE_INVALID);
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+    }
+
+    if(ret)
+    {
+        printf("power supply = %s\n", ret);
+        return 0;
+    }
+
+    /* not everything went as planned, return error */
+    return 1;
+}
+
 int main (int argc, char *argv[])
 {
     int query = 0, network = 0, setmode = 0, config = 0;
     int modelist = 0, mode_configured = 0, hide = 0, unhide = 0, hiddenlist = 0, clear = 0;
+    int wakeups = 0, wakeups_reset = 0, power_supply = 0;
+    int latency = 0, latency_reset = 0, recorder = 0;
     int res = 1, opt, rescue = 0;
     char *option = 0;
 
@@ -410,7 +572,7 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
-    while ((opt = getopt(argc, argv, "c:dhi:mn:qrs:u:vU:")) != -1)
+    while ((opt = getopt(argc, argv, "c:dFhi:lLmn:pqrs:u:vU:wW")) != -1)
     {
         switch (opt) {
         case 'c':
@@ -420,10 +582,19 @@ int main (int argc, char *argv[])
         case 'd':
             mode_configured = 1;
             break;
+        case 'F':
+            recorder = 1;
+            break;
         case 'i':
             hide = 1;
             option = optarg;
             break;
+        case 'l':
+            latency = 1;
+            break;
+        case 'L':
+            latency_reset = 1;
+            break;
         case 'm':
             modelist = 1;
             break;
@@ -431,6 +602,9 @@ int main (int argc, char *argv[])
             network = 1;
             option = optarg;
             break;
+        case 'p':
+            power_supply = 1;
+            break;
         case 'q':
             query = 1;
             break;
@@ -452,22 +626,34 @@ int main (int argc, char *argv[])
             clear = 1;
             option = optarg;
             break;
+        case 'w':
+            wakeups = 1;
+            break;
+        case 'W':
+            wakeups_reset = 1;
+            break;
         case 'h':
         default:
                 fprintf(stderr, "\nUsage: %s -<option> <args>\n\n \
                    Options are: \n \
                    \t-c to set a mode in the config file,\n \
                    \t-d to get the default mode set in the configuration, \n \
+                   \t-F to get the flight recorder event history, \n \
                    \t-h to get this help, \n \
                    \t-i hide a mode,\n \
+                   \t-l to get mode switch latency histograms,\n \
+                   \t-L to reset mode switch latency histograms,\n \
                    \t-n to get/set network configuration. Use get:${config}/set:${config},${value}\n \
                    \t-m to get the list of supported modes, \n \
+                   \t-p to get details of the tracked power supply device, \n \
                    \t-q to query the current mode,\n \
                    \t-r turn rescue mode off,\n \
                    \t-s to set/activate a mode,\n \
                    \t-u unhide a mode,\n \
                    \t-v to get the list of hidden modes\n \
-                   \t-U <uid> to clear config for a user\n",
+                   \t-U <uid> to clear config for a user\n \
+                   \t-w to get event source wakeup counts,\n \
+                   \t-W to reset event source wakeup counts\n",
                         argv[0]);
             exit(1);
         }
@@ -506,6 +692,18 @@ int main (int argc, char *argv[])
         res = util_get_hiddenlist();
     else if (clear)
         res = util_clear_user_config(option);
+    else if (wakeups)
+        res = util_get_wakeup_stats();
+    else if (wakeups_reset)
+        res = util_reset_wakeup_stats();
+    else if (power_supply)
+        res = util_get_power_supply();
+    else if (latency)
+        res = util_get_latency_stats();
+    else if (latency_reset)
+        res = util_reset_latency_stats();
+    else if (recorder)
+        res = util_get_flight_recorder();
 
     /* subfunctions will return 1 if an error occured, print message */
     if(res)
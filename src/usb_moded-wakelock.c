@@ -0,0 +1,442 @@
+/**
+ * @file usb_moded-wakelock.c
+ *
+ * Reference counted wakelocks with hold time accounting
+ *
+ * The sysfs control files are opened once and kept open. Named locks
+ * are reference counted, so that only the outermost acquire and
+ * release reach the kernel. For each lock the number of acquisitions,
+ * total time held and the longest hold are recorded.
+ *
+ * Wakelocks are used only from the main thread, so no locking is done.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-wakelock.h"
+
+#include "usb_moded.h"
+
+#include "usb_moded-common.h"
+#include "usb_moded-log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/* Wakelogging is noisy, do not log it by default */
+#ifndef  VERBOSE_WAKELOCKING
+# define VERBOSE_WAKELOCKING 0
+#endif
+
+/** Sysfs file for acquiring wakelocks */
+#define WAKELOCK_LOCK_PATH   "/sys/power/wake_lock"
+
+/** Sysfs file for releasing wakelocks */
+#define WAKELOCK_UNLOCK_PATH "/sys/power/wake_unlock"
+
+/** Kernel side auto-release timeout [ms]
+ *
+ * Automatically terminating wakelocks are used, so that we do not
+ * block suspend indefinitely in case usb_moded gets stuck or crashes.
+ */
+#define WAKELOCK_TIMEOUT_MS  USB_MODED_SUSPEND_DELAY_MAXIMUM_MS
+
+/** File descriptor value for: open not attempted yet */
+#define WAKELOCK_FD_UNKNOWN  (-1)
+
+/** File descriptor value for: file does not exist or can't be opened */
+#define WAKELOCK_FD_MISSING  (-2)
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Bookkeeping data for one named wakelock */
+typedef struct wakelock_t
+{
+    /** Number of nested acquires */
+    unsigned refcount;
+
+    /** When outermost acquire was made [ms] */
+    int64_t  acquired;
+
+    /** When kernel side timeout was last renewed [ms] */
+    int64_t  renewed;
+
+    /** Number of outermost acquires */
+    unsigned acquire_count;
+
+    /** Number of nested acquires that did not reach the kernel */
+    unsigned nested_count;
+
+    /** Total time held in completed holds [ms] */
+    int64_t  held_total;
+
+    /** Longest completed hold [ms] */
+    int64_t  held_max;
+} wakelock_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * WAKELOCK
+ * ------------------------------------------------------------------------- */
+
+static bool        wakelock_write       (int *pfd, const char *path, const char *text);
+static bool        wakelock_write_lock  (const char *name);
+static bool        wakelock_write_unlock(const char *name);
+static wakelock_t *wakelock_lookup      (const char *name);
+void               wakelock_acquire     (const char *name);
+void               wakelock_renew       (const char *name);
+void               wakelock_release     (const char *name);
+gchar             *wakelock_get_stats   (void);
+void               wakelock_reset_stats (void);
+void               wakelock_quit        (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Cached file descriptor for WAKELOCK_LOCK_PATH */
+static int wakelock_lock_fd = WAKELOCK_FD_UNKNOWN;
+
+/** Cached file descriptor for WAKELOCK_UNLOCK_PATH */
+static int wakelock_unlock_fd = WAKELOCK_FD_UNKNOWN;
+
+/** Lock name -> wakelock_t lookup table */
+static GHashTable *wakelock_lut = 0;
+
+/* ========================================================================= *
+ * WAKELOCK
+ * ========================================================================= */
+
+/** Write string to cached sysfs file
+ *
+ * The file is opened on first use. If the file does not exist,
+ * the failure is remembered and further writes are silently ignored.
+ *
+ * @param pfd   Pointer to cached file descriptor
+ * @param path  Sysfs file path
+ * @param text  What to write
+ *
+ * @return true on success, or false on failure
+ */
+static bool
+wakelock_write(int *pfd, const char *path, const char *text)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( *pfd == WAKELOCK_FD_UNKNOWN ) {
+        if( (*pfd = open(path, O_WRONLY | O_CLOEXEC)) == -1 ) {
+            if( errno != ENOENT )
+                log_warning("%s: open for writing failed: %m", path);
+            *pfd = WAKELOCK_FD_MISSING;
+        }
+    }
+
+    if( *pfd == WAKELOCK_FD_MISSING )
+        goto EXIT;
+
+    if( write(*pfd, text, strlen(text)) == -1 ) {
+        log_warning("%s: write failed : %m", path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Acquire kernel side wakelock with auto-release timeout
+ *
+ * @param name  Wakelock name
+ *
+ * @return true on success, or false on failure
+ */
+static bool
+wakelock_write_lock(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char buff[256];
+    snprintf(buff, sizeof buff, "%s %lld", name,
+             WAKELOCK_TIMEOUT_MS * 1000000LL);
+    return wakelock_write(&wakelock_lock_fd,
+                          common_root_path(WAKELOCK_LOCK_PATH), buff);
+}
+
+/** Release kernel side wakelock
+ *
+ * @param name  Wakelock name
+ *
+ * @return true on success, or false on failure
+ */
+static bool
+wakelock_write_unlock(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return wakelock_write(&wakelock_unlock_fd,
+                          common_root_path(WAKELOCK_UNLOCK_PATH), name);
+}
+
+/** Lookup wakelock bookkeeping data, create if needed
+ *
+ * @param name  Wakelock name
+ *
+ * @return wakelock bookkeeping data
+ */
+static wakelock_t *
+wakelock_lookup(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !wakelock_lut )
+        wakelock_lut = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, g_free);
+
+    wakelock_t *self = g_hash_table_lookup(wakelock_lut, name);
+    if( !self ) {
+        self = g_malloc0(sizeof *self);
+        g_hash_table_replace(wakelock_lut, g_strdup(name), self);
+    }
+    return self;
+}
+
+/** Acquire wakelock
+ *
+ * Wakelock must be released via wakelock_release().
+ *
+ * Only the outermost acquire reaches the kernel, unless the kernel
+ * side timeout is about to expire during a long nested hold.
+ *
+ * Note: The name should be unique within the system.
+ *
+ * @param name  Wakelock to be acquired
+ */
+void
+wakelock_acquire(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    wakelock_t *self = wakelock_lookup(name);
+    int64_t     now  = common_get_monotonic_ms();
+
+    if( self->refcount++ == 0 ) {
+        self->acquired = now;
+        self->acquire_count += 1;
+        wakelock_write_lock(name);
+        self->renewed = now;
+    }
+    else {
+        self->nested_count += 1;
+        if( now - self->renewed > WAKELOCK_TIMEOUT_MS / 2 ) {
+            wakelock_write_lock(name);
+            self->renewed = now;
+        }
+    }
+
+#if VERBOSE_WAKELOCKING
+    log_debug("wakelock_acquire %s (%u)", name, self->refcount);
+#endif
+}
+
+/** Restart kernel side timeout of already held wakelock
+ *
+ * Does not affect reference count.
+ *
+ * @param name  Wakelock to be renewed
+ */
+void
+wakelock_renew(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    wakelock_t *self = wakelock_lookup(name);
+
+    if( self->refcount == 0 ) {
+        log_warning("wakelock_renew %s: not held", name);
+        goto EXIT;
+    }
+
+#if VERBOSE_WAKELOCKING
+    log_debug("wakelock_renew %s", name);
+#endif
+
+    wakelock_write_lock(name);
+    self->renewed = common_get_monotonic_ms();
+
+EXIT:
+    return;
+}
+
+/** Release wakelock
+ *
+ * @param name  Wakelock to be released
+ */
+void
+wakelock_release(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    wakelock_t *self = wakelock_lookup(name);
+
+    if( self->refcount == 0 ) {
+        log_warning("wakelock_release %s: not held", name);
+        goto EXIT;
+    }
+
+#if VERBOSE_WAKELOCKING
+    log_debug("wakelock_release %s (%u)", name, self->refcount);
+#endif
+
+    if( --self->refcount == 0 ) {
+        int64_t held = common_get_monotonic_ms() - self->acquired;
+        self->held_total += held;
+        if( self->held_max < held )
+            self->held_max = held;
+        wakelock_write_unlock(name);
+    }
+
+EXIT:
+    return;
+}
+
+/** Get wakelock statistics
+ *
+ * @return "name: acquired=N nested=N held=ms longest=ms active=0|1, ..."
+ *         string; caller must release with g_free()
+ */
+gchar *
+wakelock_get_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *buff = g_string_new(0);
+    int64_t  now  = common_get_monotonic_ms();
+
+    if( wakelock_lut ) {
+        GList *keys = g_hash_table_get_keys(wakelock_lut);
+        keys = g_list_sort(keys, (GCompareFunc)strcmp);
+        for( GList *iter = keys; iter; iter = iter->next ) {
+            const char       *name = iter->data;
+            const wakelock_t *self = g_hash_table_lookup(wakelock_lut, name);
+
+            /* Include ongoing hold in totals */
+            int64_t held_total = self->held_total;
+            int64_t held_max   = self->held_max;
+            if( self->refcount ) {
+                int64_t held = now - self->acquired;
+                held_total += held;
+                if( held_max < held )
+                    held_max = held;
+            }
+
+            if( buff->len )
+                g_string_append(buff, ", ");
+            g_string_append_printf(buff, "%s: acquired=%u nested=%u "
+                                   "held=%lld longest=%lld active=%d",
+                                   name, self->acquire_count,
+                                   self->nested_count,
+                                   (long long)held_total,
+                                   (long long)held_max,
+                                   self->refcount > 0);
+        }
+        g_list_free(keys);
+    }
+
+    return g_string_free(buff, FALSE);
+}
+
+/** Reset wakelock statistics
+ *
+ * Currently held locks stay held, and their ongoing hold is
+ * accounted from the time of reset.
+ */
+void
+wakelock_reset_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !wakelock_lut )
+        goto EXIT;
+
+    int64_t        now = common_get_monotonic_ms();
+    GHashTableIter iter;
+    gpointer       val;
+
+    g_hash_table_iter_init(&iter, wakelock_lut);
+    while( g_hash_table_iter_next(&iter, 0, &val) ) {
+        wakelock_t *self = val;
+        self->acquire_count = 0;
+        self->nested_count  = 0;
+        self->held_total    = 0;
+        self->held_max      = 0;
+        if( self->refcount )
+            self->acquired = now;
+    }
+
+EXIT:
+    return;
+}
+
+/** Release all wakelocks and close cached file descriptors
+ *
+ * Meant to be called just before exit, so that wakelocks are not
+ * left behind.
+ */
+void
+wakelock_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( wakelock_lut ) {
+        GHashTableIter iter;
+        gpointer       key, val;
+
+        g_hash_table_iter_init(&iter, wakelock_lut);
+        while( g_hash_table_iter_next(&iter, &key, &val) ) {
+            wakelock_t *self = val;
+            if( self->refcount ) {
+                log_warning("wakelock %s still held on exit", (char *)key);
+                self->refcount = 0;
+                wakelock_write_unlock(key);
+            }
+        }
+        g_hash_table_unref(wakelock_lut), wakelock_lut = 0;
+    }
+
+    if( wakelock_lock_fd >= 0 )
+        close(wakelock_lock_fd);
+    wakelock_lock_fd = WAKELOCK_FD_UNKNOWN;
+
+    if( wakelock_unlock_fd >= 0 )
+        close(wakelock_unlock_fd);
+    wakelock_unlock_fd = WAKELOCK_FD_UNKNOWN;
+}
@@ -0,0 +1,41 @@
+/**
+ * @file usb_moded-wakelock.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_WAKELOCK_H_
+# define USB_MODED_WAKELOCK_H_
+
+# include <glib.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * WAKELOCK
+ * ------------------------------------------------------------------------- */
+
+void   wakelock_acquire     (const char *name);
+void   wakelock_renew       (const char *name);
+void   wakelock_release     (const char *name);
+gchar *wakelock_get_stats   (void);
+void   wakelock_reset_stats (void);
+void   wakelock_quit        (void);
+
+#endif /* USB_MODED_WAKELOCK_H_ */
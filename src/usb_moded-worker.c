@@ -24,14 +24,18 @@
 
 #include "usb_moded-worker.h"
 
-#include "usb_moded-android.h"
-#include "usb_moded-configfs.h"
 #include "usb_moded-control.h"
+#include "usb_moded-dbus-private.h"
 #include "usb_moded-dyn-config.h"
+#include "usb_moded-evloop.h"
+#include "usb_moded-gadget.h"
+#include "usb_moded-latency.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-modules.h"
+#include "usb_moded-recorder.h"
+#include "usb_moded-taskgraph.h"
 
 // FIXME: worker thread should not depend on control functionality
 #include "usb_moded-control.h"
@@ -45,6 +49,8 @@
 #include <string.h>
 #include <errno.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <inttypes.h>
 
 /* ========================================================================= *
  * Types
@@ -66,6 +72,61 @@ static const char * const devstate_name[] = {
   [DEVSTATE_MOUNTED]   = "mounted",
 };
 
+/** Reasons for ending mtpd linger period */
+typedef enum {
+    WORKER_REAP_NONE,
+    /** Linger time is over */
+    WORKER_REAP_EXPIRED,
+    /** System is under memory pressure */
+    WORKER_REAP_PRESSURE,
+    /** Active user has changed */
+    WORKER_REAP_USER,
+
+    WORKER_REAP_NUMOF
+} worker_reap_t;
+
+static const char * const worker_reap_name[WORKER_REAP_NUMOF] = {
+  [WORKER_REAP_NONE]     = "none",
+  [WORKER_REAP_EXPIRED]  = "expired",
+  [WORKER_REAP_PRESSURE] = "pressure",
+  [WORKER_REAP_USER]     = "user-change",
+};
+
+/** Memory pressure that ends mtpd linger period
+ *
+ * Tasks stalled on memory for 150 ms within 1 second window,
+ * see kernel Documentation/accounting/psi.rst
+ */
+#define WORKER_LINGER_PSI_TRIGGER "some 150000 1000000"
+
+/** Mode switch job passed from main thread to worker thread */
+typedef struct worker_job_t
+{
+    /** Job sequence number, assigned by main thread */
+    unsigned       id;
+
+    /** Requested internal mode name, owned by the job */
+    gchar         *mode;
+
+    /** Why the mode switch was requested */
+    mode_reason_t  reason;
+
+    /** Requesting user, or UID_UNKNOWN */
+    uid_t          uid;
+
+    /** Keep current gadget configured, just detach it from the bus */
+    bool           linger;
+
+    /** Mode to prepare in background while user is choosing, or NULL */
+    gchar         *prewarm;
+
+    /** When the job was queued, see common_get_monotonic_ms() */
+    int64_t        queued;
+} worker_job_t;
+
+/** Number of slots in the job queue, must be a power of two */
+#define WORKER_QUEUE_SIZE 16
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -74,8 +135,13 @@ static const char * const devstate_name[] = {
  * WORKER
  * ------------------------------------------------------------------------- */
 
-static bool        worker_thread_p                 (void);
+bool               worker_thread_p                 (void);
+static bool        worker_job_thread_p             (void);
 bool               worker_bailing_out              (void);
+static void        worker_request_bailout          (void);
+static void        worker_signal_cancel_evfd       (void);
+static bool        worker_drain_cancel_evfd        (void);
+static void        worker_reset_bailout            (void);
 static devstate_t  worker_get_mtp_device_state     (void);
 static void        worker_unmount_mtp_device       (void);
 static bool        worker_mount_mtp_device         (void);
@@ -84,25 +150,54 @@ static bool        worker_is_mtpd_running          (void);
 static bool        worker_mtpd_running_p           (void *aptr);
 static bool        worker_mtpd_stopped_p           (void *aptr);
 static bool        worker_stop_mtpd                (void);
+static bool        worker_launch_mtpd              (bool block);
 static bool        worker_start_mtpd               (void);
+static bool        worker_start_mtpd_nowait        (void);
+static bool        worker_mtpd_is_lingering        (void);
+static void        worker_mtpd_set_lingering       (bool lingering);
+static bool        worker_mtpd_reuse               (const char *mode);
+static bool        worker_mtpd_linger              (void);
+static void        worker_mtpd_reap                (void);
+static bool        worker_linger_timer_cb          (void *aptr);
+static bool        worker_linger_psi_cb            (int fd, uint32_t events, void *aptr);
+static void        worker_linger_start             (void);
+static void        worker_linger_stop              (void);
+static void        worker_linger_rethink           (void);
+gchar             *worker_get_mtpd_stats           (void);
 static bool        worker_switch_to_charging       (void);
 const char        *worker_get_kernel_module        (void);
+bool               worker_begin_kernel_module      (const char *module);
+bool               worker_finish_kernel_module     (void);
 bool               worker_set_kernel_module        (const char *module);
 void               worker_clear_kernel_module      (void);
 const modedata_t  *worker_get_usb_mode_data        (void);
 modedata_t        *worker_dup_usb_mode_data        (void);
 void               worker_set_usb_mode_data        (const modedata_t *data);
+static void        worker_job_clear                (worker_job_t *job);
+static void        worker_job_disown               (worker_job_t *job);
+static bool        worker_queue_push               (worker_job_t *job);
+static bool        worker_queue_pop                (worker_job_t *job);
+static bool        worker_queue_collapse           (worker_job_t *job);
+static void        worker_queue_flush_overflow     (void);
+static void        worker_queue_clear              (void);
 static const char *worker_get_activated_mode_locked(void);
 static bool        worker_set_activated_mode_locked(const char *mode);
 static const char *worker_get_requested_mode_locked(void);
 static bool        worker_set_requested_mode_locked(const char *mode);
-void               worker_request_hardware_mode    (const char *mode);
+static void        worker_queue_job                (const char *mode, mode_reason_t reason, uid_t uid, bool linger, const char *prewarm);
+void               worker_request_hardware_mode    (const char *mode, mode_reason_t reason, uid_t uid);
+void               worker_request_hardware_linger  (mode_reason_t reason);
+void               worker_request_hardware_ask     (const char *prewarm, mode_reason_t reason, uid_t uid);
 void               worker_clear_hardware_mode      (void);
+static void        worker_complete_job             (const worker_job_t *job);
 static void        worker_execute                  (void);
+static bool        worker_prewarm_mode             (const char *mode);
+static void        worker_rollback_prewarm         (void);
+static bool        worker_suspend_mode             (void);
+static bool        worker_resume_mode              (void);
 static void        worker_switch_to_mode           (const char *mode);
-static guint       worker_add_iowatch              (int fd, bool close_on_unref, GIOCondition cnd, GIOFunc io_cb, gpointer aptr);
 static void       *worker_thread_cb                (void *aptr);
-static gboolean    worker_notify_cb                (GIOChannel *chn, GIOCondition cnd, gpointer data);
+static bool        worker_notify_cb                (int fd, uint32_t events, void *aptr);
 static bool        worker_start_thread             (void);
 static void        worker_stop_thread              (void);
 static void        worker_delete_eventfd           (void);
@@ -111,6 +206,9 @@ bool               worker_init                     (void);
 void               worker_quit                     (void);
 void               worker_wakeup                   (void);
 static void        worker_notify                   (void);
+static void        worker_mtpd_request_reap        (worker_reap_t reason);
+int                worker_get_cancel_fd            (void);
+bool               worker_cancel_fd_triggered      (void);
 
 /* ========================================================================= *
  * Data
@@ -134,6 +232,13 @@ static volatile bool worker_bailout_requested = false;
  */
 static volatile bool worker_bailout_handled = false;
 
+/** Eventfd for: Main thread has requested bailout
+ *
+ * Non-blocking, so that it can be polled from both worker thread and
+ * task graph helper threads alongside blocking operations.
+ */
+static int worker_cancel_evfd = -1;
+
 #define WORKER_LOCKED_ENTER do {\
     if( pthread_mutex_lock(&worker_mutex) != 0 ) { \
         log_crit("WORKER LOCK FAILED");\
@@ -152,7 +257,7 @@ static volatile bool worker_bailout_handled = false;
  * Functions
  * ========================================================================= */
 
-static bool
+bool
 worker_thread_p(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -160,21 +265,110 @@ worker_thread_p(void)
     return worker_thread_id && worker_thread_id == pthread_self();
 }
 
+/** Check if calling thread is executing the current job
+ *
+ * In addition to the worker thread itself, this includes task graph
+ * helper threads that execute mode switch steps on its behalf.
+ *
+ * @return true if calling thread is part of the current job
+ */
+static bool
+worker_job_thread_p(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (worker_thread_p() ||
+            (worker_thread_id && taskgraph_helper_of(worker_thread_id)));
+}
+
 bool
 worker_bailing_out(void)
 {
     LOG_REGISTER_CONTEXT;
 
     // ref: see common_msleep_()
-    return (worker_thread_p() &&
+    return (worker_job_thread_p() &&
             worker_bailout_requested &&
             !worker_bailout_handled);
 }
 
+/** Make worker and its helper threads bail out; main thread only
+ */
+static void
+worker_request_bailout(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_bailout_requested = true;
+    worker_signal_cancel_evfd();
+}
+
+/** Make cancel eventfd readable
+ */
+static void
+worker_signal_cancel_evfd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    uint64_t cnt = 1;
+    if( worker_cancel_evfd != -1 &&
+        write(worker_cancel_evfd, &cnt, sizeof cnt) == -1 ) {
+        log_err("failed to signal cancel: %m");
+    }
+}
+
+/** Consume pending cancel eventfd wakeups
+ *
+ * A bailout request can land between checking the flag and draining
+ * the eventfd. To retain the invariant that a set bailout flag implies
+ * a readable eventfd, the flag is re-checked after draining and the
+ * eventfd is signaled again if needed.
+ *
+ * @return true if bailout is pending, false otherwise
+ */
+static bool
+worker_drain_cancel_evfd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    uint64_t cnt = 0;
+    if( worker_cancel_evfd != -1 &&
+        read(worker_cancel_evfd, &cnt, sizeof cnt) == -1 &&
+        errno != EAGAIN ) {
+        log_warning("failed to drain cancel requests: %m");
+    }
+
+    /* Once bailout has been handled, waking up is no longer useful */
+    if( !worker_bailout_requested || worker_bailout_handled )
+        return false;
+
+    worker_signal_cancel_evfd();
+    return true;
+}
+
+/** Start accepting bailout requests for a new job; worker thread only
+ */
+static void
+worker_reset_bailout(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_bailout_requested = false;
+    worker_bailout_handled = false;
+
+    /* Requests made before clearing the flag are dropped along with
+     * the stale wakeups; requests made after it stay both flagged and
+     * signaled, see worker_drain_cancel_evfd() */
+    worker_drain_cancel_evfd();
+}
+
 /* ------------------------------------------------------------------------- *
  * MTP_DEVICE
  * ------------------------------------------------------------------------- */
 
+/** User that was active when mtp device was mounted */
+static uid_t worker_mtp_device_uid = UID_UNKNOWN;
+
 /** Check if mtp device is mounted
  *
  * Returns DEVSTATE_MOUNTED / DEVSTATE_UNMOUNTED depending
@@ -199,7 +393,7 @@ worker_get_mtp_device_state(void)
 
     devstate_t state = DEVSTATE_UNKNOWN;
 
-    if( access("/dev/mtp/ep0", F_OK) == 0 )
+    if( access(common_root_path("/dev/mtp/ep0"), F_OK) == 0 )
         state = DEVSTATE_MOUNTED;
     else if( errno == ENOENT )
         state = DEVSTATE_UNMOUNTED;
@@ -272,6 +466,7 @@ worker_mount_mtp_device(void)
         goto EXIT;
     }
 
+    worker_mtp_device_uid = control_get_current_user();
     mounted = true;
 
 EXIT:
@@ -337,7 +532,7 @@ static bool worker_is_mtpd_running(void)
     bool ack = true;
 
     for( size_t i = 0; lut[i]; ++i ) {
-        if( access(lut[i], F_OK) == -1 ) {
+        if( access(common_root_path(lut[i]), F_OK) == -1 ) {
             ack = false;
             break;
         }
@@ -399,6 +594,31 @@ FAILURE:
     return ack;
 }
 
+/** Issue mtp service start
+ *
+ * @param block  true to wait for the systemd job to finish
+ *
+ * @return true if start was issued successfully, false otherwise
+ */
+static bool
+worker_launch_mtpd(bool block)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Have attempted to start mtp service */
+    worker_mtp_service_started = true;
+
+    int rc = common_system(block
+                           ? "systemctl-user start buteo-mtp.service"
+                           : "systemctl-user --no-block start buteo-mtp.service");
+    if( rc != 0 ) {
+        log_warning("failed to start mtp daemon; exit code = %d", rc);
+        return false;
+    }
+
+    return true;
+}
+
 static bool
 worker_start_mtpd(void)
 {
@@ -411,14 +631,8 @@ worker_start_mtpd(void)
         goto SUCCESS;
     }
 
-    /* Have attempted to start mtp service */
-    worker_mtp_service_started = true;
-
-    int rc = common_system("systemctl-user start buteo-mtp.service");
-    if( rc != 0 ) {
-        log_warning("failed to start mtp daemon; exit code = %d", rc);
+    if( !worker_launch_mtpd(true) )
         goto FAILURE;
-    }
 
     if( common_wait(worker_mtp_start_delay, worker_mtpd_running_p, 0) != WAIT_READY ) {
         log_warning("failed to start mtp daemon; giving up");
@@ -434,23 +648,353 @@ FAILURE:
     return ack;
 }
 
+/** Start mtp daemon without waiting for it to become ready
+ *
+ * Like worker_start_mtpd(), but neither the systemd job nor
+ * the mtp endpoints are waited for.
+ *
+ * @return true if mtpd is running or start was issued, false otherwise
+ */
+static bool
+worker_start_mtpd_nowait(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( worker_mtpd_running_p(0) ) {
+        log_debug("mtp daemon is running");
+        return true;
+    }
+
+    return worker_launch_mtpd(false);
+}
+
+/* ------------------------------------------------------------------------- *
+ * MTP_LINGER
+ * ------------------------------------------------------------------------- */
+
+/** Flag for: mtpd is kept running while mtp mode is not active
+ *
+ * Protected by worker_mutex.
+ */
+static bool worker_mtpd_lingering = false;
+
+/** Pending worker_reap_t request from the main thread */
+static int worker_mtpd_reap_reason = WORKER_REAP_NONE;
+
+/** Number of mtp mode activations that used lingering mtpd */
+static unsigned worker_mtpd_hits = 0;
+
+/** Number of mtp mode activations that had to start mtpd */
+static unsigned worker_mtpd_misses = 0;
+
+/** Number of linger periods ended, by worker_reap_t */
+static unsigned worker_mtpd_reaped[WORKER_REAP_NUMOF];
+
+/** Timer for ending linger period; main thread only */
+static guint worker_linger_timer_id = 0;
+
+/** Memory pressure trigger file descriptor; main thread only */
+static int worker_linger_psi_fd = -1;
+
+/** I/O watch for worker_linger_psi_fd; main thread only */
+static guint worker_linger_psi_id = 0;
+
+static bool
+worker_mtpd_is_lingering(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    WORKER_LOCKED_ENTER;
+    bool lingering = worker_mtpd_lingering;
+    WORKER_LOCKED_LEAVE;
+
+    return lingering;
+}
+
+static void
+worker_mtpd_set_lingering(bool lingering)
+{
+    LOG_REGISTER_CONTEXT;
+
+    WORKER_LOCKED_ENTER;
+    if( worker_mtpd_lingering != lingering ) {
+        log_debug("mtpd lingering: %d -> %d",
+                  worker_mtpd_lingering, lingering);
+        worker_mtpd_lingering = lingering;
+    }
+    WORKER_LOCKED_LEAVE;
+}
+
+/** Check if lingering mtpd can be used when activating a mode
+ *
+ * Worker thread only.
+ *
+ * @param mode  mode that is about to be activated
+ *
+ * @return true if mtpd and mtp device should be left as is,
+ *         false otherwise
+ */
+static bool
+worker_mtpd_reuse(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( !worker_mode_is_mtp_mode(mode) )
+        goto EXIT;
+
+    if( !worker_mtpd_is_lingering() ) {
+        if( usbmoded_get_mtpd_linger() > 0 ) {
+            WORKER_LOCKED_ENTER;
+            worker_mtpd_misses += 1;
+            WORKER_LOCKED_LEAVE;
+        }
+        goto EXIT;
+    }
+
+    worker_mtpd_set_lingering(false);
+
+    /* Mtp device is mounted with group id of the active user */
+    if( control_get_current_user() != worker_mtp_device_uid ) {
+        log_debug("active user changed; restart mtpd");
+        WORKER_LOCKED_ENTER;
+        worker_mtpd_reaped[WORKER_REAP_USER] += 1;
+        worker_mtpd_misses += 1;
+        WORKER_LOCKED_LEAVE;
+        goto EXIT;
+    }
+
+    log_debug("using lingering mtpd");
+    WORKER_LOCKED_ENTER;
+    worker_mtpd_hits += 1;
+    WORKER_LOCKED_LEAVE;
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Check if mtpd should be kept running when leaving current mode
+ *
+ * Worker thread only.
+ *
+ * Applicable only when leaving mtp mode on configfs backend, where
+ * mtpd must be running before the gadget is bound anyway.
+ *
+ * @return true if mtpd and mtp device should be left as is,
+ *         false otherwise
+ */
+static bool
+worker_mtpd_linger(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( worker_mtpd_is_lingering() ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( usbmoded_get_mtpd_linger() <= 0 || !gadget_mtpd_before_udc() )
+        goto EXIT;
+
+    const modedata_t *data = worker_get_usb_mode_data();
+    if( !data || !worker_mode_is_mtp_mode(data->mode_name) )
+        goto EXIT;
+
+    if( !worker_is_mtpd_running() )
+        goto EXIT;
+
+    log_debug("leaving mtpd running for %d s", usbmoded_get_mtpd_linger());
+    worker_mtpd_set_lingering(true);
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Stop lingering mtpd if main thread has requested it
+ *
+ * Worker thread only.
+ */
+static void
+worker_mtpd_reap(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int reason = __atomic_exchange_n(&worker_mtpd_reap_reason,
+                                     WORKER_REAP_NONE, __ATOMIC_ACQ_REL);
+
+    if( reason <= WORKER_REAP_NONE || reason >= WORKER_REAP_NUMOF )
+        goto EXIT;
+
+    if( !worker_mtpd_is_lingering() )
+        goto EXIT;
+
+    log_debug("stopping lingering mtpd: %s", worker_reap_name[reason]);
+
+    worker_stop_mtpd();
+    worker_unmount_mtp_device();
+
+    worker_mtpd_set_lingering(false);
+
+    WORKER_LOCKED_ENTER;
+    worker_mtpd_reaped[reason] += 1;
+    WORKER_LOCKED_LEAVE;
+
+    /* Let main thread cancel timers */
+    worker_notify();
+
+EXIT:
+    return;
+}
+
+static bool
+worker_linger_timer_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    worker_linger_timer_id = 0;
+    worker_mtpd_request_reap(WORKER_REAP_EXPIRED);
+
+    return false;
+}
+
+static bool
+worker_linger_psi_cb(int fd, uint32_t events, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)fd;
+    (void)aptr;
+
+    bool keep_going = true;
+
+    if( events & EPOLLPRI ) {
+        log_debug("memory pressure");
+        worker_mtpd_request_reap(WORKER_REAP_PRESSURE);
+    }
+
+    if( events & (EPOLLERR | EPOLLHUP) ) {
+        log_warning("memory pressure trigger failed");
+        worker_linger_psi_id = 0;
+        keep_going = false;
+    }
+
+    return keep_going;
+}
+
+/** Start linger timer and memory pressure monitoring; main thread only
+ */
+static void
+worker_linger_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_linger_timer_id ) {
+        unsigned delay = usbmoded_get_mtpd_linger() * 1000u;
+        worker_linger_timer_id = evloop_add_timer("mtpd-linger", delay, 1000,
+                                                  worker_linger_timer_cb, 0);
+    }
+
+    if( worker_linger_psi_fd == -1 ) {
+        static const char trigger[] = WORKER_LINGER_PSI_TRIGGER;
+
+        int fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if( fd == -1 ) {
+            log_debug("/proc/pressure/memory: %m");
+            goto EXIT;
+        }
+        worker_linger_psi_fd = fd;
+
+        if( write(fd, trigger, sizeof trigger) == -1 ) {
+            log_debug("/proc/pressure/memory: can't set trigger: %m");
+            goto EXIT;
+        }
+
+        worker_linger_psi_id = evloop_add_io("mtpd-pressure", EVLOOP_PRIO_TIMER,
+                                             fd, EPOLLPRI,
+                                             worker_linger_psi_cb, 0);
+    }
+
+EXIT:
+    return;
+}
+
+/** Stop linger timer and memory pressure monitoring; main thread only
+ */
+static void
+worker_linger_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( worker_linger_timer_id )
+        evloop_remove(worker_linger_timer_id), worker_linger_timer_id = 0;
+
+    if( worker_linger_psi_id )
+        evloop_remove(worker_linger_psi_id), worker_linger_psi_id = 0;
+
+    if( worker_linger_psi_fd != -1 )
+        close(worker_linger_psi_fd), worker_linger_psi_fd = -1;
+}
+
+/** Sync linger monitoring with worker state; main thread only
+ */
+static void
+worker_linger_rethink(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( worker_mtpd_is_lingering() )
+        worker_linger_start();
+    else
+        worker_linger_stop();
+}
+
+/** Get mtpd linger statistics as "key=value, ..." string
+ *
+ * @return statistics string, caller must release
+ */
+gchar *
+worker_get_mtpd_stats(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    WORKER_LOCKED_ENTER;
+    gchar *stats = g_strdup_printf("mtpd-lingering=%d, mtpd-hits=%u, "
+                                   "mtpd-misses=%u, mtpd-expired=%u, "
+                                   "mtpd-pressure=%u, mtpd-user-change=%u",
+                                   worker_mtpd_lingering,
+                                   worker_mtpd_hits,
+                                   worker_mtpd_misses,
+                                   worker_mtpd_reaped[WORKER_REAP_EXPIRED],
+                                   worker_mtpd_reaped[WORKER_REAP_PRESSURE],
+                                   worker_mtpd_reaped[WORKER_REAP_USER]);
+    WORKER_LOCKED_LEAVE;
+
+    return stats;
+}
+
 static bool worker_switch_to_charging(void)
 {
     LOG_REGISTER_CONTEXT;
 
     bool ack = true;
 
-    if( android_set_charging_mode() )
-        goto SUCCESS;
-
-    if( configfs_set_charging_mode() )
-        goto SUCCESS;
+    const char *module = gadget_charging_module();
 
-    if( modules_in_use() ) {
-        if( worker_set_kernel_module(MODULE_MASS_STORAGE) )
+    if( module ) {
+        if( worker_set_kernel_module(module) )
             goto SUCCESS;
         worker_set_kernel_module(MODULE_NONE);
     }
+    else if( gadget_set_charging_mode() ) {
+        goto SUCCESS;
+    }
 
     log_err("switch to charging mode failed");
 
@@ -466,6 +1010,12 @@ SUCCESS:
 /** The module name for the specific mode */
 static char *worker_kernel_module = NULL;
 
+/** The module name for the mode being activated, while loading */
+static char *worker_kernel_module_pending = NULL;
+
+/** Monotonic time when module switch was initiated [ms], or zero */
+static int64_t worker_kernel_module_started = 0;
+
 /** get the supposedly loaded module
  *
  * @return The name of the loaded module
@@ -478,12 +1028,20 @@ const char * worker_get_kernel_module(void)
     return worker_kernel_module ?: MODULE_NONE;
 }
 
-/** set the loaded module
+/** Start switching to module for requested mode
+ *
+ * Unloads the current module and initiates asynchronous insertion
+ * of the new one, so that the worker can proceed with setup steps
+ * that do not depend on the gadget driver.
+ *
+ * The switch must be completed with worker_finish_kernel_module(),
+ * which also records LATENCY_PHASE_MODULE for the mode being set up.
  *
  * @param module The module name for the requested mode
  *
+ * @return true if module switch was initiated, false otherwise
  */
-bool worker_set_kernel_module(const char *module)
+bool worker_begin_kernel_module(const char *module)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -492,6 +1050,11 @@ bool worker_set_kernel_module(const char *module)
     if( !module )
         module = MODULE_NONE;
 
+    /* Make sure previous switch is not left hanging */
+    worker_finish_kernel_module();
+
+    worker_kernel_module_started = common_get_monotonic_ms();
+
     const char *current = worker_get_kernel_module();
 
     log_debug("current module: %s -> %s", current, module);
@@ -499,16 +1062,23 @@ bool worker_set_kernel_module(const char *module)
     if( !g_strcmp0(current, module) )
         goto SUCCESS;
 
+#ifdef GADGET_MODULES
     if( modules_unload_module(current) != 0 )
         goto EXIT;
 
     free(worker_kernel_module), worker_kernel_module = 0;
 
-    if( modules_load_module(module) != 0 )
+    if( !g_strcmp0(module, MODULE_NONE) )
+        goto SUCCESS;
+
+    if( !modules_load_module_async(module) )
         goto EXIT;
 
-    if( g_strcmp0(module, MODULE_NONE) )
-        worker_kernel_module = strdup(module);
+    worker_kernel_module_pending = strdup(module);
+#else
+    log_warning("load module %s - without module support", module);
+    goto EXIT;
+#endif
 
 SUCCESS:
     ack = true;
@@ -516,10 +1086,64 @@ EXIT:
     return ack;
 }
 
+/** Wait for module switch initiated by worker_begin_kernel_module()
+ *
+ * If a dynamic mode is being set up, time from initiating the switch
+ * to module being available is recorded as LATENCY_PHASE_MODULE.
+ *
+ * @return true if the module got loaded / there was nothing to
+ *         wait for, false otherwise
+ */
+bool worker_finish_kernel_module(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack     = true;
+    int64_t started = worker_kernel_module_started;
+
+    worker_kernel_module_started = 0;
+
+    if( !worker_kernel_module_pending )
+        goto EXIT;
+
+#ifdef GADGET_MODULES
+    if( modules_load_module_wait() != 0 ) {
+        free(worker_kernel_module_pending);
+        ack = false;
+    }
+    else {
+        worker_kernel_module = worker_kernel_module_pending;
+    }
+#endif
+    worker_kernel_module_pending = 0;
+
+EXIT:
+    if( ack && started ) {
+        const modedata_t *data = worker_get_usb_mode_data();
+        if( data )
+            latency_record(data->mode_name, LATENCY_PHASE_MODULE, started);
+    }
+    return ack;
+}
+
+/** set the loaded module
+ *
+ * @param module The module name for the requested mode
+ *
+ */
+bool worker_set_kernel_module(const char *module)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (worker_begin_kernel_module(module) &&
+            worker_finish_kernel_module());
+}
+
 void worker_clear_kernel_module(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    worker_finish_kernel_module();
     free(worker_kernel_module), worker_kernel_module = 0;
 }
 
@@ -557,27 +1181,214 @@ modedata_t *worker_dup_usb_mode_data(void)
 
     modedata_t *modedata = modedata_copy(worker_mode_data);
 
-    WORKER_LOCKED_LEAVE;
+    WORKER_LOCKED_LEAVE;
+
+    return modedata;;
+}
+
+/** set the modedata_t data
+ *
+ * Note: This function should be called only from the worker thread,
+ *
+ * @param data mode_list_element pointer
+ */
+void worker_set_usb_mode_data(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    WORKER_LOCKED_ENTER;
+
+    modedata_free(worker_mode_data),
+        worker_mode_data = modedata_copy(data);
+
+    WORKER_LOCKED_LEAVE;
+}
+
+/* ------------------------------------------------------------------------- *
+ * JOB_QUEUE
+ * ------------------------------------------------------------------------- */
+
+/* Single producer / single consumer ring buffer
+ *
+ * Only the main thread adds jobs and advances the head index, and
+ * only the worker thread removes jobs and advances the tail index.
+ * Ownership of the mode string moves along with the job. */
+static worker_job_t worker_queue_slot[WORKER_QUEUE_SIZE];
+
+/** Index of the next slot to fill; modified by main thread only */
+static unsigned worker_queue_head = 0;
+
+/** Index of the next slot to drain; modified by worker thread only */
+static unsigned worker_queue_tail = 0;
+
+/** Latest job that did not fit into the queue; main thread only */
+static worker_job_t worker_queue_overflow = { .mode = 0 };
+
+/** Sequence number of the previously queued job; main thread only */
+static unsigned worker_queue_last_id = 0;
+
+/** Mode of the previously queued job; main thread only
+ *
+ * Used for ignoring repeated requests without consulting the
+ * worker thread, which might be still processing older jobs.
+ */
+static gchar *worker_queued_mode = NULL;
+
+/** Whether the previously queued job was a linger job; main thread only */
+static bool worker_queued_linger = false;
+
+/** Sequence number of the most recently completed job */
+static unsigned worker_completed_id = 0;
+
+/** Mode that got activated by the most recently completed job */
+static gchar *worker_completed_mode = NULL;
+
+static void
+worker_job_clear(worker_job_t *job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(job->mode), job->mode = 0;
+    g_free(job->prewarm), job->prewarm = 0;
+}
+
+/** Forget job data after ownership has been moved elsewhere
+ */
+static void
+worker_job_disown(worker_job_t *job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    job->mode = 0;
+    job->prewarm = 0;
+}
+
+/** Add job to the queue; main thread only
+ *
+ * On success ownership of job data is transferred to the queue.
+ *
+ * @param job  job to add
+ *
+ * @return true if job was queued, or false if the queue is full
+ */
+static bool
+worker_queue_push(worker_job_t *job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool     ack  = false;
+    unsigned head = worker_queue_head;
+    unsigned tail = __atomic_load_n(&worker_queue_tail, __ATOMIC_ACQUIRE);
+
+    if( head - tail >= WORKER_QUEUE_SIZE )
+        goto EXIT;
+
+    worker_queue_slot[head % WORKER_QUEUE_SIZE] = *job;
+    worker_job_disown(job);
+
+    __atomic_store_n(&worker_queue_head, head + 1, __ATOMIC_RELEASE);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Remove job from the queue; worker thread only
+ *
+ * @param job  where to store the job, caller must release
+ *
+ * @return true if a job was removed, or false if the queue is empty
+ */
+static bool
+worker_queue_pop(worker_job_t *job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool     ack  = false;
+    unsigned tail = worker_queue_tail;
+    unsigned head = __atomic_load_n(&worker_queue_head, __ATOMIC_ACQUIRE);
+
+    if( head == tail )
+        goto EXIT;
+
+    worker_job_t *slot = &worker_queue_slot[tail % WORKER_QUEUE_SIZE];
+    *job = *slot;
+    worker_job_disown(slot);
+
+    __atomic_store_n(&worker_queue_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Remove all queued jobs, keeping only the latest one; worker thread only
+ *
+ * @param job  where to store the latest job, caller must release
+ *
+ * @return true if there was at least one job, false otherwise
+ */
+static bool
+worker_queue_collapse(worker_job_t *job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool         ack  = false;
+    worker_job_t next = { .mode = 0 };
+
+    while( worker_queue_pop(&next) ) {
+        if( ack ) {
+            log_debug("job #%u %s (%s) superseded by #%u %s (%s)",
+                      job->id, job->mode, mode_reason_repr(job->reason),
+                      next.id, next.mode, mode_reason_repr(next.reason));
+            worker_job_clear(job);
+        }
+        *job = next, worker_job_disown(&next);
+        ack = true;
+    }
+
+    return ack;
+}
+
+/** Move job that did not fit in the queue earlier; main thread only
+ */
+static void
+worker_queue_flush_overflow(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_queue_overflow.mode )
+        goto EXIT;
+
+    if( !worker_queue_push(&worker_queue_overflow) )
+        goto EXIT;
+
+    log_debug("job #%u moved from overflow to queue",
+              worker_queue_overflow.id);
+    worker_wakeup();
 
-    return modedata;;
+EXIT:
+    return;
 }
 
-/** set the modedata_t data
- *
- * Note: This function should be called only from the worker thread,
- *
- * @param data mode_list_element pointer
+/** Discard all pending jobs; worker thread must not be running
  */
-void worker_set_usb_mode_data(const modedata_t *data)
+static void
+worker_queue_clear(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    WORKER_LOCKED_ENTER;
+    worker_job_t job = { .mode = 0 };
 
-    modedata_free(worker_mode_data),
-        worker_mode_data = modedata_copy(data);
+    while( worker_queue_pop(&job) )
+        worker_job_clear(&job);
+    worker_job_clear(&worker_queue_overflow);
 
-    WORKER_LOCKED_LEAVE;
+    g_free(worker_queued_mode), worker_queued_mode = 0;
+    worker_queued_linger = false;
+    g_free(worker_completed_mode), worker_completed_mode = 0;
 }
 
 /* ------------------------------------------------------------------------- *
@@ -594,6 +1405,24 @@ static gchar *worker_requested_mode = NULL;
 
 static gchar *worker_activated_mode = NULL;
 
+/** Activated mode is configured, but detached from the bus
+ *
+ * Accessed only from the worker thread.
+ */
+static bool worker_mode_suspended = false;
+
+/** User that was active when dynamic mode was set up
+ *
+ * Accessed only from the worker thread.
+ */
+static uid_t worker_mode_uid = UID_UNKNOWN;
+
+/** Mode that has been prepared while waiting for user choice
+ *
+ * Accessed only from the worker thread.
+ */
+static gchar *worker_prewarmed_mode = NULL;
+
 static const char *
 worker_get_activated_mode_locked(void)
 {
@@ -650,22 +1479,120 @@ EXIT:
     return changed;
 }
 
-void worker_request_hardware_mode(const char *mode)
+/** Queue job for the worker thread; main thread only
+ *
+ * @param mode     internal mode name
+ * @param reason   why the mode switch is requested
+ * @param uid      requesting user, or UID_UNKNOWN
+ * @param linger   true to keep current gadget configured
+ * @param prewarm  mode to prepare in background, or NULL
+ */
+static void
+worker_queue_job(const char *mode, mode_reason_t reason, uid_t uid,
+                 bool linger, const char *prewarm)
 {
     LOG_REGISTER_CONTEXT;
 
-    WORKER_LOCKED_ENTER;
+    worker_job_t job = { .mode = 0 };
 
-    if( !worker_set_requested_mode_locked(mode) )
+    if( !g_strcmp0(worker_queued_mode ?: MODE_UNDEFINED, mode) &&
+        worker_queued_linger == linger )
         goto EXIT;
 
-    worker_wakeup();
+    g_free(worker_queued_mode),
+        worker_queued_mode = g_strdup(mode);
+    worker_queued_linger = linger;
+
+    job.id     = ++worker_queue_last_id;
+    job.mode   = g_strdup(mode);
+    job.reason = reason;
+    job.uid    = uid;
+    job.linger = linger;
+    job.prewarm = g_strdup(prewarm);
+    job.queued = common_get_monotonic_ms();
+
+    log_debug("job #%u %s%s (%s, uid=%d, prewarm=%s) queued",
+              job.id, job.mode, job.linger ? " [linger]" : "",
+              mode_reason_repr(job.reason), (int)job.uid,
+              job.prewarm ?: "none");
+
+    /* Retain ordering with respect to earlier overflow */
+    worker_queue_flush_overflow();
+
+    if( !worker_queue_overflow.mode && worker_queue_push(&job) ) {
+        worker_wakeup();
+        goto EXIT;
+    }
+
+    /* Worker is not keeping up. Only the latest request matters,
+     * so hold on to it until there is space in the queue again. */
+    if( worker_queue_overflow.mode )
+        log_debug("job #%u superseded in overflow",
+                  worker_queue_overflow.id);
+    else
+        log_warning("job queue full; deferring job #%u", job.id);
+    worker_job_clear(&worker_queue_overflow);
+    worker_queue_overflow = job, worker_job_disown(&job);
+
+    /* Make the worker bail out of whatever it is doing */
+    worker_request_bailout();
 
 EXIT:
-    WORKER_LOCKED_LEAVE;
+    worker_job_clear(&job);
     return;
 }
 
+/** Queue mode switch job for the worker thread; main thread only
+ *
+ * @param mode    internal mode name
+ * @param reason  why the mode switch is requested
+ * @param uid     requesting user, or UID_UNKNOWN
+ */
+void worker_request_hardware_mode(const char *mode, mode_reason_t reason,
+                                  uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_queue_job(mode, reason, uid, false, 0);
+}
+
+/** Queue switch to MODE_UNDEFINED that keeps the gadget configured
+ *
+ * If the current mode supports it, the gadget is only detached from
+ * the bus. Then it can be reattached quickly if the same mode gets
+ * requested again. Otherwise this is equal to requesting MODE_UNDEFINED.
+ *
+ * A later worker_request_hardware_mode(MODE_UNDEFINED) performs the
+ * full cleanup.
+ *
+ * @param reason  why the mode switch is requested
+ */
+void worker_request_hardware_linger(mode_reason_t reason)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_queue_job(MODE_UNDEFINED, reason, UID_UNKNOWN, true, 0);
+}
+
+/** Queue switch to MODE_ASK with a hint about likely user choice
+ *
+ * After the switch to charging has been made, the worker thread
+ * prepares the predicted mode as far as it can be done without
+ * exposing anything over usb. Preparations are put to use if the
+ * user selects the predicted mode, and undone otherwise.
+ *
+ * @param prewarm  mode user is likely to select, or NULL
+ * @param reason   why the mode switch is requested
+ * @param uid      requesting user, or UID_UNKNOWN
+ */
+void worker_request_hardware_ask(const char *prewarm, mode_reason_t reason,
+                                 uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_queue_job(MODE_ASK, reason, uid, false, prewarm);
+}
+
 void worker_clear_hardware_mode(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -673,35 +1600,116 @@ void worker_clear_hardware_mode(void)
     WORKER_LOCKED_ENTER;
     g_free(worker_requested_mode), worker_requested_mode = 0;
     WORKER_LOCKED_LEAVE;
+
+    worker_queue_clear();
 }
 
+/** Publish result of a finished job; worker thread only
+ *
+ * @param job  the job that was executed
+ */
 static void
-worker_execute(void)
+worker_complete_job(const worker_job_t *job)
 {
     LOG_REGISTER_CONTEXT;
 
     WORKER_LOCKED_ENTER;
+    const char *mode = worker_get_requested_mode_locked();
+    g_free(worker_completed_mode),
+        worker_completed_mode = g_strdup(mode);
+    worker_completed_id = job->id;
+    recorder_event(RECORDER_JOB_END, job->id, mode, 0);
+    WORKER_LOCKED_LEAVE;
 
-    const char *activated = worker_get_activated_mode_locked();
-    const char *requested = worker_get_requested_mode_locked();
-    const char *activate  = common_map_mode_to_hardware(requested);
+    log_debug("job #%u %s (%s, uid=%d) completed in %" PRId64 " ms",
+              job->id, job->mode, mode_reason_repr(job->reason),
+              (int)job->uid, common_get_monotonic_ms() - job->queued);
+
+    worker_notify();
+}
 
-    log_debug("activated = %s", activated);
-    log_debug("requested = %s", requested);
-    log_debug("activate = %s",   activate);
+static void
+worker_execute(void)
+{
+    LOG_REGISTER_CONTEXT;
 
-    bool changed = g_strcmp0(activated, activate) != 0;
-    gchar *mode  = g_strdup(activate);
+    worker_job_t job  = { .mode = 0 };
+    worker_job_t next = { .mode = 0 };
 
-    WORKER_LOCKED_LEAVE;
+    /* Jobs queued from this point onwards cancel the one we pick.
+     * Note: Flags must be reset before draining the queue, see
+     *       worker_cancel_fd_triggered(). */
+    worker_reset_bailout();
 
-    if( changed )
-        worker_switch_to_mode(mode);
-    else
-        worker_notify();
+    if( !worker_queue_collapse(&job) )
+        goto EXIT;
+
+    for( ;; ) {
+        WORKER_LOCKED_ENTER;
+
+        worker_set_requested_mode_locked(job.mode);
+
+        const char *activated = worker_get_activated_mode_locked();
+        const char *requested = worker_get_requested_mode_locked();
+        const char *activate  = common_map_mode_to_hardware(requested);
+
+        log_debug("activated = %s", activated);
+        log_debug("requested = %s", requested);
+        log_debug("activate = %s",   activate);
+
+        bool changed = g_strcmp0(activated, activate) != 0;
+        gchar *mode  = g_strdup(activate);
+
+        WORKER_LOCKED_LEAVE;
+
+        recorder_event(RECORDER_JOB_BEGIN, job.id, job.mode, 0);
+
+        /* Preparations made for some other mode are not needed
+         * anymore; mode switches handle this implicitly */
+        if( !changed && worker_prewarmed_mode &&
+            g_strcmp0(worker_prewarmed_mode, job.prewarm) )
+            worker_rollback_prewarm();
+
+        if( changed && job.linger && worker_suspend_mode() ) {
+            /* Gadget is still configured for the activated mode */
+        }
+        else if( !changed && worker_mode_suspended ) {
+            if( !worker_resume_mode() )
+                worker_switch_to_mode(mode);
+        }
+        else if( changed ) {
+            worker_switch_to_mode(mode);
+        }
+
+        g_free(mode);
 
-    g_free(mode);
+        if( !worker_bailout_handled )
+            break;
+
+        /* Mode switch was interrupted - either by a newer job, or by
+         * a wakeup that raced with collapsing the queue above */
+        worker_reset_bailout();
+
+        if( worker_queue_collapse(&next) ) {
+            log_debug("job #%u %s superseded by #%u %s",
+                      job.id, job.mode, next.id, next.mode);
+            worker_job_clear(&job);
+            job = next, worker_job_disown(&next);
+        }
+        else {
+            log_debug("job #%u %s interrupted; retrying", job.id, job.mode);
+        }
+    }
+
+    worker_complete_job(&job);
 
+    /* Prepare in background, i.e. after mode switch has been
+     * acknowledged and user can make the choice */
+    if( job.prewarm && !worker_bailing_out() )
+        worker_prewarm_mode(job.prewarm);
+
+EXIT:
+    worker_job_clear(&job);
     return;
 }
 
@@ -709,6 +1717,137 @@ worker_execute(void)
  * MODE_SWITCH
  * ------------------------------------------------------------------------- */
 
+/** Prepare mode user is likely to select
+ *
+ * Currently only mtp mode on configfs backend has preparations
+ * that are both slow and invisible on the usb side: functionfs
+ * can be mounted and mtpd started while charging only gadget
+ * is active. Starting mtpd can take tens of seconds, so it is
+ * not waited for here.
+ *
+ * @param mode  mode to prepare
+ *
+ * @return true if preparations were made, false otherwise
+ */
+static bool
+worker_prewarm_mode(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( !g_strcmp0(worker_prewarmed_mode, mode) ) {
+        /* Mtp device is mounted with group id of the active user */
+        if( control_get_current_user() == worker_mtp_device_uid ) {
+            ack = true;
+            goto EXIT;
+        }
+        log_debug("active user changed; prewarm %s again", mode);
+        worker_rollback_prewarm();
+    }
+
+    if( !worker_mode_is_mtp_mode(mode) || !gadget_mtpd_before_udc() )
+        goto EXIT;
+
+    if( !usbmoded_can_export() )
+        goto EXIT;
+
+    if( worker_get_mtp_device_state() != DEVSTATE_UNMOUNTED )
+        goto EXIT;
+
+    log_debug("prewarm %s", mode);
+    g_free(worker_prewarmed_mode),
+        worker_prewarmed_mode = g_strdup(mode);
+
+    if( !worker_mount_mtp_device() )
+        goto EXIT;
+
+    if( !worker_start_mtpd_nowait() )
+        goto EXIT;
+
+    ack = true;
+
+EXIT:
+    /* Undo partial preparations */
+    if( !ack )
+        worker_rollback_prewarm();
+
+    return ack;
+}
+
+/** Undo preparations made by worker_prewarm_mode()
+ */
+static void
+worker_rollback_prewarm(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_prewarmed_mode )
+        goto EXIT;
+
+    log_debug("rollback prewarmed %s", worker_prewarmed_mode);
+    g_free(worker_prewarmed_mode), worker_prewarmed_mode = 0;
+
+    worker_stop_mtpd();
+    worker_unmount_mtp_device();
+
+EXIT:
+    return;
+}
+
+/** Detach activated dynamic mode from the bus
+ *
+ * @return true if mode was suspended, false if full cleanup is needed
+ */
+static bool
+worker_suspend_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( worker_mode_suspended )
+        goto EXIT;
+
+    if( !modesetting_suspend_dynamic_mode() )
+        goto EXIT;
+
+    log_debug("dynamic mode suspended");
+    worker_mode_suspended = true;
+
+EXIT:
+    return worker_mode_suspended;
+}
+
+/** Reattach suspended dynamic mode to the bus
+ *
+ * Mtp device, appsync units etc are set up for the user that was
+ * active at mode setup, so if active user has changed since, the
+ * mode must be set up again.
+ *
+ * @return true if mode was resumed, false if it must be set up again
+ */
+static bool
+worker_resume_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    worker_mode_suspended = false;
+
+    if( control_get_current_user() != worker_mode_uid ) {
+        log_debug("active user changed; set up dynamic mode again");
+        goto EXIT;
+    }
+
+    if( !(ack = modesetting_resume_dynamic_mode()) )
+        log_warning("failed to resume dynamic mode");
+    else
+        log_debug("dynamic mode resumed");
+
+EXIT:
+    return ack;
+}
+
 static void
 worker_switch_to_mode(const char *mode)
 {
@@ -716,6 +1855,23 @@ worker_switch_to_mode(const char *mode)
 
     const char *override = 0;
     modedata_t *data     = 0;
+    int64_t     started  = common_get_monotonic_ms();
+    int64_t     t        = 0;
+
+    /* Suspended mode, if any, gets cleaned up below */
+    worker_mode_suspended = false;
+
+    /* Preparations made while waiting for user choice are kept
+     * only if the mode they were made for is being activated */
+    bool prewarmed = !g_strcmp0(worker_prewarmed_mode, mode);
+    if( prewarmed && control_get_current_user() != worker_mtp_device_uid ) {
+        log_debug("active user changed; discard prewarmed %s", mode);
+        worker_rollback_prewarm();
+        prewarmed = false;
+    }
+    g_free(worker_prewarmed_mode), worker_prewarmed_mode = 0;
+    if( prewarmed )
+        log_debug("using prewarmed %s", mode);
 
     /* set return to 1 to be sure to error out if no matching mode is found either */
 
@@ -727,8 +1883,16 @@ worker_switch_to_mode(const char *mode)
      * Similarly, unmount mtp device to make sure sure it gets mounted
      * with appropriate uid/gid values when it is actually needed.
      */
-    worker_stop_mtpd();
-    worker_unmount_mtp_device();
+    bool reuse = prewarmed || worker_mtpd_reuse(mode);
+
+    if( !reuse && !worker_mtpd_linger() ) {
+        t = common_get_monotonic_ms();
+        worker_stop_mtpd();
+        latency_record(mode, LATENCY_PHASE_MTPD_STOP, t);
+        t = common_get_monotonic_ms();
+        worker_unmount_mtp_device();
+        latency_record(mode, LATENCY_PHASE_UNMOUNT, t);
+    }
 
     if( worker_get_usb_mode_data() ) {
         modesetting_leave_dynamic_mode();
@@ -762,27 +1926,36 @@ worker_switch_to_mode(const char *mode)
 
         /* When dealing with configfs, we can't enable UDC without
          * already having mtpd running */
-        if( worker_mode_is_mtp_mode(mode) && configfs_in_use() ) {
-            if( !worker_mount_mtp_device() )
+        if( worker_mode_is_mtp_mode(mode) && gadget_mtpd_before_udc() ) {
+            t = common_get_monotonic_ms();
+            if( !reuse && !worker_mount_mtp_device() )
                 goto FAILED;
             if( !worker_start_mtpd() )
                 goto FAILED;
+            latency_record(mode, LATENCY_PHASE_MTPD_START, t);
         }
 
-        if( !worker_set_kernel_module(data->mode_module) )
+        /* Module insertion is allowed to overlap with setup steps
+         * that precede gadget configuration, which then waits for
+         * it via worker_finish_kernel_module() */
+        if( !worker_begin_kernel_module(data->mode_module) )
             goto FAILED;
 
         if( !modesetting_enter_dynamic_mode() )
             goto FAILED;
 
+        worker_mode_uid = control_get_current_user();
+
         /* When dealing with android usb, it must be enabled before
          * we can start mtpd. Assumption is that the same applies
          * when using kernel modules. */
-        if( worker_mode_is_mtp_mode(mode) && !configfs_in_use() ) {
+        if( worker_mode_is_mtp_mode(mode) && !gadget_mtpd_before_udc() ) {
+            t = common_get_monotonic_ms();
             if( !worker_mount_mtp_device() )
                 goto FAILED;
             if( !worker_start_mtpd() )
                 goto FAILED;
+            latency_record(mode, LATENCY_PHASE_MTPD_START, t);
         }
 
         goto SUCCESS;
@@ -794,6 +1967,8 @@ FAILED:
     worker_bailout_handled = true;
 
     /* Undo any changes we might have might have already done */
+    worker_finish_kernel_module();
+
     if( worker_get_usb_mode_data() ) {
         log_debug("Cleaning up failed mode switch");
         worker_stop_mtpd();
@@ -846,6 +2021,9 @@ SUCCESS:
     }
     WORKER_LOCKED_LEAVE;
 
+    if( !override )
+        latency_record(mode, LATENCY_PHASE_TOTAL, started);
+
     worker_notify();
 
     modedata_free(data);
@@ -866,47 +2044,25 @@ static int              worker_rsp_evfd  = -1;
 /** I/O watch identifier for worker_rsp_evfd */
 static guint            worker_rsp_wid   = 0;
 
-static guint
-worker_add_iowatch(int fd, bool close_on_unref,
-               GIOCondition cnd, GIOFunc io_cb, gpointer aptr)
-{
-    LOG_REGISTER_CONTEXT;
-
-    guint         wid = 0;
-    GIOChannel   *chn = 0;
-
-    if( !(chn = g_io_channel_unix_new(fd)) )
-        goto cleanup;
-
-    g_io_channel_set_close_on_unref(chn, close_on_unref);
-
-    cnd |= G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-
-    if( !(wid = g_io_add_watch(chn, cnd, io_cb, aptr)) )
-        goto cleanup;
-
-cleanup:
-    if( chn != 0 ) g_io_channel_unref(chn);
-
-    return wid;
-
-}
-
 static void *worker_thread_cb(void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
     (void)aptr;
 
+    log_set_thread_name("worker");
+
     /* Async cancellation, but disabled */
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
 
-    /* Leave INT/TERM signal processing up to the main thread */
+    /* Leave signal processing up to the main thread */
     sigset_t ss;
     sigemptyset(&ss);
     sigaddset(&ss, SIGINT);
+    sigaddset(&ss, SIGQUIT);
     sigaddset(&ss, SIGTERM);
+    sigaddset(&ss, SIGHUP);
     pthread_sigmask(SIG_BLOCK, &ss, 0);
 
     /* Loop until explicitly canceled */
@@ -928,37 +2084,37 @@ static void *worker_thread_cb(void *aptr)
             continue;
 
         if( cnt > 0 ) {
-            worker_bailout_requested = false;
-            worker_bailout_handled = false;
             worker_execute();
+            worker_mtpd_reap();
         }
 
+        /* Drop whatever got queued on private bus connection */
+        umdbus_dispatch_worker_connection();
+
     }
 EXIT:
     return 0;
 }
 
-static gboolean
-worker_notify_cb(GIOChannel *chn, GIOCondition cnd, gpointer data)
+static bool
+worker_notify_cb(int fd, uint32_t events, void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    (void)data;
+    (void)aptr;
 
-    gboolean keep_going = FALSE;
+    bool keep_going = false;
 
     if( !worker_rsp_wid )
         goto cleanup_nak;
 
-    int fd = g_io_channel_unix_get_fd(chn);
-
     if( fd < 0 )
         goto cleanup_nak;
 
-    if( cnd & ~G_IO_IN )
+    if( events & ~EPOLLIN )
         goto cleanup_nak;
 
-    if( !(cnd & G_IO_IN) )
+    if( !(events & EPOLLIN) )
         goto cleanup_ack;
 
     uint64_t cnt = 0;
@@ -983,16 +2139,30 @@ worker_notify_cb(GIOChannel *chn, GIOCondition cnd, gpointer data)
 
     {
         WORKER_LOCKED_ENTER;
-        const char *mode = worker_get_requested_mode_locked();
-        gchar *work = g_strdup(mode);
+        unsigned id = worker_completed_id;
+        gchar *work = g_strdup(worker_completed_mode);
         WORKER_LOCKED_LEAVE;
 
-        control_mode_switched(work);
+        /* Results of jobs that have already been superseded by
+         * newer requests are of no interest */
+        if( id != worker_queue_last_id ) {
+            log_debug("job #%u completed; waiting for #%u",
+                      id, worker_queue_last_id);
+        }
+        else if( work ) {
+            /* Mode might have been overridden by the worker */
+            g_free(worker_queued_mode),
+                worker_queued_mode = g_strdup(work);
+            control_mode_switched(work);
+        }
         g_free(work);
+
+        worker_queue_flush_overflow();
+        worker_linger_rethink();
     }
 
 cleanup_ack:
-    keep_going = TRUE;
+    keep_going = true;
 
 cleanup_nak:
 
@@ -1069,11 +2239,14 @@ worker_delete_eventfd(void)
     if( worker_req_evfd != -1 )
         close(worker_req_evfd), worker_req_evfd = -1;
 
+    if( worker_cancel_evfd != -1 )
+        close(worker_cancel_evfd), worker_cancel_evfd = -1;
+
     if( worker_rsp_wid )
-        g_source_remove(worker_rsp_wid), worker_rsp_wid = 0;
+        evloop_remove(worker_rsp_wid), worker_rsp_wid = 0;
 
     if( worker_rsp_evfd != -1 )
-        close(worker_rsp_evfd), worker_req_evfd = -1;
+        close(worker_rsp_evfd), worker_rsp_evfd = -1;
 }
 
 static bool
@@ -1088,8 +2261,9 @@ worker_create_eventfd(void)
     if( (worker_rsp_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 )
         goto EXIT;
 
-    worker_rsp_wid = worker_add_iowatch(worker_rsp_evfd, false, G_IO_IN,
-                                worker_notify_cb, 0);
+    worker_rsp_wid = evloop_add_io("worker", EVLOOP_PRIO_WORKER,
+                                   worker_rsp_evfd, EPOLLIN,
+                                   worker_notify_cb, 0);
     if( !worker_rsp_wid )
         goto EXIT;
 
@@ -1098,6 +2272,12 @@ worker_create_eventfd(void)
     if( (worker_req_evfd = eventfd(0, EFD_CLOEXEC)) == -1 )
         goto EXIT;
 
+    /* Setup cancel signaling; polled by worker and its helper threads
+     * during blocking operations, so it must never block readers */
+
+    if( (worker_cancel_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 )
+        goto EXIT;
+
     ack = true;
 
 EXIT:
@@ -1115,6 +2295,11 @@ worker_init(void)
     if( !worker_create_eventfd() )
         goto EXIT;
 
+    /* Blocking D-Bus calls made by worker thread should not
+     * interfere with mainloop D-Bus processing */
+    if( !umdbus_init_worker_connection() )
+        log_warning("worker uses shared D-Bus connection");
+
     if( !worker_start_thread() )
         goto EXIT;
 
@@ -1132,9 +2317,14 @@ worker_quit(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    worker_linger_stop();
     worker_stop_thread();
     worker_delete_eventfd();
 
+    /* Private connections can be closed after worker thread is gone */
+    umdbus_cleanup_worker_connection();
+    umdbus_cleanup_thread_connections();
+
     /* Worker thread is stopped and resources can be released. */
     worker_set_usb_mode_data(0);
 }
@@ -1144,7 +2334,7 @@ worker_wakeup(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    worker_bailout_requested = true;
+    worker_request_bailout();
 
     uint64_t cnt = 1;
     if( write(worker_req_evfd, &cnt, sizeof cnt) == -1 ) {
@@ -1162,3 +2352,69 @@ worker_notify(void)
         log_err("failed to signal handled: %m");
     }
 }
+
+/** Ask worker thread to stop lingering mtpd; main thread only
+ *
+ * Unlike worker_wakeup(), this does not interrupt mode switch
+ * that might be in progress.
+ *
+ * @param reason  why linger period should end
+ */
+static void
+worker_mtpd_request_reap(worker_reap_t reason)
+{
+    LOG_REGISTER_CONTEXT;
+
+    __atomic_store_n(&worker_mtpd_reap_reason, reason, __ATOMIC_RELEASE);
+
+    uint64_t cnt = 1;
+    if( write(worker_req_evfd, &cnt, sizeof cnt) == -1 ) {
+        log_err("failed to signal reap request: %m");
+    }
+}
+
+/** Get file descriptor that signals cancellation of the current job
+ *
+ * Blocking operations made from the worker thread, or from task graph
+ * helper threads working on its behalf, can include the returned
+ * descriptor in poll() sets. When it becomes readable,
+ * worker_cancel_fd_triggered() tells whether the operation should
+ * be abandoned.
+ *
+ * @return eventfd to poll for POLLIN, or -1 if the calling context
+ *         can't be canceled (not part of the job / already bailing out)
+ */
+int
+worker_get_cancel_fd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_job_thread_p() || worker_bailout_handled )
+        return -1;
+
+    return worker_cancel_evfd;
+}
+
+/** Check cancellation after worker_get_cancel_fd() became readable
+ *
+ * Main thread sets the bailout flag before signaling the eventfd. A
+ * readable eventfd without the flag is thus a left-over wakeup that
+ * raced with starting a new job, and it is consumed here so that it
+ * does not keep waking up the caller. A request landing while the
+ * eventfd is drained is detected by re-checking the flag afterwards,
+ * and the eventfd is left readable for other waiters. The eventfd is
+ * non-blocking, so concurrent helper threads can't get stuck on an
+ * already consumed wakeup.
+ *
+ * @return true if the current job should be abandoned, false otherwise
+ */
+bool
+worker_cancel_fd_triggered(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( worker_bailing_out() )
+        return true;
+
+    return worker_drain_cancel_evfd() && worker_bailing_out();
+}
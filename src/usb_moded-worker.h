@@ -27,6 +27,9 @@
 
 # include <stdbool.h>
 
+# include <sys/types.h>
+
+# include "usb_moded-common.h"
 # include "usb_moded-dyn-config.h"
 
 /* ========================================================================= *
@@ -41,17 +44,25 @@
  * WORKER
  * ------------------------------------------------------------------------- */
 
-bool              worker_bailing_out          (void);
-const char       *worker_get_kernel_module    (void);
-bool              worker_set_kernel_module    (const char *module);
-void              worker_clear_kernel_module  (void);
-const modedata_t *worker_get_usb_mode_data    (void);
-modedata_t       *worker_dup_usb_mode_data    (void);
-void              worker_set_usb_mode_data    (const modedata_t *data);
-void              worker_request_hardware_mode(const char *mode);
-void              worker_clear_hardware_mode  (void);
-bool              worker_init                 (void);
-void              worker_quit                 (void);
-void              worker_wakeup               (void);
+bool              worker_thread_p               (void);
+bool              worker_bailing_out            (void);
+const char       *worker_get_kernel_module      (void);
+bool              worker_begin_kernel_module    (const char *module);
+bool              worker_finish_kernel_module   (void);
+bool              worker_set_kernel_module      (const char *module);
+void              worker_clear_kernel_module    (void);
+const modedata_t *worker_get_usb_mode_data      (void);
+modedata_t       *worker_dup_usb_mode_data      (void);
+void              worker_set_usb_mode_data      (const modedata_t *data);
+void              worker_request_hardware_mode  (const char *mode, mode_reason_t reason, uid_t uid);
+void              worker_request_hardware_linger(mode_reason_t reason);
+void              worker_request_hardware_ask   (const char *prewarm, mode_reason_t reason, uid_t uid);
+void              worker_clear_hardware_mode    (void);
+bool              worker_init                   (void);
+void              worker_quit                   (void);
+void              worker_wakeup                 (void);
+int               worker_get_cancel_fd          (void);
+bool              worker_cancel_fd_triggered    (void);
+gchar            *worker_get_mtpd_stats         (void);
 
 #endif /* USB_MODED_WORKER_H_ */
@@ -37,22 +37,25 @@
 
 #include "usb_moded.h"
 
-#include "usb_moded-android.h"
 #include "usb_moded-appsync.h"
 #include "usb_moded-config-private.h"
-#include "usb_moded-configfs.h"
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-devicelock.h"
+#include "usb_moded-evloop.h"
+#include "usb_moded-gadget.h"
+#include "usb_moded-latency.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
 #include "usb_moded-modesetting.h"
-#include "usb_moded-modules.h"
 #include "usb_moded-network.h"
+#include "usb_moded-recorder.h"
 #include "usb_moded-sigpipe.h"
 #include "usb_moded-systemd.h"
+#include "usb_moded-trace.h"
 #include "usb_moded-trigger.h"
 #include "usb_moded-udev.h"
+#include "usb_moded-wakelock.h"
 #include "usb_moded-worker.h"
 #include "usb_moded-modes.h"
 
@@ -78,11 +81,6 @@
  * Constants
  * ========================================================================= */
 
-/* Wakelogging is noisy, do not log it by default */
-#ifndef  VERBOSE_WAKELOCKING
-# define VERBOSE_WAKELOCKING 0
-#endif
-
 /** Default allowed cable detection delay
  *
  * To comply with USB standards, the delay should be
@@ -104,6 +102,29 @@
 
 #define CABLE_CONNECTION_DELAY_MAXIMUM 4000
 
+/** Default reconnect grace period
+ *
+ * Any value <= zero means dynamic modes are torn down immediately
+ * on cable disconnect.
+ */
+#define RECONNECT_GRACE_DEFAULT 0
+
+/** Maximum reconnect grace period
+ *
+ * Applications relying on usb connection stay active while the
+ * gadget is detached, so this should not be excessively long.
+ */
+#define RECONNECT_GRACE_MAXIMUM 30000
+
+/** Default time to keep mtpd running after leaving mtp mode [s]
+ *
+ * Any value <= zero means mtpd is stopped immediately.
+ */
+#define MTPD_LINGER_DEFAULT 0
+
+/** Maximum time to keep mtpd running after leaving mtp mode [s] */
+#define MTPD_LINGER_MAXIMUM 3600
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -124,7 +145,11 @@ void              usbmoded_set_diag_mode             (bool diag_mode);
 bool              usbmoded_is_mode_permitted         (const char *modename, uid_t uid);
 void              usbmoded_set_cable_connection_delay(int delay_ms);
 int               usbmoded_get_cable_connection_delay(void);
-static gboolean   usbmoded_allow_suspend_timer_cb    (gpointer aptr);
+void              usbmoded_set_reconnect_grace       (int grace_ms);
+int               usbmoded_get_reconnect_grace       (void);
+void              usbmoded_set_mtpd_linger           (int linger_s);
+int               usbmoded_get_mtpd_linger           (void);
+static bool       usbmoded_allow_suspend_timer_cb    (void *aptr);
 void              usbmoded_allow_suspend             (void);
 void              usbmoded_delay_suspend             (void);
 bool              usbmoded_can_export                (void);
@@ -436,6 +461,95 @@ usbmoded_get_cable_connection_delay(void)
     return usbmoded_cable_connection_delay;
 }
 
+/* ------------------------------------------------------------------------- *
+ * RECONNECT_GRACE
+ * ------------------------------------------------------------------------- */
+
+/** Reconnect grace period
+ *
+ * Briefly disconnecting and reconnecting the cable should not lead
+ * to full teardown and setup of the usb mode. This defines how long
+ * the gadget is kept configured, but detached from the bus, after
+ * pc disconnect.
+ */
+static int usbmoded_reconnect_grace = RECONNECT_GRACE_DEFAULT;
+
+/** Helper for setting reconnect grace period
+ *
+ * Used for implementing --reconnect-grace=grace_ms option.
+ */
+void
+usbmoded_set_reconnect_grace(int grace_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( grace_ms > RECONNECT_GRACE_MAXIMUM )
+        grace_ms = RECONNECT_GRACE_MAXIMUM;
+    if( grace_ms < 0 )
+        grace_ms = 0;
+
+    if( usbmoded_reconnect_grace != grace_ms ) {
+        log_info("reconnect_grace: %d -> %d",
+                 usbmoded_reconnect_grace,
+                 grace_ms);
+        usbmoded_reconnect_grace = grace_ms;
+    }
+}
+
+/** Helper for getting reconnect grace period
+ */
+int
+usbmoded_get_reconnect_grace(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return usbmoded_reconnect_grace;
+}
+
+/* ------------------------------------------------------------------------- *
+ * MTPD_LINGER
+ * ------------------------------------------------------------------------- */
+
+/** Time to keep mtpd running after leaving mtp mode [s]
+ *
+ * Starting mtpd involves indexing of exposed files and can take
+ * a long time. Keeping it running for a while makes reconnects
+ * and switching back to mtp mode faster.
+ */
+static int usbmoded_mtpd_linger = MTPD_LINGER_DEFAULT;
+
+/** Helper for setting mtpd linger time
+ *
+ * Used for implementing --mtpd-linger=seconds option.
+ */
+void
+usbmoded_set_mtpd_linger(int linger_s)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( linger_s > MTPD_LINGER_MAXIMUM )
+        linger_s = MTPD_LINGER_MAXIMUM;
+    if( linger_s < 0 )
+        linger_s = 0;
+
+    if( usbmoded_mtpd_linger != linger_s ) {
+        log_info("mtpd_linger: %d -> %d",
+                 usbmoded_mtpd_linger,
+                 linger_s);
+        usbmoded_mtpd_linger = linger_s;
+    }
+}
+
+/** Helper for getting mtpd linger time
+ */
+int
+usbmoded_get_mtpd_linger(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return usbmoded_mtpd_linger;
+}
+
 /* ------------------------------------------------------------------------- *
  * SUSPEND_BLOCKING
  * ------------------------------------------------------------------------- */
@@ -450,7 +564,7 @@ static guint usbmoded_allow_suspend_timer_id = 0;
  *
  * @param aptr callback argument (not used)
  */
-static gboolean usbmoded_allow_suspend_timer_cb(gpointer aptr)
+static bool usbmoded_allow_suspend_timer_cb(void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -460,7 +574,7 @@ static gboolean usbmoded_allow_suspend_timer_cb(gpointer aptr)
 
     usbmoded_allow_suspend();
 
-    return FALSE;
+    return false;
 }
 
 /** Release wakelock acquired via usbmoded_delay_suspend()
@@ -473,13 +587,13 @@ void usbmoded_allow_suspend(void)
     LOG_REGISTER_CONTEXT;
 
     if( usbmoded_allow_suspend_timer_id ) {
-        g_source_remove(usbmoded_allow_suspend_timer_id),
+        evloop_remove(usbmoded_allow_suspend_timer_id),
             usbmoded_allow_suspend_timer_id = 0;
     }
 
     if( usbmoded_blocking_suspend ) {
         usbmoded_blocking_suspend = false;
-        common_release_wakelock(USB_MODED_WAKELOCK_STATE_CHANGE);
+        wakelock_release(USB_MODED_WAKELOCK_STATE_CHANGE);
     }
 }
 
@@ -499,16 +613,22 @@ void usbmoded_delay_suspend(void)
 
     /* Use of automatically terminating wakelocks also means we need
      * to renew the wakelock when extending the suspend delay. */
-    common_acquire_wakelock(USB_MODED_WAKELOCK_STATE_CHANGE);
-
-    usbmoded_blocking_suspend = true;
+    if( usbmoded_blocking_suspend ) {
+        wakelock_renew(USB_MODED_WAKELOCK_STATE_CHANGE);
+    }
+    else {
+        wakelock_acquire(USB_MODED_WAKELOCK_STATE_CHANGE);
+        usbmoded_blocking_suspend = true;
+    }
 
     if( usbmoded_allow_suspend_timer_id )
-        g_source_remove(usbmoded_allow_suspend_timer_id);
+        evloop_remove(usbmoded_allow_suspend_timer_id);
 
     usbmoded_allow_suspend_timer_id =
-        g_timeout_add(USB_MODED_SUSPEND_DELAY_DEFAULT_MS,
-                      usbmoded_allow_suspend_timer_cb, 0);
+        evloop_add_timer("allow-suspend",
+                         USB_MODED_SUSPEND_DELAY_DEFAULT_MS,
+                         USB_MODED_SUSPEND_DELAY_SLACK_MS,
+                         usbmoded_allow_suspend_timer_cb, 0);
 }
 
 /* ------------------------------------------------------------------------- *
@@ -577,7 +697,8 @@ void usbmoded_probe_init_done(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    usbmoded_set_init_done(access(usbmoded_init_done_flagfile, F_OK) == 0);
+    usbmoded_set_init_done(access(common_root_path(usbmoded_init_done_flagfile),
+                                  F_OK) == 0);
 }
 
 /* ------------------------------------------------------------------------- *
@@ -612,6 +733,7 @@ void usbmoded_handle_signal(int signum)
     LOG_REGISTER_CONTEXT;
 
     log_debug("handle signal: %s\n", strsignal(signum));
+    recorder_event(RECORDER_SIGNAL, signum, strsignal(signum), 0);
 
     if( signum == SIGTERM )
     {
@@ -656,7 +778,7 @@ void usbmoded_handle_signal(int signum)
              * something else. */
             log_warning("current mode '%s' is not valid, re-evaluating",
                         current);
-            control_select_usb_mode();
+            control_select_usb_mode(MODE_REASON_POLICY);
         }
         else {
             /* Dynamic mode that is still valid - do nothing.
@@ -673,6 +795,11 @@ void usbmoded_handle_signal(int signum)
         common_send_supported_modes_signal();
         common_send_available_modes_signal();
     }
+    else if( signum == SIGUSR2 )
+    {
+        /* Dump recent history for field diagnostics */
+        recorder_dump_to(common_root_path(RECORDER_DUMP_PATH));
+    }
     else
     {
         usbmoded_exit_mainloop(EXIT_FAILURE);
@@ -689,16 +816,26 @@ static bool usbmoded_init(void)
     /* Check if we are in mid-bootup */
     usbmoded_probe_init_done();
 
-    if( !worker_init() ) {
-        log_crit("worker thread init failed");
-      goto EXIT;
+    if( !evloop_init() ) {
+        log_crit("event loop init failed");
+        goto EXIT;
     }
 
+    /* Start streaming trace data if requested via --trace */
+    trace_init();
+
+    /* Signals are blocked in favor of signalfd, must be done
+     * before creating threads that would inherit the mask */
     if( !sigpipe_init() ) {
         log_crit("signal handler init failed");
         goto EXIT;
     }
 
+    if( !worker_init() ) {
+        log_crit("worker thread init failed");
+      goto EXIT;
+    }
+
     if( usbmoded_get_rescue_mode() && usbmoded_init_done_p() ) {
         usbmoded_set_rescue_mode(false);
         log_warning("init done passed; rescue mode ignored");
@@ -752,7 +889,7 @@ static bool usbmoded_init(void)
         trigger_init();
 
     /* Set-up mac address before kmod */
-    if(access("/etc/modprobe.d/g_ether.conf", F_OK) != 0)
+    if(access(common_root_path("/etc/modprobe.d/g_ether.conf"), F_OK) != 0)
     {
         mac_generate_random_mac();
     }
@@ -763,17 +900,14 @@ static bool usbmoded_init(void)
      * while waiting.
      */
     for( int i = 10; ; ) {
-        if( configfs_init() )
-            break;
-
-        if( android_init() )
+        if( gadget_init(false) )
             break;
 
         /* Must probe / poll since we're not yet running mainloop */
         usbmoded_probe_init_done();
 
         if( usbmoded_init_done_p() || --i <= 0 ) {
-            if( !modules_init() )
+            if( !gadget_init(true) )
                 log_crit("No supported usb control mechanisms found");
             break;
         }
@@ -878,9 +1012,7 @@ static void usbmoded_cleanup(void)
     umudev_quit();
 
     /* Do backend specific cleanup */
-    modules_quit();
-    android_quit();
-    configfs_quit();
+    gadget_quit();
 
     /* Undo trigger_init() */
     trigger_stop();
@@ -902,6 +1034,7 @@ static void usbmoded_cleanup(void)
     control_clear_target_mode();
 
     modesetting_quit();
+    latency_quit();
 
     /* Detach from SessionBus connection used for APP_SYNC_DBUS.
      *
@@ -911,6 +1044,9 @@ static void usbmoded_cleanup(void)
     dbusappsync_cleanup();
 # endif
 #endif
+
+    /* Undo sigpipe_init() */
+    sigpipe_quit();
 }
 
 /* ========================================================================= *
@@ -931,6 +1067,10 @@ static const char usbmoded_usage_info[] =
 "      log to syslog\n"
 "  -T,  --force-stderr\n"
 "      log to stderr\n"
+"  -J,  --force-journal\n"
+"      log to systemd journal, with usb mode, cable state and\n"
+"      source location as separate fields; ignored if built\n"
+"      without systemd support\n"
 "  -l,  --log-line-info\n"
 "      log to stderr and show origin of logging\n"
 "  -D,  --debug\n"
@@ -949,6 +1089,14 @@ static const char usbmoded_usage_info[] =
 "      output version information and exit\n"
 "  -m,  --max-cable-delay=<ms>\n"
 "      maximum delay before accepting cable connection\n"
+"  -g,  --reconnect-grace=<ms>\n"
+"      keep usb mode configured for given time after cable\n"
+"      disconnect, so that it can be resumed quickly if the\n"
+"      cable gets reconnected.\n"
+"  -k,  --mtpd-linger=<seconds>\n"
+"      keep mtp daemon running for given time after leaving\n"
+"      mtp mode, so that it does not need to be restarted if\n"
+"      mtp mode gets activated again.\n"
 "  -b,  --android-bootup-function=<function>\n"
 "      Setup given function during bootup. Might be required\n"
 "      on some devices to make enumeration work on the 1st\n"
@@ -957,6 +1105,15 @@ static const char usbmoded_usage_info[] =
 "      Dump usb-moded D-Bus introspect data to stdout.\n"
 "  -B --dbus-busconfig-xml\n"
 "      Dump usb-moded D-Bus busconfig data to stdout.\n"
+"  -t,  --trace=<subsystem>[,<subsystem>...]\n"
+"      Record function call timings for given subsystems, e.g.\n"
+"      \"worker,modesetting\" or \"all\", to " TRACE_OUTPUT_PATH "\n"
+"      in Chrome trace event format. Tracing stops if the file\n"
+"      grows too large.\n"
+"  -R,  --root-prefix=<dir>\n"
+"      Look up sysfs, configfs, proc and configuration files\n"
+"      under given directory instead of the real root. Meant\n"
+"      for running against a simulated gadget tree.\n"
 "\n";
 
 static const struct option usbmoded_long_options[] =
@@ -966,6 +1123,7 @@ static const struct option usbmoded_long_options[] =
     { "fallback",                       no_argument,       0, 'd' },
     { "force-syslog",                   no_argument,       0, 's' },
     { "force-stderr",                   no_argument,       0, 'T' },
+    { "force-journal",                  no_argument,       0, 'J' },
     { "log-line-info",                  no_argument,       0, 'l' },
     { "debug",                          no_argument,       0, 'D' },
     { "diag",                           no_argument,       0, 'd' },
@@ -974,14 +1132,18 @@ static const struct option usbmoded_long_options[] =
     { "systemd",                        no_argument,       0, 'n' },
     { "version",                        no_argument,       0, 'v' },
     { "max-cable-delay",                required_argument, 0, 'm' },
+    { "reconnect-grace",                required_argument, 0, 'g' },
+    { "mtpd-linger",                    required_argument, 0, 'k' },
     { "android-bootup-function",        required_argument, 0, 'b' },
     { "auto-exit",                      no_argument,       0, 'Q' },
     { "dbus-introspect-xml",            no_argument,       0, 'I' },
     { "dbus-busconfig-xml",             no_argument,       0, 'B' },
+    { "trace",                          required_argument, 0, 't' },
+    { "root-prefix",                    required_argument, 0, 'R' },
     { 0, 0, 0, 0 }
 };
 
-static const char usbmoded_short_options[] = "aifsTlDdhrnvm:b:QIB";
+static const char usbmoded_short_options[] = "aifsTJlDdhrnvm:g:k:b:QIBt:R:";
 
 /* Display usbmoded_usage information */
 static void usbmoded_usage(void)
@@ -1023,6 +1185,14 @@ static void usbmoded_parse_options(int argc, char* argv[])
             log_set_type(LOG_TO_STDERR);
             break;
 
+        case 'J':
+#ifdef SYSTEMD
+            log_set_type(LOG_TO_JOURNAL);
+#else
+            log_warning("Built without systemd support: --force-journal ignored");
+#endif
+            break;
+
         case 'D':
             log_set_level(LOG_DEBUG);
             break;
@@ -1056,6 +1226,14 @@ static void usbmoded_parse_options(int argc, char* argv[])
             usbmoded_set_cable_connection_delay(strtol(optarg, 0, 0));
             break;
 
+        case 'g':
+            usbmoded_set_reconnect_grace(strtol(optarg, 0, 0));
+            break;
+
+        case 'k':
+            usbmoded_set_mtpd_linger(strtol(optarg, 0, 0));
+            break;
+
         case 'b':
             log_warning("Deprecated option: --android-bootup-function");
             break;
@@ -1072,6 +1250,14 @@ static void usbmoded_parse_options(int argc, char* argv[])
             umdbus_dump_busconfig_xml();
             exit(EXIT_SUCCESS);
 
+        case 't':
+            trace_set_subsystems(optarg);
+            break;
+
+        case 'R':
+            common_set_root_prefix(optarg);
+            break;
+
         default:
             usbmoded_usage();
             exit(EXIT_FAILURE);
@@ -1101,6 +1287,7 @@ int main(int argc, char* argv[])
     /* Set logging defaults */
     log_init();
     log_set_name(basename(*argv));
+    log_set_thread_name("main");
 
     /* Parse command line options */
     usbmoded_parse_options(argc, argv);
@@ -1119,6 +1306,9 @@ int main(int argc, char* argv[])
         }
     }
 
+    /* Move log output off the main and worker threads */
+    log_start_thread();
+
     /* - - - - - - - - - - - - - - - - - - - *
      * INITIALIZE
      * - - - - - - - - - - - - - - - - - - - */
@@ -1171,8 +1361,19 @@ EXIT:
     /* Must be done just before exit to make sure no more wakelocks
      * are taken and left behind on exit path */
     usbmoded_allow_suspend();
+    wakelock_quit();
+
+    /* Flush trace data while event loop still exists */
+    trace_quit();
+
+    /* Undo evloop_init() */
+    evloop_quit();
 
     log_debug("usb-moded return from main, with exit code %d",
               usbmoded_exitcode);
+
+    /* Write out queued log messages */
+    log_stop_thread();
+
     return usbmoded_exitcode;
 }
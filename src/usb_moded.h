@@ -61,6 +61,9 @@
 # define USB_MODED_SUSPEND_DELAY_MAXIMUM_MS \
      (USB_MODED_SUSPEND_DELAY_DEFAULT_MS * 2)
 
+/** How much suspend delay expiry can be postponed to coalesce wakeups [ms] */
+# define USB_MODED_SUSPEND_DELAY_SLACK_MS        500
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -81,6 +84,10 @@ void              usbmoded_set_diag_mode             (bool diag_mode);
 bool              usbmoded_is_mode_permitted         (const char *modename, uid_t uid);
 void              usbmoded_set_cable_connection_delay(int delay_ms);
 int               usbmoded_get_cable_connection_delay(void);
+void              usbmoded_set_reconnect_grace       (int grace_ms);
+int               usbmoded_get_reconnect_grace       (void);
+void              usbmoded_set_mtpd_linger           (int linger_s);
+int               usbmoded_get_mtpd_linger           (void);
 void              usbmoded_allow_suspend             (void);
 void              usbmoded_delay_suspend             (void);
 bool              usbmoded_can_export                (void);